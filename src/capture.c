@@ -0,0 +1,151 @@
+/*
+ *   capture.c
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <string.h>
+#include "capture.h"
+
+int
+capture_init (struct capture *capture, int channels, uint64_t frames)
+{
+  size_t size = sizeof (float) * channels * frames;
+
+  if (ow_arena_init (&capture->arena, size))
+    {
+      return 1;
+    }
+
+  capture->data = ow_arena_alloc (&capture->arena, size);
+  if (!capture->data)
+    {
+      ow_arena_destroy (&capture->arena);
+      return 1;
+    }
+  capture->channels = channels;
+  capture->frames = frames;
+  capture->head = 0;
+  capture->writing = 0;
+
+  debug_print (1, "Capture ring of %lu frames (%zu B)", frames, size);
+
+  return 0;
+}
+
+void
+capture_destroy (struct capture *capture)
+{
+  ow_arena_destroy (&capture->arena);
+}
+
+void
+capture_write (struct capture *capture, const float *src, int src_channels,
+	       uint64_t mask, uint32_t frames)
+{
+  uint64_t head = capture->head;
+  float *dst = &capture->data[(head % capture->frames) * capture->channels];
+  float *end = &capture->data[capture->frames * capture->channels];
+  int all = src_channels == capture->channels;
+
+  //Like a seqlock, readers know what is being overwritten before it happens.
+  __atomic_store_n (&capture->writing, head + frames, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+
+  for (uint32_t i = 0; i < frames; i++)
+    {
+      if (all)
+	{
+	  memcpy (dst, src, sizeof (float) * src_channels);
+	  dst += src_channels;
+	}
+      else
+	{
+	  for (int j = 0; j < src_channels; j++)
+	    {
+	      if (mask & (1ULL << j))
+		{
+		  *dst = src[j];
+		  dst++;
+		}
+	    }
+	}
+
+      src += src_channels;
+      if (dst == end)
+	{
+	  dst = capture->data;
+	}
+    }
+
+  __atomic_store_n (&capture->head, head + frames, __ATOMIC_RELEASE);
+}
+
+uint64_t
+capture_get_head (struct capture *capture)
+{
+  return __atomic_load_n (&capture->head, __ATOMIC_ACQUIRE);
+}
+
+uint64_t
+capture_get_tail (struct capture *capture)
+{
+  uint64_t head = capture_get_head (capture);
+  return head > capture->frames ? head - capture->frames : 0;
+}
+
+uint32_t
+capture_read (struct capture *capture, uint64_t *pos, float *dst,
+	      uint32_t frames, uint64_t *lost)
+{
+  uint64_t head, tail, first;
+  uint32_t len, copied;
+  uint64_t start = *pos;
+
+  while (1)
+    {
+      head = capture_get_head (capture);
+      tail = head > capture->frames ? head - capture->frames : 0;
+      if (*pos < tail)
+	{
+	  *pos = tail;
+	}
+
+      len = head - *pos < frames ? head - *pos : frames;
+      first = *pos % capture->frames;
+      copied = capture->frames - first < len ? capture->frames - first : len;
+
+      memcpy (dst, &capture->data[first * capture->channels],
+	      sizeof (float) * capture->channels * copied);
+      memcpy (dst + copied * capture->channels, capture->data,
+	      sizeof (float) * capture->channels * (len - copied));
+
+      //The writer must not have reached the frames copied in the meantime.
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+      head = __atomic_load_n (&capture->writing, __ATOMIC_RELAXED);
+      if (head <= capture->frames || head - capture->frames <= *pos)
+	{
+	  break;
+	}
+    }
+
+  *lost += *pos - start;
+  *pos += len;
+
+  return len;
+}
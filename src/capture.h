@@ -0,0 +1,55 @@
+/*
+ *   capture.h
+ *   Copyright (C) 2022 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include "utils.h"
+
+//Retroactive capture ring of interleaved frames.
+//It is written by a single thread without locks and read by another one. Positions are absolute frames and a read checks afterwards that the writer did not overwrite what was copied.
+struct capture
+{
+  struct ow_arena arena;
+  float *data;
+  int channels;
+  uint64_t frames;		//Capacity
+  uint64_t head;		//Frames written since the start
+  uint64_t writing;		//Head once the frames being written are done
+};
+
+int capture_init (struct capture *, int, uint64_t);
+
+void capture_destroy (struct capture *);
+
+//Only the source channels in the mask are written, so it must have as many bits set as channels.
+void capture_write (struct capture *, const float *, int, uint64_t,
+		    uint32_t);
+
+uint64_t capture_get_head (struct capture *);
+
+//Oldest frame still in the ring.
+uint64_t capture_get_tail (struct capture *);
+
+//Copies up to the given frames from the position until the head and advances the position past them.
+//Frames already overwritten are skipped and added to the lost frames. Returns the frames copied.
+uint32_t capture_read (struct capture *, uint64_t *, float *, uint32_t,
+		       uint64_t *);
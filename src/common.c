@@ -19,33 +19,11 @@
  */
 
 #include <errno.h>
+#include <signal.h>
+#include <string.h>
 #include "common.h"
 #include "utils.h"
-
-void
-print_help (const char *executable_path, const char *package_string,
-	    struct option *option, const char *fixed_params)
-{
-  char *exec_name;
-  char *executable_path_copy = strdup (executable_path);
-
-  fprintf (stderr, "%s\n", package_string);
-  exec_name = basename (executable_path_copy);
-  fprintf (stderr, "Usage: %s [options]%s%s\n", exec_name,
-	   fixed_params ? " " : "", fixed_params ? fixed_params : "");
-  fprintf (stderr, "Options:\n");
-  while (option->name)
-    {
-      fprintf (stderr, "  --%s, -%c", option->name, option->val);
-      if (option->has_arg)
-	{
-	  fprintf (stderr, " value");
-	}
-      fprintf (stderr, "\n");
-      option++;
-    }
-  free (executable_path_copy);
-}
+#include "transpose.h"
 
 ow_err_t
 print_devices ()
@@ -64,20 +42,20 @@ print_devices ()
   for (int i = 0; i < total; i++, device++)
     {
       fprintf (stderr, "%d: %s (ID %04x:%04x) at bus %03d, address %03d\n", i,
-	       device->desc.name, device->vid, device->pid, device->bus,
+	       device->desc->name, device->vid, device->pid, device->bus,
 	       device->address);
       if (debug_level)
 	{
 	  fprintf (stderr, "  Inputs:\n");
-	  for (int j = 0; j < device->desc.inputs; j++)
+	  for (int j = 0; j < device->desc->inputs; j++)
 	    {
-	      fprintf (stderr, "    %s\n", device->desc.input_track_names[j]);
+	      fprintf (stderr, "    %s\n", device->desc->input_track_names[j]);
 	    }
 	  fprintf (stderr, "  Outputs:\n");
-	  for (int j = 0; j < device->desc.outputs; j++)
+	  for (int j = 0; j < device->desc->outputs; j++)
 	    {
 	      fprintf (stderr, "    %s\n",
-		       device->desc.output_track_names[j]);
+		       device->desc->output_track_names[j]);
 	    }
 	}
 
@@ -112,15 +90,174 @@ get_ow_blocks_per_transfer_argument (const char *optarg)
   char *endstr;
   int blocks_per_transfer;
 
+  if (!strcmp (optarg, "auto"))
+    {
+      return OW_AUTO_BLOCKS;
+    }
+
   errno = 0;
   blocks_per_transfer = (int) strtol (optarg, &endstr, 10);
-  if (errno || endstr == optarg || *endstr != '\0' || blocks_per_transfer < 2
-      || blocks_per_transfer > 32)
+  if (errno || endstr == optarg || *endstr != '\0'
+      || blocks_per_transfer < OW_MIN_BLOCKS
+      || blocks_per_transfer > OW_MAX_BLOCKS)
     {
       blocks_per_transfer = OW_DEFAULT_BLOCKS;
       fprintf (stderr,
-	       "Blocks value must be in [2..32]. Using value %d...\n",
-	       blocks_per_transfer);
+	       "Blocks value must be in [%d..%d] or 'auto'. Using value %d...\n",
+	       OW_MIN_BLOCKS, OW_MAX_BLOCKS, blocks_per_transfer);
     }
   return blocks_per_transfer;
 }
+
+int
+get_ow_quality_argument (const char *optarg)
+{
+  char *endstr;
+  int quality;
+
+  errno = 0;
+  quality = (int) strtol (optarg, &endstr, 10);
+  if (errno || endstr == optarg || *endstr != '\0' || quality > 4
+      || quality < 0)
+    {
+      quality = DEFAULT_QUALITY;
+      fprintf (stderr,
+	       "Resampling quality value must be in [0..4]. Using value %d...\n",
+	       quality);
+    }
+  return quality;
+}
+
+uint64_t
+get_ow_cpu_list_argument (const char *optarg)
+{
+  uint64_t cpus;
+
+  if (ow_parse_cpu_list (optarg, &cpus))
+    {
+      cpus = 0;
+      fprintf (stderr,
+	       "CPU list must be like '2-3,6' with CPUs in [0..%d]. Not pinning thread...\n",
+	       OW_MAX_CPUS - 1);
+    }
+  return cpus;
+}
+
+//Installs the same handler for the termination and debug level signals.
+inline void
+set_signal_handler (void (*handler) (int))
+{
+  struct sigaction action;
+
+  action.sa_handler = handler;
+  sigemptyset (&action.sa_mask);
+  action.sa_flags = 0;
+  sigaction (SIGHUP, &action, NULL);
+  sigaction (SIGINT, &action, NULL);
+  sigaction (SIGTERM, &action, NULL);
+  sigaction (SIGTSTP, &action, NULL);
+  sigaction (SIGUSR1, &action, NULL);
+  sigaction (SIGUSR2, &action, NULL);
+}
+
+//SIGUSR1 and SIGUSR2 increase and decrease the debug level. Returns 1 if the signal was one of those.
+int
+update_debug_level (int signum)
+{
+  if (signum == SIGUSR1)
+    {
+      debug_level++;
+    }
+  else if (signum == SIGUSR2)
+    {
+      debug_level--;
+      debug_level = debug_level < 0 ? 0 : debug_level;
+    }
+  else
+    {
+      return 0;
+    }
+
+  debug_print (1, "Debug level: %d", debug_level);
+  return 1;
+}
+
+//Interleaved to planar copy from the o2h resampler output to the host ports.
+void
+copy_o2h_audio (const float *f, uint32_t nframes, float *buffer[],
+		const struct ow_device_desc *desc)
+{
+  transpose_to_planar (f, nframes, buffer, desc->outputs);
+}
+
+//Planar to interleaved copy from the host ports to the h2o resampler input.
+inline void
+copy_h2o_audio (float *f, uint32_t nframes, float *buffer[],
+		const struct ow_device_desc *desc)
+{
+  transpose_to_interleaved (f, nframes, buffer, desc->inputs);
+}
+
+static inline uint64_t
+copy_all_channels (int channels)
+{
+  return channels == OB_MAX_TRACKS ? UINT64_MAX : (1ULL << channels) - 1;
+}
+
+//Only the channels in the mask are copied and the other buffers are not touched, so they can be NULL.
+//The whole tile transpose is used when every channel is in the mask.
+void
+copy_o2h_audio_masked (const float *f, uint32_t nframes, float *buffer[],
+		       const struct ow_device_desc *desc, uint64_t mask)
+{
+  int channels = desc->outputs;
+
+  mask &= copy_all_channels (channels);
+  if (mask == copy_all_channels (channels))
+    {
+      transpose_to_planar (f, nframes, buffer, channels);
+      return;
+    }
+
+  for (int i = 0; mask; i++, mask >>= 1)
+    {
+      if (mask & 1)
+	{
+	  const float *src = f + i;
+	  float *dst = buffer[i];
+	  for (uint32_t j = 0; j < nframes; j++, src += channels)
+	    {
+	      dst[j] = *src;
+	    }
+	}
+    }
+}
+
+//Channels not in the mask are silenced and their buffers are not read, so they can be NULL.
+void
+copy_h2o_audio_masked (float *f, uint32_t nframes, float *buffer[],
+		       const struct ow_device_desc *desc, uint64_t mask)
+{
+  int channels = desc->inputs;
+
+  mask &= copy_all_channels (channels);
+  if (mask == copy_all_channels (channels))
+    {
+      transpose_to_interleaved (f, nframes, buffer, channels);
+      return;
+    }
+
+  memset (f, 0, sizeof (float) * nframes * channels);
+  for (int i = 0; mask; i++, mask >>= 1)
+    {
+      if (mask & 1)
+	{
+	  const float *src = buffer[i];
+	  float *dst = f + i;
+	  for (uint32_t j = 0; j < nframes; j++, dst += channels)
+	    {
+	      *dst = src[j];
+	    }
+	}
+    }
+}
@@ -26,10 +26,31 @@
 #include <getopt.h>
 #include <overwitch.h>
 
-void print_help (const char *, const char *, struct option *, const char *);
+#define DEFAULT_QUALITY 2
 
 ow_err_t print_devices ();
 
 int get_ow_xfr_timeout_argument (const char *);
 
 int get_ow_blocks_per_transfer_argument (const char *);
+
+int get_ow_quality_argument (const char *);
+
+uint64_t get_ow_cpu_list_argument (const char *);
+
+void set_signal_handler (void (*)(int));
+
+int update_debug_level (int);
+
+void copy_o2h_audio (const float *, uint32_t, float *[],
+		     const struct ow_device_desc *);
+
+void copy_h2o_audio (float *, uint32_t, float *[],
+		     const struct ow_device_desc *);
+
+//Like the above but only for the channels set in the mask.
+void copy_o2h_audio_masked (const float *, uint32_t, float *[],
+			    const struct ow_device_desc *, uint64_t);
+
+void copy_h2o_audio_masked (float *, uint32_t, float *[],
+			    const struct ow_device_desc *, uint64_t);
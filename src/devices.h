@@ -0,0 +1,46 @@
+/*
+ *   devices.h
+ *   Copyright (C) 2021 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "overwitch.h"
+
+//Built-in device tables, generated from res/devices.json by gen-devices.py.
+
+//Engine sizes for OW_DEFAULT_BLOCKS. See ow_engine_init_mem.
+struct ow_device_sizes
+{
+  size_t o2h_frame_size;
+  size_t h2o_frame_size;
+  size_t audio_in_blk_len;
+  size_t audio_out_blk_len;
+  size_t o2h_transfer_size;
+  size_t h2o_transfer_size;
+  size_t xfr_audio_in_data_len;
+  size_t xfr_audio_out_data_len;
+};
+
+//Sorted by PID. OW_DEVICE_SIZES has the same order.
+extern const struct ow_device_desc OW_DEVICE_DESCS[];
+extern const struct ow_device_sizes OW_DEVICE_SIZES[];
+extern const size_t OW_DEVICE_DESCS_LEN;
+
+const struct ow_device_sizes *ow_get_device_sizes (const struct ow_device_desc
+						   *, unsigned int);
@@ -59,6 +59,7 @@ ow_dll_overbridge_init (void *data, double samplerate, uint32_t frames)
   w = 2 * M_PI * 0.1 * dll_ob->dt;
   dll_ob->w1 = 1.6 * w;
   dll_ob->w2 = w * w;
+  dll_ob->boot = 1;
 }
 
 //Taken from https://github.com/jackaudio/tools/blob/master/zalsa/alsathread.cc.
@@ -102,6 +103,36 @@ ow_dll_overbridge_update (void *data, uint32_t frames, uint64_t t)
 	       dll_ob->i1.frames);
 }
 
+//Interpolates the Overbridge frame at the given time between the last two instants.
+inline uint32_t
+ow_dll_overbridge_get_frame (void *data, uint64_t t)
+{
+  double dn, dd;
+  struct ow_dll *dll = data;
+  struct ow_dll_overbridge *dll_ob = &dll->dll_overbridge;
+  double time = UINT64_USEC_TO_DOUBLE_SEC (t);
+
+  dn = wrap_time (time - dll_ob->i0.time, dll->t_quantum);
+  dd = wrap_time (dll_ob->i1.time - dll_ob->i0.time, dll->t_quantum);
+  if (dd <= 0)
+    {
+      return dll_ob->i0.frames;
+    }
+
+  return dll_ob->i0.frames + (int32_t) floor ((dll_ob->i1.frames -
+					       dll_ob->i0.frames) * dn / dd);
+}
+
+//Frame at the given time counted from the start given the frames received until the last update, which must be close to the time.
+uint64_t
+ow_dll_overbridge_get_abs_frame (struct ow_dll *dll, uint64_t received,
+				 uint64_t t)
+{
+  uint32_t frame = ow_dll_overbridge_get_frame (dll, t);
+  int32_t delta = frame - dll->dll_overbridge.i0.frames;
+  return delta < 0 && -delta > received ? 0 : received + delta;
+}
+
 //The whole calculation of the target_delay and the loop filter is taken from https://github.com/jackaudio/tools/blob/master/zalsa/jackclient.cc.
 inline void
 ow_dll_host_update_error (struct ow_dll *dll, uint64_t t)
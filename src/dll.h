@@ -62,6 +62,11 @@ void ow_dll_overbridge_init (void *, double, uint32_t);
 
 void ow_dll_overbridge_update (void *, uint32_t, uint64_t);
 
+uint32_t ow_dll_overbridge_get_frame (void *, uint64_t);
+
+uint64_t ow_dll_overbridge_get_abs_frame (struct ow_dll *, uint64_t,
+					  uint64_t);
+
 void ow_dll_host_init (struct ow_dll *);
 
 void ow_dll_host_reset (struct ow_dll *, double, double, uint32_t, uint32_t);
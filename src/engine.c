@@ -26,10 +26,12 @@
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <endian.h>
 #include <time.h>
 #include <unistd.h>
 #include "engine.h"
+#include "devices.h"
 
 #define AUDIO_OUT_EP 0x03
 #define AUDIO_IN_EP  (AUDIO_OUT_EP | 0x80)
@@ -41,27 +43,67 @@
 
 #define USB_CONTROL_LEN (sizeof (struct libusb_control_setup) + OB_NAME_MAX_LEN)
 
+//Synchronous control transfers must not block the initialization forever.
+#define USB_CONTROL_TIMEOUT_MS 1000
+
 #define SAMPLE_TIME_NS (1e9 / ((int)OB_SAMPLE_RATE))
 
 #define INT32_TO_FLOAT32_SCALE ((float) (1.0f / INT_MAX))
 
 #define SLEEP_THE_LEAST nanosleep (&SHORTEST_SLEEP_TIME, NULL)
 
+#define READY_POLL_US 10000
+
+//The shared region must fit in a single cache line.
+_Static_assert (offsetof (struct ow_engine, lock) % OW_CACHE_LINE_SIZE == 0,
+		"Shared region not aligned");
+_Static_assert (offsetof (struct ow_engine, o2h_latency) -
+		offsetof (struct ow_engine, lock) == OW_CACHE_LINE_SIZE,
+		"Shared region does not fit in a cache line");
+_Static_assert (offsetof (struct ow_engine, h2o_midi_lock) %
+		OW_CACHE_LINE_SIZE == 0, "h2o MIDI region not aligned");
+_Static_assert (sizeof (struct ow_engine) % OW_CACHE_LINE_SIZE == 0,
+		"Last region shares its cache line");
+
+//Error budget. Up to RECOVERY_MAX_ATTEMPTS recoveries are allowed in RECOVERY_WINDOW_US.
+#define RECOVERY_MAX_ATTEMPTS 5
+#define RECOVERY_WINDOW_US 10000000
+#define RECOVERY_BACKOFF_US 10000
+
+//Blocks per transfer controller. The transfer size is evaluated every window while running.
+#define AUTO_BLOCKS_START 4
+#define AUTO_BLOCKS_WINDOW_FRAMES (2 * OB_SAMPLE_RATE)
+#define AUTO_BLOCKS_SHRINK_WINDOWS 5
+
+//The USB completions only take a fraction of the transfer period.
+#define DEADLINE_RUNTIME_DIVISOR 4
+
 static void prepare_cycle_in_audio ();
 static void prepare_cycle_out_audio ();
-static void prepare_cycle_in_midi ();
+static void prepare_cycle_in_midi (struct ow_engine *, int);
+static void prepare_cycles_in_midi (struct ow_engine *);
 static void ow_engine_load_overbridge_name (struct ow_engine *);
+static void ow_engine_set_blocks_per_transfer (struct ow_engine *,
+					       unsigned int);
 
 static const struct timespec SHORTEST_SLEEP_TIME = {
   .tv_sec = 0,
   .tv_nsec = SAMPLE_TIME_NS * 32 / 2	//Average wait time for a 32 sample buffer
 };
 
+static uint64_t
+ow_engine_get_monotonic_time ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static void
 ow_engine_init_name (struct ow_engine *engine, uint8_t bus, uint8_t address)
 {
   snprintf (engine->name, OW_LABEL_MAX_LEN, "%s @ %03d,%03d",
-	    engine->device_desc.name, bus, address);
+	    engine->device_desc->name, bus, address);
   ow_engine_load_overbridge_name (engine);
 }
 
@@ -80,16 +122,22 @@ prepare_transfers (struct ow_engine *engine)
       return -ENOMEM;
     }
 
-  engine->usb.xfr_midi_in = libusb_alloc_transfer (0);
-  if (!engine->usb.xfr_midi_in)
+  for (int i = 0; i < OW_O2H_MIDI_XFRS; i++)
     {
-      return -ENOMEM;
+      engine->usb.xfr_midi_in[i] = libusb_alloc_transfer (0);
+      if (!engine->usb.xfr_midi_in[i])
+	{
+	  return -ENOMEM;
+	}
     }
 
-  engine->usb.xfr_midi_out = libusb_alloc_transfer (0);
-  if (!engine->usb.xfr_midi_out)
+  for (int i = 0; i < OW_H2O_MIDI_XFRS; i++)
     {
-      return -ENOMEM;
+      engine->usb.xfr_midi_out[i] = libusb_alloc_transfer (0);
+      if (!engine->usb.xfr_midi_out[i])
+	{
+	  return -ENOMEM;
+	}
     }
 
   engine->usb.xfr_control_in = libusb_alloc_transfer (0);
@@ -121,7 +169,7 @@ ow_engine_read_usb_input_blocks (struct ow_engine *engine)
       s = blk->data;
       for (int j = 0; j < OB_FRAMES_PER_BLOCK; j++)
 	{
-	  for (int k = 0; k < engine->device_desc.outputs; k++)
+	  for (int k = 0; k < engine->device_desc->outputs; k++)
 	    {
 	      hv = be32toh (*s);
 	      *f = INT32_TO_FLOAT32_SCALE * hv;
@@ -132,6 +180,34 @@ ow_engine_read_usb_input_blocks (struct ow_engine *engine)
     }
 }
 
+//Same as above but track after track.
+inline void
+ow_engine_read_usb_input_blocks_planar (struct ow_engine *engine)
+{
+  int32_t hv;
+  int32_t *s;
+  float *f, *t;
+  struct ow_engine_usb_blk *blk;
+
+  for (int i = 0; i < engine->blocks_per_transfer; i++)
+    {
+      blk = GET_NTH_INPUT_USB_BLK (engine, i);
+      s = blk->data;
+      f = engine->o2h_transfer_buf + i * OB_FRAMES_PER_BLOCK;
+      for (int j = 0; j < OB_FRAMES_PER_BLOCK; j++, f++)
+	{
+	  t = f;
+	  for (int k = 0; k < engine->device_desc->outputs; k++)
+	    {
+	      hv = be32toh (*s);
+	      *t = INT32_TO_FLOAT32_SCALE * hv;
+	      t += engine->frames_per_transfer;
+	      s++;
+	    }
+	}
+    }
+}
+
 static void
 set_usb_input_data_blks (struct ow_engine *engine)
 {
@@ -188,12 +264,12 @@ ow_engine_write_usb_output_blocks (struct ow_engine *engine)
   for (int i = 0; i < engine->blocks_per_transfer; i++)
     {
       blk = GET_NTH_OUTPUT_USB_BLK (engine, i);
-      blk->frames = htobe16 (engine->usb.audio_frames_counter);
-      engine->usb.audio_frames_counter += OB_FRAMES_PER_BLOCK;
+      blk->frames = htobe16 (engine->audio_frames_counter);
+      engine->audio_frames_counter += OB_FRAMES_PER_BLOCK;
       s = blk->data;
       for (int j = 0; j < OB_FRAMES_PER_BLOCK; j++)
 	{
-	  for (int k = 0; k < engine->device_desc.inputs; k++)
+	  for (int k = 0; k < engine->device_desc->inputs; k++)
 	    {
 	      ov = htobe32 ((int32_t) (*f * INT_MAX));
 	      *s = ov;
@@ -204,6 +280,36 @@ ow_engine_write_usb_output_blocks (struct ow_engine *engine)
     }
 }
 
+//Same as above but track after track.
+inline void
+ow_engine_write_usb_output_blocks_planar (struct ow_engine *engine)
+{
+  int32_t ov;
+  int32_t *s;
+  float *f, *t;
+  struct ow_engine_usb_blk *blk;
+
+  for (int i = 0; i < engine->blocks_per_transfer; i++)
+    {
+      blk = GET_NTH_OUTPUT_USB_BLK (engine, i);
+      blk->frames = htobe16 (engine->audio_frames_counter);
+      engine->audio_frames_counter += OB_FRAMES_PER_BLOCK;
+      s = blk->data;
+      f = engine->h2o_transfer_buf + i * OB_FRAMES_PER_BLOCK;
+      for (int j = 0; j < OB_FRAMES_PER_BLOCK; j++, f++)
+	{
+	  t = f;
+	  for (int k = 0; k < engine->device_desc->inputs; k++)
+	    {
+	      ov = htobe32 ((int32_t) (*t * INT_MAX));
+	      *s = ov;
+	      t += engine->frames_per_transfer;
+	      s++;
+	    }
+	}
+    }
+}
+
 static void
 set_usb_output_data_blks (struct ow_engine *engine)
 {
@@ -211,7 +317,15 @@ set_usb_output_data_blks (struct ow_engine *engine)
   size_t bytes;
   long frames;
   int res;
-  int h2o_enabled = ow_engine_is_option (engine, OW_ENGINE_OPTION_P2O_AUDIO);
+  int h2o_enabled;
+
+  //The h2o frames were already set by the process callback.
+  if (engine->context->process)
+    {
+      goto set_blocks;
+    }
+
+  h2o_enabled = ow_engine_is_option (engine, OW_ENGINE_OPTION_P2O_AUDIO);
 
   if (h2o_enabled)
     {
@@ -262,6 +376,7 @@ set_usb_output_data_blks (struct ow_engine *engine)
       debug_print (2,
 		   "h2o: Audio ring buffer underflow (%zu B < %zu B). Resampling...",
 		   rsh2o, engine->h2o_transfer_size);
+      engine->auto_blocks.underflows++;
       frames = rsh2o / engine->h2o_frame_size;
       bytes = frames * engine->h2o_frame_size;
       engine->context->read (engine->context->h2o_audio,
@@ -271,7 +386,7 @@ set_usb_output_data_blks (struct ow_engine *engine)
 	(double) engine->frames_per_transfer / frames;
       //We should NOT use the simple API but since this only happens very occasionally and mostly at startup, this has very low impact on audio quality.
       res = src_simple (&engine->h2o_data, SRC_SINC_FASTEST,
-			engine->device_desc.inputs);
+			engine->device_desc->inputs);
       if (res)
 	{
 	  error_print
@@ -294,7 +409,206 @@ set_usb_output_data_blks (struct ow_engine *engine)
     }
 
 set_blocks:
-  ow_engine_write_usb_output_blocks (engine);
+  if (engine->planar)
+    {
+      ow_engine_write_usb_output_blocks_planar (engine);
+    }
+  else
+    {
+      ow_engine_write_usb_output_blocks (engine);
+    }
+}
+
+//Pull model. There are no buffers in between so nothing is measured as latency.
+static void
+ow_engine_process (struct ow_engine *engine)
+{
+  int options;
+  ow_engine_status_t status;
+  const float *o2h = NULL;
+  float *h2o = NULL;
+
+  pthread_spin_lock (&engine->lock);
+  status = engine->status;
+  options = engine->context->options;
+  pthread_spin_unlock (&engine->lock);
+
+  if (status < OW_ENGINE_STATUS_RUN)
+    {
+      return;
+    }
+
+  if (options & OW_ENGINE_OPTION_O2P_AUDIO)
+    {
+      if (engine->planar)
+	{
+	  ow_engine_read_usb_input_blocks_planar (engine);
+	}
+      else
+	{
+	  ow_engine_read_usb_input_blocks (engine);
+	}
+      o2h = engine->o2h_transfer_buf;
+    }
+
+  if (options & OW_ENGINE_OPTION_P2O_AUDIO)
+    {
+      h2o = engine->h2o_transfer_buf;
+      engine->reading_at_h2o_end = 1;
+    }
+  else if (engine->reading_at_h2o_end)
+    {
+      memset (engine->h2o_transfer_buf, 0, engine->h2o_transfer_size);
+      engine->reading_at_h2o_end = 0;
+    }
+
+  engine->context->process (engine->context->process_data, o2h, h2o,
+			    engine->frames_per_transfer);
+}
+
+//Going back to BOOT makes the host side wait until the transfers are running again.
+static void
+ow_engine_restart (struct ow_engine *engine)
+{
+  pthread_spin_lock (&engine->lock);
+  if (engine->status >= OW_ENGINE_STATUS_BOOT)
+    {
+      engine->status = OW_ENGINE_STATUS_BOOT;
+    }
+  engine->restarts++;
+  pthread_spin_unlock (&engine->lock);
+}
+
+static void
+ow_engine_request_recovery (struct ow_engine *engine)
+{
+  if (engine->recovering)
+    {
+      return;
+    }
+
+  engine->recovering = 1;
+  ow_engine_restart (engine);
+}
+
+static void
+ow_engine_handle_xfr_error (struct ow_engine *engine,
+			    enum libusb_transfer_status status)
+{
+  switch (status)
+    {
+    case LIBUSB_TRANSFER_CANCELLED:	//Only the recovery cancels transfers.
+      break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      ow_engine_set_status (engine, OW_ENGINE_STATUS_ERROR);
+      break;
+    default:
+      ow_engine_request_recovery (engine);
+    }
+}
+
+static void
+ow_engine_handle_submit_error (struct ow_engine *engine, int err)
+{
+  if (err == LIBUSB_ERROR_NO_DEVICE)
+    {
+      ow_engine_set_status (engine, OW_ENGINE_STATUS_ERROR);
+    }
+  else
+    {
+      ow_engine_request_recovery (engine);
+    }
+}
+
+static void
+ow_engine_auto_blocks_reset_window (struct ow_engine *engine)
+{
+  engine->auto_blocks.frames = 0;
+  engine->auto_blocks.underflows = 0;
+  engine->auto_blocks.max_jitter = 0;
+  pthread_spin_lock (&engine->lock);
+  engine->host_xruns = 0;
+  pthread_spin_unlock (&engine->lock);
+}
+
+//Grows the transfers quickly when the stream is not stable and shrinks them slowly while it is.
+//A value that has failed is never tried again.
+static void
+ow_engine_auto_blocks_update (struct ow_engine *engine)
+{
+  int stable;
+  unsigned int xruns, blocks;
+  uint64_t now, delta, jitter, period;
+
+  if (ow_engine_get_status (engine) != OW_ENGINE_STATUS_RUN)
+    {
+      engine->auto_blocks.last_xfr_time = 0;
+      ow_engine_auto_blocks_reset_window (engine);
+      return;
+    }
+
+  now = ow_engine_get_monotonic_time ();
+  period = engine->frames_per_transfer * 1000000 / OB_SAMPLE_RATE;
+  if (engine->auto_blocks.last_xfr_time)
+    {
+      delta = now - engine->auto_blocks.last_xfr_time;
+      jitter = delta > period ? delta - period : period - delta;
+      if (jitter > engine->auto_blocks.max_jitter)
+	{
+	  engine->auto_blocks.max_jitter = jitter;
+	}
+    }
+  engine->auto_blocks.last_xfr_time = now;
+
+  engine->auto_blocks.frames += engine->frames_per_transfer;
+  if (engine->auto_blocks.frames < AUTO_BLOCKS_WINDOW_FRAMES)
+    {
+      return;
+    }
+
+  pthread_spin_lock (&engine->lock);
+  xruns = engine->host_xruns;
+  pthread_spin_unlock (&engine->lock);
+
+  //A completion late by a whole period is about to starve the device.
+  stable = !xruns && !engine->auto_blocks.underflows &&
+    engine->auto_blocks.max_jitter < period;
+
+  debug_print (2,
+	       "%s: %u blocks: %u xruns, %u underflows, %lu us max. jitter",
+	       engine->name, engine->blocks_per_transfer, xruns,
+	       engine->auto_blocks.underflows, engine->auto_blocks.max_jitter);
+
+  blocks = engine->blocks_per_transfer;
+  if (stable)
+    {
+      engine->auto_blocks.stable_windows++;
+      if (engine->auto_blocks.stable_windows == AUTO_BLOCKS_SHRINK_WINDOWS)
+	{
+	  engine->auto_blocks.stable_windows = 0;
+	  if (blocks > engine->auto_blocks.min_blocks)
+	    {
+	      blocks--;
+	    }
+	}
+    }
+  else
+    {
+      engine->auto_blocks.stable_windows = 0;
+      engine->auto_blocks.min_blocks = blocks + 1;
+      blocks = blocks * 2 > OW_MAX_BLOCKS ? OW_MAX_BLOCKS : blocks * 2;
+    }
+
+  engine->auto_blocks.blocks = blocks;
+  ow_engine_auto_blocks_reset_window (engine);
+}
+
+//Callbacks run in the audio thread, which is also the one draining the transfers.
+static inline int
+ow_engine_can_resubmit (struct ow_engine *engine)
+{
+  return ow_engine_get_status (engine) > OW_ENGINE_STATUS_STOP
+    && !engine->recovering && !engine->draining;
 }
 
 static void LIBUSB_CALL
@@ -302,6 +616,8 @@ cb_xfr_audio_in (struct libusb_transfer *xfr)
 {
   struct ow_engine *engine = xfr->user_data;
 
+  engine->xfrs_in_flight--;
+
   if (xfr->status == LIBUSB_TRANSFER_COMPLETED)
     {
       if (xfr->length < xfr->actual_length)
@@ -311,21 +627,30 @@ cb_xfr_audio_in (struct libusb_transfer *xfr)
 	     xfr->actual_length);
 	}
 
-      struct ow_engine *engine = xfr->user_data;
-      if (engine->context->options & OW_ENGINE_OPTION_O2P_AUDIO)
+      if (engine->context->process)
+	{
+	  ow_engine_process (engine);
+	}
+      else if (engine->context->options & OW_ENGINE_OPTION_O2P_AUDIO)
 	{
 	  set_usb_input_data_blks (engine);
 	}
+
+      if (engine->auto_blocks.enabled)
+	{
+	  ow_engine_auto_blocks_update (engine);
+	}
     }
   else
     {
       error_print ("o2h: Error on USB audio transfer: %s",
 		   libusb_error_name (xfr->status));
+      ow_engine_handle_xfr_error (engine, xfr->status);
     }
 
-  if (ow_engine_get_status (engine) > OW_ENGINE_STATUS_STOP)
+  if (ow_engine_can_resubmit (engine)
+      && engine->auto_blocks.blocks == engine->blocks_per_transfer)
     {
-      // start new cycle even if this one did not succeed
       prepare_cycle_in_audio (xfr->user_data);
     }
 }
@@ -335,6 +660,8 @@ cb_xfr_audio_out (struct libusb_transfer *xfr)
 {
   struct ow_engine *engine = xfr->user_data;
 
+  engine->xfrs_in_flight--;
+
   if (xfr->status == LIBUSB_TRANSFER_COMPLETED)
     {
       if (xfr->length < xfr->actual_length)
@@ -348,11 +675,12 @@ cb_xfr_audio_out (struct libusb_transfer *xfr)
     {
       error_print ("h2o: Error on USB audio transfer: %s",
 		   libusb_error_name (xfr->status));
+      ow_engine_handle_xfr_error (engine, xfr->status);
     }
 
   set_usb_output_data_blks (xfr->user_data);
 
-  if (ow_engine_get_status (engine) > OW_ENGINE_STATUS_STOP)
+  if (ow_engine_can_resubmit (engine))
     {
       // We have to make sure that the out cycle is always started after its callback
       // Race condition on slower systems!
@@ -364,15 +692,28 @@ static void LIBUSB_CALL
 cb_xfr_midi_in (struct libusb_transfer *xfr)
 {
   int len;
+  unsigned int packets;
   uint8_t *pos;
   struct ow_midi_event event;
   struct ow_engine *engine = xfr->user_data;
 
+  engine->xfrs_in_flight--;
+
   if (xfr->status == LIBUSB_TRANSFER_COMPLETED)
     {
       len = 0;
-      pos = engine->usb.xfr_midi_in_data;
+      pos = xfr->buffer;
+      packets = 0;
       event.time = engine->context->get_time ();
+      event.frame = 0;
+      if (engine->context->dll)
+	{
+	  pthread_spin_lock (&engine->lock);
+	  event.frame =
+	    engine->context->dll_overbridge_get_frame (engine->context->dll,
+						       event.time);
+	  pthread_spin_unlock (&engine->lock);
+	}
 
       while (len < xfr->actual_length)
 	{
@@ -386,6 +727,7 @@ cb_xfr_midi_in (struct libusb_transfer *xfr)
 			   event.packet.data[1], event.packet.data[2],
 			   event.time);
 
+	      packets++;
 	      if (engine->context->write_space (engine->context->o2h_midi) >=
 		  sizeof (struct ow_midi_event))
 		{
@@ -408,19 +750,34 @@ cb_xfr_midi_in (struct libusb_transfer *xfr)
 	  len += OB_MIDI_EVENT_SIZE;
 	  pos += OB_MIDI_EVENT_SIZE;
 	}
+
+      engine->o2h_midi_xfrs++;
+      engine->o2h_midi_packets += packets;
+      if (packets > engine->o2h_midi_max_packets)
+	{
+	  engine->o2h_midi_max_packets = packets;
+	}
     }
   else
     {
-      if (xfr->status != LIBUSB_TRANSFER_TIMED_OUT)
+      if (xfr->status != LIBUSB_TRANSFER_TIMED_OUT
+	  && xfr->status != LIBUSB_TRANSFER_CANCELLED)
 	{
 	  error_print ("Error on USB MIDI in transfer: %s",
 		       libusb_error_name (xfr->status));
+	  ow_engine_handle_xfr_error (engine, xfr->status);
 	}
     }
 
-  if (ow_engine_get_status (engine) > OW_ENGINE_STATUS_STOP)
+  if (ow_engine_can_resubmit (engine))
     {
-      prepare_cycle_in_midi (engine);
+      for (int i = 0; i < OW_O2H_MIDI_XFRS; i++)
+	{
+	  if (engine->usb.xfr_midi_in[i] == xfr)
+	    {
+	      prepare_cycle_in_midi (engine, i);
+	    }
+	}
     }
 }
 
@@ -430,7 +787,17 @@ cb_xfr_midi_out (struct libusb_transfer *xfr)
   struct ow_engine *engine = xfr->user_data;
 
   pthread_spin_lock (&engine->h2o_midi_lock);
-  engine->h2o_midi_ready = 1;
+  for (int i = 0; i < OW_H2O_MIDI_XFRS; i++)
+    {
+      if (engine->usb.xfr_midi_out[i] == xfr)
+	{
+	  engine->h2o_midi_ready[i] = 1;
+	}
+    }
+  if (xfr->status != LIBUSB_TRANSFER_COMPLETED)
+    {
+      engine->h2o_midi_status = xfr->status;
+    }
   pthread_spin_unlock (&engine->h2o_midi_lock);
 
   if (xfr->status != LIBUSB_TRANSFER_COMPLETED)
@@ -455,63 +822,277 @@ prepare_cycle_out_audio (struct ow_engine *engine)
     {
       error_print ("h2o: Error when submitting USB audio transfer: %s",
 		   libusb_strerror (err));
-      ow_engine_set_status (engine, OW_ENGINE_STATUS_ERROR);
+      ow_engine_handle_submit_error (engine, err);
+    }
+  else
+    {
+      engine->xfrs_in_flight++;
+    }
+}
+
+static void
+prepare_cycle_in_audio (struct ow_engine *engine)
+{
+  libusb_fill_interrupt_transfer (engine->usb.xfr_audio_in,
+				  engine->usb.device_handle, AUDIO_IN_EP,
+				  engine->usb.xfr_audio_in_data,
+				  engine->usb.xfr_audio_in_data_len,
+				  cb_xfr_audio_in, engine,
+				  engine->usb.xfr_timeout);
+
+  int err = libusb_submit_transfer (engine->usb.xfr_audio_in);
+  if (err)
+    {
+      error_print ("o2h: Error when submitting USB audio in transfer: %s",
+		   libusb_strerror (err));
+      ow_engine_handle_submit_error (engine, err);
+    }
+  else
+    {
+      engine->xfrs_in_flight++;
+    }
+}
+
+//The device might not send anything for a long time so these never time out.
+static void
+prepare_cycle_in_midi (struct ow_engine *engine, int xfr)
+{
+  libusb_fill_bulk_transfer (engine->usb.xfr_midi_in[xfr],
+			     engine->usb.device_handle, MIDI_IN_EP,
+			     engine->usb.xfr_midi_in_data[xfr],
+			     USB_BULK_MIDI_LEN, cb_xfr_midi_in, engine, 0);
+
+  int err = libusb_submit_transfer (engine->usb.xfr_midi_in[xfr]);
+  if (err)
+    {
+      error_print ("o2h: Error when submitting USB MIDI transfer: %s",
+		   libusb_strerror (err));
+      ow_engine_handle_submit_error (engine, err);
+    }
+  else
+    {
+      engine->xfrs_in_flight++;
+    }
+}
+
+static void
+prepare_cycles_in_midi (struct ow_engine *engine)
+{
+  for (int i = 0; i < OW_O2H_MIDI_XFRS; i++)
+    {
+      prepare_cycle_in_midi (engine, i);
+    }
+}
+
+//This runs in the h2o MIDI thread so it can not use the audio thread recovery.
+static int
+prepare_cycle_out_midi (struct ow_engine *engine, int xfr)
+{
+  libusb_fill_bulk_transfer (engine->usb.xfr_midi_out[xfr],
+			     engine->usb.device_handle, MIDI_OUT_EP,
+			     engine->usb.xfr_midi_out_data[xfr],
+			     USB_BULK_MIDI_LEN, cb_xfr_midi_out, engine,
+			     engine->usb.xfr_timeout);
+
+  int err = libusb_submit_transfer (engine->usb.xfr_midi_out[xfr]);
+  if (err)
+    {
+      error_print ("h2o: Error when submitting USB MIDI transfer: %s",
+		   libusb_strerror (err));
+      if (err == LIBUSB_ERROR_NO_DEVICE)
+	{
+	  ow_engine_set_status (engine, OW_ENGINE_STATUS_ERROR);
+	}
+    }
+
+  return err;
+}
+
+//Cancelled transfers still call their callbacks so we wait for all of them.
+static void
+ow_engine_drain_transfers (struct ow_engine *engine)
+{
+  engine->draining = 1;
+
+  libusb_cancel_transfer (engine->usb.xfr_audio_in);
+  libusb_cancel_transfer (engine->usb.xfr_audio_out);
+  for (int i = 0; i < OW_O2H_MIDI_XFRS; i++)
+    {
+      libusb_cancel_transfer (engine->usb.xfr_midi_in[i]);
+    }
+
+  while (engine->xfrs_in_flight > 0)
+    {
+      libusb_handle_events_completed (engine->usb.context, NULL);
+    }
+
+  engine->draining = 0;
+}
+
+static int
+ow_engine_clear_halts (struct ow_engine *engine)
+{
+  int err;
+  uint8_t endpoints[] = { AUDIO_IN_EP, AUDIO_OUT_EP, MIDI_IN_EP };
+
+  for (int i = 0; i < sizeof (endpoints); i++)
+    {
+      err = libusb_clear_halt (engine->usb.device_handle, endpoints[i]);
+      if (err)
+	{
+	  error_print ("Error while clearing endpoint %02x: %s",
+		       endpoints[i], libusb_error_name (err));
+	  return err;
+	}
+    }
+
+  return 0;
+}
+
+static void
+ow_engine_rearm_transfers (struct ow_engine *engine)
+{
+  memset (engine->h2o_transfer_buf, 0, engine->h2o_transfer_size);
+
+  if (engine->context->dll)
+    {
+      pthread_spin_lock (&engine->lock);
+      engine->context->dll_overbridge_init (engine->context->dll,
+					    OB_SAMPLE_RATE,
+					    engine->frames_per_transfer);
+      pthread_spin_unlock (&engine->lock);
+    }
+
+  if (engine->context->options & OW_ENGINE_OPTION_O2P_MIDI)
+    {
+      prepare_cycles_in_midi (engine);
+    }
+  prepare_cycle_in_audio (engine);
+  prepare_cycle_out_audio (engine);
+
+  if (engine->context->dll)
+    {
+      pthread_spin_lock (&engine->lock);
+      engine->context->dll_overbridge_update (engine->context->dll,
+					      engine->frames_per_transfer,
+					      engine->context->get_time ());
+      pthread_spin_unlock (&engine->lock);
+    }
+}
+
+//Returns 0 when the transfers are running again or 1 if the engine must end.
+static int
+ow_engine_recover (struct ow_engine *engine)
+{
+  int err;
+  uint64_t now;
+
+  while (1)
+    {
+      ow_engine_drain_transfers (engine);
+
+      if (ow_engine_get_status (engine) <= OW_ENGINE_STATUS_STOP)
+	{
+	  return 1;
+	}
+
+      now = ow_engine_get_monotonic_time ();
+      if (now - engine->recovery_window_start > RECOVERY_WINDOW_US)
+	{
+	  engine->recovery_window_start = now;
+	  engine->recovery_attempts = 0;
+	}
+
+      if (engine->recovery_attempts == RECOVERY_MAX_ATTEMPTS)
+	{
+	  error_print ("%s: Too many USB errors. Stopping...", engine->name);
+	  ow_engine_set_status (engine, OW_ENGINE_STATUS_ERROR);
+	  return 1;
+	}
+
+      usleep (RECOVERY_BACKOFF_US << engine->recovery_attempts);
+      engine->recovery_attempts++;
+
+      error_print ("%s: Recovering from USB error (attempt %d)...",
+		   engine->name, engine->recovery_attempts);
+
+      if (ow_engine_get_status (engine) <= OW_ENGINE_STATUS_STOP)
+	{
+	  return 1;
+	}
+
+      err = ow_engine_clear_halts (engine);
+      if (err == LIBUSB_ERROR_NO_DEVICE)
+	{
+	  ow_engine_set_status (engine, OW_ENGINE_STATUS_ERROR);
+	  return 1;
+	}
+      if (err)
+	{
+	  continue;
+	}
+
+      engine->recovering = 0;
+      ow_engine_rearm_transfers (engine);
+      if (!engine->recovering)
+	{
+	  debug_print (1, "%s: USB transfers recovered", engine->name);
+	  return 0;
+	}
     }
 }
 
+//This must run in the audio thread as deadline scheduling can only be set by the thread itself.
 static void
-prepare_cycle_in_audio (struct ow_engine *engine)
+ow_engine_set_audio_sched (struct ow_engine *engine)
 {
-  libusb_fill_interrupt_transfer (engine->usb.xfr_audio_in,
-				  engine->usb.device_handle, AUDIO_IN_EP,
-				  engine->usb.xfr_audio_in_data,
-				  engine->usb.xfr_audio_in_data_len,
-				  cb_xfr_audio_in, engine,
-				  engine->usb.xfr_timeout);
+  uint64_t period;
+  struct ow_sched *sched = &engine->context->sched;
 
-  int err = libusb_submit_transfer (engine->usb.xfr_audio_in);
-  if (err)
+  if (sched->policy == OW_SCHED_POLICY_DEADLINE)
     {
-      error_print ("o2h: Error when submitting USB audio in transfer: %s",
-		   libusb_strerror (err));
-      ow_engine_set_status (engine, OW_ENGINE_STATUS_ERROR);
+      period = engine->frames_per_transfer * 1000000000 / OB_SAMPLE_RATE;
+      engine->deadline =
+	!ow_set_thread_deadline (period / DEADLINE_RUNTIME_DIVISOR, period);
+      if (engine->deadline)
+	{
+	  debug_print (1, "%s: Using deadline scheduling (%lu ns period)",
+		       engine->name, period);
+	  if (sched->audio_cpus)
+	    {
+	      debug_print (1,
+			   "Deadline threads can not be pinned. Ignoring affinity...");
+	    }
+	  return;
+	}
+
+      engine->context->set_rt_priority (pthread_self (),
+					engine->context->priority);
     }
+
+  ow_set_thread_affinity (pthread_self (), sched->audio_cpus);
 }
 
 static void
-prepare_cycle_in_midi (struct ow_engine *engine)
+ow_engine_resize_transfers (struct ow_engine *engine)
 {
-  libusb_fill_bulk_transfer (engine->usb.xfr_midi_in,
-			     engine->usb.device_handle, MIDI_IN_EP,
-			     engine->usb.xfr_midi_in_data,
-			     USB_BULK_MIDI_LEN, cb_xfr_midi_in, engine,
-			     engine->usb.xfr_timeout);
+  debug_print (1, "%s: Changing blocks per transfer from %u to %u...",
+	       engine->name, engine->blocks_per_transfer,
+	       engine->auto_blocks.blocks);
 
-  int err = libusb_submit_transfer (engine->usb.xfr_midi_in);
-  if (err)
-    {
-      error_print ("o2h: Error when submitting USB MIDI transfer: %s",
-		   libusb_strerror (err));
-      ow_engine_set_status (engine, OW_ENGINE_STATUS_ERROR);
-    }
-}
+  ow_engine_drain_transfers (engine);
 
-static void
-prepare_cycle_out_midi (struct ow_engine *engine)
-{
-  libusb_fill_bulk_transfer (engine->usb.xfr_midi_out,
-			     engine->usb.device_handle, MIDI_OUT_EP,
-			     engine->usb.xfr_midi_out_data,
-			     USB_BULK_MIDI_LEN, cb_xfr_midi_out, engine,
-			     engine->usb.xfr_timeout);
+  pthread_spin_lock (&engine->lock);
+  ow_engine_set_blocks_per_transfer (engine, engine->auto_blocks.blocks);
+  pthread_spin_unlock (&engine->lock);
 
-  int err = libusb_submit_transfer (engine->usb.xfr_midi_out);
-  if (err)
+  if (engine->deadline)
     {
-      error_print ("h2o: Error when submitting USB MIDI transfer: %s",
-		   libusb_strerror (err));
-      ow_engine_set_status (engine, OW_ENGINE_STATUS_ERROR);
+      ow_engine_set_audio_sched (engine);
     }
+
+  ow_engine_restart (engine);
+  ow_engine_rearm_transfers (engine);
 }
 
 static void
@@ -523,22 +1104,25 @@ usb_shutdown (struct ow_engine *engine)
   libusb_close (engine->usb.device_handle);
   libusb_free_transfer (engine->usb.xfr_audio_in);
   libusb_free_transfer (engine->usb.xfr_audio_out);
-  libusb_free_transfer (engine->usb.xfr_midi_in);
-  libusb_free_transfer (engine->usb.xfr_midi_out);
+  for (int i = 0; i < OW_O2H_MIDI_XFRS; i++)
+    {
+      libusb_free_transfer (engine->usb.xfr_midi_in[i]);
+    }
+  for (int i = 0; i < OW_H2O_MIDI_XFRS; i++)
+    {
+      libusb_free_transfer (engine->usb.xfr_midi_out[i]);
+    }
   libusb_free_transfer (engine->usb.xfr_control_in);
   libusb_free_transfer (engine->usb.xfr_control_out);
   libusb_exit (engine->usb.context);
 }
 
-void
-ow_engine_init_mem (struct ow_engine *engine,
-		    unsigned int blocks_per_transfer)
+//Sets the sizes for the given blocks. The memory is allocated for OW_MAX_BLOCKS so this can be changed without reallocating.
+static void
+ow_engine_set_blocks_per_transfer (struct ow_engine *engine,
+				   unsigned int blocks_per_transfer)
 {
-  struct ow_engine_usb_blk *blk;
-
-  engine->context = NULL;
-
-  pthread_spin_init (&engine->lock, PTHREAD_PROCESS_SHARED);
+  const struct ow_device_sizes *sizes;
 
   engine->blocks_per_transfer = blocks_per_transfer;
   debug_print (1, "Blocks per transfer: %u", engine->blocks_per_transfer);
@@ -546,82 +1130,186 @@ ow_engine_init_mem (struct ow_engine *engine,
   engine->frames_per_transfer =
     OB_FRAMES_PER_BLOCK * engine->blocks_per_transfer;
 
-  engine->o2h_frame_size = OB_BYTES_PER_SAMPLE * engine->device_desc.outputs;
-  engine->h2o_frame_size = OB_BYTES_PER_SAMPLE * engine->device_desc.inputs;
+  sizes = ow_get_device_sizes (engine->device_desc,
+			       engine->blocks_per_transfer);
+  if (sizes)
+    {
+      engine->o2h_transfer_size = sizes->o2h_transfer_size;
+      engine->h2o_transfer_size = sizes->h2o_transfer_size;
+      engine->usb.xfr_audio_in_data_len = sizes->xfr_audio_in_data_len;
+      engine->usb.xfr_audio_out_data_len = sizes->xfr_audio_out_data_len;
+    }
+  else
+    {
+      engine->o2h_transfer_size =
+	engine->frames_per_transfer * engine->o2h_frame_size;
+      engine->h2o_transfer_size =
+	engine->frames_per_transfer * engine->h2o_frame_size;
+      engine->usb.xfr_audio_in_data_len =
+	engine->usb.audio_in_blk_len * engine->blocks_per_transfer;
+      engine->usb.xfr_audio_out_data_len =
+	engine->usb.audio_out_blk_len * engine->blocks_per_transfer;
+    }
 
   engine->o2h_min_latency =
     engine->frames_per_transfer * engine->o2h_frame_size;
   engine->h2o_min_latency =
     engine->frames_per_transfer * engine->h2o_frame_size;
 
+  debug_print (2, "o2h: audio transfer size: %zu B",
+	       engine->o2h_transfer_size);
+  debug_print (2, "h2o: audio transfer size: %zu B",
+	       engine->h2o_transfer_size);
+
+  engine->h2o_data.input_frames = engine->frames_per_transfer;
+  engine->h2o_data.output_frames = engine->frames_per_transfer;
+}
+
+//Returns 1 if the arena could not be allocated.
+int
+ow_engine_init_mem (struct ow_engine *engine,
+		    unsigned int blocks_per_transfer)
+{
+  struct ow_engine_usb_blk *blk;
+  const struct ow_device_sizes *sizes;
+  size_t max_xfr_in_len, max_xfr_out_len, max_o2h_size, max_h2o_size;
+
+  engine->context = NULL;
+  engine->planar = 0;
+
+  pthread_spin_init (&engine->lock, PTHREAD_PROCESS_SHARED);
+
+  engine->auto_blocks.enabled = blocks_per_transfer == OW_AUTO_BLOCKS;
+  if (engine->auto_blocks.enabled)
+    {
+      blocks_per_transfer = AUTO_BLOCKS_START;
+    }
+  engine->auto_blocks.blocks = blocks_per_transfer;
+  engine->auto_blocks.min_blocks = OW_MIN_BLOCKS;
+
+  //Frame and block sizes do not depend on the blocks per transfer.
+  sizes = ow_get_device_sizes (engine->device_desc, OW_DEFAULT_BLOCKS);
+  if (sizes)
+    {
+      engine->o2h_frame_size = sizes->o2h_frame_size;
+      engine->h2o_frame_size = sizes->h2o_frame_size;
+      engine->usb.audio_in_blk_len = sizes->audio_in_blk_len;
+      engine->usb.audio_out_blk_len = sizes->audio_out_blk_len;
+    }
+  else
+    {
+      engine->o2h_frame_size =
+	OB_BYTES_PER_SAMPLE * engine->device_desc->outputs;
+      engine->h2o_frame_size =
+	OB_BYTES_PER_SAMPLE * engine->device_desc->inputs;
+      engine->usb.audio_in_blk_len =
+	sizeof (struct ow_engine_usb_blk) +
+	OB_FRAMES_PER_BLOCK * engine->o2h_frame_size;
+      engine->usb.audio_out_blk_len =
+	sizeof (struct ow_engine_usb_blk) +
+	OB_FRAMES_PER_BLOCK * engine->h2o_frame_size;
+    }
+
   debug_print (2, "o2h: USB in frame size: %zu B", engine->o2h_frame_size);
   debug_print (2, "h2o: USB out frame size: %zu B", engine->h2o_frame_size);
 
-  engine->usb.audio_in_blk_len =
-    sizeof (struct ow_engine_usb_blk) +
-    OB_FRAMES_PER_BLOCK * engine->o2h_frame_size;
-  engine->usb.audio_out_blk_len =
-    sizeof (struct ow_engine_usb_blk) +
-    OB_FRAMES_PER_BLOCK * engine->h2o_frame_size;
-
   debug_print (2, "o2h: USB in block size: %zu B",
 	       engine->usb.audio_in_blk_len);
   debug_print (2, "h2o: USB out block size: %zu B",
 	       engine->usb.audio_out_blk_len);
 
-  engine->o2h_transfer_size =
-    engine->frames_per_transfer * engine->o2h_frame_size;
-  engine->h2o_transfer_size =
-    engine->frames_per_transfer * engine->h2o_frame_size;
-
-  debug_print (2, "o2h: audio transfer size: %zu B",
-	       engine->o2h_transfer_size);
-  debug_print (2, "h2o: audio transfer size: %zu B",
-	       engine->h2o_transfer_size);
-
-  engine->usb.audio_frames_counter = 0;
-  engine->usb.xfr_audio_in_data_len =
-    engine->usb.audio_in_blk_len * engine->blocks_per_transfer;
-  engine->usb.xfr_audio_out_data_len =
-    engine->usb.audio_out_blk_len * engine->blocks_per_transfer;
-  engine->usb.xfr_audio_in_data = malloc (engine->usb.xfr_audio_in_data_len);
-  engine->usb.xfr_audio_out_data =
-    malloc (engine->usb.xfr_audio_out_data_len);
-  memset (engine->usb.xfr_audio_in_data, 0,
-	  engine->usb.xfr_audio_in_data_len);
-  memset (engine->usb.xfr_audio_out_data, 0,
-	  engine->usb.xfr_audio_out_data_len);
+  max_xfr_in_len = engine->usb.audio_in_blk_len * OW_MAX_BLOCKS;
+  max_xfr_out_len = engine->usb.audio_out_blk_len * OW_MAX_BLOCKS;
+  max_o2h_size = OB_FRAMES_PER_BLOCK * OW_MAX_BLOCKS * engine->o2h_frame_size;
+  max_h2o_size = OB_FRAMES_PER_BLOCK * OW_MAX_BLOCKS * engine->h2o_frame_size;
+
+  //Everything the threads use is in the zeroed arena so the first cycles do not page fault.
+  if (ow_arena_init (&engine->arena,
+		     OW_CACHE_LINE_ALIGN (max_xfr_in_len) +
+		     OW_CACHE_LINE_ALIGN (max_xfr_out_len) +
+		     OW_CACHE_LINE_ALIGN (max_o2h_size) +
+		     2 * OW_CACHE_LINE_ALIGN (max_h2o_size) +
+		     (OW_H2O_MIDI_XFRS +
+		      OW_O2H_MIDI_XFRS) *
+		     OW_CACHE_LINE_ALIGN (USB_BULK_MIDI_LEN) +
+		     OW_CACHE_LINE_ALIGN (USB_CONTROL_LEN) +
+		     OW_CACHE_LINE_ALIGN (OB_NAME_MAX_LEN)))
+    {
+      return 1;
+    }
+
+  engine->audio_frames_counter = 0;
+  engine->usb.xfr_audio_in_data = ow_arena_alloc (&engine->arena,
+						  max_xfr_in_len);
+  engine->usb.xfr_audio_out_data = ow_arena_alloc (&engine->arena,
+						   max_xfr_out_len);
+  if (!engine->usb.xfr_audio_in_data || !engine->usb.xfr_audio_out_data)
+    {
+      goto error;
+    }
 
-  for (int i = 0; i < engine->blocks_per_transfer; i++)
+  for (int i = 0; i < OW_MAX_BLOCKS; i++)
     {
       blk = GET_NTH_OUTPUT_USB_BLK (engine, i);
       blk->header = htobe16 (0x07ff);
     }
 
-  engine->h2o_transfer_buf = malloc (engine->h2o_transfer_size);
-  engine->o2h_transfer_buf = malloc (engine->o2h_transfer_size);
-  memset (engine->h2o_transfer_buf, 0, engine->h2o_transfer_size);
-  memset (engine->o2h_transfer_buf, 0, engine->o2h_transfer_size);
+  engine->h2o_transfer_buf = ow_arena_alloc (&engine->arena, max_h2o_size);
+  engine->o2h_transfer_buf = ow_arena_alloc (&engine->arena, max_o2h_size);
 
   //o2h resampler
-  engine->h2o_resampler_buf = malloc (engine->h2o_transfer_size);
-  memset (engine->h2o_resampler_buf, 0, engine->h2o_transfer_size);
+  engine->h2o_resampler_buf = ow_arena_alloc (&engine->arena, max_h2o_size);
+  if (!engine->h2o_transfer_buf || !engine->o2h_transfer_buf
+      || !engine->h2o_resampler_buf)
+    {
+      goto error;
+    }
   engine->h2o_data.data_in = engine->h2o_resampler_buf;
   engine->h2o_data.data_out = engine->h2o_transfer_buf;
   engine->h2o_data.end_of_input = 1;
-  engine->h2o_data.input_frames = engine->frames_per_transfer;
-  engine->h2o_data.output_frames = engine->frames_per_transfer;
+
+  ow_engine_set_blocks_per_transfer (engine, blocks_per_transfer);
 
   //MIDI
-  engine->usb.xfr_midi_out_data = malloc (USB_BULK_MIDI_LEN);
-  engine->usb.xfr_midi_in_data = malloc (USB_BULK_MIDI_LEN);
-  memset (engine->usb.xfr_midi_out_data, 0, USB_BULK_MIDI_LEN);
-  memset (engine->usb.xfr_midi_in_data, 0, USB_BULK_MIDI_LEN);
+  for (int i = 0; i < OW_H2O_MIDI_XFRS; i++)
+    {
+      engine->usb.xfr_midi_out_data[i] = ow_arena_alloc (&engine->arena,
+							 USB_BULK_MIDI_LEN);
+      if (!engine->usb.xfr_midi_out_data[i])
+	{
+	  goto error;
+	}
+      engine->h2o_midi_ready[i] = 1;
+    }
+  for (int i = 0; i < OW_O2H_MIDI_XFRS; i++)
+    {
+      engine->usb.xfr_midi_in_data[i] = ow_arena_alloc (&engine->arena,
+							USB_BULK_MIDI_LEN);
+      if (!engine->usb.xfr_midi_in_data[i])
+	{
+	  goto error;
+	}
+    }
+  engine->h2o_midi_status = LIBUSB_TRANSFER_COMPLETED;
+  engine->h2o_midi_late_packets = 0;
+  engine->h2o_midi_max_lateness = 0;
   pthread_spin_init (&engine->h2o_midi_lock, PTHREAD_PROCESS_SHARED);
 
   //Control
-  engine->usb.xfr_control_out_data = malloc (USB_CONTROL_LEN);
-  engine->usb.xfr_control_in_data = malloc (OB_NAME_MAX_LEN);
+  engine->usb.xfr_control_out_data = ow_arena_alloc (&engine->arena,
+						     USB_CONTROL_LEN);
+  engine->usb.xfr_control_in_data = ow_arena_alloc (&engine->arena,
+						    OB_NAME_MAX_LEN);
+  if (!engine->usb.xfr_control_out_data || !engine->usb.xfr_control_in_data)
+    {
+      goto error;
+    }
+
+  return 0;
+
+error:
+  ow_arena_destroy (&engine->arena);
+  return 1;
 }
 
 // initialization taken from sniffed session
@@ -635,8 +1323,14 @@ ow_engine_init (struct ow_engine *engine, unsigned int blocks_per_transfer,
 
   engine->usb.xfr_audio_in = NULL;
   engine->usb.xfr_audio_out = NULL;
-  engine->usb.xfr_midi_in = NULL;
-  engine->usb.xfr_midi_out = NULL;
+  for (int i = 0; i < OW_O2H_MIDI_XFRS; i++)
+    {
+      engine->usb.xfr_midi_in[i] = NULL;
+    }
+  for (int i = 0; i < OW_H2O_MIDI_XFRS; i++)
+    {
+      engine->usb.xfr_midi_out[i] = NULL;
+    }
   engine->usb.xfr_control_in = NULL;
   engine->usb.xfr_control_out = NULL;
 
@@ -718,7 +1412,12 @@ ow_engine_init (struct ow_engine *engine, unsigned int blocks_per_transfer,
 end:
   if (ret == OW_OK)
     {
-      ow_engine_init_mem (engine, blocks_per_transfer);
+      if (ow_engine_init_mem (engine, blocks_per_transfer))
+	{
+	  usb_shutdown (engine);
+	  free (engine);
+	  ret = OW_GENERIC_ERROR;
+	}
     }
   else
     {
@@ -749,7 +1448,11 @@ ow_engine_init_from_libusb_device_descriptor (struct ow_engine **engine_,
       return OW_USB_ERROR_LIBUSB_INIT_FAILED;
     }
 
-  engine = malloc (sizeof (struct ow_engine));
+  if (posix_memalign ((void **) &engine, OW_CACHE_LINE_SIZE,
+		      sizeof (struct ow_engine)))
+    {
+      return OW_GENERIC_ERROR;
+    }
 
   if (libusb_init (&engine->usb.context) != LIBUSB_SUCCESS)
     {
@@ -808,7 +1511,11 @@ ow_engine_init_from_bus_address (struct ow_engine **engine_,
   struct ow_engine *engine;
   struct libusb_device_descriptor desc;
 
-  engine = malloc (sizeof (struct ow_engine));
+  if (posix_memalign ((void **) &engine, OW_CACHE_LINE_SIZE,
+		      sizeof (struct ow_engine)))
+    {
+      return OW_GENERIC_ERROR;
+    }
 
   if (libusb_init (&engine->usb.context) != LIBUSB_SUCCESS)
     {
@@ -829,10 +1536,10 @@ ow_engine_init_from_bus_address (struct ow_engine **engine_,
 	  continue;
 	}
 
-      if (!ow_get_device_desc_from_vid_pid (desc.idVendor, desc.idProduct,
-					    &engine->device_desc)
-	  && libusb_get_bus_number (*device) == bus
-	  && libusb_get_device_address (*device) == address)
+      if (libusb_get_bus_number (*device) == bus
+	  && libusb_get_device_address (*device) == address
+	  && !ow_get_device_desc_from_vid_pid (desc.idVendor, desc.idProduct,
+					       &engine->device_desc))
 	{
 	  err = libusb_open (*device, &engine->usb.device_handle);
 	  if (err)
@@ -886,116 +1593,192 @@ static const char *ob_err_strgs[] = {
   "'o2h_midi' not set in context",
   "'h2o_midi' not set in context",
   "'get_time' not set in context",
-  "'dll' not set in context"
+  "'dll' not set in context",
+  "'process' and 'dll' set in context",
+  "planar 'layout' without 'process' in context"
 };
 
-static void *
-run_h2o_midi (void *data)
+static void
+h2o_midi_sleep (uint64_t us)
 {
-  int len, h2o_midi_ready, event_read;
-  uint8_t *pos;
-  uint64_t last_time, before_usb, after_usb, delta_event, delta_usb;
   struct timespec sleep_time;
-  struct ow_midi_event event;
-  struct ow_engine *engine = data;
 
-  event_read = 0;
-  len = 0;
-  last_time = 0;
-  delta_event = 0;
-  pos = engine->usb.xfr_midi_out_data;
-  memset (pos, 0, USB_BULK_MIDI_LEN);
-  while (1)
+  debug_print (2, "h2o: Sleeping %lu us...", us);
+  sleep_time.tv_sec = us / 1000000;
+  sleep_time.tv_nsec = (us % 1000000) * 1000;
+  nanosleep (&sleep_time, NULL);
+}
+
+//Events keep their relative timing through an offset from their time to the time they are due.
+//The offset is kept when the queue gets empty between events and it is only set again when an event would be sent after its window, which is always the case for the first one.
+void
+ow_engine_sync_h2o_midi (struct ow_engine *engine, uint64_t now,
+			 uint64_t time)
+{
+  if (engine->h2o_midi_synced &&
+      time + engine->h2o_midi_offset + engine->h2o_midi_window >= now)
+    {
+      return;
+    }
+
+  debug_print (2, "h2o: Setting MIDI offset...");
+  engine->h2o_midi_offset = now - time;
+  engine->h2o_midi_synced = 1;
+}
+
+//Packs every event due before the end of the window. An event due later is kept for the next transfer.
+//Returns the bytes packed.
+int
+ow_engine_pack_h2o_midi (struct ow_engine *engine, uint8_t *buf, int size,
+			 uint64_t now)
+{
+  uint64_t due, lateness;
+  int len = 0;
+  struct ow_midi_event *event = &engine->h2o_midi_event;
+
+  while (len + OB_MIDI_EVENT_SIZE <= size)
     {
-      while ((event_read
-	      || engine->context->read_space (engine->context->h2o_midi) >=
-	      sizeof (struct ow_midi_event)) && len < USB_BULK_MIDI_LEN)
+      if (!engine->h2o_midi_event_read)
 	{
-	  if (!event_read)
+	  if (engine->context->read_space (engine->context->h2o_midi) <
+	      sizeof (struct ow_midi_event))
 	    {
-	      engine->context->read (engine->context->h2o_midi,
-				     (void *) &event,
-				     sizeof (struct ow_midi_event));
-	      debug_print (3,
-			   "h2o: MIDI packet: %02x %02x %02x %02x @ %lu us",
-			   event.packet.header, event.packet.data[0],
-			   event.packet.data[1], event.packet.data[2],
-			   event.time);
-	      event_read = 1;
-	      if (len == 0)
-		{
-		  delta_event = 0;
-		  last_time = event.time;
-		}
-	      else
-		{
-		  if (event.time != last_time)
-		    {
-		      delta_event = event.time - last_time;
-		      last_time = event.time;
-		      break;
-		    }
-		}
+	      break;
 	    }
+	  engine->context->read (engine->context->h2o_midi, (void *) event,
+				 sizeof (struct ow_midi_event));
+	  engine->h2o_midi_event_read = 1;
+	}
 
-	  memcpy (pos, event.raw, OB_MIDI_EVENT_SIZE);
-	  pos += OB_MIDI_EVENT_SIZE;
-	  len += OB_MIDI_EVENT_SIZE;
-	  event_read = 0;
+      due = event->time + engine->h2o_midi_offset;
+      if (due > now + engine->h2o_midi_window)
+	{
+	  break;
 	}
 
-      if (len)
+      debug_print (3,
+		   "h2o: MIDI packet: %02x %02x %02x %02x @ %lu us",
+		   event->packet.header, event->packet.data[0],
+		   event->packet.data[1], event->packet.data[2], event->time);
+
+      lateness = now > due ? now - due : 0;
+      if (lateness > engine->h2o_midi_window)
 	{
-	  int64_t delta;
+	  engine->h2o_midi_late_packets++;
+	  if (lateness > engine->h2o_midi_max_lateness)
+	    {
+	      engine->h2o_midi_max_lateness = lateness;
+	    }
+	  debug_print (2, "h2o: MIDI packet %lu us late", lateness);
+	}
+
+      memcpy (buf + len, event->raw, OB_MIDI_EVENT_SIZE);
+      len += OB_MIDI_EVENT_SIZE;
+      engine->h2o_midi_event_read = 0;
+    }
+
+  return len;
+}
 
-	  engine->h2o_midi_ready = 0;
-	  debug_print (2, "Sending %d bytes to MIDI endpoint...", len);
+//The next batch is packed while the previous transfer is in flight.
+static void *
+run_h2o_midi (void *data)
+{
+  int len, next, idle, h2o_midi_ready, h2o_midi_status;
+  uint8_t *buf;
+  uint64_t now, due;
+  struct ow_engine *engine = data;
 
-	  prepare_cycle_out_midi (engine);
+  ow_set_thread_affinity (pthread_self (), engine->context->sched.midi_cpus);
 
-	  //Waiting for the USB block to be sent...
+  engine->h2o_midi_window = engine->context->h2o_midi_window ?
+    engine->context->h2o_midi_window : OW_DEFAULT_H2O_MIDI_WINDOW;
+  debug_print (1, "h2o: MIDI window: %lu us", engine->h2o_midi_window);
 
-	  before_usb = engine->context->get_time ();
+  next = 0;
+  idle = 1;
+  engine->h2o_midi_synced = 0;
+  engine->h2o_midi_event_read = 0;
+  while (1)
+    {
+      if (ow_engine_get_status (engine) <= OW_ENGINE_STATUS_STOP)
+	{
+	  break;
+	}
 
-	  pthread_spin_lock (&engine->h2o_midi_lock);
-	  h2o_midi_ready = engine->h2o_midi_ready;
-	  pthread_spin_unlock (&engine->h2o_midi_lock);
-	  while (!h2o_midi_ready)
+      if (!engine->h2o_midi_event_read)
+	{
+	  if (engine->context->read_space (engine->context->h2o_midi) <
+	      sizeof (struct ow_midi_event))
 	    {
+	      idle = 1;
 	      SLEEP_THE_LEAST;
-	      pthread_spin_lock (&engine->h2o_midi_lock);
-	      h2o_midi_ready = engine->h2o_midi_ready;
-	      pthread_spin_unlock (&engine->h2o_midi_lock);
+	      continue;
 	    }
 
-	  after_usb = engine->context->get_time ();
-
-	  //Sleep until the next event (already read)
-	  delta_usb = after_usb - before_usb;
-	  delta = delta_event - delta_usb;
-	  if (delta > 0)
+	  engine->context->read (engine->context->h2o_midi,
+				 (void *) &engine->h2o_midi_event,
+				 sizeof (struct ow_midi_event));
+	  engine->h2o_midi_event_read = 1;
+	  if (idle)
 	    {
-	      debug_print (2, "Sleeping %lu us...", delta);
-	      sleep_time.tv_sec = delta / 1000000;
-	      sleep_time.tv_nsec = (delta - sleep_time.tv_sec) * 1e3;
-	      nanosleep (&sleep_time, NULL);
+	      ow_engine_sync_h2o_midi (engine, engine->context->get_time (),
+				       engine->h2o_midi_event.time);
+	      idle = 0;
 	    }
+	}
+
+      now = engine->context->get_time ();
+      due = engine->h2o_midi_event.time + engine->h2o_midi_offset;
+      if (due > now)
+	{
+	  h2o_midi_sleep (due - now);
+	  continue;
+	}
 
-	  len = 0;
-	  pos = engine->usb.xfr_midi_out_data;
-	  memset (pos, 0, USB_BULK_MIDI_LEN);
+      pthread_spin_lock (&engine->h2o_midi_lock);
+      h2o_midi_ready = engine->h2o_midi_ready[next];
+      h2o_midi_status = engine->h2o_midi_status;
+      engine->h2o_midi_status = LIBUSB_TRANSFER_COMPLETED;
+      pthread_spin_unlock (&engine->h2o_midi_lock);
+
+      if (h2o_midi_status == LIBUSB_TRANSFER_STALL)
+	{
+	  error_print ("h2o: Clearing MIDI endpoint halt...");
+	  libusb_clear_halt (engine->usb.device_handle, MIDI_OUT_EP);
 	}
-      else
+
+      //Transfers complete in order so the next one is the oldest.
+      if (!h2o_midi_ready)
 	{
 	  SLEEP_THE_LEAST;
+	  continue;
 	}
 
-      if (ow_engine_get_status (engine) <= OW_ENGINE_STATUS_STOP)
+      buf = engine->usb.xfr_midi_out_data[next];
+      len = ow_engine_pack_h2o_midi (engine, buf, USB_BULK_MIDI_LEN, now);
+      memset (buf + len, 0, USB_BULK_MIDI_LEN - len);
+
+      debug_print (2, "h2o: Sending %d bytes to MIDI endpoint...", len);
+
+      pthread_spin_lock (&engine->h2o_midi_lock);
+      engine->h2o_midi_ready[next] = 0;
+      pthread_spin_unlock (&engine->h2o_midi_lock);
+
+      if (prepare_cycle_out_midi (engine, next))
 	{
-	  break;
+	  //A transfer that was not submitted never calls its callback.
+	  pthread_spin_lock (&engine->h2o_midi_lock);
+	  engine->h2o_midi_ready[next] = 1;
+	  pthread_spin_unlock (&engine->h2o_midi_lock);
 	}
+
+      next = (next + 1) % OW_H2O_MIDI_XFRS;
     }
 
+  debug_print (1, "h2o: Late MIDI packets: %lu (max. %lu us)",
+	       engine->h2o_midi_late_packets, engine->h2o_midi_max_lateness);
+
   return NULL;
 }
 
@@ -1005,6 +1788,9 @@ run_audio_o2h_midi (void *data)
   size_t rsh2o, bytes;
   struct ow_engine *engine = data;
 
+  engine->deadline = 0;
+  ow_engine_set_audio_sched (engine);
+
   if (engine->context->dll)
     {
       engine->context->dll_overbridge_init (engine->context->dll,
@@ -1015,11 +1801,22 @@ run_audio_o2h_midi (void *data)
   //MIDI runs independently of audio status
   if (engine->context->options & OW_ENGINE_OPTION_O2P_MIDI)
     {
-      prepare_cycle_in_midi (engine);
+      prepare_cycles_in_midi (engine);
 
       while (ow_engine_get_status (engine) == OW_ENGINE_STATUS_READY)
 	{
-	  libusb_handle_events_completed (engine->usb.context, NULL);
+	  //A failed MIDI transfer is recovered once the audio has started.
+	  if (engine->recovering)
+	    {
+	      SLEEP_THE_LEAST;
+	    }
+	  else
+	    {
+	      //MIDI in transfers do not time out so the status needs to be polled.
+	      struct timeval tv = {.tv_sec = 0,.tv_usec = READY_POLL_US };
+	      libusb_handle_events_timeout_completed (engine->usb.context,
+						      &tv, NULL);
+	    }
 	}
     }
 
@@ -1066,11 +1863,24 @@ run_audio_o2h_midi (void *data)
 	}
       pthread_spin_unlock (&engine->lock);
 
-      while (ow_engine_get_status (engine) >= OW_ENGINE_STATUS_WAIT)
+      while (ow_engine_get_status (engine) >= OW_ENGINE_STATUS_WAIT
+	     && !engine->recovering
+	     && engine->auto_blocks.blocks == engine->blocks_per_transfer)
 	{
 	  libusb_handle_events_completed (engine->usb.context, NULL);
 	}
 
+      if (engine->recovering && ow_engine_recover (engine))
+	{
+	  break;
+	}
+
+      if (engine->auto_blocks.blocks != engine->blocks_per_transfer
+	  && ow_engine_get_status (engine) > OW_ENGINE_STATUS_STOP)
+	{
+	  ow_engine_resize_transfers (engine);
+	}
+
       if (ow_engine_get_status (engine) < OW_ENGINE_STATUS_BOOT)
 	{
 	  break;
@@ -1080,18 +1890,26 @@ run_audio_o2h_midi (void *data)
 
       debug_print (1, "Clearing buffers...");
 
-      rsh2o = engine->context->read_space (engine->context->h2o_audio);
-      bytes = ow_bytes_to_frame_bytes (rsh2o, engine->h2o_frame_size);
-      engine->context->read (engine->context->h2o_audio, NULL, bytes);
+      if (!engine->context->process)
+	{
+	  rsh2o = engine->context->read_space (engine->context->h2o_audio);
+	  bytes = ow_bytes_to_frame_bytes (rsh2o, engine->h2o_frame_size);
+	  engine->context->read (engine->context->h2o_audio, NULL, bytes);
+	}
       memset (engine->h2o_transfer_buf, 0, engine->h2o_transfer_size);
     }
 
   //status == OW_ENGINE_STATUS_STOP || status == OW_ENGINE_STATUS_ERROR
 
   //Handle completed events but not actually processed.
-  //No new transfers will be submitted due to the status.
+  //No new transfers will be submitted due to the status but the MIDI in transfers never time out.
   debug_print (2, "Processing remaining event...");
-  libusb_handle_events_completed (engine->usb.context, NULL);
+  ow_engine_drain_transfers (engine);
+
+  debug_print (1,
+	       "o2h: MIDI transfers: %lu; packets: %lu (max. %u per transfer)",
+	       engine->o2h_midi_xfrs, engine->o2h_midi_packets,
+	       engine->o2h_midi_max_packets);
 
   return NULL;
 }
@@ -1120,7 +1938,23 @@ ow_engine_start (struct ow_engine *engine, struct ow_context *context)
       return OW_GENERIC_ERROR;
     }
 
-  if (context->options & OW_ENGINE_OPTION_O2P_AUDIO)
+  if (context->process)
+    {
+      audio_o2h_midi_thread = 1;
+      if (context->dll)
+	{
+	  return OW_INIT_ERROR_PROCESS_WITH_DLL;
+	}
+    }
+
+  if (context->layout == OW_SAMPLE_LAYOUT_PLANAR && !context->process)
+    {
+      return OW_INIT_ERROR_PLANAR_WITHOUT_PROCESS;
+    }
+  engine->planar = context->layout == OW_SAMPLE_LAYOUT_PLANAR;
+
+  //With a process callback, no buffers are needed for audio.
+  if (!context->process && context->options & OW_ENGINE_OPTION_O2P_AUDIO)
     {
       audio_o2h_midi_thread = 1;
       if (!context->read_space)
@@ -1141,7 +1975,7 @@ ow_engine_start (struct ow_engine *engine, struct ow_context *context)
 	}
     }
 
-  if (context->options & OW_ENGINE_OPTION_P2O_AUDIO)
+  if (!context->process && context->options & OW_ENGINE_OPTION_P2O_AUDIO)
     {
       audio_o2h_midi_thread = 1;
       if (!context->read_space)
@@ -1197,6 +2031,16 @@ ow_engine_start (struct ow_engine *engine, struct ow_context *context)
       engine->status = OW_ENGINE_STATUS_READY;
     }
 
+  engine->recovering = 0;
+  engine->draining = 0;
+  engine->xfrs_in_flight = 0;
+  engine->o2h_midi_xfrs = 0;
+  engine->o2h_midi_packets = 0;
+  engine->o2h_midi_max_packets = 0;
+  engine->restarts = 0;
+  engine->recovery_attempts = 0;
+  engine->recovery_window_start = 0;
+
   if (!context->set_rt_priority)
     {
       context->set_rt_priority = ow_set_thread_rt_priority;
@@ -1225,8 +2069,12 @@ ow_engine_start (struct ow_engine *engine, struct ow_context *context)
 	  error_print ("Could not start device thread");
 	  return OW_GENERIC_ERROR;
 	}
-      context->set_rt_priority (engine->audio_o2h_midi_thread,
-				engine->context->priority);
+      //With deadline scheduling, the thread sets its own policy.
+      if (context->sched.policy != OW_SCHED_POLICY_DEADLINE)
+	{
+	  context->set_rt_priority (engine->audio_o2h_midi_thread,
+				    engine->context->priority);
+	}
     }
 
   return OW_OK;
@@ -1259,18 +2107,9 @@ ow_engine_destroy (struct ow_engine *engine)
 void
 ow_engine_free_mem (struct ow_engine *engine)
 {
-  free (engine->h2o_transfer_buf);
-  free (engine->h2o_resampler_buf);
-  free (engine->o2h_transfer_buf);
-  free (engine->usb.xfr_audio_in_data);
-  free (engine->usb.xfr_audio_out_data);
-  free (engine->usb.xfr_midi_out_data);
-  free (engine->usb.xfr_midi_in_data);
-  free (engine->usb.xfr_control_out_data);
-  free (engine->usb.xfr_control_in_data);
+  ow_arena_destroy (&engine->arena);
   pthread_spin_destroy (&engine->lock);
   pthread_spin_destroy (&engine->h2o_midi_lock);
-  ow_free_device_desc (&engine->device_desc);
 }
 
 inline ow_engine_status_t
@@ -1329,10 +2168,38 @@ ow_bytes_to_frame_bytes (int bytes, int bytes_per_frame)
   return frames * bytes_per_frame;
 }
 
-struct ow_device_desc *
+const struct ow_device_desc *
 ow_engine_get_device_desc (struct ow_engine *engine)
 {
-  return &engine->device_desc;
+  return engine->device_desc;
+}
+
+unsigned int
+ow_engine_get_restarts (struct ow_engine *engine)
+{
+  unsigned int restarts;
+  pthread_spin_lock (&engine->lock);
+  restarts = engine->restarts;
+  pthread_spin_unlock (&engine->lock);
+  return restarts;
+}
+
+unsigned int
+ow_engine_get_blocks_per_transfer (struct ow_engine *engine)
+{
+  unsigned int blocks;
+  pthread_spin_lock (&engine->lock);
+  blocks = engine->blocks_per_transfer;
+  pthread_spin_unlock (&engine->lock);
+  return blocks;
+}
+
+void
+ow_engine_report_xrun (struct ow_engine *engine)
+{
+  pthread_spin_lock (&engine->lock);
+  engine->host_xruns++;
+  pthread_spin_unlock (&engine->lock);
 }
 
 inline void
@@ -1357,7 +2224,7 @@ ow_engine_print_blocks (struct ow_engine *engine, char *blks, size_t blk_len)
       s = blk->data;
       for (int j = 0; j < OB_FRAMES_PER_BLOCK; j++)
 	{
-	  for (int k = 0; k < engine->device_desc.outputs; k++)
+	  for (int k = 0; k < engine->device_desc->outputs; k++)
 	    {
 	      v = be32toh (*s);
 	      printf ("Frame %2d, track %2d: %d\n", j, k, v);
@@ -1375,7 +2242,7 @@ ow_engine_load_overbridge_name (struct ow_engine *engine)
 				     LIBUSB_REQUEST_TYPE_VENDOR |
 				     LIBUSB_RECIPIENT_DEVICE, 1, 0, 0,
 				     engine->usb.xfr_control_in_data,
-				     OB_NAME_MAX_LEN, 0);
+				     OB_NAME_MAX_LEN, USB_CONTROL_TIMEOUT_MS);
 
   if (res >= 0)
     {
@@ -1395,7 +2262,7 @@ ow_engine_load_overbridge_name (struct ow_engine *engine)
 				 LIBUSB_REQUEST_TYPE_VENDOR |
 				 LIBUSB_RECIPIENT_DEVICE, 2, 0, 0,
 				 engine->usb.xfr_control_in_data,
-				 OB_NAME_MAX_LEN, 0);
+				 OB_NAME_MAX_LEN, USB_CONTROL_TIMEOUT_MS);
 
   if (res >= 0)
     {
@@ -158,36 +158,40 @@
 
 #define OB_NAME_MAX_LEN 32
 
+//While one MIDI out transfer is in flight the next batch is packed in the other.
+#define OW_H2O_MIDI_XFRS 2
+//MIDI in transfers queued at the same time so that bursts are not held in the device between completions.
+#define OW_O2H_MIDI_XFRS 4
+
+//The struct is split in cache line aligned regions so that the fields each thread writes do not share a line with the fields other threads write.
 struct ow_engine
 {
+  //Cold. Written during initialization and read by all the threads.
   char name[OW_LABEL_MAX_LEN];
   char overbridge_name[OB_NAME_MAX_LEN];
-  ow_engine_status_t status;
-  unsigned int blocks_per_transfer;
-  unsigned int frames_per_transfer;
-  pthread_spinlock_t lock;
-  size_t o2h_latency;
-  size_t o2h_min_latency;
-  size_t o2h_max_latency;
-  size_t h2o_latency;
-  size_t h2o_min_latency;
-  size_t h2o_max_latency;
   pthread_t audio_o2h_midi_thread;
   pthread_t h2o_midi_thread;
-  struct ow_device_desc device_desc;
+  const struct ow_device_desc *device_desc;
+  struct ow_context *context;
+  struct ow_arena arena;
+  size_t o2h_frame_size;
+  size_t h2o_frame_size;
+  //Only written when the transfers are resized.
+  unsigned int blocks_per_transfer;
+  unsigned int frames_per_transfer;
   size_t h2o_transfer_size;
   size_t o2h_transfer_size;
+  size_t o2h_min_latency;
+  size_t h2o_min_latency;
   float *h2o_transfer_buf;
   float *o2h_transfer_buf;
-  size_t o2h_frame_size;
-  size_t h2o_frame_size;
+  float *h2o_resampler_buf;
   struct
   {
     libusb_context *context;
     libusb_device_handle *device_handle;
     unsigned int xfr_timeout;
     //Audio
-    uint16_t audio_frames_counter;
     struct libusb_transfer *xfr_audio_in;
     struct libusb_transfer *xfr_audio_out;
     uint8_t *xfr_audio_in_data;
@@ -197,24 +201,70 @@ struct ow_engine
     int xfr_audio_in_data_len;
     int xfr_audio_out_data_len;
     //MIDI
-    struct libusb_transfer *xfr_midi_out;
-    struct libusb_transfer *xfr_midi_in;
-    uint8_t *xfr_midi_out_data;
-    uint8_t *xfr_midi_in_data;
+    struct libusb_transfer *xfr_midi_out[OW_H2O_MIDI_XFRS];
+    struct libusb_transfer *xfr_midi_in[OW_O2H_MIDI_XFRS];
+    uint8_t *xfr_midi_out_data[OW_H2O_MIDI_XFRS];
+    uint8_t *xfr_midi_in_data[OW_O2H_MIDI_XFRS];
     //Control
     struct libusb_transfer *xfr_control_out;
     struct libusb_transfer *xfr_control_in;
     uint8_t *xfr_control_out_data;
     uint8_t *xfr_control_in_data;
   } usb;
+
+  //Shared. Written by every thread under lock.
+  pthread_spinlock_t lock OW_CACHE_LINE_ALIGNED;
+  ow_engine_status_t status;
+  unsigned int restarts;
+  unsigned int host_xruns;	//Host side xruns and underflows for the blocks per transfer controller.
+
+  //Audio thread. The latencies are read by the host under lock.
+  size_t o2h_latency OW_CACHE_LINE_ALIGNED;
+  size_t o2h_max_latency;
+  size_t h2o_latency;
+  size_t h2o_max_latency;
+  uint16_t audio_frames_counter;
+  int reading_at_h2o_end;
+  int planar;			//Transfer buffers are track after track.
   //j2o resampler
-  float *h2o_resampler_buf;
   SRC_DATA h2o_data;
-  //MIDI
-  int reading_at_h2o_end;
-  pthread_spinlock_t h2o_midi_lock;
-  int h2o_midi_ready;
-  struct ow_context *context;
+  int deadline;
+  //Recovery
+  int recovering;
+  int draining;			//Transfers are being cancelled so they must not be resubmitted.
+  int xfrs_in_flight;
+  //o2h MIDI
+  uint64_t o2h_midi_xfrs;
+  uint64_t o2h_midi_packets;
+  unsigned int o2h_midi_max_packets;	//Per transfer
+  unsigned int recovery_attempts;
+  uint64_t recovery_window_start;
+  //Blocks per transfer controller
+  struct
+  {
+    int enabled;
+    unsigned int blocks;	//Blocks to use after the next restart
+    unsigned int min_blocks;	//Lowest value that has not failed
+    unsigned int stable_windows;
+    unsigned int frames;
+    unsigned int underflows;
+    uint64_t last_xfr_time;
+    uint64_t max_jitter;
+  } auto_blocks;
+
+  //h2o MIDI thread and the MIDI out callback.
+  pthread_spinlock_t h2o_midi_lock OW_CACHE_LINE_ALIGNED;
+  int h2o_midi_ready[OW_H2O_MIDI_XFRS];
+  int h2o_midi_status;		//Last failed status
+  //Only used by the h2o MIDI thread.
+  uint64_t h2o_midi_window;
+  int64_t h2o_midi_offset;	//From the event time to the time it is due
+  int h2o_midi_synced;
+  struct ow_midi_event h2o_midi_event;	//Read but not packed yet
+  int h2o_midi_event_read;
+  //Lateness of the packets sent after their window.
+  uint64_t h2o_midi_late_packets;
+  uint64_t h2o_midi_max_lateness;
 };
 
 struct ow_engine_usb_blk
@@ -231,8 +281,19 @@ void ow_engine_read_usb_input_blocks (struct ow_engine *);
 
 void ow_engine_write_usb_output_blocks (struct ow_engine *);
 
-void ow_engine_init_mem (struct ow_engine *, unsigned int);
+void ow_engine_read_usb_input_blocks_planar (struct ow_engine *);
+
+void ow_engine_write_usb_output_blocks_planar (struct ow_engine *);
+
+int ow_engine_init_mem (struct ow_engine *, unsigned int);
+
+//Host side xruns and underflows feed the blocks per transfer controller.
+void ow_engine_report_xrun (struct ow_engine *);
 
 void ow_engine_free_mem (struct ow_engine *);
 
 void ow_engine_print_blocks (struct ow_engine *, char *, size_t);
+
+void ow_engine_sync_h2o_midi (struct ow_engine *, uint64_t, uint64_t);
+
+int ow_engine_pack_h2o_midi (struct ow_engine *, uint8_t *, int, uint64_t);
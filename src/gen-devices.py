@@ -0,0 +1,155 @@
+#!/usr/bin/env python3
+#
+#   gen-devices.py
+#   Copyright (C) 2021 David García Goñi <dagargo@gmail.com>
+#
+#   This file is part of Overwitch.
+#
+#   Overwitch is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 3 of the License, or
+#   (at your option) any later version.
+#
+#   Overwitch is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+
+# Generates the built-in device descriptor tables from a devices JSON file.
+# Usage: gen-devices.py devices.json > devices.c
+
+import json
+import sys
+
+# These must match the values in overwitch.h and engine.h.
+# The generated code checks them at compile time.
+OB_FRAMES_PER_BLOCK = 7
+OB_BYTES_PER_SAMPLE = 4
+OW_DEFAULT_BLOCKS = 24
+USB_BLK_HEADER_LEN = 32
+OB_MAX_TRACKS = 64
+
+HEADER = """\
+//Generated by gen-devices.py from {0}. Do not edit.
+
+#include "devices.h"
+#include "engine.h"
+
+_Static_assert (OB_FRAMES_PER_BLOCK == {1}, "OB_FRAMES_PER_BLOCK mismatch");
+_Static_assert (OB_BYTES_PER_SAMPLE == {2}, "OB_BYTES_PER_SAMPLE mismatch");
+_Static_assert (OW_DEFAULT_BLOCKS == {3}, "OW_DEFAULT_BLOCKS mismatch");
+_Static_assert (sizeof (struct ow_engine_usb_blk) == {4},
+		"struct ow_engine_usb_blk size mismatch");
+"""
+
+
+def fail(msg):
+    print(f'{sys.argv[0]}: {msg}', file=sys.stderr)
+    sys.exit(1)
+
+
+def c_string(s):
+    return json.dumps(s, ensure_ascii=False)
+
+
+def check_device(i, d):
+    for key, kind in (('pid', int), ('name', str),
+                      ('input_track_names', list),
+                      ('output_track_names', list)):
+        if not isinstance(d.get(key), kind):
+            fail(f"device {i}: missing or invalid member '{key}'")
+    for key in ('input_track_names', 'output_track_names'):
+        names = d[key]
+        if not names or len(names) > OB_MAX_TRACKS:
+            fail(f"device {i}: invalid number of '{key}'")
+        if not all(isinstance(n, str) for n in names):
+            fail(f"device {i}: invalid track name in '{key}'")
+
+
+def get_sizes(d):
+    frames_per_transfer = OB_FRAMES_PER_BLOCK * OW_DEFAULT_BLOCKS
+    o2h_frame_size = OB_BYTES_PER_SAMPLE * len(d['output_track_names'])
+    h2o_frame_size = OB_BYTES_PER_SAMPLE * len(d['input_track_names'])
+    audio_in_blk_len = (USB_BLK_HEADER_LEN +
+                        OB_FRAMES_PER_BLOCK * o2h_frame_size)
+    audio_out_blk_len = (USB_BLK_HEADER_LEN +
+                         OB_FRAMES_PER_BLOCK * h2o_frame_size)
+    return [
+        ('o2h_frame_size', o2h_frame_size),
+        ('h2o_frame_size', h2o_frame_size),
+        ('audio_in_blk_len', audio_in_blk_len),
+        ('audio_out_blk_len', audio_out_blk_len),
+        ('o2h_transfer_size', frames_per_transfer * o2h_frame_size),
+        ('h2o_transfer_size', frames_per_transfer * h2o_frame_size),
+        ('xfr_audio_in_data_len', OW_DEFAULT_BLOCKS * audio_in_blk_len),
+        ('xfr_audio_out_data_len', OW_DEFAULT_BLOCKS * audio_out_blk_len),
+    ]
+
+
+def print_names(var, names):
+    print(f'static char *{var}[] = {{')
+    for n in names:
+        print(f'  {c_string(n)},')
+    print('};')
+    print()
+
+
+def main():
+    if len(sys.argv) != 2:
+        fail('usage: gen-devices.py devices.json')
+
+    filename = sys.argv[1]
+    with open(filename, encoding='utf-8') as f:
+        devices = json.load(f)
+
+    if not isinstance(devices, list) or not devices:
+        fail(f'{filename}: not a non-empty array')
+
+    for i, d in enumerate(devices):
+        check_device(i, d)
+
+    devices.sort(key=lambda d: d['pid'])
+    for a, b in zip(devices, devices[1:]):
+        if a['pid'] == b['pid']:
+            fail(f"duplicated device with PID {a['pid']:04x}")
+
+    print(HEADER.format(filename.split('/')[-1], OB_FRAMES_PER_BLOCK,
+                        OB_BYTES_PER_SAMPLE, OW_DEFAULT_BLOCKS,
+                        USB_BLK_HEADER_LEN))
+
+    for i, d in enumerate(devices):
+        print_names(f'INPUT_TRACK_NAMES_{i}', d['input_track_names'])
+        print_names(f'OUTPUT_TRACK_NAMES_{i}', d['output_track_names'])
+
+    print('const struct ow_device_desc OW_DEVICE_DESCS[] = {')
+    for i, d in enumerate(devices):
+        print('  {')
+        print(f"   .pid = 0x{d['pid']:04x},")
+        print(f"   .name = {c_string(d['name'])},")
+        print(f"   .inputs = {len(d['input_track_names'])},")
+        print(f"   .outputs = {len(d['output_track_names'])},")
+        print(f'   .input_track_names = INPUT_TRACK_NAMES_{i},')
+        print(f'   .output_track_names = OUTPUT_TRACK_NAMES_{i}')
+        print('   },')
+    print('};')
+    print()
+
+    print('const struct ow_device_sizes OW_DEVICE_SIZES[] = {')
+    for d in devices:
+        print('  {')
+        sizes = get_sizes(d)
+        for j, (member, value) in enumerate(sizes):
+            sep = ',' if j < len(sizes) - 1 else ''
+            print(f'   .{member} = {value}{sep}')
+        print('   },')
+    print('};')
+    print()
+
+    print(f'const size_t OW_DEVICE_DESCS_LEN = {len(devices)};')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,403 @@
+/*
+ *   hotplug.c
+ *   Copyright (C) 2021 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include "hotplug.h"
+#include "utils.h"
+
+#define HOTPLUG_CREATE_RETRIES 10
+#define HOTPLUG_CREATE_RETRY_US 100000
+#define HOTPLUG_EVENTS_TIMEOUT_US 100000
+
+int
+hotplug_is_available ()
+{
+  return libusb_has_capability (LIBUSB_CAP_HAS_HOTPLUG);
+}
+
+void
+hotplug_manager_init (struct hotplug_manager *manager,
+		      const struct hotplug_source *source,
+		      hotplug_create_t create, hotplug_destroy_t destroy,
+		      void *data)
+{
+  manager->source = source;
+  manager->create = create;
+  manager->destroy = destroy;
+  manager->data = data;
+  manager->enumerate = 1;
+  manager->entries_len = 0;
+  manager->events_head = 0;
+  manager->events_len = 0;
+  manager->running = 0;
+  manager->context = NULL;
+  manager->source_running = 0;
+  pthread_mutex_init (&manager->lock, NULL);
+  pthread_cond_init (&manager->cond, NULL);
+}
+
+void
+hotplug_manager_destroy (struct hotplug_manager *manager)
+{
+  pthread_mutex_destroy (&manager->lock);
+  pthread_cond_destroy (&manager->cond);
+}
+
+//Called from the sources. This never blocks for long as the libusb hotplug callback must not.
+int
+hotplug_manager_push (struct hotplug_manager *manager,
+		      const struct hotplug_event *event)
+{
+  int pos, err = 0;
+
+  pthread_mutex_lock (&manager->lock);
+  if (manager->events_len == HOTPLUG_MAX_EVENTS)
+    {
+      error_print ("Hotplug event queue full. Dropping event...");
+      err = 1;
+    }
+  else
+    {
+      pos = (manager->events_head + manager->events_len) % HOTPLUG_MAX_EVENTS;
+      manager->events[pos] = *event;
+      manager->events_len++;
+      pthread_cond_signal (&manager->cond);
+    }
+  pthread_mutex_unlock (&manager->lock);
+
+  return err;
+}
+
+static struct hotplug_entry *
+hotplug_manager_get_entry (struct hotplug_manager *manager, uint8_t bus,
+			   uint8_t address)
+{
+  struct hotplug_entry *entry = manager->entries;
+  for (int i = 0; i < manager->entries_len; i++, entry++)
+    {
+      if (entry->bus == bus && entry->address == address)
+	{
+	  return entry;
+	}
+    }
+  return NULL;
+}
+
+static void
+hotplug_manager_remove_entry (struct hotplug_manager *manager,
+			      struct hotplug_entry *entry)
+{
+  debug_print (1, "Destroying instance at %03d:%03d...", entry->bus,
+	       entry->address);
+  manager->destroy (entry->instance, entry->bus, entry->address,
+		    manager->data);
+  manager->entries_len--;
+  *entry = manager->entries[manager->entries_len];
+}
+
+static void
+hotplug_manager_arrived (struct hotplug_manager *manager,
+			 const struct hotplug_event *event)
+{
+  void *instance;
+  struct hotplug_entry *entry;
+  struct ow_usb_device device;
+
+  if (ow_get_device_desc_from_vid_pid (event->vid, event->pid, &device.desc))
+    {
+      return;
+    }
+
+  device.vid = event->vid;
+  device.pid = event->pid;
+  device.bus = event->bus;
+  device.address = event->address;
+
+  debug_print (1, "%s arrived at %03d:%03d", device.desc->name, device.bus,
+	       device.address);
+
+  //The departure of a previous device at the same address was missed.
+  entry = hotplug_manager_get_entry (manager, device.bus, device.address);
+  if (entry)
+    {
+      hotplug_manager_remove_entry (manager, entry);
+    }
+
+  if (manager->entries_len == HOTPLUG_MAX_DEVICES)
+    {
+      error_print ("Too many devices. Ignoring device at %03d:%03d...",
+		   device.bus, device.address);
+      return;
+    }
+
+  for (int i = 0; i < HOTPLUG_CREATE_RETRIES; i++)
+    {
+      instance = manager->create (&device, manager->data);
+      if (instance)
+	{
+	  entry = &manager->entries[manager->entries_len];
+	  entry->bus = device.bus;
+	  entry->address = device.address;
+	  entry->instance = instance;
+	  manager->entries_len++;
+	  return;
+	}
+      usleep (HOTPLUG_CREATE_RETRY_US);
+    }
+
+  error_print ("Unable to create instance for device at %03d:%03d",
+	       device.bus, device.address);
+}
+
+static void
+hotplug_manager_left (struct hotplug_manager *manager,
+		      const struct hotplug_event *event)
+{
+  struct hotplug_entry *entry = hotplug_manager_get_entry (manager,
+							   event->bus,
+							   event->address);
+  if (entry)
+    {
+      debug_print (1, "Device at %03d:%03d left", event->bus,
+		   event->address);
+      hotplug_manager_remove_entry (manager, entry);
+    }
+}
+
+//Processes all the queued events. Returns the amount of processed events.
+int
+hotplug_manager_dispatch (struct hotplug_manager *manager)
+{
+  struct hotplug_event event;
+  int processed = 0;
+
+  while (1)
+    {
+      pthread_mutex_lock (&manager->lock);
+      if (!manager->events_len)
+	{
+	  pthread_mutex_unlock (&manager->lock);
+	  break;
+	}
+      event = manager->events[manager->events_head];
+      manager->events_head = (manager->events_head + 1) % HOTPLUG_MAX_EVENTS;
+      manager->events_len--;
+      pthread_mutex_unlock (&manager->lock);
+
+      if (event.type == HOTPLUG_EVENT_ARRIVED)
+	{
+	  hotplug_manager_arrived (manager, &event);
+	}
+      else
+	{
+	  hotplug_manager_left (manager, &event);
+	}
+      processed++;
+    }
+
+  return processed;
+}
+
+static void *
+hotplug_manager_runner (void *data)
+{
+  struct hotplug_manager *manager = data;
+
+  pthread_mutex_lock (&manager->lock);
+  while (manager->running)
+    {
+      if (!manager->events_len)
+	{
+	  pthread_cond_wait (&manager->cond, &manager->lock);
+	  continue;
+	}
+      pthread_mutex_unlock (&manager->lock);
+      hotplug_manager_dispatch (manager);
+      pthread_mutex_lock (&manager->lock);
+    }
+  pthread_mutex_unlock (&manager->lock);
+
+  return NULL;
+}
+
+int
+hotplug_manager_start (struct hotplug_manager *manager)
+{
+  manager->running = 1;
+  if (pthread_create (&manager->thread, NULL, hotplug_manager_runner,
+		      manager))
+    {
+      error_print ("Could not start hotplug thread");
+      manager->running = 0;
+      return 1;
+    }
+
+  if (manager->source->start (manager))
+    {
+      hotplug_manager_stop (manager);
+      return 1;
+    }
+
+  return 0;
+}
+
+//Stops the source and the manager thread and destroys all the instances.
+void
+hotplug_manager_stop (struct hotplug_manager *manager)
+{
+  if (manager->source_running)
+    {
+      manager->source->stop (manager);
+    }
+
+  pthread_mutex_lock (&manager->lock);
+  if (!manager->running)
+    {
+      pthread_mutex_unlock (&manager->lock);
+      return;
+    }
+  manager->running = 0;
+  pthread_cond_signal (&manager->cond);
+  pthread_mutex_unlock (&manager->lock);
+
+  pthread_join (manager->thread, NULL);
+
+  //Pending events are discarded.
+  manager->events_len = 0;
+  while (manager->entries_len)
+    {
+      hotplug_manager_remove_entry (manager, &manager->entries[0]);
+    }
+}
+
+//libusb source
+
+//This runs inside libusb event handling so the event is only queued.
+static int LIBUSB_CALL
+hotplug_libusb_cb (libusb_context *context, libusb_device *device,
+		   libusb_hotplug_event type, void *data)
+{
+  struct libusb_device_descriptor desc;
+  struct hotplug_event event;
+  struct hotplug_manager *manager = data;
+
+  if (libusb_get_device_descriptor (device, &desc))
+    {
+      return 0;
+    }
+
+  event.type = type == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ?
+    HOTPLUG_EVENT_ARRIVED : HOTPLUG_EVENT_LEFT;
+  event.vid = desc.idVendor;
+  event.pid = desc.idProduct;
+  event.bus = libusb_get_bus_number (device);
+  event.address = libusb_get_device_address (device);
+
+  hotplug_manager_push (manager, &event);
+
+  return 0;
+}
+
+static void *
+hotplug_libusb_runner (void *data)
+{
+  struct hotplug_manager *manager = data;
+  struct timeval tv = {
+    .tv_sec = 0,
+    .tv_usec = HOTPLUG_EVENTS_TIMEOUT_US
+  };
+
+  while (manager->source_running)
+    {
+      libusb_handle_events_timeout_completed (manager->context, &tv, NULL);
+    }
+
+  return NULL;
+}
+
+static int
+hotplug_libusb_start (struct hotplug_manager *manager)
+{
+  int err;
+
+  if (!hotplug_is_available ())
+    {
+      error_print ("libusb does not support hotplug on this platform");
+      return 1;
+    }
+
+  err = libusb_init (&manager->context);
+  if (err)
+    {
+      error_print ("libusb init failed: %s", libusb_error_name (err));
+      return 1;
+    }
+
+  //With LIBUSB_HOTPLUG_ENUMERATE, the present devices are queued from this call.
+  err = libusb_hotplug_register_callback (manager->context,
+					  LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED
+					  | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+					  manager->enumerate ?
+					  LIBUSB_HOTPLUG_ENUMERATE : 0,
+					  LIBUSB_HOTPLUG_MATCH_ANY,
+					  LIBUSB_HOTPLUG_MATCH_ANY,
+					  LIBUSB_HOTPLUG_MATCH_ANY,
+					  hotplug_libusb_cb, manager,
+					  &manager->callback_handle);
+  if (err)
+    {
+      error_print ("Error while registering hotplug callback: %s",
+		   libusb_error_name (err));
+      libusb_exit (manager->context);
+      return 1;
+    }
+
+  manager->source_running = 1;
+  if (pthread_create (&manager->source_thread, NULL, hotplug_libusb_runner,
+		      manager))
+    {
+      error_print ("Could not start hotplug event thread");
+      manager->source_running = 0;
+      libusb_hotplug_deregister_callback (manager->context,
+					  manager->callback_handle);
+      libusb_exit (manager->context);
+      return 1;
+    }
+
+  return 0;
+}
+
+static void
+hotplug_libusb_stop (struct hotplug_manager *manager)
+{
+  manager->source_running = 0;
+  //This also wakes up the event handling.
+  libusb_hotplug_deregister_callback (manager->context,
+				      manager->callback_handle);
+  pthread_join (manager->source_thread, NULL);
+  libusb_exit (manager->context);
+  manager->context = NULL;
+}
+
+const struct hotplug_source HOTPLUG_SOURCE_LIBUSB = {
+  .start = hotplug_libusb_start,
+  .stop = hotplug_libusb_stop
+};
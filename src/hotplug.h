@@ -0,0 +1,107 @@
+/*
+ *   hotplug.h
+ *   Copyright (C) 2021 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <libusb.h>
+#include "overwitch.h"
+
+#define HOTPLUG_MAX_DEVICES 32
+#define HOTPLUG_MAX_EVENTS 64
+
+//The manager calls create when an Overbridge device arrives and destroy when it leaves.
+//Both run in the manager thread, so they can block. Instances are opaque to the manager.
+//create returns NULL on error and it is retried for a while as udev might not have set the permissions yet.
+typedef void *(*hotplug_create_t) (const struct ow_usb_device *, void *);
+typedef void (*hotplug_destroy_t) (void *, uint8_t, uint8_t, void *);
+
+typedef enum
+{
+  HOTPLUG_EVENT_ARRIVED,
+  HOTPLUG_EVENT_LEFT
+} hotplug_event_type_t;
+
+struct hotplug_event
+{
+  hotplug_event_type_t type;
+  uint16_t vid;
+  uint16_t pid;
+  uint8_t bus;
+  uint8_t address;
+};
+
+struct hotplug_manager;
+
+//Sources feed the manager with hotplug_manager_push.
+struct hotplug_source
+{
+  int (*start) (struct hotplug_manager *);
+  void (*stop) (struct hotplug_manager *);
+};
+
+struct hotplug_entry
+{
+  uint8_t bus;
+  uint8_t address;
+  void *instance;
+};
+
+struct hotplug_manager
+{
+  const struct hotplug_source *source;
+  hotplug_create_t create;
+  hotplug_destroy_t destroy;
+  void *data;
+  int enumerate;		//Report the devices already present on start
+  struct hotplug_entry entries[HOTPLUG_MAX_DEVICES];
+  int entries_len;
+  //Event queue
+  struct hotplug_event events[HOTPLUG_MAX_EVENTS];
+  int events_head;
+  int events_len;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int running;
+  pthread_t thread;
+  //libusb source
+  libusb_context *context;
+  libusb_hotplug_callback_handle callback_handle;
+  int source_running;
+  pthread_t source_thread;
+};
+
+extern const struct hotplug_source HOTPLUG_SOURCE_LIBUSB;
+
+int hotplug_is_available ();
+
+void hotplug_manager_init (struct hotplug_manager *,
+			   const struct hotplug_source *, hotplug_create_t,
+			   hotplug_destroy_t, void *);
+
+int hotplug_manager_start (struct hotplug_manager *);
+
+void hotplug_manager_stop (struct hotplug_manager *);
+
+void hotplug_manager_destroy (struct hotplug_manager *);
+
+int hotplug_manager_push (struct hotplug_manager *,
+			  const struct hotplug_event *);
+
+int hotplug_manager_dispatch (struct hotplug_manager *);
@@ -0,0 +1,246 @@
+/*
+ *   jclient-internal.c
+ *   Copyright (C) 2021 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//JACK internal client. It is loaded into jackd with
+//jack_load [-i "options"] overwitch
+//and runs the process callback in the server thread.
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <jack/jack.h>
+#include "jclient.h"
+#include "utils.h"
+#include "common.h"
+
+#define MAX_INIT_ARGS 16
+
+static struct option options[] = {
+  {"use-device-number", 1, NULL, 'n'},
+  {"use-device", 1, NULL, 'd'},
+  {"resampling-quality", 1, NULL, 'q'},
+  {"blocks-per-transfer", 1, NULL, 'b'},
+  {"usb-transfer-timeout", 1, NULL, 't'},
+  {"verbose", 0, NULL, 'v'},
+  {NULL, 0, NULL, 0}
+};
+
+static int
+parse_init_string (const char *load_init, int *device_num,
+		   char **device_name, struct jclient *jclient)
+{
+  int opt, argc;
+  char *endstr;
+  char *argv[MAX_INIT_ARGS + 1];
+  char *init = strdup (load_init ? load_init : "");
+  char *saveptr;
+  int long_index = 0;
+  int err = 0;
+
+  argv[0] = "overwitch";
+  argc = 1;
+  for (char *token = strtok_r (init, " \t", &saveptr);
+       token && argc < MAX_INIT_ARGS;
+       token = strtok_r (NULL, " \t", &saveptr))
+    {
+      argv[argc] = token;
+      argc++;
+    }
+  argv[argc] = NULL;
+
+  //The server process might have used getopt before.
+  optind = 0;
+  while ((opt = getopt_long (argc, argv, "n:d:q:b:t:v",
+			     options, &long_index)) != -1)
+    {
+      switch (opt)
+	{
+	case 'n':
+	  *device_num = (int) strtol (optarg, &endstr, 10);
+	  break;
+	case 'd':
+	  *device_name = strdup (optarg);
+	  *device_num = -1;
+	  break;
+	case 'q':
+	  errno = 0;
+	  jclient->quality = (int) strtol (optarg, &endstr, 10);
+	  if (errno || endstr == optarg || *endstr != '\0'
+	      || jclient->quality > 4 || jclient->quality < 0)
+	    {
+	      jclient->quality = DEFAULT_QUALITY;
+	      error_print
+		("Resampling quality value must be in [0..4]. Using value %d...",
+		 jclient->quality);
+	    }
+	  break;
+	case 'b':
+	  jclient->blocks_per_transfer =
+	    get_ow_blocks_per_transfer_argument (optarg);
+	  break;
+	case 't':
+	  jclient->xfr_timeout = get_ow_xfr_timeout_argument (optarg);
+	  break;
+	case 'v':
+	  debug_level++;
+	  break;
+	case '?':
+	  err = 1;
+	}
+    }
+
+  free (init);
+  return err;
+}
+
+struct jclient_internal
+{
+  //The jclient goes first as it is the process callback argument.
+  struct jclient jclient;
+  pthread_t thread;
+  int device_num;
+  char *device_name;
+  int err;
+};
+
+//Used until the device is ready so that jack_finish always gets the argument.
+static int
+jclient_internal_idle_cb (jack_nframes_t nframes, void *arg)
+{
+  return 0;
+}
+
+//The device initialization waits for USB so it is done outside the server thread.
+static void *
+jclient_internal_init_runner (void *data)
+{
+  struct ow_usb_device *device;
+  struct jclient_internal *internal = data;
+  struct jclient *jclient = &internal->jclient;
+
+  internal->err = 1;
+
+  if (ow_get_usb_device_from_device_attrs (internal->device_num,
+					   internal->device_name, &device))
+    {
+      error_print ("Device not found");
+      return NULL;
+    }
+
+  jclient->bus = device->bus;
+  jclient->address = device->address;
+  free (device);
+
+  if (jclient_init (jclient))
+    {
+      return NULL;
+    }
+
+  if (jclient_activate (jclient))
+    {
+      jclient_free_buffers (jclient);
+      jclient_destroy (jclient);
+      return NULL;
+    }
+
+  internal->err = 0;
+
+  return NULL;
+}
+
+int
+jack_initialize (jack_client_t * client, const char *load_init)
+{
+  struct jclient_internal *internal;
+  struct jclient *jclient;
+
+  internal = malloc (sizeof (struct jclient_internal));
+  if (!internal)
+    {
+      return 1;
+    }
+  internal->device_num = 0;
+  internal->device_name = NULL;
+
+  jclient = &internal->jclient;
+  jclient->blocks_per_transfer = OW_DEFAULT_BLOCKS;
+  jclient->xfr_timeout = OW_DEFAULT_XFR_TIMEOUT;
+  jclient->quality = DEFAULT_QUALITY;
+  jclient->priority = JCLIENT_DEFAULT_PRIORITY;
+  //The server threads are not ours to pin.
+  memset (&jclient->sched, 0, sizeof (struct ow_sched));
+  jclient->direct = 0;
+  //The client is owned by the server so its name is not changed.
+  jclient->client = client;
+
+  if (parse_init_string (load_init, &internal->device_num,
+			 &internal->device_name, jclient))
+    {
+      error_print ("Invalid init string '%s'", load_init);
+      goto error;
+    }
+
+  if (jack_set_process_callback (client, jclient_internal_idle_cb, jclient))
+    {
+      goto error;
+    }
+
+  if (pthread_create (&internal->thread, NULL, jclient_internal_init_runner,
+		      internal))
+    {
+      error_print ("Could not start device initialization thread");
+      goto error;
+    }
+
+  return 0;
+
+error:
+  free (internal->device_name);
+  free (internal);
+  return 1;
+}
+
+//The server passes the process callback argument, which is the jclient.
+void
+jack_finish (void *arg)
+{
+  struct jclient_internal *internal = arg;
+  struct jclient *jclient = arg;
+
+  if (!internal)
+    {
+      return;
+    }
+
+  pthread_join (internal->thread, NULL);
+
+  if (!internal->err)
+    {
+      jclient_stop (jclient);
+      ow_resampler_wait (jclient->resampler);
+      jclient_free_buffers (jclient);
+      jclient_destroy (jclient);
+    }
+
+  free (internal->device_name);
+  free (internal);
+}
@@ -29,6 +29,7 @@
 #include <jack/midiport.h>
 
 #include "utils.h"
+#include "common.h"
 #include "jclient.h"
 
 #define MSG_ERROR_PORT_REGISTER "Error while registering JACK port"
@@ -37,49 +38,6 @@
 
 #define MAX_LATENCY (8192 * 2)	//This is twice the maximum JACK latency.
 
-void
-squeue_init (struct squeue *queue, uint32_t max_len)
-{
-  queue->max_len = max_len;
-  queue->data = malloc (max_len);
-  queue->len = 0;
-}
-
-void
-squeue_destroy (struct squeue *queue)
-{
-  free (queue->data);
-}
-
-inline int
-squeue_write (struct squeue *queue, void *data, uint32_t len)
-{
-  if (queue->len + len >= queue->max_len)
-    {
-      error_print ("o2j: Not enough space in queue. Resetting...");
-      queue->len = 0;
-      return 1;
-    }
-
-  memcpy (queue->data + queue->len, data, len);
-  queue->len += len;
-  return 0;
-}
-
-inline void
-squeue_read (struct squeue *queue, void *data)
-{
-  memcpy (data, queue->data, queue->len);
-  queue->len = 0;
-}
-
-void
-squeue_consume (struct squeue *queue, uint32_t consumed)
-{
-  queue->len -= consumed;
-  memcpy (queue->data, queue->data + consumed, queue->len);
-}
-
 size_t
 jclient_buffer_read (void *buffer, char *src, size_t size)
 {
@@ -104,16 +62,14 @@ jclient_thread_xrun_cb (void *cb_data)
 }
 
 static void
-jclient_thread_latency_cb (jack_latency_callback_mode_t mode, void *cb_data)
+jclient_set_latencies (struct jclient *jclient,
+		       jack_latency_callback_mode_t mode)
 {
   jack_latency_range_t range;
-  struct jclient *jclient = cb_data;
   size_t latency, min_latency, max_latency;
   struct ow_engine *engine = ow_resampler_get_engine (jclient->resampler);
   const struct ow_device_desc *desc = ow_engine_get_device_desc (engine);
 
-  debug_print (2, "JACK latency request");
-
   if (mode == JackPlaybackLatency)
     {
       debug_print (2, "Recalculating input to output latency...");
@@ -145,33 +101,57 @@ jclient_thread_latency_cb (jack_latency_callback_mode_t mode, void *cb_data)
 }
 
 static void
-jclient_port_connect_cb (jack_port_id_t a, jack_port_id_t b, int connect,
-			 void *cb_data)
+jclient_thread_latency_cb (jack_latency_callback_mode_t mode, void *cb_data)
 {
-  int total_connections = 0;
-  struct jclient *jclient = cb_data;
+  debug_print (2, "JACK latency request");
+  jclient_set_latencies (cb_data, mode);
+}
+
+static void
+jclient_check_connections (struct jclient *jclient)
+{
+  uint64_t outputs = 0;
+  uint64_t inputs = 0;
   struct ow_engine *engine = ow_resampler_get_engine (jclient->resampler);
   const struct ow_device_desc *desc = ow_engine_get_device_desc (engine);
 
   for (int i = 0; i < desc->inputs; i++)
     {
-      total_connections += jack_port_connected (jclient->input_ports[i]);
+      if (jack_port_connected (jclient->input_ports[i]))
+	{
+	  inputs |= 1ULL << i;
+	}
     }
 
-  ow_engine_set_option (engine, OW_ENGINE_OPTION_P2O_AUDIO,
-			total_connections != 0);
+  ow_engine_set_option (engine, OW_ENGINE_OPTION_P2O_AUDIO, inputs != 0);
 
   for (int i = 0; i < desc->outputs; i++)
     {
-      total_connections += jack_port_connected (jclient->output_ports[i]);
+      if (jack_port_connected (jclient->output_ports[i]))
+	{
+	  outputs |= 1ULL << i;
+	}
     }
 
-  if (!total_connections)
+  debug_print (2, "Connected ports: outputs %016llx; inputs %016llx",
+	       (unsigned long long) outputs, (unsigned long long) inputs);
+
+  __atomic_store_n (&jclient->connected_outputs, outputs, __ATOMIC_RELEASE);
+  __atomic_store_n (&jclient->connected_inputs, inputs, __ATOMIC_RELEASE);
+
+  if (!outputs && !inputs)
     {
       ow_resampler_clear_buffers (jclient->resampler);
     }
 }
 
+static void
+jclient_port_connect_cb (jack_port_id_t a, jack_port_id_t b, int connect,
+			 void *cb_data)
+{
+  jclient_check_connections (cb_data);
+}
+
 static void
 jclient_jack_shutdown_cb (jack_status_t code, const char *reason,
 			  void *cb_data)
@@ -201,25 +181,139 @@ jclient_jack_client_registration_cb (const char *name, int op, void *cb_data)
 	       op ? "registered" : "unregistered");
 }
 
+static void jclient_direct_set_buffer_size (struct jclient *,
+					    jack_nframes_t);
+
+//On failure, the client is stopped so that the process callback only outputs silence.
 static int
-jclient_set_buffer_size_cb (jack_nframes_t nframes, void *cb_data)
+jclient_set_buffer_size (struct jclient *jclient, jack_nframes_t nframes)
 {
-  struct jclient *jclient = cb_data;
-  debug_print (1, "JACK buffer size: %d", nframes);
   jclient->bufsize = nframes;
-  ow_resampler_set_buffer_size (jclient->resampler, nframes);
+  if (jclient->direct)
+    {
+      jclient_direct_set_buffer_size (jclient, nframes);
+    }
+  else if (ow_resampler_set_buffer_size (jclient->resampler, nframes))
+    {
+      error_print ("Error while setting the buffer size. Stopping...");
+      jclient_stop (jclient);
+      return 1;
+    }
   return 0;
 }
 
+static int
+jclient_set_buffer_size_cb (jack_nframes_t nframes, void *cb_data)
+{
+  debug_print (1, "JACK buffer size: %d", nframes);
+  return jclient_set_buffer_size (cb_data, nframes);
+}
+
 static int
 jclient_set_sample_rate_cb (jack_nframes_t nframes, void *cb_data)
 {
   struct jclient *jclient = cb_data;
   debug_print (1, "JACK sample rate: %d", nframes);
-  ow_resampler_set_samplerate (jclient->resampler, nframes);
+  if (jclient->direct)
+    {
+      if (nframes != OB_SAMPLE_RATE)
+	{
+	  error_print ("Direct mode requires JACK to run at %.0f Hz",
+		       OB_SAMPLE_RATE);
+	  jclient_stop (jclient);
+	}
+    }
+  else
+    {
+      ow_resampler_set_samplerate (jclient->resampler, nframes);
+    }
   return 0;
 }
 
+//Appends the packet bytes to the o2j queue.
+//Returns the length of the message ready to be read from the queue or 0 if it is not complete yet.
+uint32_t
+jclient_o2j_midi_packet (struct jclient *jclient,
+			 const struct ow_midi_event_packet *packet)
+{
+  uint32_t len;
+  int send;
+
+  switch (packet->header)
+    {
+    case 0x04:
+      len = 3;
+      send = 0;
+      if (jclient->o2j_midi_skipping)
+	{
+	  return 0;
+	}
+      break;
+    case 0x05:
+      len = 1;
+      send = 1;
+      if (jclient->o2j_midi_skipping)
+	{
+	  jclient->o2j_midi_skipping = 0;
+	  return 0;
+	}
+      break;
+    case 0x06:
+      len = 2;
+      send = 1;
+      if (jclient->o2j_midi_skipping)
+	{
+	  jclient->o2j_midi_skipping = 0;
+	  return 0;
+	}
+      break;
+    case 0x07:
+      len = 3;
+      send = 1;
+      if (jclient->o2j_midi_skipping)
+	{
+	  jclient->o2j_midi_skipping = 0;
+	  return 0;
+	}
+      break;
+    case 0x0c:			//Program Change
+    case 0x0d:			//Channel Pressure (After-touch)
+      len = 2;
+      send = 1;
+      jclient->o2j_midi_skipping = 0;
+      break;
+    case 0x08:			//Note Off
+    case 0x09:			//Note On
+    case 0x0a:			//Polyphonic Key Pressure
+    case 0x0b:			//Control Change
+    case 0x0e:			//Pitch Bend Change
+      len = 3;
+      send = 1;
+      jclient->o2j_midi_skipping = 0;
+      break;
+    case 0x0f:			//Single Byte SysEx
+      len = 1;
+      send = 1;
+      jclient->o2j_midi_skipping = 0;
+      break;
+    default:
+      error_print ("o2j: Message %02X not implemented", packet->header);
+      mring_reset (&jclient->o2j_midi_queue);
+      jclient->o2j_midi_skipping = 0;
+      return 0;
+    }
+
+  if (mring_write (&jclient->o2j_midi_queue, packet->data, len))
+    {
+      error_print ("o2j: Not enough space in queue. Resetting...");
+      mring_reset (&jclient->o2j_midi_queue);
+      jclient->o2j_midi_skipping = 1;	//No space. We skip the current message being sent.
+      return 0;
+    }
+
+  return send ? mring_len (&jclient->o2j_midi_queue) : 0;
+}
+
 static inline void
 jclient_o2j_midi (struct jclient *jclient, jack_nframes_t nframes)
 {
@@ -227,8 +321,8 @@ jclient_o2j_midi (struct jclient *jclient, jack_nframes_t nframes)
   jack_midi_data_t *jmidi;
   struct ow_midi_event event;
   jack_nframes_t last_frame, jack_frame;
-  int send = 0;
-  uint32_t len, lost_count;
+  int locked;
+  uint32_t msg_len, lost_count;
   int64_t frame;
 
   midi_port_buf = jack_port_get_buffer (jclient->midi_output_port, nframes);
@@ -236,132 +330,77 @@ jclient_o2j_midi (struct jclient *jclient, jack_nframes_t nframes)
 
   last_frame = jack_last_frame_time (jclient->client);
 
+  //Once the DLL is running, events are played along the audio they arrived with.
+  locked = !jclient->direct
+    && ow_resampler_get_status (jclient->resampler) ==
+    OW_RESAMPLER_STATUS_RUN;
+
   while (jack_ringbuffer_read_space (jclient->context.o2h_midi) >=
 	 sizeof (struct ow_midi_event))
     {
       jack_ringbuffer_peek (jclient->context.o2h_midi, (void *) &event,
 			    sizeof (struct ow_midi_event));
 
-      // We add 1 JACK cycle because it's the maximum delay we want to achieve
-      // as everyting generated during the previous cycle will always be played.
-      // If we tried to adjust it automatically we'd get 1 cycle delay.
-      jack_frame = jack_time_to_frames (jclient->client, event.time) +
-	nframes;
+      if (locked)
+	{
+	  frame = ow_resampler_get_o2h_host_frame (jclient->resampler,
+						   event.frame);
+	  debug_print (3, "o2j: Overbridge frame: %u", event.frame);
+	}
+      else
+	{
+	  // We add 1 JACK cycle because it's the maximum delay we want to achieve
+	  // as everyting generated during the previous cycle will always be played.
+	  // If we tried to adjust it automatically we'd get 1 cycle delay.
+	  jack_frame = jack_time_to_frames (jclient->client, event.time) +
+	    nframes;
+
+	  debug_print (3, "o2j: last frame: %u", last_frame);
+	  debug_print (3, "o2j: JACK frame: %u", jack_frame);
 
-      debug_print (3, "o2j: last frame: %u", last_frame);
-      debug_print (3, "o2j: JACK frame: %u", jack_frame);
+	  frame = jack_frame < last_frame ? -1 : jack_frame - last_frame;
+	}
 
-      if (jack_frame < last_frame)
+      if (frame < 0)
 	{
 	  frame = 0;
-	  debug_print (2, "o2j: Processing missed event @ %lu us...", frame);
+	  debug_print (2, "o2j: Processing missed event @ %lu us...",
+		       event.time);
 	}
-      else
+      else if (frame >= nframes)
 	{
-	  frame = jack_frame - last_frame;
-	  if (frame >= nframes)
-	    {
-	      debug_print (2,
-			   "o2j: Skipping until the next cycle (event frames %lu)...",
-			   frame);
-	      break;
-	    }
+	  debug_print (2,
+		       "o2j: Skipping until the next cycle (event frames %lu)...",
+		       frame);
+	  break;
 	}
 
       debug_print (2, "o2j: Event frames: %lu", frame);
 
       jack_ringbuffer_read_advance (jclient->context.o2h_midi,
 				    sizeof (struct ow_midi_event));
-      switch (event.packet.header)
-	{
-	case 0x04:
-	  len = 3;
-	  send = 0;
-	  if (jclient->o2j_midi_skipping)
-	    {
-	      continue;
-	    }
-	  break;
-	case 0x05:
-	  len = 1;
-	  send = 1;
-	  if (jclient->o2j_midi_skipping)
-	    {
-	      jclient->o2j_midi_skipping = 0;
-	      continue;
-	    }
-	  break;
-	case 0x06:
-	  len = 2;
-	  send = 1;
-	  if (jclient->o2j_midi_skipping)
-	    {
-	      jclient->o2j_midi_skipping = 0;
-	      continue;
-	    }
-	  break;
-	case 0x07:
-	  len = 3;
-	  send = 1;
-	  if (jclient->o2j_midi_skipping)
-	    {
-	      jclient->o2j_midi_skipping = 0;
-	      continue;
-	    }
-	  break;
-	case 0x0c:		//Program Change
-	case 0x0d:		//Channel Pressure (After-touch)
-	  len = 2;
-	  send = 1;
-	  jclient->o2j_midi_skipping = 0;
-	  break;
-	case 0x08:		//Note Off
-	case 0x09:		//Note On
-	case 0x0a:		//Polyphonic Key Pressure
-	case 0x0b:		//Control Change
-	case 0x0e:		//Pitch Bend Change
-	  len = 3;
-	  send = 1;
-	  jclient->o2j_midi_skipping = 0;
-	  break;
-	case 0x0f:		//Single Byte SysEx
-	  len = 1;
-	  send = 1;
-	  jclient->o2j_midi_skipping = 0;
-	  break;
-	default:
-	  error_print ("o2j: Message %02X not implemented",
-		       event.packet.header);
-	  jclient->o2j_midi_queue.len = 0;
-	  jclient->o2j_midi_skipping = 0;
-	  continue;
-	}
 
       debug_print (3,
 		   "o2j MIDI packet: %02x %02x %02x %02x @ %lu us",
 		   event.packet.header, event.packet.data[0],
 		   event.packet.data[1], event.packet.data[2], event.time);
 
-      if (squeue_write (&jclient->o2j_midi_queue, event.packet.data, len))
-	{
-	  jclient->o2j_midi_skipping = 1;	//No space. We skip the current message being sent.
-	  continue;
-	}
-
-      if (send)
+      msg_len = jclient_o2j_midi_packet (jclient, &event.packet);
+      if (msg_len)
 	{
-	  jmidi = jack_midi_event_reserve (midi_port_buf, frame,
-					   jclient->o2j_midi_queue.len);
+	  jmidi = jack_midi_event_reserve (midi_port_buf, frame, msg_len);
 	  if (jmidi)
 	    {
 	      debug_print (2, "o2j: Processing MIDI event @ %lu (%d B)",
-			   frame, jclient->o2j_midi_queue.len);
-	      squeue_read (&jclient->o2j_midi_queue, jmidi);
+			   frame, msg_len);
+	      //The message goes from the ring straight into the JACK buffer.
+	      mring_read (&jclient->o2j_midi_queue, jmidi, msg_len);
 	    }
 	  else
 	    {
-	      error_print ("o2j: JACK could not reserve event");
-	      jclient->o2j_midi_queue.len = 0;
+	      error_print ("o2j: JACK could not reserve event (%d B)",
+			   msg_len);
+	      mring_reset (&jclient->o2j_midi_queue);
 	    }
 	}
 
@@ -397,32 +436,32 @@ jclient_j2o_midi_queue_event (struct jclient *jclient,
 
 static inline void
 jclient_copy_event_bytes (struct ow_midi_event *oevent,
-			  jack_midi_data_t *buffer, size_t len)
+			  const jack_midi_data_t *buffer, size_t len)
 {
   memcpy (oevent->packet.data, buffer, len);
   memset (oevent->packet.data + len, 0, OB_MIDI_EVENT_BYTES - len);
 }
 
 static inline void
-jclient_j2o_midi_msg (struct jclient *jclient, jack_midi_event_t *jevent,
-		      jack_time_t time)
+jclient_j2o_midi_msg (struct jclient *jclient, const jack_midi_data_t *buffer,
+		      size_t size, jack_time_t time)
 {
   struct ow_midi_event oevent;
-  jack_midi_data_t status_byte = jevent->buffer[0];
+  jack_midi_data_t status_byte = buffer[0];
   jack_midi_data_t type = status_byte & 0xf0;
 
   oevent.packet.header = 0;
 
   debug_print (2, "j2o: Sending MIDI message...");
 
-  if (jevent->size == 1)
+  if (size == 1)
     {
       if (status_byte >= 0xf8 && status_byte <= 0xfc)
 	{
 	  oevent.packet.header = 0x0f;	//Single Byte SysEx
 	}
     }
-  else if (jevent->size == 2)
+  else if (size == 2)
     {
       switch (type)
 	{
@@ -434,7 +473,7 @@ jclient_j2o_midi_msg (struct jclient *jclient, jack_midi_event_t *jevent,
 	  break;
 	}
     }
-  else				// jevent->size == 3
+  else				// size == 3
     {
       switch (type)
 	{
@@ -459,7 +498,7 @@ jclient_j2o_midi_msg (struct jclient *jclient, jack_midi_event_t *jevent,
   if (oevent.packet.header)
     {
       oevent.time = time;
-      jclient_copy_event_bytes (&oevent, jevent->buffer, jevent->size);
+      jclient_copy_event_bytes (&oevent, buffer, size);
       jclient_j2o_midi_queue_event (jclient, &oevent);
     }
   else
@@ -468,77 +507,131 @@ jclient_j2o_midi_msg (struct jclient *jclient, jack_midi_event_t *jevent,
     }
 }
 
-//Multiple byte SysEx
-
-static inline void
-jclient_j2o_midi_sysex (struct jclient *jclient, jack_midi_event_t *jevent,
-			jack_time_t time)
+//Length of the messages other than SysEx from their status byte.
+static inline size_t
+jclient_get_midi_msg_len (jack_midi_data_t status_byte)
 {
-  int consumed;
-  uint8_t *b;
+  if (status_byte >= 0xf8)
+    {
+      return 1;
+    }
 
-  if (squeue_write (&jclient->j2o_midi_queue, jevent->buffer, jevent->size))
+  switch (status_byte & 0xf0)
     {
-      return;
+    case 0xc0:
+    case 0xd0:
+      return 2;
     }
 
-  debug_print (2, "j2o: Sending MIDI SysEx packets...");
+  return 3;
+}
 
-  b = jclient->j2o_midi_queue.data;
-  consumed = 0;
-  while (consumed < jclient->j2o_midi_queue.len)
-    {
-      struct ow_midi_event oevent;
-      size_t plen = 0;
-      int end = 0;
-      uint8_t *start = b;
-      oevent.packet.header = 0x04;
-      oevent.time = time;
+//Multiple byte SysEx
+
+//Packets are only taken while there is space in the h2o ring buffer so long messages are sent over several cycles.
+//The messages received meanwhile are queued behind to keep the order.
+void
+jclient_j2o_midi_flush (struct jclient *jclient, jack_time_t time)
+{
+  int end;
+  size_t len;
+  jack_midi_data_t status_byte;
+  jack_midi_data_t msg[OB_MIDI_EVENT_BYTES];
+  struct ow_midi_event oevent;
+  struct mring *queue = &jclient->j2o_midi_queue;
 
-      for (int i = 0; i < OB_MIDI_EVENT_BYTES &&
-	   consumed + i < jclient->j2o_midi_queue.len; i++, b++, plen++)
+  oevent.time = time;
+  while (jack_ringbuffer_write_space (jclient->context.h2o_midi) >=
+	 sizeof (struct ow_midi_event) && mring_len (queue))
+    {
+      //SysEx data bytes are below 0x80 so any other status byte starts a queued message.
+      status_byte = mring_at (queue, 0);
+      if (status_byte >= 0x80 && status_byte != 0xf0 && status_byte != 0xf7)
 	{
-	  if (*b == 0xf7)
-	    {
-	      switch (i)
-		{
-		case 0:
-		  oevent.packet.header = 0x05;
-		  break;
-		case 1:
-		  oevent.packet.header = 0x06;
-		  break;
-		default:	// 2
-		  oevent.packet.header = 0x07;
-		}
-
-	      end = 1;
-	      plen = i + 1;
-	      jclient->j2o_ongoing_sysex = 0;
-
-	      debug_print (2,
-			   "j2o: MIDI packet (%ld): %02x %02x %02x %02x @ %lu us",
-			   plen, oevent.packet.header, *start, *(start + 1),
-			   *(start + 2), oevent.time);
-
-	      break;
-	    }
+	  len = jclient_get_midi_msg_len (status_byte);
+	  mring_read (queue, msg, len);
+	  jclient_j2o_midi_msg (jclient, msg, len, time);
+	  continue;
 	}
 
-      if (!end && plen < OB_MIDI_EVENT_BYTES)
+      if (!mring_sysex_packet (queue, &oevent.packet, &end))
 	{
 	  break;
 	}
 
-      jclient_copy_event_bytes (&oevent, start, plen);
-      jclient_j2o_midi_queue_event (jclient, &oevent);
-      consumed += plen;
+      if (end)
+	{
+	  debug_print (2,
+		       "j2o: MIDI packet: %02x %02x %02x %02x @ %lu us",
+		       oevent.packet.header, oevent.packet.data[0],
+		       oevent.packet.data[1], oevent.packet.data[2],
+		       oevent.time);
+	}
+      jack_ringbuffer_write (jclient->context.h2o_midi, (void *) &oevent,
+			     sizeof (struct ow_midi_event));
+    }
+
+  if (mring_len (queue))
+    {
+      debug_print (2, "j2o: MIDI queue pending bytes: %d", mring_len (queue));
+    }
+}
+
+static inline void
+jclient_j2o_midi_sysex (struct jclient *jclient,
+			const jack_midi_data_t *buffer, size_t size,
+			jack_time_t time)
+{
+  if (mring_write (&jclient->j2o_midi_queue, buffer, size))
+    {
+      error_print ("j2o: Not enough space in queue. Resetting...");
+      mring_reset (&jclient->j2o_midi_queue);
+      jclient->j2o_ongoing_sysex = 0;
+      return;
+    }
+
+  //Following events belong to this message until its end is seen.
+  jclient->j2o_ongoing_sysex = buffer[size - 1] != 0xf7;
+
+  debug_print (2, "j2o: Sending MIDI SysEx packets...");
+
+  jclient_j2o_midi_flush (jclient, time);
+}
+
+static inline void
+jclient_j2o_midi_msg_queue (struct jclient *jclient,
+			    const jack_midi_data_t *buffer, size_t size)
+{
+  //The length is taken from the status byte when the message is dequeued.
+  if (size != jclient_get_midi_msg_len (buffer[0]))
+    {
+      error_print ("j2o: Message %02x not implemented", buffer[0]);
+      return;
     }
 
-  squeue_consume (&jclient->j2o_midi_queue, consumed);
+  if (mring_write (&jclient->j2o_midi_queue, buffer, size))
+    {
+      error_print ("j2o: Not enough space in queue. Discarding message...");
+    }
+}
 
-  debug_print (2, "j2o: SysEx message pending bytes: %d",
-	       jclient->j2o_midi_queue.len);
+void
+jclient_j2o_midi_event (struct jclient *jclient,
+			const jack_midi_data_t *buffer, size_t size,
+			jack_time_t time)
+{
+  if (buffer[0] == 0xf0 || jclient->j2o_ongoing_sysex)
+    {
+      jclient_j2o_midi_sysex (jclient, buffer, size, time);
+    }
+  else if (mring_len (&jclient->j2o_midi_queue))
+    {
+      jclient_j2o_midi_msg_queue (jclient, buffer, size);
+    }
+  else
+    {
+      jclient_j2o_midi_msg (jclient, buffer, size, time);
+    }
 }
 
 static inline void
@@ -550,6 +643,9 @@ jclient_j2o_midi (struct jclient *jclient, jack_nframes_t nframes,
   jack_nframes_t event_count;
   jack_time_t time = jack_frames_to_time (jclient->client, current_frames);
 
+  //Pending messages from previous cycles go first.
+  jclient_j2o_midi_flush (jclient, time);
+
   midi_port_buf = jack_port_get_buffer (jclient->midi_input_port, nframes);
   event_count = jack_midi_get_event_count (midi_port_buf);
 
@@ -559,15 +655,7 @@ jclient_j2o_midi (struct jclient *jclient, jack_nframes_t nframes,
 	{
 	  debug_print (2, "j2o: Processing MIDI event @ %u (%zu B)",
 		       jevent.time, jevent.size);
-	  if (jevent.buffer[0] == 0xf0 || jclient->j2o_ongoing_sysex)
-	    {
-	      jclient->j2o_ongoing_sysex = 1;
-	      jclient_j2o_midi_sysex (jclient, &jevent, time);
-	    }
-	  else
-	    {
-	      jclient_j2o_midi_msg (jclient, &jevent, time);
-	    }
+	  jclient_j2o_midi_event (jclient, jevent.buffer, jevent.size, time);
 	}
     }
 }
@@ -577,14 +665,7 @@ jclient_copy_o2j_audio (float *f, jack_nframes_t nframes,
 			jack_default_audio_sample_t *buffer[],
 			const struct ow_device_desc *desc)
 {
-  for (int i = 0; i < nframes; i++)
-    {
-      for (int j = 0; j < desc->outputs; j++)
-	{
-	  buffer[j][i] = *f;
-	  f++;
-	}
-    }
+  copy_o2h_audio (f, nframes, buffer, desc);
 }
 
 inline void
@@ -592,14 +673,7 @@ jclient_copy_j2o_audio (float *f, jack_nframes_t nframes,
 			jack_default_audio_sample_t *buffer[],
 			const struct ow_device_desc *desc)
 {
-  for (int i = 0; i < nframes; i++)
-    {
-      for (int j = 0; j < desc->inputs; j++)
-	{
-	  *f = buffer[j][i];
-	  f++;
-	}
-    }
+  copy_h2o_audio (f, nframes, buffer, desc);
 }
 
 static void
@@ -608,65 +682,277 @@ jclient_audio_running (void *data)
   jack_recompute_total_latencies (data);
 }
 
-static inline int
-jclient_process_cb (jack_nframes_t nframes, void *arg)
+static void
+jclient_silence (struct jclient *jclient, jack_nframes_t nframes)
 {
-  float *f;
-  jack_default_audio_sample_t *buffer[OB_MAX_TRACKS];
-  struct jclient *jclient = arg;
-  jack_nframes_t current_frames;
-  jack_time_t current_usecs;
-  jack_time_t next_usecs;
-  float period_usecs;
+  void *buffer;
   struct ow_engine *engine = ow_resampler_get_engine (jclient->resampler);
   const struct ow_device_desc *desc = ow_engine_get_device_desc (engine);
 
-  if (jack_get_cycle_times (jclient->client, &current_frames, &current_usecs,
-			    &next_usecs, &period_usecs))
+  for (int i = 0; i < desc->outputs; i++)
     {
-      error_print ("Error while getting JACK time");
+      buffer = jack_port_get_buffer (jclient->output_ports[i], nframes);
+      memset (buffer, 0, nframes * sizeof (jack_default_audio_sample_t));
     }
 
-  //MIDI runs independently of audio status
-  jclient_o2j_midi (jclient, nframes);
-  jclient_j2o_midi (jclient, nframes, current_frames);
-
-  if (ow_resampler_compute_ratios (jclient->resampler, current_usecs,
-				   jclient_audio_running, jclient->client))
-    {
-      return 0;
-    }
+  buffer = jack_port_get_buffer (jclient->midi_output_port, nframes);
+  jack_midi_clear_buffer (buffer);
+}
 
-  //o2h
+//Only connected ports are processed. An output that has just been disconnected is silenced once so a later connection does not read stale audio before the callback sets its bit.
+static inline uint64_t
+jclient_get_output_buffers (struct jclient *jclient, jack_nframes_t nframes,
+			    jack_default_audio_sample_t *buffer[],
+			    const struct ow_device_desc *desc)
+{
+  uint64_t mask = __atomic_load_n (&jclient->connected_outputs,
+				   __ATOMIC_ACQUIRE);
+  uint64_t cleared = jclient->filled_outputs & ~mask;
 
   for (int i = 0; i < desc->outputs; i++)
     {
-      buffer[i] = jack_port_get_buffer (jclient->output_ports[i], nframes);
+      if ((mask | cleared) & (1ULL << i))
+	{
+	  buffer[i] = jack_port_get_buffer (jclient->output_ports[i],
+					    nframes);
+	}
+      else
+	{
+	  buffer[i] = NULL;
+	}
+
+      if (cleared & (1ULL << i))
+	{
+	  memset (buffer[i], 0,
+		  nframes * sizeof (jack_default_audio_sample_t));
+	}
     }
 
-  f = ow_resampler_get_o2h_audio_buffer (jclient->resampler);
-  ow_resampler_read_audio (jclient->resampler);
-  jclient_copy_o2j_audio (f, nframes, buffer, desc);
+  jclient->filled_outputs = mask;
 
-  //h2o
+  return mask;
+}
 
-  if (ow_engine_is_option (engine, OW_ENGINE_OPTION_P2O_AUDIO))
-    {
-      for (int i = 0; i < desc->inputs; i++)
-	{
-	  buffer[i] = jack_port_get_buffer (jclient->input_ports[i], nframes);
-	}
+static inline uint64_t
+jclient_get_input_buffers (struct jclient *jclient, jack_nframes_t nframes,
+			   jack_default_audio_sample_t *buffer[],
+			   const struct ow_device_desc *desc)
+{
+  uint64_t mask = __atomic_load_n (&jclient->connected_inputs,
+				   __ATOMIC_ACQUIRE);
 
-      f = ow_resampler_get_h2o_audio_buffer (jclient->resampler);
-      jclient_copy_j2o_audio (f, nframes, buffer, desc);
-      ow_resampler_write_audio (jclient->resampler);
+  for (int i = 0; i < desc->inputs; i++)
+    {
+      buffer[i] = mask & (1ULL << i) ?
+	jack_port_get_buffer (jclient->input_ports[i], nframes) : NULL;
     }
 
-  return 0;
+  return mask;
 }
 
+//Direct mode. The device and JACK run on different clocks and a JACK client cannot pace the graph, so the USB stream cannot be the clock master.
+//Instead of resampling, single frames are dropped or repeated (slips) when the ring buffers drift away from their nominal fill.
+
 static void
-set_rt_priority (pthread_t thread, int priority)
+jclient_direct_set_buffer_size (struct jclient *jclient,
+				jack_nframes_t nframes)
+{
+  free (jclient->direct_o2h_buf);
+  free (jclient->direct_h2o_buf);
+  jclient->direct_o2h_buf = malloc ((nframes + 1) *
+				    ow_resampler_get_o2h_frame_size
+				    (jclient->resampler));
+  jclient->direct_h2o_buf = malloc ((nframes + 1) *
+				    ow_resampler_get_h2o_frame_size
+				    (jclient->resampler));
+  jclient->direct_o2h_running = 0;
+}
+
+static inline void
+jclient_direct_o2h (struct jclient *jclient, jack_nframes_t nframes,
+		    uint32_t max_frames)
+{
+  size_t frames;
+  size_t frame_size = ow_resampler_get_o2h_frame_size (jclient->resampler);
+  void *o2h_audio = jclient->context.o2h_audio;
+  char *buf = (char *) jclient->direct_o2h_buf;
+
+  frames = jack_ringbuffer_read_space (o2h_audio) / frame_size;
+
+  if (!jclient->direct_o2h_running)
+    {
+      memset (buf, 0, nframes * frame_size);
+      if (frames < nframes + max_frames / 2)
+	{
+	  return;
+	}
+      debug_print (2, "o2h: Direct mode running");
+      jclient->direct_o2h_running = 1;
+    }
+
+  if (frames > nframes + max_frames)
+    {
+      debug_print (2, "o2h: Dropping frame...");
+      jack_ringbuffer_read_advance (o2h_audio, frame_size);
+      jclient->direct_o2h_slips++;
+      frames--;
+    }
+
+  if (frames >= nframes)
+    {
+      jack_ringbuffer_read (o2h_audio, buf, nframes * frame_size);
+    }
+  else if (frames == nframes - 1)
+    {
+      debug_print (2, "o2h: Repeating frame...");
+      jack_ringbuffer_read (o2h_audio, buf, frames * frame_size);
+      memcpy (buf + frames * frame_size, buf + (frames - 1) * frame_size,
+	      frame_size);
+      jclient->direct_o2h_slips++;
+    }
+  else
+    {
+      error_print ("o2h: Audio ring buffer underflow (%zu < %u). Priming...",
+		   frames, nframes);
+      memset (buf, 0, nframes * frame_size);
+      jclient->direct_o2h_running = 0;
+    }
+}
+
+static inline void
+jclient_direct_h2o (struct jclient *jclient, jack_nframes_t nframes,
+		    uint32_t max_frames)
+{
+  size_t frames;
+  size_t frame_size = ow_resampler_get_h2o_frame_size (jclient->resampler);
+  void *h2o_audio = jclient->context.h2o_audio;
+
+  frames = jack_ringbuffer_read_space (h2o_audio) / frame_size;
+
+  //The engine already stretches the data when there are not enough frames.
+  if (frames > nframes + max_frames)
+    {
+      debug_print (2, "h2o: Dropping frame...");
+      nframes--;
+      jclient->direct_h2o_slips++;
+    }
+
+  if (jack_ringbuffer_write_space (h2o_audio) >= nframes * frame_size)
+    {
+      jack_ringbuffer_write (h2o_audio, (void *) jclient->direct_h2o_buf,
+			     nframes * frame_size);
+    }
+  else
+    {
+      error_print ("h2o: Audio ring buffer overflow. Discarding data...");
+    }
+}
+
+static inline void
+jclient_process_direct (struct jclient *jclient, jack_nframes_t nframes)
+{
+  uint64_t mask;
+  jack_default_audio_sample_t *buffer[OB_MAX_TRACKS];
+  struct ow_engine *engine = ow_resampler_get_engine (jclient->resampler);
+  const struct ow_device_desc *desc = ow_engine_get_device_desc (engine);
+  //Nominal fill variation, as the device writes and reads whole transfers.
+  uint32_t max_frames = 2 * ow_engine_get_blocks_per_transfer (engine) *
+    OB_FRAMES_PER_BLOCK;
+
+  if (ow_engine_get_status (engine) != OW_ENGINE_STATUS_RUN)
+    {
+      jclient_silence (jclient, nframes);
+      return;
+    }
+
+  mask = jclient_get_output_buffers (jclient, nframes, buffer, desc);
+  jclient_direct_o2h (jclient, nframes, max_frames);
+  copy_o2h_audio_masked (jclient->direct_o2h_buf, nframes, buffer, desc,
+			 mask);
+
+  if (ow_engine_is_option (engine, OW_ENGINE_OPTION_P2O_AUDIO))
+    {
+      mask = jclient_get_input_buffers (jclient, nframes, buffer, desc);
+      copy_h2o_audio_masked (jclient->direct_h2o_buf, nframes, buffer, desc,
+			     mask);
+      jclient_direct_h2o (jclient, nframes, max_frames);
+    }
+}
+
+static inline void
+jclient_process (struct jclient *jclient, jack_nframes_t nframes,
+		 jack_nframes_t current_frames, jack_time_t current_usecs)
+{
+  float *f;
+  uint64_t mask;
+  jack_default_audio_sample_t *buffer[OB_MAX_TRACKS];
+  struct ow_engine *engine = ow_resampler_get_engine (jclient->resampler);
+  const struct ow_device_desc *desc = ow_engine_get_device_desc (engine);
+
+  //A stopped device keeps its ports silent until the client goes away.
+  if (ow_engine_get_status (engine) <= OW_ENGINE_STATUS_STOP)
+    {
+      jclient_silence (jclient, nframes);
+      return;
+    }
+
+  //MIDI runs independently of audio status
+  jclient_o2j_midi (jclient, nframes);
+  jclient_j2o_midi (jclient, nframes, current_frames);
+
+  if (jclient->direct)
+    {
+      jclient_process_direct (jclient, nframes);
+      return;
+    }
+
+  if (ow_resampler_compute_ratios (jclient->resampler, current_usecs,
+				   jclient_audio_running, jclient->client))
+    {
+      return;
+    }
+
+  //o2h
+  //The resampler always runs as it consumes the device stream and keeps the ratio.
+
+  mask = jclient_get_output_buffers (jclient, nframes, buffer, desc);
+  f = ow_resampler_get_o2h_audio_buffer (jclient->resampler);
+  ow_resampler_read_audio (jclient->resampler);
+  copy_o2h_audio_masked (f, nframes, buffer, desc, mask);
+
+  //h2o
+
+  if (ow_engine_is_option (engine, OW_ENGINE_OPTION_P2O_AUDIO))
+    {
+      mask = jclient_get_input_buffers (jclient, nframes, buffer, desc);
+      f = ow_resampler_get_h2o_audio_buffer (jclient->resampler);
+      copy_h2o_audio_masked (f, nframes, buffer, desc, mask);
+      ow_resampler_write_audio (jclient->resampler);
+    }
+}
+
+static int
+jclient_process_cb (jack_nframes_t nframes, void *arg)
+{
+  struct jclient *jclient = arg;
+  jack_nframes_t current_frames;
+  jack_time_t current_usecs;
+  jack_time_t next_usecs;
+  float period_usecs;
+
+  if (jack_get_cycle_times (jclient->client, &current_frames, &current_usecs,
+			    &next_usecs, &period_usecs))
+    {
+      error_print ("Error while getting JACK time");
+    }
+
+  jclient_process (jclient, nframes, current_frames, current_usecs);
+
+  return 0;
+}
+
+static void
+set_rt_priority (pthread_t thread, int priority)
 {
   int err = jack_acquire_real_time_scheduling (thread, priority);
   if (err)
@@ -675,13 +961,29 @@ set_rt_priority (pthread_t thread, int priority)
     }
 }
 
+//Called by JACK in its process thread before the first cycle.
+static void
+jclient_thread_init_cb (void *arg)
+{
+  struct ow_sched *sched = arg;
+  ow_set_thread_affinity (pthread_self (), sched->host_cpus);
+}
+
 void
 jclient_stop (struct jclient *jclient)
 {
   debug_print (1, "Stopping client...");
   if (jclient->client)
     {
-      ow_resampler_report_status (jclient->resampler);
+      if (jclient->direct)
+	{
+	  debug_print (1, "%s: o2h slips: %u; h2o slips: %u", jclient->name,
+		       jclient->direct_o2h_slips, jclient->direct_h2o_slips);
+	}
+      else
+	{
+	  ow_resampler_report_status (jclient->resampler);
+	}
       ow_resampler_stop (jclient->resampler);
     }
 }
@@ -711,179 +1013,170 @@ jclient_init (struct jclient *jclient)
   return 0;
 }
 
-void
-jclient_destroy (struct jclient *jclient)
+struct jclient_init_job
 {
-  ow_resampler_destroy (jclient->resampler);
+  struct jclient *jclient;
+  int err;
+  int threaded;
+  pthread_t thread;
+};
+
+static void *
+jclient_init_runner (void *data)
+{
+  struct jclient_init_job *job = data;
+  job->err = jclient_init (job->jclient);
+  return NULL;
 }
 
+//Most of the device initialization time is spent waiting for USB so all the devices are initialized concurrently.
+//Every error is stored in errors and the amount of initialized jclients is returned.
 int
-jclient_run (struct jclient *jclient)
+jclient_init_all (struct jclient *jclients[], int count, int errors[])
 {
-  jack_status_t status;
-  ow_err_t err = OW_OK;
-  char *client_name;
-  struct ow_engine *engine;
-  const struct ow_device_desc *desc;
-
-  jclient->output_ports = NULL;
-  jclient->input_ports = NULL;
-  jclient->j2o_ongoing_sysex = 0;
-  jclient->context.h2o_audio = NULL;
-  jclient->context.o2h_audio = NULL;
-  jclient->context.h2o_midi = NULL;
-  jclient->context.o2h_midi = NULL;
-
-  engine = ow_resampler_get_engine (jclient->resampler);
-  desc = ow_engine_get_device_desc (engine);
+  int initialized = 0;
+  jack_time_t start = jack_get_time ();
+  struct jclient_init_job *jobs = malloc (sizeof (struct jclient_init_job) *
+					  count);
+  struct jclient_init_job *job = jobs;
 
-  jclient->client = jack_client_open (jclient->name, JackNoStartServer,
-				      &status, NULL);
-  if (jclient->client == NULL)
+  for (int i = 0; i < count; i++, job++)
     {
-      if (status & JackServerFailed)
-	{
-	  error_print ("Unable to connect to JACK server");
-	}
-      else
+      job->jclient = jclients[i];
+      job->threaded = !pthread_create (&job->thread, NULL,
+				       jclient_init_runner, job);
+      if (!job->threaded)
 	{
-	  error_print ("Unable to open client. Error 0x%2.0x", status);
+	  jclient_init_runner (job);
 	}
-      return OW_GENERIC_ERROR;
-    }
-
-  if (status & JackServerStarted)
-    {
-      debug_print (1, "JACK server started");
-    }
-
-  if (status & JackNameNotUnique)
-    {
-      client_name = jack_get_client_name (jclient->client);
-      debug_print (0, "Name client in use. Using %s...", client_name);
-    }
-
-  if (jack_set_process_callback (jclient->client, jclient_process_cb,
-				 jclient))
-    {
-      goto cleanup_jack;
     }
 
-  if (jack_set_xrun_callback (jclient->client, jclient_thread_xrun_cb,
-			      jclient->resampler))
+  job = jobs;
+  for (int i = 0; i < count; i++, job++)
     {
-      goto cleanup_jack;
+      if (job->threaded)
+	{
+	  pthread_join (job->thread, NULL);
+	}
+      errors[i] = job->err;
+      if (!job->err)
+	{
+	  initialized++;
+	}
     }
 
-  if (jack_set_latency_callback (jclient->client, jclient_thread_latency_cb,
-				 jclient))
-    {
-      goto cleanup_jack;
-    }
+  free (jobs);
 
-  if (jack_set_port_connect_callback (jclient->client,
-				      jclient_port_connect_cb, jclient))
-    {
-      error_print
-	("Cannot set port connect callback so j2o audio will not be possible");
-    }
+  debug_print (1, "%d of %d devices initialized in %.1f ms", initialized,
+	       count, (jack_get_time () - start) / 1000.0);
 
-  jack_on_info_shutdown (jclient->client, jclient_jack_shutdown_cb, jclient);
+  return initialized;
+}
 
-  if (jack_set_freewheel_callback (jclient->client, jclient_jack_freewheel,
-				   jclient))
-    {
-      error_print ("Cannot set JACK freewheel callback");
-    }
+void
+jclient_destroy (struct jclient *jclient)
+{
+  ow_resampler_destroy (jclient->resampler);
+}
 
-  if (jack_set_graph_order_callback (jclient->client,
-				     jclient_jack_graph_order_cb, jclient))
-    {
-      error_print ("Cannot set JACK graph order callback");
-    }
+//Port names are prefixed with the device name when a single JACK client hosts several devices.
+static jack_port_t *
+jclient_register_port (struct jclient *jclient, const char *prefix,
+		       const char *name, const char *type, unsigned long flags)
+{
+  char port_name[OW_LABEL_MAX_LEN * 2 + 2];
 
-  if (jack_set_client_registration_callback (jclient->client,
-					     jclient_jack_client_registration_cb,
-					     jclient))
+  if (prefix)
     {
-      error_print ("Cannot set JACK client registration callback");
+      snprintf (port_name, sizeof (port_name), "%s %s", prefix, name);
     }
-
-  if (jack_set_buffer_size_callback (jclient->client,
-				     jclient_set_buffer_size_cb, jclient))
+  else
     {
-      goto cleanup_jack;
+      snprintf (port_name, sizeof (port_name), "%s", name);
     }
 
-  if (jack_set_sample_rate_callback (jclient->client,
-				     jclient_set_sample_rate_cb, jclient))
-    {
-      goto cleanup_jack;
-    }
+  debug_print (2, "Registering port %s...", port_name);
+  return jack_port_register (jclient->client, port_name, type, flags, 0);
+}
 
-  if (jclient->priority < 0)
-    {
-      jclient->priority = jack_client_real_time_priority (jclient->client);
-    }
-  debug_print (1, "Using RT priority %d...", jclient->priority);
+static int
+jclient_register_ports (struct jclient *jclient, const char *prefix)
+{
+  struct ow_engine *engine = ow_resampler_get_engine (jclient->resampler);
+  const struct ow_device_desc *desc = ow_engine_get_device_desc (engine);
 
   debug_print (1, "Registering ports...");
   jclient->output_ports = malloc (sizeof (jack_port_t *) * desc->outputs);
   for (int i = 0; i < desc->outputs; i++)
     {
-      const char *name = desc->output_track_names[i];
-      debug_print (2, "Registering output port %s...", name);
-      jclient->output_ports[i] = jack_port_register (jclient->client,
-						     name,
-						     JACK_DEFAULT_AUDIO_TYPE,
-						     JackPortIsOutput |
-						     JackPortIsTerminal, 0);
+      jclient->output_ports[i] = jclient_register_port (jclient, prefix,
+							desc->output_track_names
+							[i],
+							JACK_DEFAULT_AUDIO_TYPE,
+							JackPortIsOutput |
+							JackPortIsTerminal);
 
       if (jclient->output_ports[i] == NULL)
 	{
 	  error_print (MSG_ERROR_PORT_REGISTER);
-	  goto cleanup_jack;
+	  return -1;
 	}
     }
 
   jclient->input_ports = malloc (sizeof (jack_port_t *) * desc->inputs);
   for (int i = 0; i < desc->inputs; i++)
     {
-      const char *name = desc->input_track_names[i];
-      debug_print (2, "Registering input port %s...", name);
-      jclient->input_ports[i] = jack_port_register (jclient->client,
-						    name,
-						    JACK_DEFAULT_AUDIO_TYPE,
-						    JackPortIsInput |
-						    JackPortIsTerminal, 0);
+      jclient->input_ports[i] = jclient_register_port (jclient, prefix,
+						       desc->input_track_names
+						       [i],
+						       JACK_DEFAULT_AUDIO_TYPE,
+						       JackPortIsInput |
+						       JackPortIsTerminal);
 
       if (jclient->input_ports[i] == NULL)
 	{
 	  error_print (MSG_ERROR_PORT_REGISTER);
-	  goto cleanup_jack;
+	  return -1;
 	}
     }
 
-  jclient->midi_output_port = jack_port_register (jclient->client, "MIDI out",
-						  JACK_DEFAULT_MIDI_TYPE,
-						  JackPortIsOutput, 0);
+  jclient->midi_output_port = jclient_register_port (jclient, prefix,
+						     "MIDI out",
+						     JACK_DEFAULT_MIDI_TYPE,
+						     JackPortIsOutput);
 
   if (jclient->midi_output_port == NULL)
     {
       error_print (MSG_ERROR_PORT_REGISTER);
-      goto cleanup_jack;
+      return -1;
     }
 
-  jclient->midi_input_port = jack_port_register (jclient->client, "MIDI in",
-						 JACK_DEFAULT_MIDI_TYPE,
-						 JackPortIsInput, 0);
+  jclient->midi_input_port = jclient_register_port (jclient, prefix,
+						    "MIDI in",
+						    JACK_DEFAULT_MIDI_TYPE,
+						    JackPortIsInput);
 
   if (jclient->midi_input_port == NULL)
     {
       error_print (MSG_ERROR_PORT_REGISTER);
-      goto cleanup_jack;
+      return -1;
     }
 
+  return 0;
+}
+
+//On error, the buffers are still released with jclient_free_buffers.
+static int
+jclient_init_buffers (struct jclient *jclient, int priority)
+{
+  jclient->output_ports = NULL;
+  jclient->input_ports = NULL;
+  jclient->connected_outputs = 0;
+  jclient->connected_inputs = 0;
+  //Unconnected outputs are silenced in the first cycle.
+  jclient->filled_outputs = UINT64_MAX;
+  jclient->j2o_ongoing_sysex = 0;
+
   jclient->context.o2h_audio = jack_ringbuffer_create (MAX_LATENCY *
 						       ow_resampler_get_o2h_frame_size
 						       (jclient->resampler));
@@ -906,56 +1199,245 @@ jclient_run (struct jclient *jclient)
     (ow_buffer_rw_space_t) jack_ringbuffer_write_space;
   jclient->context.read = jclient_buffer_read;
   jclient->context.write = (ow_buffer_write_t) jack_ringbuffer_write;
+  jclient->context.process = NULL;
+  //The planar layout requires a process callback. See ow_sample_layout_t.
+  jclient->context.layout = OW_SAMPLE_LAYOUT_INTERLEAVED;
   jclient->context.get_time = jack_get_time;
+  jclient->context.h2o_midi_window = OW_DEFAULT_H2O_MIDI_WINDOW;
 
   jclient->context.set_rt_priority = set_rt_priority;
-  jclient->context.priority = jclient->priority;
+  jclient->context.priority = priority;
+  jclient->context.sched = jclient->sched;
 
   jclient->context.options = OW_ENGINE_OPTION_O2P_AUDIO |
     OW_ENGINE_OPTION_O2P_MIDI | OW_ENGINE_OPTION_P2O_MIDI;
 
-  squeue_init (&jclient->o2j_midi_queue, MAX_MIDI_BUF_LEN);
-  squeue_init (&jclient->j2o_midi_queue, MAX_MIDI_BUF_LEN);
-
   jclient->o2j_midi_skipping = 0;
   jclient->o2j_last_lost_count = 0;
 
-  err = ow_resampler_start (jclient->resampler, &jclient->context);
-  if (err)
-    {
-      goto cleanup_jack;
-    }
+  jclient->direct_o2h_buf = NULL;
+  jclient->direct_h2o_buf = NULL;
+  jclient->direct_o2h_running = 0;
+  jclient->direct_o2h_slips = 0;
+  jclient->direct_h2o_slips = 0;
 
-  if (jack_activate (jclient->client))
+  jclient->j2o_midi_queue.data = NULL;
+  if (mring_init (&jclient->o2j_midi_queue, MAX_MIDI_BUF_LEN) ||
+      mring_init (&jclient->j2o_midi_queue, MAX_MIDI_BUF_LEN))
     {
-      error_print ("Cannot activate client");
-      err = -1;
-      goto cleanup_jack;
+      error_print ("Could not allocate MIDI queues");
+      return -1;
     }
 
-  ow_resampler_wait (jclient->resampler);
-
-  debug_print (1, "Exiting...");
-  jack_deactivate (jclient->client);
+  return 0;
+}
 
-cleanup_jack:
+void
+jclient_free_buffers (struct jclient *jclient)
+{
   jack_ringbuffer_free (jclient->context.h2o_audio);
   jack_ringbuffer_free (jclient->context.o2h_audio);
   jack_ringbuffer_free (jclient->context.h2o_midi);
   jack_ringbuffer_free (jclient->context.o2h_midi);
-  squeue_destroy (&jclient->o2j_midi_queue);
-  squeue_destroy (&jclient->j2o_midi_queue);
-  jack_client_close (jclient->client);
+  mring_destroy (&jclient->o2j_midi_queue);
+  mring_destroy (&jclient->j2o_midi_queue);
   free (jclient->output_ports);
   free (jclient->input_ports);
-  return err;
+  free (jclient->direct_o2h_buf);
+  free (jclient->direct_h2o_buf);
 }
 
-static void *
-jclient_thread_runner (void *data)
+static jack_client_t *
+jclient_open_client (const char *name)
 {
-  struct jclient *jclient = data;
-  jclient_run (jclient);
+  jack_status_t status;
+  char *client_name;
+  jack_client_t *client = jack_client_open (name, JackNoStartServer,
+					    &status, NULL);
+  if (client == NULL)
+    {
+      if (status & JackServerFailed)
+	{
+	  error_print ("Unable to connect to JACK server");
+	}
+      else
+	{
+	  error_print ("Unable to open client. Error 0x%2.0x", status);
+	}
+      return NULL;
+    }
+
+  if (status & JackServerStarted)
+    {
+      debug_print (1, "JACK server started");
+    }
+
+  if (status & JackNameNotUnique)
+    {
+      client_name = jack_get_client_name (client);
+      debug_print (0, "Name client in use. Using %s...", client_name);
+    }
+
+  return client;
+}
+
+static void
+jclient_set_optional_callbacks (jack_client_t *client, void *cb_data)
+{
+  if (jack_set_freewheel_callback (client, jclient_jack_freewheel, cb_data))
+    {
+      error_print ("Cannot set JACK freewheel callback");
+    }
+
+  if (jack_set_graph_order_callback (client, jclient_jack_graph_order_cb,
+				     cb_data))
+    {
+      error_print ("Cannot set JACK graph order callback");
+    }
+
+  if (jack_set_client_registration_callback (client,
+					     jclient_jack_client_registration_cb,
+					     cb_data))
+    {
+      error_print ("Cannot set JACK client registration callback");
+    }
+}
+
+static void
+jclient_wait_audio (struct jclient *jclient)
+{
+  if (jclient->direct)
+    {
+      ow_engine_wait (ow_resampler_get_engine (jclient->resampler));
+    }
+  else
+    {
+      ow_resampler_wait (jclient->resampler);
+    }
+}
+
+int
+jclient_activate (struct jclient *jclient)
+{
+  if (jclient->priority < 0)
+    {
+      jclient->priority = jack_client_real_time_priority (jclient->client);
+    }
+  debug_print (1, "Using RT priority %d...", jclient->priority);
+
+  if (jclient_init_buffers (jclient, jclient->priority))
+    {
+      return OW_GENERIC_ERROR;
+    }
+
+  if (jack_set_thread_init_callback (jclient->client, jclient_thread_init_cb,
+				     &jclient->sched))
+    {
+      return OW_GENERIC_ERROR;
+    }
+
+  if (jack_set_process_callback (jclient->client, jclient_process_cb,
+				 jclient))
+    {
+      return OW_GENERIC_ERROR;
+    }
+
+  if (jack_set_xrun_callback (jclient->client, jclient_thread_xrun_cb,
+			      jclient->resampler))
+    {
+      return OW_GENERIC_ERROR;
+    }
+
+  if (jack_set_latency_callback (jclient->client, jclient_thread_latency_cb,
+				 jclient))
+    {
+      return OW_GENERIC_ERROR;
+    }
+
+  if (jack_set_port_connect_callback (jclient->client,
+				      jclient_port_connect_cb, jclient))
+    {
+      error_print
+	("Cannot set port connect callback so j2o audio will not be possible");
+    }
+
+  jack_on_info_shutdown (jclient->client, jclient_jack_shutdown_cb, jclient);
+
+  jclient_set_optional_callbacks (jclient->client, jclient);
+
+  if (jack_set_buffer_size_callback (jclient->client,
+				     jclient_set_buffer_size_cb, jclient))
+    {
+      return OW_GENERIC_ERROR;
+    }
+
+  if (jack_set_sample_rate_callback (jclient->client,
+				     jclient_set_sample_rate_cb, jclient))
+    {
+      return OW_GENERIC_ERROR;
+    }
+
+  if (jclient_register_ports (jclient, NULL))
+    {
+      return OW_GENERIC_ERROR;
+    }
+
+  if (jclient->direct)
+    {
+      //Without a DLL the engine goes straight to run.
+      jclient->context.dll = NULL;
+      if (ow_engine_start (ow_resampler_get_engine (jclient->resampler),
+			   &jclient->context))
+	{
+	  return OW_GENERIC_ERROR;
+	}
+    }
+  else if (ow_resampler_start (jclient->resampler, &jclient->context))
+    {
+      return OW_GENERIC_ERROR;
+    }
+
+  if (jack_activate (jclient->client))
+    {
+      error_print ("Cannot activate client");
+      ow_resampler_stop (jclient->resampler);
+      jclient_wait_audio (jclient);
+      return OW_GENERIC_ERROR;
+    }
+
+  return OW_OK;
+}
+
+int
+jclient_run (struct jclient *jclient)
+{
+  ow_err_t err;
+
+  jclient->client = jclient_open_client (jclient->name);
+  if (jclient->client == NULL)
+    {
+      return OW_GENERIC_ERROR;
+    }
+
+  err = jclient_activate (jclient);
+  if (!err)
+    {
+      jclient_wait_audio (jclient);
+
+      debug_print (1, "Exiting...");
+      jack_deactivate (jclient->client);
+    }
+
+  jack_client_close (jclient->client);
+  jclient_free_buffers (jclient);
+  return err;
+}
+
+static void *
+jclient_thread_runner (void *data)
+{
+  struct jclient *jclient = data;
+  jclient_run (jclient);
   return NULL;
 }
 
@@ -977,3 +1459,289 @@ jclient_wait (struct jclient *jclient)
       jclient->running = 0;
     }
 }
+
+//Aggregate mode. A single JACK client hosts every device so JACK only schedules one node per cycle.
+//Devices are processed serially inside the process callback.
+
+static int
+jclient_aggregate_process_cb (jack_nframes_t nframes, void *arg)
+{
+  struct jclient_aggregate *aggregate = arg;
+  jack_nframes_t current_frames;
+  jack_time_t current_usecs;
+  jack_time_t next_usecs;
+  float period_usecs;
+  struct jclient *jclient = aggregate->jclients;
+
+  if (jack_get_cycle_times (aggregate->client, &current_frames,
+			    &current_usecs, &next_usecs, &period_usecs))
+    {
+      error_print ("Error while getting JACK time");
+    }
+
+  for (int i = 0; i < aggregate->count; i++, jclient++)
+    {
+      jclient_process (jclient, nframes, current_frames, current_usecs);
+    }
+
+  return 0;
+}
+
+static int
+jclient_aggregate_xrun_cb (void *cb_data)
+{
+  struct jclient_aggregate *aggregate = cb_data;
+  struct jclient *jclient = aggregate->jclients;
+  error_print ("JACK xrun");
+  for (int i = 0; i < aggregate->count; i++, jclient++)
+    {
+      ow_resampler_inc_xruns (jclient->resampler);
+    }
+  return 0;
+}
+
+static void
+jclient_aggregate_latency_cb (jack_latency_callback_mode_t mode,
+			      void *cb_data)
+{
+  struct jclient_aggregate *aggregate = cb_data;
+  struct jclient *jclient = aggregate->jclients;
+  debug_print (2, "JACK latency request");
+  for (int i = 0; i < aggregate->count; i++, jclient++)
+    {
+      jclient_set_latencies (jclient, mode);
+    }
+}
+
+static void
+jclient_aggregate_port_connect_cb (jack_port_id_t a, jack_port_id_t b,
+				   int connect, void *cb_data)
+{
+  struct jclient_aggregate *aggregate = cb_data;
+  struct jclient *jclient = aggregate->jclients;
+  for (int i = 0; i < aggregate->count; i++, jclient++)
+    {
+      jclient_check_connections (jclient);
+    }
+}
+
+static void
+jclient_aggregate_shutdown_cb (jack_status_t code, const char *reason,
+			       void *cb_data)
+{
+  debug_print (1, "JACK is shutting down: %s", reason);
+  jclient_aggregate_stop (cb_data);
+}
+
+static int
+jclient_aggregate_set_buffer_size_cb (jack_nframes_t nframes, void *cb_data)
+{
+  struct jclient_aggregate *aggregate = cb_data;
+  struct jclient *jclient = aggregate->jclients;
+  int err = 0;
+  debug_print (1, "JACK buffer size: %d", nframes);
+  for (int i = 0; i < aggregate->count; i++, jclient++)
+    {
+      err |= jclient_set_buffer_size (jclient, nframes);
+    }
+  return err;
+}
+
+static int
+jclient_aggregate_set_sample_rate_cb (jack_nframes_t nframes, void *cb_data)
+{
+  struct jclient_aggregate *aggregate = cb_data;
+  struct jclient *jclient = aggregate->jclients;
+  debug_print (1, "JACK sample rate: %d", nframes);
+  for (int i = 0; i < aggregate->count; i++, jclient++)
+    {
+      ow_resampler_set_samplerate (jclient->resampler, nframes);
+    }
+  return 0;
+}
+
+void
+jclient_aggregate_stop (struct jclient_aggregate *aggregate)
+{
+  struct jclient *jclient = aggregate->jclients;
+  for (int i = 0; i < aggregate->count; i++, jclient++)
+    {
+      jclient_stop (jclient);
+    }
+}
+
+int
+jclient_aggregate_run (struct jclient_aggregate *aggregate)
+{
+  ow_err_t err = OW_OK;
+  struct jclient *jclient;
+  int started = 0;
+  int initialized = 0;
+
+  aggregate->client = jclient_open_client (aggregate->name);
+  if (aggregate->client == NULL)
+    {
+      return OW_GENERIC_ERROR;
+    }
+
+  if (aggregate->priority < 0)
+    {
+      aggregate->priority =
+	jack_client_real_time_priority (aggregate->client);
+    }
+  debug_print (1, "Using RT priority %d...", aggregate->priority);
+
+  jclient = aggregate->jclients;
+  for (; initialized < aggregate->count; initialized++, jclient++)
+    {
+      jclient->client = aggregate->client;
+      jclient->priority = aggregate->priority;
+      jclient->sched = aggregate->sched;
+      if (jclient_init_buffers (jclient, aggregate->priority))
+	{
+	  //The failed one still needs its partial buffers released.
+	  initialized++;
+	  err = OW_GENERIC_ERROR;
+	  goto cleanup_jack;
+	}
+    }
+
+  if (jack_set_thread_init_callback (aggregate->client,
+				     jclient_thread_init_cb,
+				     &aggregate->sched))
+    {
+      err = OW_GENERIC_ERROR;
+      goto cleanup_jack;
+    }
+
+  if (jack_set_process_callback (aggregate->client,
+				 jclient_aggregate_process_cb, aggregate))
+    {
+      err = OW_GENERIC_ERROR;
+      goto cleanup_jack;
+    }
+
+  if (jack_set_xrun_callback (aggregate->client, jclient_aggregate_xrun_cb,
+			      aggregate))
+    {
+      err = OW_GENERIC_ERROR;
+      goto cleanup_jack;
+    }
+
+  if (jack_set_latency_callback (aggregate->client,
+				 jclient_aggregate_latency_cb, aggregate))
+    {
+      err = OW_GENERIC_ERROR;
+      goto cleanup_jack;
+    }
+
+  if (jack_set_port_connect_callback (aggregate->client,
+				      jclient_aggregate_port_connect_cb,
+				      aggregate))
+    {
+      error_print
+	("Cannot set port connect callback so j2o audio will not be possible");
+    }
+
+  jack_on_info_shutdown (aggregate->client, jclient_aggregate_shutdown_cb,
+			 aggregate);
+
+  jclient_set_optional_callbacks (aggregate->client, aggregate);
+
+  if (jack_set_buffer_size_callback (aggregate->client,
+				     jclient_aggregate_set_buffer_size_cb,
+				     aggregate))
+    {
+      err = OW_GENERIC_ERROR;
+      goto cleanup_jack;
+    }
+
+  if (jack_set_sample_rate_callback (aggregate->client,
+				     jclient_aggregate_set_sample_rate_cb,
+				     aggregate))
+    {
+      err = OW_GENERIC_ERROR;
+      goto cleanup_jack;
+    }
+
+  jclient = aggregate->jclients;
+  for (int i = 0; i < aggregate->count; i++, jclient++)
+    {
+      if (jclient_register_ports (jclient, jclient->name))
+	{
+	  err = OW_GENERIC_ERROR;
+	  goto cleanup_jack;
+	}
+    }
+
+  jclient = aggregate->jclients;
+  for (; started < aggregate->count; started++, jclient++)
+    {
+      err = ow_resampler_start (jclient->resampler, &jclient->context);
+      if (err)
+	{
+	  goto stop_resamplers;
+	}
+    }
+
+  if (jack_activate (aggregate->client))
+    {
+      error_print ("Cannot activate client");
+      err = OW_GENERIC_ERROR;
+      goto stop_resamplers;
+    }
+
+  jclient = aggregate->jclients;
+  for (int i = 0; i < aggregate->count; i++, jclient++)
+    {
+      ow_resampler_wait (jclient->resampler);
+    }
+
+  debug_print (1, "Exiting...");
+  jack_deactivate (aggregate->client);
+  goto cleanup_jack;
+
+stop_resamplers:
+  jclient = aggregate->jclients;
+  for (int i = 0; i < started; i++, jclient++)
+    {
+      ow_resampler_stop (jclient->resampler);
+      ow_resampler_wait (jclient->resampler);
+    }
+
+cleanup_jack:
+  jack_client_close (aggregate->client);
+  jclient = aggregate->jclients;
+  for (int i = 0; i < initialized; i++, jclient++)
+    {
+      jclient_free_buffers (jclient);
+    }
+  return err;
+}
+
+static void *
+jclient_aggregate_thread_runner (void *data)
+{
+  struct jclient_aggregate *aggregate = data;
+  jclient_aggregate_run (aggregate);
+  return NULL;
+}
+
+int
+jclient_aggregate_start (struct jclient_aggregate *aggregate)
+{
+  int err = pthread_create (&aggregate->thread, NULL,
+			    jclient_aggregate_thread_runner, aggregate);
+  aggregate->running = err ? 0 : 1;
+  return err;
+}
+
+void
+jclient_aggregate_wait (struct jclient_aggregate *aggregate)
+{
+  if (aggregate->running)
+    {
+      pthread_join (aggregate->thread, NULL);
+      aggregate->running = 0;
+    }
+}
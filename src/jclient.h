@@ -21,20 +21,13 @@
 #include <jack/ringbuffer.h>
 #include <jack/midiport.h>
 #include "overwitch.h"
+#include "mring.h"
 
 #define JCLIENT_DEFAULT_PRIORITY -1
 
 typedef void (*jclient_end_notifier_t) (uint8_t, uint8_t);
 typedef void (*jclient_notify_status_t) (int, jack_nframes_t, jack_nframes_t);
 
-struct squeue
-{
-  uint8_t *data;
-  uint32_t item_size;
-  uint32_t len;
-  uint32_t max_len;
-};
-
 struct jclient
 {
   //JACK stuff
@@ -42,11 +35,14 @@ struct jclient
   jack_client_t *client;
   jack_port_t **output_ports;
   jack_port_t **input_ports;
+  uint64_t connected_outputs;	//Bitmaps written from the port connect callback
+  uint64_t connected_inputs;
+  uint64_t filled_outputs;	//Outputs written in the last cycle
   jack_port_t *midi_output_port;
   jack_port_t *midi_input_port;
   int j2o_ongoing_sysex;
-  struct squeue o2j_midi_queue;
-  struct squeue j2o_midi_queue;
+  struct mring o2j_midi_queue;
+  struct mring j2o_midi_queue;
   int o2j_midi_skipping;
   uint32_t o2j_last_lost_count;
   //Parameters
@@ -56,7 +52,15 @@ struct jclient
   unsigned int xfr_timeout;
   int quality;
   int priority;
+  struct ow_sched sched;
+  int direct;
   jack_nframes_t bufsize;
+  //Direct mode
+  float *direct_o2h_buf;
+  float *direct_h2o_buf;
+  int direct_o2h_running;
+  uint32_t direct_o2h_slips;
+  uint32_t direct_h2o_slips;
   // Overwitch stuff
   struct ow_resampler *resampler;
   struct ow_context context;
@@ -65,18 +69,43 @@ struct jclient
   pthread_t thread;
 };
 
+struct jclient_aggregate
+{
+  const char *name;
+  jack_client_t *client;
+  struct jclient *jclients;
+  int count;
+  int priority;
+  struct ow_sched sched;
+  // Thread stuff
+  int running;
+  pthread_t thread;
+};
+
 void jclient_check_jack_server (jclient_notify_status_t);
 
 int jclient_init (struct jclient *);
 
+int jclient_init_all (struct jclient *[], int, int[]);
+
 int jclient_start (struct jclient *);
 
+int jclient_activate (struct jclient *);
+
+void jclient_free_buffers (struct jclient *);
+
 void jclient_destroy (struct jclient *);
 
 void jclient_wait (struct jclient *);
 
 void jclient_stop (struct jclient *);
 
+int jclient_aggregate_start (struct jclient_aggregate *);
+
+void jclient_aggregate_wait (struct jclient_aggregate *);
+
+void jclient_aggregate_stop (struct jclient_aggregate *);
+
 void jclient_print_latencies (struct ow_resampler *, const char *);
 
 void jclient_copy_o2j_audio (float *, jack_nframes_t,
@@ -87,12 +116,10 @@ void jclient_copy_j2o_audio (float *, jack_nframes_t,
 			     jack_default_audio_sample_t *[],
 			     const struct ow_device_desc *);
 
-void squeue_init (struct squeue *queue, uint32_t max_len);
-
-void squeue_destroy (struct squeue *queue);
-
-int squeue_write (struct squeue *queue, void *data, uint32_t len);
+void jclient_j2o_midi_event (struct jclient *, const jack_midi_data_t *,
+			     size_t, jack_time_t);
 
-void squeue_consume (struct squeue *queue, uint32_t consumed);
+void jclient_j2o_midi_flush (struct jclient *, jack_time_t);
 
-void squeue_read (struct squeue *queue, void *data);
+uint32_t jclient_o2j_midi_packet (struct jclient *,
+				  const struct ow_midi_event_packet *);
@@ -22,13 +22,15 @@
 #include <errno.h>
 #include "../config.h"
 #include "jclient.h"
+#include "hotplug.h"
 #include "utils.h"
 #include "common.h"
 
-#define DEFAULT_QUALITY 2
+#define AGGREGATE_CLIENT_NAME "Overwitch"
 
 static size_t jclient_count;
 static struct jclient *jclients;
+static volatile sig_atomic_t hotplug_exit;
 
 static struct option options[] = {
   {"use-device-number", 1, NULL, 'n'},
@@ -37,6 +39,13 @@ static struct option options[] = {
   {"blocks-per-transfer", 1, NULL, 'b'},
   {"usb-transfer-timeout", 1, NULL, 't'},
   {"rt-priority", 1, NULL, 'p'},
+  {"usb-cpus", 1, NULL, 'u'},
+  {"midi-cpus", 1, NULL, 'm'},
+  {"jack-cpus", 1, NULL, 'j'},
+  {"sched-deadline", 0, NULL, 'e'},
+  {"aggregate", 0, NULL, 'a'},
+  {"direct", 0, NULL, 'D'},
+  {"hotplug", 0, NULL, 'H'},
   {"list-devices", 0, NULL, 'l'},
   {"verbose", 0, NULL, 'v'},
   {"help", 0, NULL, 'h'},
@@ -46,32 +55,25 @@ static struct option options[] = {
 static void
 signal_handler (int signum)
 {
-  if (signum == SIGHUP || signum == SIGINT || signum == SIGTERM
-      || signum == SIGTSTP)
-    {
-      struct jclient *jclient = jclients;
-      for (int i = 0; i < jclient_count; i++, jclient++)
-	{
-	  jclient_stop (jclient);
-	}
-    }
-  else if (signum == SIGUSR1)
+  struct jclient *jclient = jclients;
+
+  if (update_debug_level (signum))
     {
-      debug_level++;
-      debug_print (1, "Debug level: %d", debug_level);
+      return;
     }
-  else if (signum == SIGUSR2)
+
+  for (int i = 0; i < jclient_count; i++, jclient++)
     {
-      debug_level--;
-      debug_level = debug_level < 0 ? 0 : debug_level;
-      debug_print (1, "Debug level: %d", debug_level);
+      jclient_stop (jclient);
     }
+  hotplug_exit = 1;
 }
 
 static int
 run_single (int device_num, const char *device_name,
 	    unsigned int blocks_per_transfer, unsigned int xfr_timeout,
-	    int quality, int priority)
+	    int quality, int priority, const struct ow_sched *sched,
+	    int direct)
 {
   struct ow_usb_device *device;
   ow_err_t err = OW_OK;
@@ -89,6 +91,8 @@ run_single (int device_num, const char *device_name,
   jclients->xfr_timeout = xfr_timeout;
   jclients->quality = quality;
   jclients->priority = priority;
+  jclients->sched = *sched;
+  jclients->direct = direct;
 
   free (device);
 
@@ -109,26 +113,32 @@ end:
 
 static int
 run_all (unsigned int blocks_per_transfer, unsigned int xfr_timeout,
-	 int quality, int priority)
+	 int quality, int priority, const struct ow_sched *sched,
+	 int aggregated)
 {
+  struct jclient_aggregate aggregate;
   struct ow_usb_device *devices;
   struct ow_usb_device *device;
   struct jclient *jclient;
+  struct jclient **jclient_ptrs;
+  int *errors;
+  size_t devices_count;
   int jclient_init_count;
 
-  ow_err_t err = ow_get_usb_device_list (&devices, &jclient_count);
+  ow_err_t err = ow_get_usb_device_list (&devices, &devices_count);
 
   if (err)
     {
       return err;
     }
 
-  jclients = malloc (sizeof (struct jclient) * jclient_count);
+  jclients = malloc (sizeof (struct jclient) * devices_count);
+  jclient_ptrs = malloc (sizeof (struct jclient *) * devices_count);
+  errors = malloc (sizeof (int) * devices_count);
 
   device = devices;
   jclient = jclients;
-  jclient_init_count = 0;
-  for (int i = 0; i < jclient_count; i++, device++)
+  for (int i = 0; i < devices_count; i++, device++, jclient++)
     {
       jclient->bus = device->bus;
       jclient->address = device->address;
@@ -136,18 +146,48 @@ run_all (unsigned int blocks_per_transfer, unsigned int xfr_timeout,
       jclient->xfr_timeout = xfr_timeout;
       jclient->quality = quality;
       jclient->priority = priority;
+      jclient->sched = *sched;
+      jclient->direct = 0;
+      jclient_ptrs[i] = jclient;
+    }
+
+  ow_free_usb_device_list (devices, devices_count);
+
+  jclient_init_all (jclient_ptrs, devices_count, errors);
 
-      if (jclient_init (jclient))
+  //Initialized jclients are moved to the front so that the signal handler only sees those.
+  jclient_init_count = 0;
+  for (int i = 0; i < devices_count; i++)
+    {
+      if (!errors[i])
 	{
-	  continue;
+	  jclients[jclient_init_count] = jclients[i];
+	  jclient_init_count++;
 	}
-
-      jclient_start (jclient);
-      jclient++;
-      jclient_init_count++;
     }
+  jclient_count = jclient_init_count;
 
-  ow_free_usb_device_list (devices, jclient_count);
+  free (jclient_ptrs);
+  free (errors);
+
+  if (aggregated && jclient_init_count)
+    {
+      aggregate.name = AGGREGATE_CLIENT_NAME;
+      aggregate.jclients = jclients;
+      aggregate.count = jclient_init_count;
+      aggregate.priority = priority;
+      aggregate.sched = *sched;
+      jclient_aggregate_start (&aggregate);
+      jclient_aggregate_wait (&aggregate);
+    }
+  else
+    {
+      jclient = jclients;
+      for (int i = 0; i < jclient_init_count; i++, jclient++)
+	{
+	  jclient_start (jclient);
+	}
+    }
 
   jclient = jclients;
   for (int i = 0; i < jclient_init_count; i++, jclient++)
@@ -161,34 +201,106 @@ run_all (unsigned int blocks_per_transfer, unsigned int xfr_timeout,
   return OW_OK;
 }
 
+//The jclient passed as data only holds the parameters.
+static void *
+hotplug_create_jclient (const struct ow_usb_device *device, void *data)
+{
+  struct jclient *params = data;
+  struct jclient *jclient = malloc (sizeof (struct jclient));
+
+  jclient->bus = device->bus;
+  jclient->address = device->address;
+  jclient->blocks_per_transfer = params->blocks_per_transfer;
+  jclient->xfr_timeout = params->xfr_timeout;
+  jclient->quality = params->quality;
+  jclient->priority = params->priority;
+  jclient->sched = params->sched;
+  jclient->direct = 0;
+
+  if (jclient_init (jclient))
+    {
+      free (jclient);
+      return NULL;
+    }
+
+  if (jclient_start (jclient))
+    {
+      jclient_destroy (jclient);
+      free (jclient);
+      return NULL;
+    }
+
+  return jclient;
+}
+
+static void
+hotplug_destroy_jclient (void *instance, uint8_t bus, uint8_t address,
+			 void *data)
+{
+  struct jclient *jclient = instance;
+
+  jclient_stop (jclient);
+  jclient_wait (jclient);
+  jclient_destroy (jclient);
+  free (jclient);
+}
+
+static int
+run_hotplug (unsigned int blocks_per_transfer, unsigned int xfr_timeout,
+	     int quality, int priority, const struct ow_sched *sched)
+{
+  struct hotplug_manager manager;
+  struct jclient params;
+
+  params.blocks_per_transfer = blocks_per_transfer;
+  params.xfr_timeout = xfr_timeout;
+  params.quality = quality;
+  params.priority = priority;
+  params.sched = *sched;
+
+  hotplug_manager_init (&manager, &HOTPLUG_SOURCE_LIBUSB,
+			hotplug_create_jclient, hotplug_destroy_jclient,
+			&params);
+
+  if (hotplug_manager_start (&manager))
+    {
+      hotplug_manager_destroy (&manager);
+      return OW_GENERIC_ERROR;
+    }
+
+  while (!hotplug_exit)
+    {
+      sleep (1);
+    }
+
+  hotplug_manager_stop (&manager);
+  hotplug_manager_destroy (&manager);
+
+  return OW_OK;
+}
+
 int
 main (int argc, char *argv[])
 {
   int opt;
-  int vflg = 0, lflg = 0, dflg = 0, bflg = 0, pflg = 0, tflg = 0, nflg =
-    0, errflg = 0;
+  int vflg = 0, lflg = 0, aflg = 0, Dflg = 0, Hflg = 0, dflg = 0, bflg =
+    0, pflg = 0, tflg = 0, nflg = 0, errflg = 0;
   char *endstr;
   char *device_name = NULL;
   int long_index = 0;
   ow_err_t ow_err;
-  struct sigaction action;
   int device_num = -1;
   int blocks_per_transfer = OW_DEFAULT_BLOCKS;
   int quality = DEFAULT_QUALITY;
   int priority = JCLIENT_DEFAULT_PRIORITY;
   int xfr_timeout = OW_DEFAULT_XFR_TIMEOUT;
+  struct ow_sched sched;
+
+  memset (&sched, 0, sizeof (struct ow_sched));
+
+  set_signal_handler (signal_handler);
 
-  action.sa_handler = signal_handler;
-  sigemptyset (&action.sa_mask);
-  action.sa_flags = 0;
-  sigaction (SIGHUP, &action, NULL);
-  sigaction (SIGINT, &action, NULL);
-  sigaction (SIGTERM, &action, NULL);
-  sigaction (SIGTSTP, &action, NULL);
-  sigaction (SIGUSR1, &action, NULL);
-  sigaction (SIGUSR2, &action, NULL);
-
-  while ((opt = getopt_long (argc, argv, "n:d:q:b:t:p:lvh",
+  while ((opt = getopt_long (argc, argv, "n:d:q:b:t:p:u:m:j:eaDHlvh",
 			     options, &long_index)) != -1)
     {
       switch (opt)
@@ -202,16 +314,7 @@ main (int argc, char *argv[])
 	  dflg++;
 	  break;
 	case 'q':
-	  errno = 0;
-	  quality = (int) strtol (optarg, &endstr, 10);
-	  if (errno || endstr == optarg || *endstr != '\0' || quality > 4
-	      || quality < 0)
-	    {
-	      quality = DEFAULT_QUALITY;
-	      fprintf (stderr,
-		       "Resampling quality value must be in [0..4]. Using value %d...\n",
-		       quality);
-	    }
+	  quality = get_ow_quality_argument (optarg);
 	  break;
 	case 'b':
 	  blocks_per_transfer = get_ow_blocks_per_transfer_argument (optarg);
@@ -233,6 +336,27 @@ main (int argc, char *argv[])
 	    }
 	  pflg++;
 	  break;
+	case 'u':
+	  sched.audio_cpus = get_ow_cpu_list_argument (optarg);
+	  break;
+	case 'm':
+	  sched.midi_cpus = get_ow_cpu_list_argument (optarg);
+	  break;
+	case 'j':
+	  sched.host_cpus = get_ow_cpu_list_argument (optarg);
+	  break;
+	case 'e':
+	  sched.policy = OW_SCHED_POLICY_DEADLINE;
+	  break;
+	case 'a':
+	  aflg++;
+	  break;
+	case 'D':
+	  Dflg++;
+	  break;
+	case 'H':
+	  Hflg++;
+	  break;
 	case 'l':
 	  lflg++;
 	  break;
@@ -287,14 +411,38 @@ main (int argc, char *argv[])
       exit (EXIT_FAILURE);
     }
 
+  if (Dflg && nflg + dflg != 1)
+    {
+      fprintf (stderr, "Direct mode is only available for a single device\n");
+      exit (EXIT_FAILURE);
+    }
+
+  if (Hflg)
+    {
+      if (nflg + dflg || aflg || Dflg)
+	{
+	  fprintf (stderr,
+		   "Hotplug mode is only available for all devices in separate clients\n");
+	  exit (EXIT_FAILURE);
+	}
+      return run_hotplug (blocks_per_transfer, xfr_timeout, quality,
+			  priority, &sched);
+    }
+
   if (nflg + dflg == 0)
     {
-      return run_all (blocks_per_transfer, xfr_timeout, quality, priority);
+      return run_all (blocks_per_transfer, xfr_timeout, quality, priority,
+		      &sched, aflg);
+    }
+  else if (aflg)
+    {
+      fprintf (stderr, "Aggregate mode is only available for all devices\n");
+      exit (EXIT_FAILURE);
     }
   else if (nflg + dflg == 1)
     {
       return run_single (device_num, device_name, blocks_per_transfer,
-			 xfr_timeout, quality, priority);
+			 xfr_timeout, quality, priority, &sched, Dflg);
     }
   else
     {
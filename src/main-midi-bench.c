@@ -0,0 +1,439 @@
+/*
+ *   main-midi-bench.c
+ *   Copyright (C) 2021 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+//Measures the MIDI clock jitter and the MIDI round trip through Overwitch.
+//The input port is connected to the Overwitch MIDI output and the output port to the Overwitch MIDI input.
+//The round trip needs the device to echo the probe notes back, e.g. with a MIDI thru setting.
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <jack/jack.h>
+#include <jack/midiport.h>
+#include <jack/ringbuffer.h>
+#include "../config.h"
+#include "midibench.h"
+#include "utils.h"
+
+#define CLIENT_NAME "overwitch-midi-bench"
+#define DEFAULT_PROBE_CHANNEL 16
+#define DEFAULT_PROBE_PERIOD_MS 100
+#define EVENT_RING_LEN (4096 * sizeof (struct midi_bench_event))
+#define POLL_US 10000
+
+static volatile sig_atomic_t running;
+static jack_client_t *client;
+static jack_port_t *input_port;
+static jack_port_t *output_port;
+static jack_ringbuffer_t *event_ring;
+static uint8_t probe_channel;
+static uint8_t probe_note;
+static jack_nframes_t probe_period;
+static jack_nframes_t next_probe;
+static int probe_started;
+static int ring_overflows;
+
+static struct option options[] = {
+  {"probe-channel", 1, NULL, 'c'},
+  {"probe-period", 1, NULL, 'p'},
+  {"duration", 1, NULL, 't'},
+  {"input-port", 1, NULL, 'i'},
+  {"output-port", 1, NULL, 'o'},
+  {"record", 1, NULL, 'r'},
+  {"replay", 1, NULL, 'R'},
+  {"verbose", 0, NULL, 'v'},
+  {"help", 0, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+static void
+signal_handler (int signum)
+{
+  running = 0;
+}
+
+static void
+push_event (midi_bench_dir_t dir, jack_nframes_t frame, const uint8_t *data,
+	    size_t len)
+{
+  struct midi_bench_event event;
+
+  if (!len || len > sizeof (event.data))
+    {
+      return;
+    }
+
+  event.time = jack_frames_to_time (client, frame);
+  event.dir = dir;
+  event.len = len;
+  memcpy (event.data, data, len);
+
+  if (jack_ringbuffer_write_space (event_ring) >=
+      sizeof (struct midi_bench_event))
+    {
+      jack_ringbuffer_write (event_ring, (void *) &event,
+			     sizeof (struct midi_bench_event));
+    }
+  else
+    {
+      ring_overflows++;
+    }
+}
+
+static void
+send_probes (void *buffer, jack_nframes_t last_frame, jack_nframes_t nframes)
+{
+  int32_t offset;
+  uint8_t on[] = { 0x90 | probe_channel, 0, 0x7f };
+  uint8_t off[] = { 0x80 | probe_channel, 0, 0 };
+
+  if (!probe_started)
+    {
+      next_probe = last_frame;
+      probe_started = 1;
+    }
+
+  while ((offset = (int32_t) (next_probe - last_frame)) < (int32_t) nframes)
+    {
+      offset = offset < 0 ? 0 : offset;
+      on[1] = probe_note;
+      off[1] = probe_note;
+      if (!jack_midi_event_write (buffer, offset, on, sizeof (on)))
+	{
+	  push_event (MIDI_BENCH_OUT, last_frame + offset, on, sizeof (on));
+	  jack_midi_event_write (buffer, offset, off, sizeof (off));
+	}
+      probe_note = (probe_note + 1) % MIDI_BENCH_PROBES;
+      next_probe += probe_period;
+    }
+}
+
+static int
+process_cb (jack_nframes_t nframes, void *arg)
+{
+  jack_midi_event_t event;
+  jack_nframes_t last_frame = jack_last_frame_time (client);
+  void *input = jack_port_get_buffer (input_port, nframes);
+  void *output = jack_port_get_buffer (output_port, nframes);
+  uint32_t count = jack_midi_get_event_count (input);
+
+  jack_midi_clear_buffer (output);
+
+  for (uint32_t i = 0; i < count; i++)
+    {
+      if (!jack_midi_event_get (&event, input, i))
+	{
+	  push_event (MIDI_BENCH_IN, last_frame + event.time, event.buffer,
+		      event.size);
+	}
+    }
+
+  if (probe_period)
+    {
+      send_probes (output, last_frame, nframes);
+    }
+
+  return 0;
+}
+
+static int
+drain_events (struct midi_bench *bench, FILE *record)
+{
+  int err;
+  struct midi_bench_event event;
+
+  while (jack_ringbuffer_read_space (event_ring) >=
+	 sizeof (struct midi_bench_event))
+    {
+      jack_ringbuffer_read (event_ring, (void *) &event,
+			    sizeof (struct midi_bench_event));
+
+      err = midi_bench_process (bench, &event);
+      if (err)
+	{
+	  return err;
+	}
+
+      if (record && midi_bench_write_event (record, &event))
+	{
+	  error_print ("Error while recording event");
+	  return -EIO;
+	}
+    }
+
+  return 0;
+}
+
+static int
+run_replay (struct midi_bench *bench, const char *path)
+{
+  int events;
+  FILE *file = fopen (path, "r");
+
+  if (!file)
+    {
+      error_print ("Error while opening '%s': %s", path, strerror (errno));
+      return EXIT_FAILURE;
+    }
+
+  events = midi_bench_replay (bench, file);
+  fclose (file);
+  if (events < 0)
+    {
+      return EXIT_FAILURE;
+    }
+
+  debug_print (1, "%d events replayed", events);
+  midi_bench_print (bench, stdout);
+
+  return EXIT_SUCCESS;
+}
+
+static int
+run_jack (struct midi_bench *bench, unsigned int probe_period_ms,
+	  unsigned int duration, const char *input_name,
+	  const char *output_name, const char *record_path)
+{
+  struct timespec start, now;
+  FILE *record = NULL;
+  int err = EXIT_FAILURE;
+
+  if (record_path)
+    {
+      record = fopen (record_path, "w");
+      if (!record)
+	{
+	  error_print ("Error while opening '%s': %s", record_path,
+		       strerror (errno));
+	  return EXIT_FAILURE;
+	}
+    }
+
+  client = jack_client_open (CLIENT_NAME, JackNullOption, NULL, NULL);
+  if (!client)
+    {
+      error_print ("Error while opening JACK client");
+      goto close_record;
+    }
+
+  input_port = jack_port_register (client, "MIDI in", JACK_DEFAULT_MIDI_TYPE,
+				   JackPortIsInput, 0);
+  output_port = jack_port_register (client, "MIDI out",
+				    JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput,
+				    0);
+  if (!input_port || !output_port)
+    {
+      error_print ("Error while registering JACK ports");
+      goto close_client;
+    }
+
+  event_ring = jack_ringbuffer_create (EVENT_RING_LEN);
+  jack_ringbuffer_mlock (event_ring);
+
+  probe_period = (uint64_t) probe_period_ms *
+    jack_get_sample_rate (client) / 1000;
+  probe_started = 0;
+  probe_note = 0;
+  ring_overflows = 0;
+
+  if (jack_set_process_callback (client, process_cb, NULL)
+      || jack_activate (client))
+    {
+      error_print ("Error while activating JACK client");
+      goto free_ring;
+    }
+
+  if (input_name && jack_connect (client, input_name,
+				  jack_port_name (input_port)))
+    {
+      error_print ("Error while connecting '%s'", input_name);
+    }
+
+  if (output_name && jack_connect (client, jack_port_name (output_port),
+				   output_name))
+    {
+      error_print ("Error while connecting '%s'", output_name);
+    }
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  running = 1;
+  err = EXIT_SUCCESS;
+  while (running)
+    {
+      usleep (POLL_US);
+
+      if (drain_events (bench, record))
+	{
+	  err = EXIT_FAILURE;
+	  break;
+	}
+
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      if (duration && now.tv_sec - start.tv_sec >= duration)
+	{
+	  break;
+	}
+    }
+
+  jack_deactivate (client);
+
+  if (!err && drain_events (bench, record))
+    {
+      err = EXIT_FAILURE;
+    }
+
+  if (ring_overflows)
+    {
+      error_print ("%d events discarded due to ring overflow",
+		   ring_overflows);
+    }
+
+  midi_bench_print (bench, stdout);
+
+free_ring:
+  jack_ringbuffer_free (event_ring);
+close_client:
+  jack_client_close (client);
+close_record:
+  if (record)
+    {
+      fclose (record);
+    }
+  return err;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int opt;
+  int vflg = 0, errflg = 0;
+  char *endstr;
+  int long_index = 0;
+  struct sigaction action;
+  struct midi_bench bench;
+  long channel = DEFAULT_PROBE_CHANNEL;
+  long probe_period_ms = DEFAULT_PROBE_PERIOD_MS;
+  long duration = 0;
+  char *input_name = NULL;
+  char *output_name = NULL;
+  char *record_path = NULL;
+  char *replay_path = NULL;
+  int err;
+
+  action.sa_handler = signal_handler;
+  sigemptyset (&action.sa_mask);
+  action.sa_flags = 0;
+  sigaction (SIGHUP, &action, NULL);
+  sigaction (SIGINT, &action, NULL);
+  sigaction (SIGTERM, &action, NULL);
+
+  while ((opt = getopt_long (argc, argv, "c:p:t:i:o:r:R:vh",
+			     options, &long_index)) != -1)
+    {
+      switch (opt)
+	{
+	case 'c':
+	  errno = 0;
+	  channel = strtol (optarg, &endstr, 10);
+	  if (errno || endstr == optarg || *endstr != '\0' || channel < 1
+	      || channel > 16)
+	    {
+	      fprintf (stderr, "Probe channel must be in [1..16]\n");
+	      errflg++;
+	    }
+	  break;
+	case 'p':
+	  errno = 0;
+	  probe_period_ms = strtol (optarg, &endstr, 10);
+	  if (errno || endstr == optarg || *endstr != '\0'
+	      || probe_period_ms < 0)
+	    {
+	      fprintf (stderr,
+		       "Probe period must be a number of ms. 0 disables the probes\n");
+	      errflg++;
+	    }
+	  break;
+	case 't':
+	  errno = 0;
+	  duration = strtol (optarg, &endstr, 10);
+	  if (errno || endstr == optarg || *endstr != '\0' || duration < 0)
+	    {
+	      fprintf (stderr, "Duration must be a number of seconds\n");
+	      errflg++;
+	    }
+	  break;
+	case 'i':
+	  input_name = optarg;
+	  break;
+	case 'o':
+	  output_name = optarg;
+	  break;
+	case 'r':
+	  record_path = optarg;
+	  break;
+	case 'R':
+	  replay_path = optarg;
+	  break;
+	case 'v':
+	  vflg++;
+	  break;
+	case 'h':
+	  print_help (argv[0], PACKAGE_STRING, options, NULL);
+	  exit (EXIT_SUCCESS);
+	case '?':
+	  errflg++;
+	}
+    }
+
+  if (errflg > 0)
+    {
+      print_help (argv[0], PACKAGE_STRING, options, NULL);
+      exit (EXIT_FAILURE);
+    }
+
+  if (vflg)
+    {
+      debug_level = vflg;
+    }
+
+  probe_channel = channel - 1;
+  if (midi_bench_init (&bench, probe_channel))
+    {
+      exit (EXIT_FAILURE);
+    }
+
+  if (replay_path)
+    {
+      err = run_replay (&bench, replay_path);
+    }
+  else
+    {
+      err = run_jack (&bench, probe_period_ms, duration, input_name,
+		      output_name, record_path);
+    }
+
+  midi_bench_destroy (&bench);
+
+  return err;
+}
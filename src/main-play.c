@@ -40,6 +40,8 @@ static struct option options[] = {
   {"use-device", 1, NULL, 'd'},
   {"blocks-per-transfer", 1, NULL, 'b'},
   {"usb-transfer-timeout", 1, NULL, 't'},
+  {"usb-cpus", 1, NULL, 'u'},
+  {"sched-deadline", 0, NULL, 'e'},
   {"list-devices", 0, NULL, 'l'},
   {"verbose", 0, NULL, 'v'},
   {"help", 0, NULL, 'h'},
@@ -225,7 +227,7 @@ main (int argc, char *argv[])
   sigaction (SIGUSR1, &action, NULL);
   sigaction (SIGTSTP, &action, NULL);
 
-  while ((opt = getopt_long (argc, argv, "n:d:b:t:lvh",
+  while ((opt = getopt_long (argc, argv, "n:d:b:t:u:elvh",
 			     options, &long_index)) != -1)
     {
       switch (opt)
@@ -246,6 +248,12 @@ main (int argc, char *argv[])
 	  xfr_timeout = get_ow_xfr_timeout_argument (optarg);
 	  tflg++;
 	  break;
+	case 'u':
+	  context.sched.audio_cpus = get_ow_cpu_list_argument (optarg);
+	  break;
+	case 'e':
+	  context.sched.policy = OW_SCHED_POLICY_DEADLINE;
+	  break;
 	case 'l':
 	  lflg++;
 	  break;
@@ -0,0 +1,265 @@
+/*
+ *   main-pw.c
+ *   Copyright (C) 2021 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "../config.h"
+#include "pwclient.h"
+#include "utils.h"
+#include "common.h"
+
+static size_t pwclient_count;
+static struct pwclient *pwclients;
+
+static struct option options[] = {
+  {"use-device-number", 1, NULL, 'n'},
+  {"use-device", 1, NULL, 'd'},
+  {"resampling-quality", 1, NULL, 'q'},
+  {"blocks-per-transfer", 1, NULL, 'b'},
+  {"usb-transfer-timeout", 1, NULL, 't'},
+  {"node-latency", 1, NULL, 'L'},
+  {"list-devices", 0, NULL, 'l'},
+  {"verbose", 0, NULL, 'v'},
+  {"help", 0, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+static void
+signal_handler (int signum)
+{
+  struct pwclient *pwclient = pwclients;
+
+  if (update_debug_level (signum))
+    {
+      return;
+    }
+
+  for (int i = 0; i < pwclient_count; i++, pwclient++)
+    {
+      pwclient_stop (pwclient);
+    }
+}
+
+static int
+run_single (int device_num, const char *device_name,
+	    unsigned int blocks_per_transfer, unsigned int xfr_timeout,
+	    int quality, const char *latency)
+{
+  struct ow_usb_device *device;
+  ow_err_t err = OW_OK;
+
+  if (ow_get_usb_device_from_device_attrs (device_num, device_name, &device))
+    {
+      return OW_GENERIC_ERROR;
+    }
+
+  pwclient_count = 1;
+  pwclients = malloc (sizeof (struct pwclient));
+  pwclients->bus = device->bus;
+  pwclients->address = device->address;
+  pwclients->blocks_per_transfer = blocks_per_transfer;
+  pwclients->xfr_timeout = xfr_timeout;
+  pwclients->quality = quality;
+  pwclients->latency = latency;
+
+  free (device);
+
+  if (pwclient_init (pwclients))
+    {
+      err = OW_GENERIC_ERROR;
+      goto end;
+    }
+
+  pwclient_start (pwclients);
+  pwclient_wait (pwclients);
+  pwclient_destroy (pwclients);
+
+end:
+  free (pwclients);
+  return err;
+}
+
+static int
+run_all (unsigned int blocks_per_transfer, unsigned int xfr_timeout,
+	 int quality, const char *latency)
+{
+  struct ow_usb_device *devices;
+  struct ow_usb_device *device;
+  struct pwclient *pwclient;
+  int pwclient_init_count;
+
+  ow_err_t err = ow_get_usb_device_list (&devices, &pwclient_count);
+
+  if (err)
+    {
+      return err;
+    }
+
+  pwclients = malloc (sizeof (struct pwclient) * pwclient_count);
+
+  device = devices;
+  pwclient = pwclients;
+  pwclient_init_count = 0;
+  for (int i = 0; i < pwclient_count; i++, device++)
+    {
+      pwclient->bus = device->bus;
+      pwclient->address = device->address;
+      pwclient->blocks_per_transfer = blocks_per_transfer;
+      pwclient->xfr_timeout = xfr_timeout;
+      pwclient->quality = quality;
+      pwclient->latency = latency;
+
+      if (pwclient_init (pwclient))
+	{
+	  continue;
+	}
+
+      pwclient_start (pwclient);
+      pwclient++;
+      pwclient_init_count++;
+    }
+
+  ow_free_usb_device_list (devices, pwclient_count);
+
+  pwclient = pwclients;
+  for (int i = 0; i < pwclient_init_count; i++, pwclient++)
+    {
+      pwclient_wait (pwclient);
+      pwclient_destroy (pwclient);
+    }
+
+  free (pwclients);
+
+  return OW_OK;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int opt;
+  int vflg = 0, lflg = 0, dflg = 0, bflg = 0, tflg = 0, nflg = 0, errflg =
+    0;
+  char *endstr;
+  char *device_name = NULL;
+  int long_index = 0;
+  ow_err_t ow_err;
+  int device_num = -1;
+  int blocks_per_transfer = OW_DEFAULT_BLOCKS;
+  int quality = DEFAULT_QUALITY;
+  const char *latency = PWCLIENT_DEFAULT_LATENCY;
+  int xfr_timeout = OW_DEFAULT_XFR_TIMEOUT;
+
+  set_signal_handler (signal_handler);
+
+  while ((opt = getopt_long (argc, argv, "n:d:q:b:t:L:lvh",
+			     options, &long_index)) != -1)
+    {
+      switch (opt)
+	{
+	case 'n':
+	  device_num = (int) strtol (optarg, &endstr, 10);
+	  nflg++;
+	  break;
+	case 'd':
+	  device_name = optarg;
+	  dflg++;
+	  break;
+	case 'q':
+	  quality = get_ow_quality_argument (optarg);
+	  break;
+	case 'b':
+	  blocks_per_transfer = get_ow_blocks_per_transfer_argument (optarg);
+	  bflg++;
+	  break;
+	case 't':
+	  xfr_timeout = get_ow_xfr_timeout_argument (optarg);
+	  tflg++;
+	  break;
+	case 'L':
+	  latency = optarg;
+	  break;
+	case 'l':
+	  lflg++;
+	  break;
+	case 'v':
+	  vflg++;
+	  break;
+	case 'h':
+	  print_help (argv[0], PACKAGE_STRING, options, NULL);
+	  exit (EXIT_SUCCESS);
+	case '?':
+	  errflg++;
+	}
+    }
+
+  if (errflg > 0)
+    {
+      print_help (argv[0], PACKAGE_STRING, options, NULL);
+      exit (EXIT_FAILURE);
+    }
+
+  if (vflg)
+    {
+      debug_level = vflg;
+    }
+
+  if (lflg)
+    {
+      ow_err = print_devices ();
+      if (ow_err)
+	{
+	  fprintf (stderr, "USB error: %s\n", ow_get_err_str (ow_err));
+	  exit (EXIT_FAILURE);
+	}
+      exit (EXIT_SUCCESS);
+    }
+
+  if (bflg > 1)
+    {
+      fprintf (stderr, "Undetermined blocks\n");
+      exit (EXIT_FAILURE);
+    }
+
+  if (tflg > 1)
+    {
+      fprintf (stderr, "Undetermined timeout\n");
+      exit (EXIT_FAILURE);
+    }
+
+  if (nflg + dflg > 1)
+    {
+      fprintf (stderr, "Device not provided properly\n");
+      exit (EXIT_FAILURE);
+    }
+
+  pw_init (&argc, &argv);
+
+  if (nflg + dflg == 0)
+    {
+      ow_err = run_all (blocks_per_transfer, xfr_timeout, quality, latency);
+    }
+  else
+    {
+      ow_err = run_single (device_num, device_name, blocks_per_transfer,
+			   xfr_timeout, quality, latency);
+    }
+
+  pw_deinit ();
+
+  return ow_err;
+}
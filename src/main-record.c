@@ -22,23 +22,25 @@
 #include <sndfile.h>
 #include <unistd.h>
 #include <time.h>
+#include <poll.h>
+#include <ctype.h>
 #include "../config.h"
 #include "utils.h"
 #include "common.h"
+#include "dll.h"
+#include "capture.h"
 
 #define TRACK_BUF_KB 256
-#define MAX_FILENAME_LEN 64
-
-static struct ow_context context;
-static struct ow_engine *engine;
-static SF_INFO sfinfo;
-static SNDFILE *sf;
-static const struct ow_device_desc *desc;
-static const char *track_mask;
-static size_t track_buf_size_kb = TRACK_BUF_KB;
-static float max[OB_MAX_TRACKS];
-static float min[OB_MAX_TRACKS];
-static char filename[MAX_FILENAME_LEN];
+#define MAX_FILENAME_LEN 128
+#define MAX_DEVICES 8
+#define SETTLE_TIME_US 4000000	//Time for the DLLs to lock before the common start
+#define START_DELAY_US 100000
+#define STOP_TIMEOUT_US 1000000
+#define POLL_US 10000
+#define MAX_RETRO_MINUTES 60
+#define RETRO_MARGIN_S 2	//Head start of the writer over the overwritten frames
+#define RETRO_CHUNK_FRAMES 4800
+#define MAX_STEM_FORMATS OB_MAX_TRACKS
 
 typedef enum
 {
@@ -47,19 +49,118 @@ typedef enum
   READY
 } buffer_status_t;
 
-static struct
+//The USB thread waits for the start frame, records and stops at the end frame.
+typedef enum
+{
+  RECORDER_WAIT,
+  RECORDER_RUN,
+  RECORDER_DONE
+} recorder_status_t;
+
+struct buffer
 {
   char *mem;
   char *disk;
   size_t len;
+  size_t pos;
   pthread_t pthread;
   size_t disk_samples;
   size_t disk_frames;
   pthread_spinlock_t lock;
   buffer_status_t status;
   int outputs;
-  int outputs_mask_len;
-} buffer;
+  uint64_t generation;		//Disk buffers handed over
+  int pending;			//Stem writers still writing the disk buffer
+  uint64_t overruns;
+};
+
+struct stem_format
+{
+  const char *name;
+  const char *extension;
+  int format;
+};
+
+//Mono file of a recorded track.
+struct stem
+{
+  SNDFILE *sf;
+  char filename[MAX_FILENAME_LEN];
+  const struct stem_format *format;
+};
+
+//Every writer deinterleaves and encodes the tracks i, i + writers, i + 2 * writers...
+struct stem_writer
+{
+  pthread_t thread;
+  struct recorder *recorder;
+  int index;
+  float *mono;
+  uint64_t generation;
+  uint64_t samples;
+  uint64_t busy;		//us
+};
+
+struct recorder
+{
+  int device_num;
+  const char *device_name;
+  struct ow_context context;
+  struct ow_engine *engine;
+  const struct ow_device_desc *desc;
+  SF_INFO sfinfo;
+  SNDFILE *sf;
+  char filename[MAX_FILENAME_LEN];
+  float max[OB_MAX_TRACKS];
+  float min[OB_MAX_TRACKS];
+  struct buffer buffer;
+  //Overbridge side of the DLL against the common host clock
+  struct ow_dll dll;
+  uint32_t dll_frames;
+  uint64_t received;
+  uint64_t start_frame;
+  uint64_t end_frame;
+  recorder_status_t status;
+  int print_control;
+  //Retroactive mode
+  struct capture capture;
+  float *capture_chunk;
+  uint64_t capture_mask;
+  uint64_t flush_time;
+  uint64_t flush_end;
+  //Stem mode
+  struct stem stems[OB_MAX_TRACKS];
+  struct stem_writer *writers;
+  int writer_count;
+};
+
+static struct recorder recorders[MAX_DEVICES];
+static int recorder_count;
+static const char *track_mask;
+static int outputs_mask_len;
+static size_t track_buf_size_kb = TRACK_BUF_KB;
+static uint64_t dump_cpus;
+static uint64_t start_time;
+static uint64_t end_time;
+static volatile sig_atomic_t stop_requested;
+static volatile sig_atomic_t flush_requested;
+static volatile sig_atomic_t status_requested;
+static int retro_minutes;
+static uint64_t flush_time;
+static char flush_time_string[MAX_FILENAME_LEN >> 1];
+static int stems_enabled;
+static int stem_writers;
+static const struct stem_format *stem_formats[MAX_STEM_FORMATS];
+static int stem_format_count;
+
+static const struct stem_format STEM_FORMATS[] = {
+  {"wav", "wav", SF_FORMAT_WAV | SF_FORMAT_FLOAT},
+  {"wav24", "wav", SF_FORMAT_WAV | SF_FORMAT_PCM_24},
+  {"wav16", "wav", SF_FORMAT_WAV | SF_FORMAT_PCM_16},
+  {"flac", "flac", SF_FORMAT_FLAC | SF_FORMAT_PCM_24},
+  {"flac16", "flac", SF_FORMAT_FLAC | SF_FORMAT_PCM_16},
+  {NULL, NULL, 0}
+};
 
 static struct option options[] = {
   {"use-device-number", 1, NULL, 'n'},
@@ -68,33 +169,73 @@ static struct option options[] = {
   {"track-buffer-size-kilobytes", 1, NULL, 's'},
   {"blocks-per-transfer", 1, NULL, 'b'},
   {"usb-transfer-timeout", 1, NULL, 't'},
+  {"usb-cpus", 1, NULL, 'u'},
+  {"dump-cpus", 1, NULL, 'c'},
+  {"retroactive-minutes", 1, NULL, 'r'},
+  {"stems", 0, NULL, 'S'},
+  {"stem-formats", 1, NULL, 'f'},
+  {"stem-writers", 1, NULL, 'w'},
+  {"sched-deadline", 0, NULL, 'e'},
   {"list-devices", 0, NULL, 'l'},
   {"verbose", 0, NULL, 'v'},
   {"help", 0, NULL, 'h'},
   {NULL, 0, NULL, 0}
 };
 
-static void
-print_status ()
+//Common host clock for all the devices.
+static uint64_t
+get_time ()
 {
-  fprintf (stderr, "%lu frames written\n", sfinfo.frames);
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-static size_t
-buffer_dummy_rw_space (void *data)
+static inline int
+is_track_recorded (int track)
 {
-  return OW_DEFAULT_BLOCKS * OB_FRAMES_PER_BLOCK * OB_MAX_TRACKS *
-    OB_BYTES_PER_SAMPLE;
+  return !track_mask || (track < outputs_mask_len
+			 && track_mask[track] != '0');
+}
+
+static void
+print_status ()
+{
+  struct recorder *r = recorders;
+
+  for (int i = 0; i < recorder_count && r->desc; i++, r++)
+    {
+      if (!retro_minutes)
+	{
+	  fprintf (stderr, "%s: %lu frames written\n", r->desc->name,
+		   r->sfinfo.frames);
+	}
+
+      if (!debug_level)
+	{
+	  continue;
+	}
+
+      for (int j = 0; j < r->desc->outputs; j++)
+	{
+	  if (is_track_recorded (j))
+	    {
+	      fprintf (stderr, "%s: %s: max: %f; min: %f\n",
+		       r->desc->name, r->desc->output_track_names[j],
+		       r->max[j], r->min[j]);
+	    }
+	}
+    }
 }
 
 static buffer_status_t
-get_buffer_status ()
+get_buffer_status (struct buffer *buffer)
 {
   buffer_status_t status;
 
-  pthread_spin_lock (&buffer.lock);
-  status = buffer.status;
-  pthread_spin_unlock (&buffer.lock);
+  pthread_spin_lock (&buffer->lock);
+  status = buffer->status;
+  pthread_spin_unlock (&buffer->lock);
 
   return status;
 }
@@ -102,233 +243,1035 @@ get_buffer_status ()
 static void *
 dump_buffer (void *data)
 {
-  buffer_status_t status = get_buffer_status ();
+  size_t samples;
+  struct recorder *r = data;
+  struct buffer *buffer = &r->buffer;
+  buffer_status_t status = get_buffer_status (buffer);
   while (status >= EMPTY)
     {
       if (status == READY)
 	{
-	  pthread_spin_lock (&buffer.lock);
+	  //The USB thread does not touch the disk buffer until it is empty again.
+	  pthread_spin_lock (&buffer->lock);
+	  samples = buffer->disk_samples;
+	  pthread_spin_unlock (&buffer->lock);
+
 	  debug_print (2, "Writing %ld frames to disk...",
-		       buffer.disk_frames);
-	  sf_write_float (sf, (float *) buffer.disk, buffer.disk_samples);
+		       samples / buffer->outputs);
+	  sf_write_float (r->sf, (float *) buffer->disk, samples);
 	  debug_print (2, "Done");
 
-	  buffer.status = EMPTY;
-	  pthread_spin_unlock (&buffer.lock);
+	  pthread_spin_lock (&buffer->lock);
+	  buffer->status = EMPTY;
+	  pthread_spin_unlock (&buffer->lock);
 	}
 
       usleep (100);
 
-      status = get_buffer_status ();
+      status = get_buffer_status (buffer);
     }
   return NULL;
 }
 
-static size_t
-buffer_write (void *data, const char *buf, size_t size)
+static void
+get_filename (struct recorder *r, char *filename, const char *time_string,
+	      const char *suffix, const char *extension)
+{
+  if (recorder_count > 1)
+    {
+      snprintf (filename, MAX_FILENAME_LEN, "%s_%s%s_%ld.%s",
+		r->desc->name, time_string, suffix, r - recorders, extension);
+    }
+  else
+    {
+      snprintf (filename, MAX_FILENAME_LEN, "%s_%s%s.%s", r->desc->name,
+		time_string, suffix, extension);
+    }
+}
+
+//Deinterleaves and writes every given track.
+static void
+write_stems (struct recorder *r, const float *data, size_t frames,
+	     int first, int step, float *mono)
+{
+  int channels = r->buffer.outputs;
+
+  for (int i = first; i < channels; i += step)
+    {
+      const float *src = data + i;
+      for (size_t j = 0; j < frames; j++, src += channels)
+	{
+	  mono[j] = *src;
+	}
+      sf_writef_float (r->stems[i].sf, mono, frames);
+    }
+}
+
+//The buffer lock is not held while writing so the USB thread never waits for the encoders.
+static void *
+dump_stems (void *data)
+{
+  uint64_t generation, start;
+  buffer_status_t status;
+  size_t frames;
+  struct stem_writer *w = data;
+  struct recorder *r = w->recorder;
+  struct buffer *buffer = &r->buffer;
+
+  while (1)
+    {
+      pthread_spin_lock (&buffer->lock);
+      status = buffer->status;
+      generation = buffer->generation;
+      frames = buffer->disk_frames;
+      pthread_spin_unlock (&buffer->lock);
+
+      if (status == END)
+	{
+	  break;
+	}
+
+      if (status == READY && generation != w->generation)
+	{
+	  start = get_time ();
+	  write_stems (r, (float *) buffer->disk, frames, w->index,
+		       r->writer_count, w->mono);
+	  w->busy += get_time () - start;
+	  w->samples += frames * ((r->buffer.outputs - w->index - 1) /
+				  r->writer_count + 1);
+	  w->generation = generation;
+
+	  if (!__atomic_sub_fetch (&buffer->pending, 1, __ATOMIC_ACQ_REL))
+	    {
+	      pthread_spin_lock (&buffer->lock);
+	      buffer->status = EMPTY;
+	      pthread_spin_unlock (&buffer->lock);
+	    }
+	}
+
+      usleep (100);
+    }
+
+  return NULL;
+}
+
+static void
+print_stem_writers (struct recorder *r)
+{
+  double recorded = r->sfinfo.frames / (double) OB_SAMPLE_RATE;
+  struct stem_writer *w = r->writers;
+
+  for (int i = 0; i < r->writer_count; i++, w++)
+    {
+      fprintf (stderr,
+	       "%s: writer %d: %lu samples; %.3f s busy; %.1f%% load\n",
+	       r->desc->name, i, w->samples, w->busy / 1e6,
+	       recorded > 0 ? w->busy / 1e4 / recorded : 0);
+    }
+
+  if (r->buffer.overruns)
+    {
+      error_print
+	("%s: %lu buffers lost as the writers could not keep up",
+	 r->desc->name, r->buffer.overruns);
+    }
+}
+
+//Writes the last minutes up to the given end while the USB thread keeps writing the ring.
+static void
+flush_capture (struct recorder *r, uint64_t end, float *chunk)
+{
+  SF_INFO sfinfo;
+  SNDFILE *sf;
+  uint32_t len;
+  char filename[MAX_FILENAME_LEN];
+  uint64_t window = retro_minutes * 60ULL * OB_SAMPLE_RATE;
+  uint64_t pos = end > window ? end - window : 0;
+  uint64_t lost = 0, written = 0;
+
+  get_filename (r, filename, flush_time_string, "_retro", "wav");
+
+  sfinfo.samplerate = OB_SAMPLE_RATE;
+  sfinfo.channels = r->buffer.outputs;
+  sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+  sf = sf_open (filename, SFM_WRITE, &sfinfo);
+  if (!sf)
+    {
+      error_print ("Could not create %s: %s", filename, sf_strerror (NULL));
+      return;
+    }
+
+  while (pos < end)
+    {
+      len = capture_read (&r->capture, &pos, chunk,
+			  end - pos < RETRO_CHUNK_FRAMES ? end - pos :
+			  RETRO_CHUNK_FRAMES, &lost);
+      if (!len)
+	{
+	  break;
+	}
+
+      if (pos > end)
+	{
+	  len -= pos - end;
+	  pos = end;
+	}
+
+      sf_writef_float (sf, chunk, len);
+      written += len;
+    }
+
+  sf_close (sf);
+
+  if (lost)
+    {
+      error_print ("%s: %lu frames were overwritten before being flushed",
+		   r->desc->name, lost);
+    }
+  fprintf (stderr, "%s: %lu frames flushed to %s\n", r->desc->name, written,
+	   filename);
+}
+
+static void *
+dump_capture (void *data)
+{
+  uint64_t end;
+  uint64_t flushed = 0;
+  struct recorder *r = data;
+
+  while (get_buffer_status (&r->buffer) >= EMPTY)
+    {
+      end = __atomic_load_n (&r->flush_end, __ATOMIC_ACQUIRE);
+      if (end != flushed)
+	{
+	  flush_capture (r, end, r->capture_chunk);
+	  flushed = end;
+	}
+
+      usleep (POLL_US);
+    }
+
+  return NULL;
+}
+
+static void
+record_frames (struct recorder *r, const float *o2h, uint32_t frames)
 {
-  static int print_control = 0;
-  static size_t pos = 0;
   size_t new_pos;
   void *dst;
-  size_t frames = size / (desc->outputs * OB_BYTES_PER_SAMPLE);
+  struct buffer *buffer = &r->buffer;
+  const char *buf = (const char *) o2h;
 
-  debug_print (2, "Writing %ld bytes (%ld frames) to buffer...", size,
-	       frames);
-  new_pos = pos + frames * buffer.outputs * OB_BYTES_PER_SAMPLE;
-  if (new_pos >= buffer.len)
+  debug_print (2, "Writing %d frames to buffer...", frames);
+  new_pos = buffer->pos + frames * buffer->outputs * OB_BYTES_PER_SAMPLE;
+  if (new_pos >= buffer->len)
     {
-      pthread_spin_lock (&buffer.lock);
-      buffer.status = READY;
-      buffer.disk_samples = pos / OB_BYTES_PER_SAMPLE;
-      buffer.disk_frames = buffer.disk_samples / buffer.outputs;
-      memcpy (buffer.disk, buffer.mem,
-	      buffer.disk_frames * buffer.outputs * OB_BYTES_PER_SAMPLE);
-      pthread_spin_unlock (&buffer.lock);
-      sfinfo.frames += buffer.disk_frames;
-      pos = 0;
+      pthread_spin_lock (&buffer->lock);
+      if (buffer->status == READY)
+	{
+	  //The writers are behind so the buffer is lost instead of waiting for them.
+	  buffer->overruns++;
+	}
+      else
+	{
+	  buffer->status = READY;
+	  buffer->disk_samples = buffer->pos / OB_BYTES_PER_SAMPLE;
+	  buffer->disk_frames = buffer->disk_samples / buffer->outputs;
+	  memcpy (buffer->disk, buffer->mem,
+		  buffer->disk_frames * buffer->outputs *
+		  OB_BYTES_PER_SAMPLE);
+	  buffer->generation++;
+	  buffer->pending = r->writer_count;
+	  r->sfinfo.frames += buffer->disk_frames;
+	}
+      pthread_spin_unlock (&buffer->lock);
+      buffer->pos = 0;
     }
 
-  dst = &buffer.mem[pos];
+  dst = &buffer->mem[buffer->pos];
   for (int i = 0; i < frames; i++)
     {
-      for (int j = 0; j < desc->outputs; j++)
+      for (int j = 0; j < r->desc->outputs; j++)
 	{
-	  if (!track_mask
-	      || (j < buffer.outputs_mask_len && (track_mask[j] != '0')))
+	  if (is_track_recorded (j))
 	    {
 	      memcpy (dst, buf, OB_BYTES_PER_SAMPLE);
 	      dst += OB_BYTES_PER_SAMPLE;
-	      pos += OB_BYTES_PER_SAMPLE;
+	      buffer->pos += OB_BYTES_PER_SAMPLE;
 	      float x = *((float *) buf);
 	      if (x >= 0.0)
 		{
-		  if (x > max[j])
+		  if (x > r->max[j])
 		    {
-		      max[j] = x;
+		      r->max[j] = x;
 		    }
 		}
 	      else
 		{
-		  if (x < min[j])
+		  if (x < r->min[j])
 		    {
-		      min[j] = x;
+		      r->min[j] = x;
 		    }
 		}
 	    }
 	  buf += OB_BYTES_PER_SAMPLE;
 	}
     }
+}
+
+//The ring is always fed. The end of a flush is set here as the DLL is updated in this thread.
+static void
+retro_process (struct recorder *r, const float *o2h, uint32_t frames)
+{
+  uint64_t end;
+  uint64_t t = __atomic_load_n (&flush_time, __ATOMIC_ACQUIRE);
+
+  capture_write (&r->capture, o2h, r->desc->outputs, r->capture_mask,
+		 frames);
+
+  if (t != r->flush_time)
+    {
+      r->flush_time = t;
+      end = ow_dll_overbridge_get_abs_frame (&r->dll, r->received, t);
+      __atomic_store_n (&r->flush_end, end < r->received ? end : r->received,
+			__ATOMIC_RELEASE);
+    }
+}
+
+//Called from the USB thread with every transfer.
+//The frames of every transfer are timestamped with the DLL so that all the devices start and end at the same host time without resampling.
+static void
+record_process (void *data, const float *o2h, float *h2o, uint32_t frames)
+{
+  uint64_t first, last, t;
+  struct recorder *r = data;
+  uint64_t now = get_time ();
+  uint64_t period = frames * 1000000ULL / OB_SAMPLE_RATE;
+
+  if (frames != r->dll_frames)
+    {
+      ow_dll_overbridge_init (&r->dll, OB_SAMPLE_RATE, frames);
+      r->dll_frames = frames;
+    }
+  ow_dll_overbridge_update (&r->dll, frames, now);
+
+  first = r->received;
+  r->received += frames;
+
+  if (retro_minutes)
+    {
+      retro_process (r, o2h, frames);
+      return;
+    }
+
+  if (r->status == RECORDER_WAIT)
+    {
+      t = __atomic_load_n (&start_time, __ATOMIC_ACQUIRE);
+      if (!t || now + period < t)
+	{
+	  return;
+	}
+      r->start_frame = ow_dll_overbridge_get_abs_frame (&r->dll,
+							r->received, t);
+      debug_print (1, "%s: Starting at frame %lu", r->desc->name,
+		   r->start_frame);
+      __atomic_store_n (&r->status, RECORDER_RUN, __ATOMIC_RELEASE);
+    }
+
+  if (r->status == RECORDER_DONE)
+    {
+      return;
+    }
+
+  t = __atomic_load_n (&end_time, __ATOMIC_ACQUIRE);
+  if (t && now + period >= t && r->end_frame == UINT64_MAX)
+    {
+      r->end_frame = ow_dll_overbridge_get_abs_frame (&r->dll, r->received,
+						      t);
+      debug_print (1, "%s: Ending at frame %lu", r->desc->name,
+		   r->end_frame);
+    }
+
+  last = r->received < r->end_frame ? r->received : r->end_frame;
+  if (first < r->start_frame)
+    {
+      o2h += (r->start_frame - first) * r->desc->outputs;
+      first = r->start_frame;
+    }
+
+  if (last > first)
+    {
+      record_frames (r, o2h, last - first);
+    }
+
+  if (r->received >= r->end_frame)
+    {
+      __atomic_store_n (&r->status, RECORDER_DONE, __ATOMIC_RELEASE);
+    }
 
   if (debug_level)
     {
-      print_control += frames;
-      if (print_control >= OB_SAMPLE_RATE)
+      r->print_control += frames;
+      if (r->print_control >= OB_SAMPLE_RATE)
+	{
+	  r->print_control -= OB_SAMPLE_RATE;
+	  fprintf (stderr, "%s: %lu frames written\n", r->desc->name,
+		   r->sfinfo.frames);
+	}
+    }
+}
+
+//Only flags are set here. The work is done in wait_recorders.
+static void
+signal_handler (int signo)
+{
+  status_requested = 1;
+  if (signo == SIGUSR1 && retro_minutes)
+    {
+      flush_requested = 1;
+    }
+  if (signo == SIGHUP || signo == SIGINT || signo == SIGTERM
+      || signo == SIGTSTP)
+    {
+      stop_requested = 1;
+    }
+}
+
+static int
+recorders_running ()
+{
+  struct recorder *r = recorders;
+  for (int i = 0; i < recorder_count; i++, r++)
+    {
+      if (ow_engine_get_status (r->engine) <= OW_ENGINE_STATUS_STOP)
+	{
+	  return 0;
+	}
+    }
+  return 1;
+}
+
+static int
+recorders_done ()
+{
+  struct recorder *r = recorders;
+  for (int i = 0; i < recorder_count; i++, r++)
+    {
+      if (__atomic_load_n (&r->status, __ATOMIC_ACQUIRE) != RECORDER_DONE)
+	{
+	  return 0;
+	}
+    }
+  return 1;
+}
+
+static void
+request_flush ()
+{
+  struct tm tm;
+  time_t curr_time = time (NULL);
+
+  localtime_r (&curr_time, &tm);
+  strftime (flush_time_string, MAX_FILENAME_LEN >> 1, "%FT%T", &tm);
+  fprintf (stderr, "Flushing the last %d minutes...\n", retro_minutes);
+  __atomic_store_n (&flush_time, get_time (), __ATOMIC_RELEASE);
+}
+
+//In retroactive mode, every line read from the standard input flushes the ring.
+static void
+poll_commands (int *stdin_open)
+{
+  char buf[MAX_FILENAME_LEN];
+  ssize_t len;
+  struct pollfd pfd = {.fd = STDIN_FILENO,.events = POLLIN };
+
+  if (!*stdin_open)
+    {
+      usleep (POLL_US);
+      return;
+    }
+
+  if (poll (&pfd, 1, POLL_US / 1000) <= 0)
+    {
+      return;
+    }
+
+  len = read (STDIN_FILENO, buf, sizeof (buf));
+  if (len <= 0)
+    {
+      *stdin_open = 0;
+      return;
+    }
+
+  if (memchr (buf, '\n', len))
+    {
+      request_flush ();
+    }
+}
+
+//Sleeps unless a stop is requested or a device stops. Returns 1 in that case.
+static int
+wait_recorders (uint64_t us)
+{
+  int stdin_open = retro_minutes;
+
+  for (uint64_t t = 0; t < us; t += POLL_US)
+    {
+      if (status_requested)
 	{
-	  print_control -= OB_SAMPLE_RATE;
+	  status_requested = 0;
 	  print_status ();
 	}
+
+      if (stop_requested || !recorders_running ())
+	{
+	  return 1;
+	}
+
+      if (flush_requested)
+	{
+	  flush_requested = 0;
+	  request_flush ();
+	}
+
+      poll_commands (&stdin_open);
     }
+  return 0;
+}
 
-  return size;
+//As there is no resampling, the files cover the same host time with as many frames as every device clock ran.
+static void
+print_drift_report ()
+{
+  struct recorder *r = recorders;
+  uint64_t duration = end_time - start_time;
+  double expected = duration * (double) OB_SAMPLE_RATE / 1e6;
+  double ref_rate = 0;
+
+  if (end_time <= start_time)
+    {
+      return;
+    }
+
+  fprintf (stderr, "Recorded %.3f s of host time\n", duration / 1e6);
+  for (int i = 0; i < recorder_count; i++, r++)
+    {
+      uint64_t frames = r->end_frame - r->start_frame;
+      double rate = frames * 1e6 / duration;
+      if (i == 0)
+	{
+	  ref_rate = rate;
+	}
+      fprintf (stderr,
+	       "%s: %lu frames; %.3f Hz; %+.1f ppm (%+.0f frames) against nominal; %+.1f ppm against %s\n",
+	       r->desc->name, frames, rate, (frames / expected - 1) * 1e6,
+	       frames - expected, (rate / ref_rate - 1) * 1e6,
+	       recorders->desc->name);
+    }
 }
 
 static void
-signal_handler (int signo)
+flush_buffer (struct recorder *r)
 {
-  print_status ();
-  if (debug_level)
+  struct buffer *buffer = &r->buffer;
+  size_t samples = buffer->pos / OB_BYTES_PER_SAMPLE;
+
+  if (stems_enabled)
     {
-      for (int i = 0; i < desc->outputs; i++)
+      write_stems (r, (float *) buffer->mem, samples / buffer->outputs, 0,
+		   1, r->writers->mono);
+    }
+  else
+    {
+      sf_write_float (r->sf, (float *) buffer->mem, samples);
+    }
+  r->sfinfo.frames += samples / buffer->outputs;
+  buffer->pos = 0;
+}
+
+//Track names are part of the file names.
+static ow_err_t
+recorder_init_stems (struct recorder *r, const char *time_string)
+{
+  SF_INFO sfinfo;
+  struct stem *stem = r->stems;
+  char suffix[MAX_FILENAME_LEN];
+  long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+  for (int i = 0; i < r->desc->outputs; i++)
+    {
+      if (!is_track_recorded (i))
+	{
+	  continue;
+	}
+
+      stem->format = stem_formats[stem - r->stems < stem_format_count ?
+				  stem - r->stems : stem_format_count - 1];
+
+      snprintf (suffix, MAX_FILENAME_LEN, "_%s",
+		r->desc->output_track_names[i]);
+      for (char *c = suffix; *c; c++)
 	{
-	  if (!track_mask
-	      || (i < buffer.outputs_mask_len && (track_mask[i] != '0')))
+	  if (!isalnum ((unsigned char) *c) && *c != '-')
 	    {
-	      fprintf (stderr, "%s: max: %f; min: %f\n",
-		       desc->output_track_names[i], max[i], min[i]);
+	      *c = '_';
 	    }
 	}
+      get_filename (r, stem->filename, time_string, suffix,
+		    stem->format->extension);
+
+      sfinfo.samplerate = OB_SAMPLE_RATE;
+      sfinfo.channels = 1;
+      sfinfo.format = stem->format->format;
+      debug_print (1, "Creating stem %s (%s)...", stem->filename,
+		   stem->format->name);
+      stem->sf = sf_open (stem->filename, SFM_WRITE, &sfinfo);
+      if (!stem->sf)
+	{
+	  error_print ("Could not create %s: %s", stem->filename,
+		       sf_strerror (NULL));
+	  goto error;
+	}
+
+      stem++;
     }
-  if (signo == SIGHUP || signo == SIGINT || signo == SIGTERM
-      || signo == SIGTSTP)
+
+  r->writer_count = stem_writers ? stem_writers : cpus > 0 ? cpus : 1;
+  if (r->writer_count > r->buffer.outputs)
+    {
+      r->writer_count = r->buffer.outputs;
+    }
+
+  r->writers = calloc (r->writer_count, sizeof (struct stem_writer));
+  for (int i = 0; i < r->writer_count; i++)
     {
-      ow_engine_stop (engine);
-      fprintf (stderr, "%s file created\n", filename);
+      r->writers[i].recorder = r;
+      r->writers[i].index = i;
+      r->writers[i].mono = malloc (sizeof (float) * track_buf_size_kb *
+				   1000);
     }
+
+  debug_print (1, "Writing %d stems with %d writers...", r->buffer.outputs,
+	       r->writer_count);
+
+  return OW_OK;
+
+error:
+  while (stem > r->stems)
+    {
+      stem--;
+      sf_close (stem->sf);
+      stem->sf = NULL;
+    }
+  return OW_GENERIC_ERROR;
 }
 
-static int
-run_record (int device_num, const char *device_name,
-	    unsigned int blocks_per_transfer, unsigned int xfr_timeout)
+static ow_err_t
+recorder_init (struct recorder *r, unsigned int blocks_per_transfer,
+	       unsigned int xfr_timeout, const char *time_string)
 {
-  char curr_time_string[MAX_FILENAME_LEN >> 1];
-  time_t curr_time;
-  struct tm tm;
   ow_err_t err;
   struct ow_usb_device *device;
+  struct ow_sched sched = r->context.sched;
 
-  if (ow_get_usb_device_from_device_attrs (device_num, device_name, &device))
+  if (ow_get_usb_device_from_device_attrs (r->device_num, r->device_name,
+					   &device))
     {
       return OW_GENERIC_ERROR;
     }
 
-  err = ow_engine_init_from_bus_address (&engine, device->bus,
+  err = ow_engine_init_from_bus_address (&r->engine, device->bus,
 					 device->address, blocks_per_transfer,
 					 xfr_timeout);
   free (device);
   if (err)
     {
-      goto end;
+      return err;
     }
 
-  desc = ow_engine_get_device_desc (engine);
+  r->desc = ow_engine_get_device_desc (r->engine);
+
+  r->buffer.outputs = 0;
+  for (int i = 0; i < r->desc->outputs; i++)
+    {
+      if (is_track_recorded (i))
+	{
+	  r->buffer.outputs++;
+	}
+    }
 
-  if (track_mask)
+  if (r->buffer.outputs == 0)
     {
-      buffer.outputs = 0;
-      const char *c = track_mask;
-      for (int i = 0; i < strlen (track_mask); i++, c++)
+      err = OW_GENERIC_ERROR;
+      goto cleanup_engine;
+    }
+
+  if (retro_minutes)
+    {
+      r->capture_mask = 0;
+      for (int i = 0; i < r->desc->outputs; i++)
+	{
+	  r->capture_mask |= (uint64_t) is_track_recorded (i) << i;
+	}
+      r->flush_time = 0;
+      r->flush_end = 0;
+      r->sf = NULL;
+      r->buffer.mem = NULL;
+      r->buffer.disk = NULL;
+
+      if (capture_init (&r->capture, r->buffer.outputs,
+			(retro_minutes * 60ULL + RETRO_MARGIN_S) *
+			OB_SAMPLE_RATE))
+	{
+	  err = OW_GENERIC_ERROR;
+	  goto cleanup_engine;
+	}
+
+      r->capture_chunk = malloc (sizeof (float) * r->buffer.outputs *
+				 RETRO_CHUNK_FRAMES);
+      if (!r->capture_chunk)
+	{
+	  error_print ("Could not allocate the flush buffer");
+	  capture_destroy (&r->capture);
+	  err = OW_GENERIC_ERROR;
+	  goto cleanup_engine;
+	}
+    }
+  else
+    {
+      r->capture_chunk = NULL;
+      r->sfinfo.frames = 0;
+      r->sfinfo.samplerate = OB_SAMPLE_RATE;
+      r->sfinfo.channels = r->buffer.outputs;
+      r->sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+
+      if (stems_enabled)
 	{
-	  if (*c != '0')
+	  r->sf = NULL;
+	  err = recorder_init_stems (r, time_string);
+	  if (err)
 	    {
-	      buffer.outputs++;
+	      goto cleanup_engine;
 	    }
 	}
+      else
+	{
+	  get_filename (r, r->filename, time_string, "", "wav");
+	  debug_print (1, "Creating sample (%d channels)...",
+		       r->buffer.outputs);
+	  r->sf = sf_open (r->filename, SFM_WRITE, &r->sfinfo);
+	  if (!r->sf)
+	    {
+	      error_print ("Could not create %s: %s", r->filename,
+			   sf_strerror (NULL));
+	      err = OW_GENERIC_ERROR;
+	      goto cleanup_engine;
+	    }
+	}
+
+      r->buffer.len = track_buf_size_kb * 1000 * r->buffer.outputs;
+      r->buffer.mem = malloc (r->buffer.len * OB_BYTES_PER_SAMPLE);
+      r->buffer.disk = malloc (r->buffer.len * OB_BYTES_PER_SAMPLE);
+    }
+
+  r->buffer.pos = 0;
+  r->buffer.status = EMPTY;
+  r->buffer.generation = 0;
+  r->buffer.pending = 0;
+  r->buffer.overruns = 0;
+  pthread_spin_init (&r->buffer.lock, PTHREAD_PROCESS_SHARED);
+
+  for (int i = 0; i < r->desc->outputs; i++)
+    {
+      r->max[i] = 0.0f;
+      r->min[i] = 0.0f;
+    }
+
+  ow_dll_host_init (&r->dll);
+  r->dll_frames = 0;
+  r->received = 0;
+  r->start_frame = 0;
+  r->end_frame = UINT64_MAX;
+  //A single device does not need to wait for the others.
+  r->status = recorder_count > 1 ? RECORDER_WAIT : RECORDER_RUN;
+  r->print_control = 0;
+
+  memset (&r->context, 0, sizeof (struct ow_context));
+  r->context.sched = sched;
+  r->context.dll = NULL;
+  r->context.process = record_process;
+  r->context.process_data = r;
+  r->context.options = OW_ENGINE_OPTION_O2P_AUDIO;
+
+  return OW_OK;
+
+cleanup_engine:
+  ow_engine_destroy (r->engine);
+  return err;
+}
+
+static void
+recorder_destroy (struct recorder *r)
+{
+  pthread_spin_destroy (&r->buffer.lock);
+  free (r->buffer.mem);
+  free (r->buffer.disk);
+  if (r->sf)
+    {
+      sf_close (r->sf);
+    }
+  for (int i = 0; i < r->buffer.outputs && stems_enabled; i++)
+    {
+      if (r->stems[i].sf)
+	{
+	  sf_close (r->stems[i].sf);
+	}
+    }
+  for (int i = 0; i < r->writer_count; i++)
+    {
+      free (r->writers[i].mono);
+    }
+  free (r->writers);
+  free (r->capture_chunk);
+  if (retro_minutes)
+    {
+      capture_destroy (&r->capture);
+    }
+  ow_engine_destroy (r->engine);
+}
+
+static void
+recorder_join_writers (struct recorder *r, int writers)
+{
+  pthread_spin_lock (&r->buffer.lock);
+  r->buffer.status = END;
+  pthread_spin_unlock (&r->buffer.lock);
+
+  if (stems_enabled)
+    {
+      for (int i = 0; i < writers; i++)
+	{
+	  pthread_join (r->writers[i].thread, NULL);
+	}
     }
   else
     {
-      buffer.outputs = desc->outputs;
+      pthread_join (r->buffer.pthread, NULL);
     }
+}
 
-  if (buffer.outputs == 0)
+static int
+recorder_start_writers (struct recorder *r)
+{
+  pthread_t thread;
+
+  if (!stems_enabled)
     {
-      err = OW_GENERIC_ERROR;
-      goto cleanup_engine;
+      if (pthread_create (&r->buffer.pthread, NULL,
+			  retro_minutes ? dump_capture : dump_buffer, r))
+	{
+	  return 1;
+	}
+      ow_set_thread_rt_priority (r->buffer.pthread, OW_DEFAULT_RT_PROPERTY);
+      ow_set_thread_affinity (r->buffer.pthread, dump_cpus);
+      return 0;
     }
 
-  sfinfo.frames = 0;
-  sfinfo.samplerate = OB_SAMPLE_RATE;
-  sfinfo.channels = buffer.outputs;
-  sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+  for (int i = 0; i < r->writer_count; i++)
+    {
+      if (pthread_create (&thread, NULL, dump_stems, &r->writers[i]))
+	{
+	  recorder_join_writers (r, i);
+	  return 1;
+	}
+      r->writers[i].thread = thread;
+      ow_set_thread_rt_priority (thread, OW_DEFAULT_RT_PROPERTY);
+      ow_set_thread_affinity (thread, dump_cpus);
+    }
+
+  return 0;
+}
+
+static ow_err_t
+recorder_start (struct recorder *r)
+{
+  ow_err_t err = ow_engine_start (r->engine, &r->context);
+  if (err)
+    {
+      return err;
+    }
+
+  if (recorder_start_writers (r))
+    {
+      error_print ("Could not start recording thread");
+      ow_engine_stop (r->engine);
+      ow_engine_wait (r->engine);
+      return OW_GENERIC_ERROR;
+    }
+
+  return OW_OK;
+}
+
+static void
+recorder_stop (struct recorder *r)
+{
+  ow_engine_stop (r->engine);
+  ow_engine_wait (r->engine);
+
+  //A pending buffer is written before ending the thread.
+  while (get_buffer_status (&r->buffer) == READY)
+    {
+      usleep (100);
+    }
+
+  recorder_join_writers (r, r->writer_count);
+
+  if (!retro_minutes)
+    {
+      flush_buffer (r);
+    }
+
+  if (stems_enabled)
+    {
+      print_stem_writers (r);
+    }
+}
+
+//Every file gets the same start time as its date.
+static void
+set_file_dates (uint64_t t)
+{
+  char date[MAX_FILENAME_LEN];
+  struct timespec ts;
+  struct tm tm;
+  time_t secs;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+  secs = ts.tv_sec - ((int64_t) get_time () - (int64_t) t) / 1000000;
+  localtime_r (&secs, &tm);
+  strftime (date, MAX_FILENAME_LEN, "%FT%T", &tm);
+
+  for (int i = 0; i < recorder_count; i++)
+    {
+      struct recorder *r = &recorders[i];
+      if (stems_enabled)
+	{
+	  for (int j = 0; j < r->buffer.outputs; j++)
+	    {
+	      sf_set_string (r->stems[j].sf, SF_STR_DATE, date);
+	    }
+	}
+      else
+	{
+	  sf_set_string (r->sf, SF_STR_DATE, date);
+	}
+    }
+}
+
+static int
+run_record (unsigned int blocks_per_transfer, unsigned int xfr_timeout)
+{
+  char curr_time_string[MAX_FILENAME_LEN >> 1];
+  time_t curr_time;
+  struct tm tm;
+  ow_err_t err = OW_OK;
+  uint64_t stop;
+  int started = 0;
+  int initialized = 0;
 
   curr_time = time (NULL);
   localtime_r (&curr_time, &tm);
-  strftime (curr_time_string, MAX_FILENAME_LEN, "%FT%T", &tm);
+  strftime (curr_time_string, MAX_FILENAME_LEN >> 1, "%FT%T", &tm);
 
-  snprintf (filename, MAX_FILENAME_LEN, "%s_%s.wav", desc->name,
-	    curr_time_string);
+  for (; initialized < recorder_count; initialized++)
+    {
+      err = recorder_init (&recorders[initialized], blocks_per_transfer,
+			   xfr_timeout, curr_time_string);
+      if (err)
+	{
+	  goto cleanup;
+	}
+    }
 
-  debug_print (1, "Creating sample (%d channels)...", buffer.outputs);
-  sf = sf_open (filename, SFM_WRITE, &sfinfo);
+  for (; started < recorder_count; started++)
+    {
+      err = recorder_start (&recorders[started]);
+      if (err)
+	{
+	  goto stop;
+	}
+    }
 
-  context.dll = NULL;
-  context.write_space = buffer_dummy_rw_space;
-  context.read_space = buffer_dummy_rw_space;
-  context.write = buffer_write;
-  context.o2h_audio = sf;
-  context.options = OW_ENGINE_OPTION_O2P_AUDIO;
+  if (recorder_count > 1)
+    {
+      fprintf (stderr, "Waiting for the device clocks to settle...\n");
+      if (wait_recorders (SETTLE_TIME_US))
+	{
+	  goto stop;
+	}
+    }
 
-  err = ow_engine_start (engine, &context);
-  if (err)
+  __atomic_store_n (&start_time, get_time () +
+		    (recorder_count > 1 ? START_DELAY_US : 0),
+		    __ATOMIC_RELEASE);
+  if (retro_minutes)
     {
-      goto cleanup;
+      fprintf (stderr,
+	       "Capturing the last %d minutes. Press Enter or send SIGUSR1 to flush them...\n",
+	       retro_minutes);
+      wait_recorders (UINT64_MAX);
+      goto stop;
     }
 
-  buffer.len = track_buf_size_kb * 1000 * buffer.outputs;
-  buffer.mem = malloc (buffer.len * OB_BYTES_PER_SAMPLE);
-  buffer.disk = malloc (buffer.len * OB_BYTES_PER_SAMPLE);
-  buffer.outputs_mask_len = track_mask ? strlen (track_mask) : 0;
+  fprintf (stderr, "Recording...\n");
+
+  wait_recorders (UINT64_MAX);
 
-  for (int i = 0; i < desc->outputs; i++)
+  __atomic_store_n (&end_time, get_time (), __ATOMIC_RELEASE);
+  stop = end_time + STOP_TIMEOUT_US;
+  while (!recorders_done () && recorders_running () && get_time () < stop)
     {
-      max[i] = 0.0f;
-      min[i] = 0.0f;
+      usleep (POLL_US);
     }
 
-  buffer.status = READY;
-  pthread_spin_init (&buffer.lock, PTHREAD_PROCESS_SHARED);
-  if (pthread_create (&buffer.pthread, NULL, dump_buffer, NULL))
+stop:
+  for (int i = 0; i < started; i++)
     {
-      error_print ("Could not start recording thread");
-      goto cleanup;
+      recorder_stop (&recorders[i]);
     }
-  ow_set_thread_rt_priority (buffer.pthread, OW_DEFAULT_RT_PROPERTY);
-
-  ow_engine_wait (engine);
 
-  pthread_spin_lock (&buffer.lock);
-  buffer.status = END;
-  pthread_spin_unlock (&buffer.lock);
-  pthread_join (buffer.pthread, NULL);
+  if (started == recorder_count && recorders_done ())
+    {
+      set_file_dates (start_time);
+      if (recorder_count > 1)
+	{
+	  print_drift_report ();
+	}
+    }
 
 cleanup:
-  pthread_spin_destroy (&buffer.lock);
-  free (buffer.mem);
-  free (buffer.disk);
-  sf_close (sf);
-cleanup_engine:
-  ow_engine_destroy (engine);
-end:
+  for (int i = 0; i < initialized; i++)
+    {
+      if (!retro_minutes)
+	{
+	  fprintf (stderr, "%s: %lu frames written\n",
+		   recorders[i].desc->name, recorders[i].sfinfo.frames);
+	}
+      recorder_destroy (&recorders[i]);
+      if (stems_enabled)
+	{
+	  for (int j = 0; j < recorders[i].buffer.outputs; j++)
+	    {
+	      fprintf (stderr, "%s file created\n",
+		       recorders[i].stems[j].filename);
+	    }
+	}
+      else if (!retro_minutes)
+	{
+	  fprintf (stderr, "%s file created\n", recorders[i].filename);
+	}
+    }
+
   if (err)
     {
       error_print ("%s", ow_get_err_str (err));
@@ -336,20 +1279,76 @@ end:
   return err;
 }
 
+//Formats are given per recorded track like 'flac,flac,wav24'. The last one is used for the remaining tracks.
+static int
+parse_stem_formats (const char *arg)
+{
+  const struct stem_format *format;
+  char *formats = strdup (arg);
+  char *saveptr;
+  int err = 0;
+
+  stem_format_count = 0;
+  for (char *token = strtok_r (formats, ",", &saveptr); token;
+       token = strtok_r (NULL, ",", &saveptr))
+    {
+      for (format = STEM_FORMATS; format->name; format++)
+	{
+	  if (!strcmp (format->name, token))
+	    {
+	      break;
+	    }
+	}
+
+      if (!format->name || stem_format_count == MAX_STEM_FORMATS)
+	{
+	  fprintf (stderr, "Invalid stem format '%s'\n", token);
+	  err = 1;
+	  break;
+	}
+
+      stem_formats[stem_format_count] = format;
+      stem_format_count++;
+    }
+
+  free (formats);
+  return err;
+}
+
+static int
+add_recorder (int device_num, const char *device_name)
+{
+  struct recorder *r;
+
+  if (recorder_count == MAX_DEVICES)
+    {
+      fprintf (stderr, "Only %d devices can be recorded\n", MAX_DEVICES);
+      return 1;
+    }
+
+  r = &recorders[recorder_count];
+  r->device_num = device_num;
+  r->device_name = device_name;
+  recorder_count++;
+
+  return 0;
+}
+
 int
 main (int argc, char *argv[])
 {
   int opt;
   int lflg = 0, vflg = 0, errflg = 0;
-  int nflg = 0, dflg = 0, mflg = 0, sflg = 0, bflg = 0, tflg = 0;
+  int mflg = 0, sflg = 0, bflg = 0, tflg = 0;
   char *endstr;
-  const char *device_name = NULL;
   int long_index = 0;
   ow_err_t ow_err;
   struct sigaction action;
-  int device_num = -1;
   unsigned int blocks_per_transfer = OW_DEFAULT_BLOCKS;
   unsigned int xfr_timeout = OW_DEFAULT_XFR_TIMEOUT;
+  struct ow_sched sched;
+
+  memset (&sched, 0, sizeof (struct ow_sched));
 
   action.sa_handler = signal_handler;
   sigemptyset (&action.sa_mask);
@@ -360,18 +1359,16 @@ main (int argc, char *argv[])
   sigaction (SIGUSR1, &action, NULL);
   sigaction (SIGTSTP, &action, NULL);
 
-  while ((opt = getopt_long (argc, argv, "n:d:m:s:b:t:lvh",
+  while ((opt = getopt_long (argc, argv, "n:d:m:s:b:t:u:c:r:Sf:w:elvh",
 			     options, &long_index)) != -1)
     {
       switch (opt)
 	{
 	case 'n':
-	  device_num = (int) strtol (optarg, &endstr, 10);
-	  nflg++;
+	  errflg += add_recorder ((int) strtol (optarg, &endstr, 10), NULL);
 	  break;
 	case 'd':
-	  device_name = optarg;
-	  dflg++;
+	  errflg += add_recorder (-1, optarg);
 	  break;
 	case 'm':
 	  track_mask = optarg;
@@ -389,6 +1386,41 @@ main (int argc, char *argv[])
 	  xfr_timeout = get_ow_xfr_timeout_argument (optarg);
 	  tflg++;
 	  break;
+	case 'u':
+	  sched.audio_cpus = get_ow_cpu_list_argument (optarg);
+	  break;
+	case 'c':
+	  dump_cpus = get_ow_cpu_list_argument (optarg);
+	  break;
+	case 'r':
+	  retro_minutes = (int) strtol (optarg, &endstr, 10);
+	  if (endstr == optarg || *endstr != '\0' || retro_minutes < 1
+	      || retro_minutes > MAX_RETRO_MINUTES)
+	    {
+	      fprintf (stderr, "Retroactive minutes must be in [1..%d]\n",
+		       MAX_RETRO_MINUTES);
+	      errflg++;
+	    }
+	  break;
+	case 'S':
+	  stems_enabled = 1;
+	  break;
+	case 'f':
+	  errflg += parse_stem_formats (optarg);
+	  break;
+	case 'w':
+	  stem_writers = (int) strtol (optarg, &endstr, 10);
+	  if (endstr == optarg || *endstr != '\0' || stem_writers < 1
+	      || stem_writers > OB_MAX_TRACKS)
+	    {
+	      fprintf (stderr, "Stem writers must be in [1..%d]\n",
+		       OB_MAX_TRACKS);
+	      errflg++;
+	    }
+	  break;
+	case 'e':
+	  sched.policy = OW_SCHED_POLICY_DEADLINE;
+	  break;
 	case 'l':
 	  lflg++;
 	  break;
@@ -443,16 +1475,29 @@ main (int argc, char *argv[])
       exit (EXIT_FAILURE);
     }
 
-  if (nflg + dflg == 1)
+  if (!recorder_count)
     {
-      return run_record (device_num, device_name, blocks_per_transfer,
-			 xfr_timeout);
+      fprintf (stderr, "Device not provided properly\n");
+      exit (EXIT_FAILURE);
     }
-  else
+
+  if (stems_enabled && retro_minutes)
     {
-      fprintf (stderr, "Device not provided properly\n");
+      fprintf (stderr, "Stems are not available in retroactive mode\n");
       exit (EXIT_FAILURE);
     }
 
-  return EXIT_SUCCESS;
+  if (!stem_format_count)
+    {
+      stem_formats[0] = STEM_FORMATS;
+      stem_format_count = 1;
+    }
+
+  outputs_mask_len = track_mask ? strlen (track_mask) : 0;
+  for (int i = 0; i < recorder_count; i++)
+    {
+      recorders[i].context.sched = sched;
+    }
+
+  return run_record (blocks_per_transfer, xfr_timeout);
 }
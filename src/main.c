@@ -29,6 +29,7 @@
 #include <glib/gi18n.h>
 #include "common.h"
 #include "jclient.h"
+#include "hotplug.h"
 #include "utils.h"
 #include "overwitch_device.h"
 
@@ -40,6 +41,10 @@
 #define CONF_QUALITY "quality"
 #define CONF_TIMEOUT "timeout"
 #define CONF_PIPEWIRE_PROPS "pipewireProps"
+#define CONF_USB_CPUS "usbCpus"
+#define CONF_MIDI_CPUS "midiCpus"
+#define CONF_JACK_CPUS "jackCpus"
+#define CONF_SCHED_DEADLINE "schedDeadline"
 
 #define PIPEWIRE_PROPS_ENV_VAR "PIPEWIRE_PROPS"
 
@@ -57,7 +62,19 @@ static jack_client_t *control_client;
 static jack_nframes_t jack_sample_rate;
 static jack_nframes_t jack_buffer_size;
 static gchar *pipewire_props;
+static gchar *usb_cpus;
+static gchar *midi_cpus;
+static gchar *jack_cpus;
+static gboolean sched_deadline;
 static gboolean pipewire_env_var_set;
+static struct hotplug_manager hotplug_manager;
+static gboolean hotplug_running;
+static gboolean refreshing;
+static gboolean refresh_requested;
+//Parameters for new instances as instances might be created outside the GUI thread.
+static struct jclient jclient_params;
+//Read by the hotplug thread when creating instances.
+static GMutex jclient_params_lock;
 
 static GtkApplication *app;
 static GtkBuilder *builder;
@@ -68,6 +85,10 @@ static GtkWidget *preferences_window;
 static GtkWidget *preferences_window_cancel_button;
 static GtkWidget *preferences_window_save_button;
 static GtkWidget *pipewire_props_dialog_entry;
+static GtkWidget *usb_cpus_dialog_entry;
+static GtkWidget *midi_cpus_dialog_entry;
+static GtkWidget *jack_cpus_dialog_entry;
+static GtkWidget *deadline_dialog_check_button;
 static GtkWidget *refresh_button;
 static GtkWidget *stop_button;
 static GtkSpinButton *blocks_spin_button;
@@ -338,6 +359,18 @@ save_preferences ()
   json_builder_set_member_name (builder, CONF_PIPEWIRE_PROPS);
   json_builder_add_string_value (builder, pipewire_props);
 
+  json_builder_set_member_name (builder, CONF_USB_CPUS);
+  json_builder_add_string_value (builder, usb_cpus);
+
+  json_builder_set_member_name (builder, CONF_MIDI_CPUS);
+  json_builder_add_string_value (builder, midi_cpus);
+
+  json_builder_set_member_name (builder, CONF_JACK_CPUS);
+  json_builder_add_string_value (builder, jack_cpus);
+
+  json_builder_set_member_name (builder, CONF_SCHED_DEADLINE);
+  json_builder_add_boolean_value (builder, sched_deadline);
+
   json_builder_end_object (builder);
 
   gen = json_generator_new ();
@@ -423,6 +456,42 @@ load_preferences ()
     }
   json_reader_end_member (reader);
 
+  if (json_reader_read_member (reader, CONF_USB_CPUS))
+    {
+      const gchar *v = json_reader_get_string_value (reader);
+      if (v && strlen (v))
+	{
+	  usb_cpus = strdup (v);
+	}
+    }
+  json_reader_end_member (reader);
+
+  if (json_reader_read_member (reader, CONF_MIDI_CPUS))
+    {
+      const gchar *v = json_reader_get_string_value (reader);
+      if (v && strlen (v))
+	{
+	  midi_cpus = strdup (v);
+	}
+    }
+  json_reader_end_member (reader);
+
+  if (json_reader_read_member (reader, CONF_JACK_CPUS))
+    {
+      const gchar *v = json_reader_get_string_value (reader);
+      if (v && strlen (v))
+	{
+	  jack_cpus = strdup (v);
+	}
+    }
+  json_reader_end_member (reader);
+
+  if (json_reader_read_member (reader, CONF_SCHED_DEADLINE))
+    {
+      sched_deadline = json_reader_get_boolean_value (reader);
+    }
+  json_reader_end_member (reader);
+
   g_object_unref (reader);
   g_object_unref (parser);
 
@@ -585,17 +654,192 @@ remove_stopped_instances ()
   set_dll_target_delay ();
 }
 
+static void
+update_jclient_params ()
+{
+  gint blocks = gtk_spin_button_get_value_as_int (blocks_spin_button);
+  gint timeout = gtk_spin_button_get_value_as_int (timeout_spin_button);
+  guint quality = gtk_drop_down_get_selected (quality_drop_down);
+
+  g_mutex_lock (&jclient_params_lock);
+  jclient_params.blocks_per_transfer = blocks;
+  jclient_params.xfr_timeout = timeout;
+  jclient_params.quality = quality;
+  g_mutex_unlock (&jclient_params_lock);
+}
+
+//An empty or invalid list leaves the thread with the process affinity.
+static uint64_t
+get_cpus (const gchar * cpus)
+{
+  uint64_t mask;
+
+  if (!cpus || !strlen (cpus))
+    {
+      return 0;
+    }
+
+  if (ow_parse_cpu_list (cpus, &mask))
+    {
+      error_print ("Invalid CPU list '%s'", cpus);
+      return 0;
+    }
+
+  return mask;
+}
+
+static void
+set_sched_params ()
+{
+  struct ow_sched sched;
+
+  sched.policy = sched_deadline ? OW_SCHED_POLICY_DEADLINE :
+    OW_SCHED_POLICY_FIFO;
+  sched.audio_cpus = get_cpus (usb_cpus);
+  sched.midi_cpus = get_cpus (midi_cpus);
+  sched.host_cpus = get_cpus (jack_cpus);
+
+  g_mutex_lock (&jclient_params_lock);
+  jclient_params.sched = sched;
+  g_mutex_unlock (&jclient_params_lock);
+}
+
+static struct overwitch_instance *
+new_instance (uint8_t bus, uint8_t address)
+{
+  struct overwitch_instance *instance =
+    g_malloc (sizeof (struct overwitch_instance));
+
+  instance->jclient.bus = bus;
+  instance->jclient.address = address;
+  g_mutex_lock (&jclient_params_lock);
+  instance->jclient.blocks_per_transfer = jclient_params.blocks_per_transfer;
+  instance->jclient.xfr_timeout = jclient_params.xfr_timeout;
+  instance->jclient.quality = jclient_params.quality;
+  instance->jclient.sched = jclient_params.sched;
+  g_mutex_unlock (&jclient_params_lock);
+  instance->jclient.priority = -1;
+  instance->jclient.direct = 0;
+
+  instance->latency.o2h = 0.0;
+  instance->latency.h2o = 0.0;
+  instance->o2j_ratio = 1.0;
+  instance->j2o_ratio = 1.0;
+
+  return instance;
+}
+
+static void
+add_instance (struct overwitch_instance *instance)
+{
+  struct ow_resampler_reporter *reporter;
+  struct ow_resampler *resampler = instance->jclient.resampler;
+  struct ow_engine *engine = ow_resampler_get_engine (resampler);
+  const struct ow_device_desc *desc = ow_engine_get_device_desc (engine);
+
+  reporter = ow_resampler_get_reporter (resampler);
+  reporter->callback = (ow_resampler_report_t) set_report_data;
+  reporter->data = instance;
+
+  debug_print (1, "Adding %s...", instance->jclient.name);
+
+  g_list_store_append (status_list_store,
+		       overwitch_device_new (instance->jclient.name,
+					     desc->name,
+					     instance->jclient.bus,
+					     instance->jclient.address,
+					     instance));
+
+  start_instance (instance);
+  set_widgets_to_running_state (TRUE);
+}
+
+struct refresh_job
+{
+  struct overwitch_instance **instances;
+  struct jclient **jclients;
+  gint *errors;
+  gint count;
+};
+
+static void refresh_all (GtkWidget *, gpointer);
+
+static gboolean
+refresh_all_done_sourcefunc (gpointer data)
+{
+  struct refresh_job *job = data;
+  struct overwitch_instance *instance;
+  GtkTreeIter iter;
+
+  for (gint i = 0; i < job->count; i++)
+    {
+      instance = job->instances[i];
+
+      if (job->errors[i])
+	{
+	  g_free (instance);
+	  continue;
+	}
+
+      //Added by the hotplug thread in the meantime.
+      if (is_device_at_bus_address (instance->jclient.bus,
+				    instance->jclient.address, &iter))
+	{
+	  jclient_destroy (&instance->jclient);
+	  g_free (instance);
+	  continue;
+	}
+
+      add_instance (instance);
+    }
+
+  g_free (job->instances);
+  g_free (job->jclients);
+  g_free (job->errors);
+  g_free (job);
+
+  refreshing = FALSE;
+  gtk_widget_set_sensitive (refresh_button, TRUE);
+
+  if (refresh_requested)
+    {
+      refresh_requested = FALSE;
+      refresh_all (NULL, NULL);
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+//jclient_init_all waits for all the devices so it runs outside the GUI thread.
+static gpointer
+refresh_all_runner (gpointer data)
+{
+  struct refresh_job *job = data;
+  jclient_init_all (job->jclients, job->count, job->errors);
+  g_idle_add (refresh_all_done_sourcefunc, job);
+  return NULL;
+}
+
 static void
 refresh_all (GtkWidget *object, gpointer data)
 {
   struct ow_usb_device *devices, *device;
-  struct ow_resampler_reporter *reporter;
   struct overwitch_instance *instance;
+  struct refresh_job *job;
   size_t devices_count;
   ow_err_t err;
 
+  //The new parameters are used once the ongoing refresh finishes.
+  if (refreshing)
+    {
+      refresh_requested = TRUE;
+      return;
+    }
+
   remove_stopped_instances ();
 
+  update_jclient_params ();
+
   err = ow_get_usb_device_list (&devices, &devices_count);
   if (err || !devices_count)
     {
@@ -603,6 +847,13 @@ refresh_all (GtkWidget *object, gpointer data)
       return;
     }
 
+  job = g_malloc (sizeof (struct refresh_job));
+  job->instances = g_malloc (sizeof (struct overwitch_instance *) *
+			     devices_count);
+  job->jclients = g_malloc (sizeof (struct jclient *) * devices_count);
+  job->errors = g_malloc (sizeof (gint) * devices_count);
+  job->count = 0;
+
   device = devices;
 
   for (gint i = 0; i < devices_count; i++, device++)
@@ -615,52 +866,122 @@ refresh_all (GtkWidget *object, gpointer data)
 	  continue;
 	}
 
-      instance = g_malloc (sizeof (struct overwitch_instance));
-      instance->jclient.bus = device->bus;
-      instance->jclient.address = device->address;
-      instance->jclient.blocks_per_transfer =
-	gtk_spin_button_get_value_as_int (blocks_spin_button);
-      instance->jclient.xfr_timeout =
-	gtk_spin_button_get_value_as_int (timeout_spin_button);
-      instance->jclient.quality =
-	gtk_drop_down_get_selected (quality_drop_down);
-      instance->jclient.priority = -1;
-
-      instance->latency.o2h = 0.0;
-      instance->latency.h2o = 0.0;
-      instance->o2j_ratio = 1.0;
-      instance->j2o_ratio = 1.0;
-
-      //Needed because jclient_init will momentarily block the GUI.
-      while (g_main_context_pending (NULL))
-	{
-	  g_main_context_iteration (NULL, FALSE);
-	}
+      instance = new_instance (device->bus, device->address);
+      job->instances[job->count] = instance;
+      job->jclients[job->count] = &instance->jclient;
+      job->count++;
+    }
+
+  ow_free_usb_device_list (devices, devices_count);
+
+  refreshing = TRUE;
+  gtk_widget_set_sensitive (refresh_button, FALSE);
+  g_thread_unref (g_thread_new ("refresh", refresh_all_runner, job));
+}
 
-      if (jclient_init (&instance->jclient))
+static gboolean
+hotplug_add_instance_sourcefunc (gpointer data)
+{
+  struct overwitch_instance *instance = data;
+  GtkTreeIter iter;
+
+  //Added by a refresh in the meantime.
+  if (is_device_at_bus_address (instance->jclient.bus,
+				instance->jclient.address, &iter))
+    {
+      jclient_destroy (&instance->jclient);
+      g_free (instance);
+      return G_SOURCE_REMOVE;
+    }
+
+  add_instance (instance);
+
+  return G_SOURCE_REMOVE;
+}
+
+struct hotplug_removal
+{
+  uint8_t bus;
+  uint8_t address;
+  gchar *name;
+};
+
+static gboolean
+hotplug_remove_instance_sourcefunc (gpointer data)
+{
+  struct hotplug_removal *removal = data;
+  GListModel *model = G_LIST_MODEL (status_list_store);
+
+  for (guint i = 0; i < g_list_model_get_n_items (model); i++)
+    {
+      OverwitchDevice *dev = g_list_model_get_item (model, i);
+      gboolean found = dev->bus == removal->bus
+	&& dev->address == removal->address
+	&& !g_strcmp0 (dev->name, removal->name);
+      if (found)
 	{
+	  struct overwitch_instance *instance = dev->instance;
+	  struct ow_resampler *resampler = instance->jclient.resampler;
+	  if (ow_resampler_get_status (resampler) != OW_RESAMPLER_STATUS_ERROR)
+	    {
+	      stop_instance (instance);
+	    }
+	  jclient_wait (&instance->jclient);
+	  jclient_destroy (&instance->jclient);
 	  g_free (instance);
-	  continue;
 	}
+      g_object_unref (dev);
+      if (found)
+	{
+	  g_list_store_remove (status_list_store, i);
+	  break;
+	}
+    }
 
-      reporter = ow_resampler_get_reporter (instance->jclient.resampler);
-      reporter->callback = (ow_resampler_report_t) set_report_data;
-      reporter->data = instance;
+  set_widgets_to_running_state (g_list_model_get_n_items (model) > 0);
+  set_dll_target_delay ();
 
-      debug_print (1, "Adding %s...", instance->jclient.name);
+  g_free (removal->name);
+  g_free (removal);
 
-      g_list_store_append (status_list_store,
-			   overwitch_device_new (instance->jclient.name,
-						 device->desc.name,
-						 instance->jclient.bus,
-						 instance->jclient.address,
-						 instance));
+  return G_SOURCE_REMOVE;
+}
 
-      start_instance (instance);
-      set_widgets_to_running_state (TRUE);
+//The hotplug callbacks run in the hotplug thread so the GUI is only modified from idle functions.
+//The instance might be removed by the user at any time so the manager only gets a copy of its name.
+//Together with the bus and the address, this identifies the instance to remove when the device leaves.
+
+static void *
+hotplug_create_instance (const struct ow_usb_device *device, void *data)
+{
+  gchar *name;
+  struct overwitch_instance *instance = new_instance (device->bus,
+						      device->address);
+
+  if (jclient_init (&instance->jclient))
+    {
+      g_free (instance);
+      return NULL;
     }
 
-  ow_free_usb_device_list (devices, devices_count);
+  name = g_strdup (instance->jclient.name);
+
+  g_idle_add (hotplug_add_instance_sourcefunc, instance);
+
+  return name;
+}
+
+static void
+hotplug_destroy_instance (void *instance, uint8_t bus, uint8_t address,
+			  void *data)
+{
+  struct hotplug_removal *removal = g_malloc (sizeof (struct hotplug_removal));
+
+  removal->bus = bus;
+  removal->address = address;
+  removal->name = instance;
+
+  g_idle_add (hotplug_remove_instance_sourcefunc, removal);
 }
 
 static gboolean
@@ -734,6 +1055,15 @@ overwitch_open_preferences (GSimpleAction *simple_action, GVariant *parameter,
 
   buf = gtk_entry_get_buffer (GTK_ENTRY (pipewire_props_dialog_entry));
   gtk_entry_buffer_set_text (buf, pipewire_props ? pipewire_props : "", -1);
+  buf = gtk_entry_get_buffer (GTK_ENTRY (usb_cpus_dialog_entry));
+  gtk_entry_buffer_set_text (buf, usb_cpus ? usb_cpus : "", -1);
+  buf = gtk_entry_get_buffer (GTK_ENTRY (midi_cpus_dialog_entry));
+  gtk_entry_buffer_set_text (buf, midi_cpus ? midi_cpus : "", -1);
+  buf = gtk_entry_get_buffer (GTK_ENTRY (jack_cpus_dialog_entry));
+  gtk_entry_buffer_set_text (buf, jack_cpus ? jack_cpus : "", -1);
+  gtk_check_button_set_active (GTK_CHECK_BUTTON
+			       (deadline_dialog_check_button),
+			       sched_deadline);
   gtk_widget_set_visible (preferences_window, TRUE);
 }
 
@@ -757,7 +1087,24 @@ overwitch_save_preferences (GtkButton *self, gpointer data)
   g_free (pipewire_props);
   pipewire_props = strdup (props ? props : "");
 
+  buf = gtk_entry_get_buffer (GTK_ENTRY (usb_cpus_dialog_entry));
+  g_free (usb_cpus);
+  usb_cpus = strdup (gtk_entry_buffer_get_text (buf));
+
+  buf = gtk_entry_get_buffer (GTK_ENTRY (midi_cpus_dialog_entry));
+  g_free (midi_cpus);
+  midi_cpus = strdup (gtk_entry_buffer_get_text (buf));
+
+  buf = gtk_entry_get_buffer (GTK_ENTRY (jack_cpus_dialog_entry));
+  g_free (jack_cpus);
+  jack_cpus = strdup (gtk_entry_buffer_get_text (buf));
+
+  sched_deadline =
+    gtk_check_button_get_active (GTK_CHECK_BUTTON
+				 (deadline_dialog_check_button));
+
   set_pipewire_props ();
+  set_sched_params ();
 
   stop_all (NULL, NULL);
   usleep (PAUSE_TO_BE_NOTIFIED_USECS);	//Time to let the devices notify us.
@@ -778,6 +1125,13 @@ overwitch_exit ()
 {
   debug_print (1, "Exiting Overwitch...");
 
+  if (hotplug_running)
+    {
+      hotplug_manager_stop (&hotplug_manager);
+      hotplug_manager_destroy (&hotplug_manager);
+      hotplug_running = FALSE;
+    }
+
   stop_all (NULL, NULL);
   usleep (PAUSE_TO_BE_NOTIFIED_USECS);	//Time to let the devices notify us.
   while (g_main_context_pending (NULL))
@@ -842,6 +1196,15 @@ overwitch_build_ui ()
   pipewire_props_dialog_entry =
     GTK_WIDGET (gtk_builder_get_object
 		(builder, "pipewire_props_dialog_entry"));
+  usb_cpus_dialog_entry =
+    GTK_WIDGET (gtk_builder_get_object (builder, "usb_cpus_dialog_entry"));
+  midi_cpus_dialog_entry =
+    GTK_WIDGET (gtk_builder_get_object (builder, "midi_cpus_dialog_entry"));
+  jack_cpus_dialog_entry =
+    GTK_WIDGET (gtk_builder_get_object (builder, "jack_cpus_dialog_entry"));
+  deadline_dialog_check_button =
+    GTK_WIDGET (gtk_builder_get_object
+		(builder, "deadline_dialog_check_button"));
   preferences_window_cancel_button =
     GTK_WIDGET (gtk_builder_get_object
 		(builder, "preferences_window_cancel_button"));
@@ -902,6 +1265,13 @@ overwitch_build_ui ()
 		    NULL);
   g_signal_connect (stop_button, "clicked", G_CALLBACK (stop_all), NULL);
 
+  g_signal_connect (blocks_spin_button, "value-changed",
+		    G_CALLBACK (update_jclient_params), NULL);
+  g_signal_connect (timeout_spin_button, "value-changed",
+		    G_CALLBACK (update_jclient_params), NULL);
+  g_signal_connect (quality_drop_down, "notify::selected",
+		    G_CALLBACK (update_jclient_params), NULL);
+
   g_action_map_add_action_entries (G_ACTION_MAP (app), APP_ENTRIES,
 				   G_N_ELEMENTS (APP_ENTRIES), app);
 }
@@ -928,7 +1298,24 @@ overwitch_activate (GApplication *gapp, gpointer *user_data)
   g_variant_get (v, "b", &refresh_at_startup);
 
   start_control_client ();
-  if (refresh_at_startup)
+  update_jclient_params ();
+  set_sched_params ();
+
+  //When hotplug is available, the devices already present are only reported if refreshing at startup.
+  if (hotplug_is_available ())
+    {
+      hotplug_manager_init (&hotplug_manager, &HOTPLUG_SOURCE_LIBUSB,
+			    hotplug_create_instance, hotplug_destroy_instance,
+			    NULL);
+      hotplug_manager.enumerate = refresh_at_startup;
+      hotplug_running = !hotplug_manager_start (&hotplug_manager);
+      if (!hotplug_running)
+	{
+	  hotplug_manager_destroy (&hotplug_manager);
+	}
+    }
+
+  if (refresh_at_startup && !hotplug_running)
     {
       refresh_all (NULL, NULL);
     }
@@ -946,18 +1333,7 @@ overwitch_free_ui ()
 static void
 signal_handler (int signum)
 {
-  if (signum == SIGUSR1)
-    {
-      debug_level++;
-      debug_print (1, "Debug level: %d", debug_level);
-    }
-  else if (signum == SIGUSR2)
-    {
-      debug_level--;
-      debug_level = debug_level < 0 ? 0 : debug_level;
-      debug_print (1, "Debug level: %d", debug_level);
-    }
-  else
+  if (!update_debug_level (signum))
     {
       overwitch_exit ();
     }
@@ -968,7 +1344,6 @@ main (int argc, char *argv[])
 {
   int status, opt, long_index = 0;
   int vflg = 0, errflg = 0;
-  struct sigaction action;
 
   while ((opt = getopt_long (argc, argv, "vh", options, &long_index)) != -1)
     {
@@ -996,15 +1371,7 @@ main (int argc, char *argv[])
       debug_level = vflg;
     }
 
-  action.sa_handler = signal_handler;
-  sigemptyset (&action.sa_mask);
-  action.sa_flags = 0;
-  sigaction (SIGHUP, &action, NULL);
-  sigaction (SIGINT, &action, NULL);
-  sigaction (SIGTERM, &action, NULL);
-  sigaction (SIGTSTP, &action, NULL);
-  sigaction (SIGUSR1, &action, NULL);
-  sigaction (SIGUSR2, &action, NULL);
+  set_signal_handler (signal_handler);
 
   setlocale (LC_ALL, "");
   bindtextdomain (PACKAGE, LOCALEDIR);
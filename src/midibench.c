@@ -0,0 +1,327 @@
+/*
+ *   midibench.c
+ *   Copyright (C) 2021 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include "midibench.h"
+#include "utils.h"
+
+#define STATS_INITIAL_SIZE 4096
+#define CLOCKS_PER_BEAT 24
+#define REPLAY_LINE_LEN 64
+
+int
+midi_bench_stats_init (struct midi_bench_stats *stats)
+{
+  stats->values = malloc (sizeof (double) * STATS_INITIAL_SIZE);
+  if (!stats->values)
+    {
+      return -ENOMEM;
+    }
+  stats->len = 0;
+  stats->size = STATS_INITIAL_SIZE;
+  return 0;
+}
+
+void
+midi_bench_stats_destroy (struct midi_bench_stats *stats)
+{
+  free (stats->values);
+  stats->values = NULL;
+}
+
+int
+midi_bench_stats_add (struct midi_bench_stats *stats, double value)
+{
+  double *values;
+
+  if (stats->len == stats->size)
+    {
+      values = realloc (stats->values, sizeof (double) * stats->size * 2);
+      if (!values)
+	{
+	  return -ENOMEM;
+	}
+      stats->values = values;
+      stats->size *= 2;
+    }
+
+  stats->values[stats->len] = value;
+  stats->len++;
+  return 0;
+}
+
+static int
+midi_bench_compare (const void *a, const void *b)
+{
+  double da = *(const double *) a;
+  double db = *(const double *) b;
+  return (da > db) - (da < db);
+}
+
+//Nearest rank
+static double
+midi_bench_percentile (struct midi_bench_stats *stats, double p)
+{
+  size_t rank = ceil (p * stats->len);
+  return stats->values[rank ? rank - 1 : 0];
+}
+
+void
+midi_bench_stats_report (struct midi_bench_stats *stats,
+			 struct midi_bench_report *report)
+{
+  double sum = 0, sq = 0;
+
+  memset (report, 0, sizeof (struct midi_bench_report));
+  report->count = stats->len;
+  if (!stats->len)
+    {
+      return;
+    }
+
+  qsort (stats->values, stats->len, sizeof (double), midi_bench_compare);
+
+  for (size_t i = 0; i < stats->len; i++)
+    {
+      sum += stats->values[i];
+    }
+  report->mean = sum / stats->len;
+
+  for (size_t i = 0; i < stats->len; i++)
+    {
+      double d = stats->values[i] - report->mean;
+      sq += d * d;
+    }
+  report->stddev = sqrt (sq / stats->len);
+
+  report->min = stats->values[0];
+  report->max = stats->values[stats->len - 1];
+  report->p50 = midi_bench_percentile (stats, 0.5);
+  report->p90 = midi_bench_percentile (stats, 0.9);
+  report->p99 = midi_bench_percentile (stats, 0.99);
+  report->p999 = midi_bench_percentile (stats, 0.999);
+}
+
+int
+midi_bench_init (struct midi_bench *bench, uint8_t channel)
+{
+  int err;
+
+  bench->probe_status = 0x90 | (channel & 0xf);
+  bench->clock_running = 0;
+  bench->last_clock = 0;
+  bench->lost_probes = 0;
+  memset (bench->probe_pending, 0, sizeof (bench->probe_pending));
+
+  err = midi_bench_stats_init (&bench->clock);
+  if (err)
+    {
+      return err;
+    }
+
+  err = midi_bench_stats_init (&bench->latency);
+  if (err)
+    {
+      midi_bench_stats_destroy (&bench->clock);
+    }
+
+  return err;
+}
+
+void
+midi_bench_destroy (struct midi_bench *bench)
+{
+  midi_bench_stats_destroy (&bench->clock);
+  midi_bench_stats_destroy (&bench->latency);
+}
+
+static int
+midi_bench_is_probe (struct midi_bench *bench,
+		     const struct midi_bench_event *event)
+{
+  //A note on with velocity 0 is a note off.
+  return event->len == 3 && event->data[0] == bench->probe_status
+    && event->data[2];
+}
+
+int
+midi_bench_process (struct midi_bench *bench,
+		    const struct midi_bench_event *event)
+{
+  uint8_t note;
+
+  if (!event->len)
+    {
+      return 0;
+    }
+
+  if (event->dir == MIDI_BENCH_IN)
+    {
+      switch (event->data[0])
+	{
+	case MIDI_BENCH_CLOCK:
+	  if (bench->clock_running)
+	    {
+	      if (midi_bench_stats_add (&bench->clock,
+					event->time - bench->last_clock))
+		{
+		  return -ENOMEM;
+		}
+	    }
+	  bench->last_clock = event->time;
+	  bench->clock_running = 1;
+	  return 0;
+	case MIDI_BENCH_START:
+	case MIDI_BENCH_STOP:
+	  //The time before the first clock after these is not a clock interval.
+	  bench->clock_running = 0;
+	  return 0;
+	}
+    }
+
+  if (!midi_bench_is_probe (bench, event))
+    {
+      return 0;
+    }
+
+  note = event->data[1] & 0x7f;
+  if (event->dir == MIDI_BENCH_OUT)
+    {
+      if (bench->probe_pending[note])
+	{
+	  bench->lost_probes++;
+	}
+      bench->probe_pending[note] = 1;
+      bench->probe_time[note] = event->time;
+    }
+  else if (bench->probe_pending[note])
+    {
+      bench->probe_pending[note] = 0;
+      if (midi_bench_stats_add (&bench->latency,
+				event->time - bench->probe_time[note]))
+	{
+	  return -ENOMEM;
+	}
+    }
+
+  return 0;
+}
+
+static void
+midi_bench_print_report (FILE *file, const char *name,
+			 struct midi_bench_report *report)
+{
+  fprintf (file,
+	   "%s: %zu samples; mean: %.1f us; stddev: %.1f us; min: %.1f us; max: %.1f us\n",
+	   name, report->count, report->mean, report->stddev, report->min,
+	   report->max);
+  fprintf (file,
+	   "%s: p50: %.1f us; p90: %.1f us; p99: %.1f us; p99.9: %.1f us\n",
+	   name, report->p50, report->p90, report->p99, report->p999);
+}
+
+void
+midi_bench_print (struct midi_bench *bench, FILE *file)
+{
+  struct midi_bench_report report;
+
+  midi_bench_stats_report (&bench->clock, &report);
+  if (report.count)
+    {
+      fprintf (file, "Clock: %.2f BPM\n",
+	       60e6 / (report.mean * CLOCKS_PER_BEAT));
+      midi_bench_print_report (file, "Clock interval", &report);
+    }
+  else
+    {
+      fprintf (file, "Clock: no events\n");
+    }
+
+  midi_bench_stats_report (&bench->latency, &report);
+  if (report.count)
+    {
+      midi_bench_print_report (file, "Round trip", &report);
+    }
+  else
+    {
+      fprintf (file, "Round trip: no probes echoed\n");
+    }
+  fprintf (file, "Lost probes: %lu\n", bench->lost_probes);
+}
+
+int
+midi_bench_write_event (FILE *file, const struct midi_bench_event *event)
+{
+  if (fprintf (file, "%lu %c", event->time, event->dir) < 0)
+    {
+      return -EIO;
+    }
+
+  for (int i = 0; i < event->len; i++)
+    {
+      if (fprintf (file, " %02x", event->data[i]) < 0)
+	{
+	  return -EIO;
+	}
+    }
+
+  return fputc ('\n', file) == EOF ? -EIO : 0;
+}
+
+int
+midi_bench_replay (struct midi_bench *bench, FILE *file)
+{
+  int err, n;
+  char line[REPLAY_LINE_LEN];
+  char dir;
+  unsigned int data[3];
+  struct midi_bench_event event;
+  int events = 0;
+
+  while (fgets (line, REPLAY_LINE_LEN, file))
+    {
+      n = sscanf (line, "%lu %c %x %x %x", &event.time, &dir, &data[0],
+		  &data[1], &data[2]);
+      if (n < 3 || (dir != MIDI_BENCH_IN && dir != MIDI_BENCH_OUT))
+	{
+	  error_print ("Invalid event at line %d", events + 1);
+	  return -EINVAL;
+	}
+
+      event.dir = dir;
+      event.len = n - 2;
+      for (int i = 0; i < event.len; i++)
+	{
+	  event.data[i] = data[i];
+	}
+
+      err = midi_bench_process (bench, &event);
+      if (err)
+	{
+	  return err;
+	}
+      events++;
+    }
+
+  return events;
+}
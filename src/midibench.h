@@ -0,0 +1,103 @@
+/*
+ *   midibench.h
+ *   Copyright (C) 2021 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define MIDI_BENCH_CLOCK 0xf8
+#define MIDI_BENCH_START 0xfa
+#define MIDI_BENCH_STOP 0xfc
+#define MIDI_BENCH_PROBES 128
+
+typedef enum
+{
+  MIDI_BENCH_IN = 'i',		//From the device
+  MIDI_BENCH_OUT = 'o'		//To the device
+} midi_bench_dir_t;
+
+//Short message as seen by the host. SysEx is not measured.
+struct midi_bench_event
+{
+  uint64_t time;		//us
+  midi_bench_dir_t dir;
+  uint8_t len;
+  uint8_t data[3];
+};
+
+struct midi_bench_stats
+{
+  double *values;
+  size_t len;
+  size_t size;
+};
+
+struct midi_bench_report
+{
+  size_t count;
+  double min;
+  double max;
+  double mean;
+  double stddev;
+  double p50;
+  double p90;
+  double p99;
+  double p999;
+};
+
+//Round trips are measured with note on probes sent to the device with an echo or thru setting.
+//Probes are matched by the note number so up to MIDI_BENCH_PROBES can be pending.
+struct midi_bench
+{
+  uint8_t probe_status;
+  struct midi_bench_stats clock;	//Time between clock events
+  struct midi_bench_stats latency;	//Round trip
+  int clock_running;
+  uint64_t last_clock;
+  int probe_pending[MIDI_BENCH_PROBES];
+  uint64_t probe_time[MIDI_BENCH_PROBES];
+  uint64_t lost_probes;
+};
+
+int midi_bench_stats_init (struct midi_bench_stats *);
+
+void midi_bench_stats_destroy (struct midi_bench_stats *);
+
+int midi_bench_stats_add (struct midi_bench_stats *, double);
+
+//Values are sorted in place.
+void midi_bench_stats_report (struct midi_bench_stats *,
+			      struct midi_bench_report *);
+
+//The channel goes from 0 to 15.
+int midi_bench_init (struct midi_bench *, uint8_t);
+
+void midi_bench_destroy (struct midi_bench *);
+
+int midi_bench_process (struct midi_bench *, const struct midi_bench_event *);
+
+void midi_bench_print (struct midi_bench *, FILE *);
+
+//Recorded traffic is a line per event with the time, the direction and the bytes in hex.
+int midi_bench_write_event (FILE *, const struct midi_bench_event *);
+
+//Runs the recorded traffic through the measurements. Returns the events read or a negative error.
+int midi_bench_replay (struct midi_bench *, FILE *);
@@ -0,0 +1,158 @@
+/*
+ *   mring.c
+ *   Copyright (C) 2021 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "mring.h"
+#include "utils.h"
+
+int
+mring_init (struct mring *ring, uint32_t size)
+{
+  ring->data = NULL;
+
+  if (!size || size & (size - 1))
+    {
+      error_print ("Ring size %u is not a power of 2", size);
+      return -EINVAL;
+    }
+
+  ring->data = malloc (size);
+  if (!ring->data)
+    {
+      return -ENOMEM;
+    }
+  mlock (ring->data, size);
+
+  ring->size = size;
+  ring->head = 0;
+  ring->tail = 0;
+
+  return 0;
+}
+
+void
+mring_destroy (struct mring *ring)
+{
+  if (!ring->data)
+    {
+      return;
+    }
+
+  munlock (ring->data, ring->size);
+  free (ring->data);
+  ring->data = NULL;
+}
+
+int
+mring_write (struct mring *ring, const void *src, uint32_t len)
+{
+  uint32_t pos, first;
+
+  if (len > mring_space (ring))
+    {
+      return 1;
+    }
+
+  pos = ring->head & (ring->size - 1);
+  first = ring->size - pos;
+  if (first > len)
+    {
+      first = len;
+    }
+
+  memcpy (ring->data + pos, src, first);
+  memcpy (ring->data, (uint8_t *) src + first, len - first);
+  ring->head += len;
+
+  return 0;
+}
+
+uint32_t
+mring_read_span (const struct mring *ring, const uint8_t **span)
+{
+  uint32_t pos = ring->tail & (ring->size - 1);
+  uint32_t len = mring_len (ring);
+
+  *span = ring->data + pos;
+  return len < ring->size - pos ? len : ring->size - pos;
+}
+
+void
+mring_consume (struct mring *ring, uint32_t len)
+{
+  ring->tail += len;
+}
+
+void
+mring_read (struct mring *ring, void *dst, uint32_t len)
+{
+  const uint8_t *span;
+  uint32_t first = mring_read_span (ring, &span);
+
+  if (first > len)
+    {
+      first = len;
+    }
+
+  memcpy (dst, span, first);
+  mring_consume (ring, first);
+
+  if (len > first)
+    {
+      mring_read_span (ring, &span);
+      memcpy ((uint8_t *) dst + first, span, len - first);
+      mring_consume (ring, len - first);
+    }
+}
+
+//Bytes are peeked in place and only copied into the packet.
+int
+mring_sysex_packet (struct mring *ring, struct ow_midi_event_packet *packet,
+		    int *end)
+{
+  uint32_t len = mring_len (ring);
+  int plen = 0;
+
+  *end = 0;
+  for (int i = 0; i < OB_MIDI_EVENT_BYTES && i < len; i++)
+    {
+      packet->data[i] = mring_at (ring, i);
+      plen++;
+      if (packet->data[i] == 0xf7)
+	{
+	  *end = 1;
+	  break;
+	}
+    }
+
+  if (!*end && plen < OB_MIDI_EVENT_BYTES)
+    {
+      return 0;
+    }
+
+  //0x04 is a SysEx start or continuation and 0x05-0x07 end it with 1-3 bytes.
+  packet->header = *end ? 0x04 + plen : 0x04;
+  memset (packet->data + plen, 0, OB_MIDI_EVENT_BYTES - plen);
+  mring_consume (ring, plen);
+
+  return plen;
+}
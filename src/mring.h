@@ -0,0 +1,79 @@
+/*
+ *   mring.h
+ *   Copyright (C) 2021 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "overwitch.h"
+
+//Byte ring used to stage MIDI messages in a single thread.
+//Positions run freely and are masked on access so the size must be a power of 2.
+struct mring
+{
+  uint8_t *data;
+  uint32_t size;
+  uint32_t head;		//Write position
+  uint32_t tail;		//Read position
+};
+
+int mring_init (struct mring *, uint32_t);
+
+void mring_destroy (struct mring *);
+
+static inline uint32_t
+mring_len (const struct mring *ring)
+{
+  return ring->head - ring->tail;
+}
+
+static inline uint32_t
+mring_space (const struct mring *ring)
+{
+  return ring->size - mring_len (ring);
+}
+
+static inline uint8_t
+mring_at (const struct mring *ring, uint32_t offset)
+{
+  return ring->data[(ring->tail + offset) & (ring->size - 1)];
+}
+
+static inline void
+mring_reset (struct mring *ring)
+{
+  ring->tail = ring->head;
+}
+
+//Writes everything or nothing. Returns 1 if there is not enough space.
+int mring_write (struct mring *, const void *, uint32_t);
+
+//Returns the contiguous readable bytes from the read position.
+uint32_t mring_read_span (const struct mring *, const uint8_t **);
+
+void mring_consume (struct mring *, uint32_t);
+
+//Copies and consumes the given bytes with at most 2 copies.
+void mring_read (struct mring *, void *, uint32_t);
+
+//Takes the next USB MIDI SysEx packet.
+//Returns the bytes consumed or 0 if there are not enough bytes to fill a packet.
+//end is set if the packet ends the SysEx message.
+int mring_sysex_packet (struct mring *, struct ow_midi_event_packet *,
+			int *);
@@ -18,149 +18,40 @@
  *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <libusb.h>
 #include <string.h>
 #include <sched.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include "overwitch.h"
+#include "devices.h"
 #include "utils.h"
 
 #define DEVICES_FILE "/devices.json"
 
 #define ELEKTRON_VID 0x1935
 
-#define AFMK1_PID 0x0004
-#define AKEYS_PID 0x0006
-#define ARMK1_PID 0x0008
-#define AHMK1_PID 0x000a
-#define DTAKT_PID 0x000c
-#define AFMK2_PID 0x000e
-#define ARMK2_PID 0x0010
-#define DTONE_PID 0x0014
-#define AHMK2_PID 0x0016
-#define DKEYS_PID 0x001c
-#define STAKT_PID 0x001e
-#define AHFX_PID 0x0020
-
 #define DEV_TAG_PID "pid"
 #define DEV_TAG_NAME "name"
 #define DEV_TAG_INPUT_TRACK_NAMES "input_track_names"
 #define DEV_TAG_OUTPUT_TRACK_NAMES "output_track_names"
 
-#if !defined(JSON_DEVS_FILE) || defined(OW_TESTING)
-static const struct ow_device_desc_static DIGITAKT_DESC = {
-  .pid = DTAKT_PID,
-  .name = "Digitakt",
-  .inputs = 2,
-  .outputs = 12,
-  .input_track_names = {"Main L Input", "Main R Input"},
-  .output_track_names =
-    {"Main L", "Main R", "Track 1", "Track 2", "Track 3", "Track 4",
-     "Track 5", "Track 6", "Track 7", "Track 8", "Input L",
-     "Input R"}
-};
-
-static const struct ow_device_desc_static DIGITONE_DESC = {
-  .pid = DTONE_PID,
-  .name = "Digitone",
-  .inputs = 2,
-  .outputs = 12,
-  .input_track_names = {"Main L Input", "Main R Input"},
-  .output_track_names =
-    {"Main L", "Main R", "Track 1 L", "Track 1 R", "Track 2 L",
-     "Track 2 R", "Track 3 L", "Track 3 R", "Track 4 L", "Track 4 R",
-     "Input L", "Input R"}
-};
-
-static const struct ow_device_desc_static AFMK2_DESC = {
-  .pid = AFMK2_PID,
-  .name = "Analog Four MKII",
-  .inputs = 6,
-  .outputs = 8,
-  .input_track_names = {"Main L Input", "Main R Input", "Synth Track 1 Input",
-			"Synth Track 2 Input", "Synth Track 3 Input",
-			"Synth Track 4 Input"},
-  .output_track_names =
-    {"Main L", "Main R", "Synth Track 1", "Synth Track 2", "Synth Track 3",
-     "Synth Track 4", "Input L", "Input R"}
-};
-
-static const struct ow_device_desc_static ARMK2_DESC = {
-  .pid = ARMK2_PID,
-  .name = "Analog Rytm MKII",
-  .inputs = 12,
-  .outputs = 12,
-  .input_track_names =
-    {"Main L Input", "Main R Input", "Main FX L Input", "Main FX R Input",
-     "BD Input", "SD Input", "RS/CP Input", "BT Input",
-     "LT Input", "MT/HT Input", "CH/OH Input", "CY/CB Input"},
-  .output_track_names = {"Main L", "Main R", "BD", "SD", "RS/CP",
-			 "BT", "LT", "MT/HT", "CH/OH", "CY/CB", "Input L",
-			 "Input R"}
-};
-
-static const struct ow_device_desc_static DKEYS_DESC = {
-  .pid = DKEYS_PID,
-  .name = "Digitone Keys",
-  .inputs = 2,
-  .outputs = 12,
-  .input_track_names = {"Main L Input", "Main R Input"},
-  .output_track_names =
-    {"Main L", "Main R", "Track 1 L", "Track 1 R", "Track 2 L",
-     "Track 2 R", "Track 3 L", "Track 3 R", "Track 4 L", "Track 4 R",
-     "Input L", "Input R"}
-};
-
-static const struct ow_device_desc_static AHMK1_DESC = {
-  .pid = AHMK1_PID,
-  .name = "Analog Heat",
-  .inputs = 4,
-  .outputs = 4,
-  .input_track_names =
-    {"Main L Input", "Main R Input", "FX Send L", "FX Send R"},
-  .output_track_names = {"Main L", "Main R", "FX Return L", "FX Return R"}
-};
-
-static const struct ow_device_desc_static AHMK2_DESC = {
-  .pid = AHMK2_PID,
-  .name = "Analog Heat MKII",
-  .inputs = 4,
-  .outputs = 4,
-  .input_track_names =
-    {"Main L Input", "Main R Input", "FX Send L", "FX Send R"},
-  .output_track_names = {"Main L", "Main R", "FX Return L", "FX Return R"}
-};
-
-static const struct ow_device_desc_static AHFX_DESC = {
-  .pid = AHFX_PID,
-  .name = "Analog Heat +FX",
-  .inputs = 4,
-  .outputs = 4,
-  .input_track_names =
-    {"Main L Input", "Main R Input", "FX Send L", "FX Send R"},
-  .output_track_names = {"Main L", "Main R", "FX Return L", "FX Return R"}
+//Descriptors are shared and immutable, so a table is never freed. When the
+//devices file changes, a new table replaces the current one but the previous
+//ones are kept as their descriptors might still be in use.
+struct ow_device_desc_table
+{
+  const struct ow_device_desc *descs;	//Sorted by PID
+  size_t len;
+  struct ow_device_desc_table *prev;
 };
 
-static const struct ow_device_desc_static STAKT_DESC = {
-  .pid = STAKT_PID,
-  .name = "Syntakt",
-  .inputs = 8,
-  .outputs = 20,
-  .input_track_names =
-    {"Main L Input", "Main R Input", "Analog FX L Input", "Analog FX R Input",
-     "Track 9 Input", "Track 10 Input", "Track 11 Input", "Track 12 Input"},
-  .output_track_names =
-    {"Main L", "Main R", "Track  1", "Track  2", "Track  3", "Track  4",
-     "Track  5", "Track  6", "Track  7", "Track  8", "Track  9", "Track 10",
-     "Track 11", "Track 12", "Analog FX L", "Analog FX R",
-     "Delay/Reverb L", "Delay/Reverb R", "Input L", "Input R"}
-};
-
-static const struct ow_device_desc_static *OB_DEVICE_DESCS[] = {
-  &DIGITAKT_DESC, &DIGITONE_DESC, &AFMK2_DESC, &ARMK2_DESC, &DKEYS_DESC,
-  &AHMK1_DESC, &AHMK2_DESC, &AHFX_DESC, &STAKT_DESC, NULL
-};
-#endif
+static pthread_mutex_t desc_table_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ow_device_desc_table *desc_table;
+static struct ow_device_desc_table builtin_desc_table;
 
 void
 ow_free_device_desc (struct ow_device_desc *desc)
@@ -185,11 +76,6 @@ ow_free_device_desc (struct ow_device_desc *desc)
 void
 ow_free_usb_device_list (struct ow_usb_device *devices, size_t size)
 {
-  struct ow_usb_device *d = devices;
-  for (int i = 0; i < size; i++, d++)
-    {
-      ow_free_device_desc (&d->desc);
-    }
   free (devices);
 }
 
@@ -238,7 +124,7 @@ ow_get_usb_device_list (struct ow_usb_device **devices, size_t *size)
 	  bus = libusb_get_bus_number (*usb_device);
 	  address = libusb_get_device_address (*usb_device);
 	  debug_print (1, "Found %s (bus %03d, address %03d, ID %04x:%04x)",
-		       device->desc.name, bus, address, desc.idVendor,
+		       device->desc->name, bus, address, desc.idVendor,
 		       desc.idProduct);
 	  device->vid = desc.idVendor;
 	  device->pid = desc.idProduct;
@@ -284,218 +170,298 @@ ow_copy_device_desc_static (struct ow_device_desc *device_desc,
     }
 }
 
-int
-ow_get_device_desc_from_vid_pid (uint16_t vid, uint16_t pid,
-				 struct ow_device_desc *device_desc)
+static int
+ow_device_desc_cmp (const void *a, const void *b)
 {
-  if (vid != ELEKTRON_VID)
+  const struct ow_device_desc *da = a;
+  const struct ow_device_desc *db = b;
+  return (int) da->pid - (int) db->pid;
+}
+
+static struct ow_device_desc_table *
+ow_device_desc_table_builtin ()
+{
+  builtin_desc_table.descs = OW_DEVICE_DESCS;
+  builtin_desc_table.len = OW_DEVICE_DESCS_LEN;
+  return &builtin_desc_table;
+}
+
+#if defined(JSON_DEVS_FILE) && !defined(OW_TESTING)
+static struct ow_device_desc_table *loaded_desc_tables;
+static struct timespec desc_file_mtime;
+static int desc_file_found;
+
+static int
+ow_read_track_names (JsonReader * reader, const char *member, char ***names,
+		     int *tracks)
+{
+  const gchar *name;
+  int err = 0;
+
+  if (!json_reader_read_member (reader, member)
+      || !json_reader_is_array (reader))
     {
-      return 1;
+      error_print ("Cannot read member '%s'", member);
+      json_reader_end_member (reader);
+      return -ENODEV;
     }
 
-#if defined(JSON_DEVS_FILE) && !defined(OW_TESTING)
-  gint dpid, err, devices;
-  JsonParser *parser;
-  JsonReader *reader;
-  gchar *devices_filename;
-  GError *error = NULL;
+  *tracks = json_reader_count_elements (reader);
+  if (*tracks <= 0)
+    {
+      debug_print (1, "No tracks found");
+      *tracks = 0;
+      json_reader_end_member (reader);
+      return -ENODEV;
+    }
 
-  device_desc->inputs = 0;
-  device_desc->outputs = 0;
-  device_desc->input_track_names = NULL;
-  device_desc->output_track_names = NULL;
+  *names = calloc (*tracks, sizeof (char *));
+  for (int i = 0; i < *tracks; i++)
+    {
+      json_reader_read_element (reader, i);
+      name = json_reader_get_string_value (reader);
+      if (name)
+	{
+	  (*names)[i] = strdup (name);
+	}
+      else
+	{
+	  error_print ("Cannot read track name %d", i);
+	  err = -ENODEV;
+	}
+      json_reader_end_element (reader);
+    }
+  json_reader_end_member (reader);
 
-  parser = json_parser_new ();
+  return err;
+}
 
-  devices_filename = get_expanded_dir (CONF_DIR DEVICES_FILE);
+static int
+ow_read_device_desc (JsonReader * reader, struct ow_device_desc *desc)
+{
+  const gchar *name;
 
-  if (!json_parser_load_from_file (parser, devices_filename, &error))
+  if (!json_reader_read_member (reader, DEV_TAG_PID))
     {
-      debug_print (1, "%s", error->message);
-      g_clear_error (&error);
+      error_print ("Cannot read member '%s'", DEV_TAG_PID);
+      json_reader_end_member (reader);
+      return -ENODEV;
+    }
+  desc->pid = json_reader_get_int_value (reader);
+  json_reader_end_member (reader);
 
-      g_free (devices_filename);
-      devices_filename = strdup (DATADIR DEVICES_FILE);
+  json_reader_read_member (reader, DEV_TAG_NAME);
+  name = json_reader_get_string_value (reader);
+  if (name)
+    {
+      desc->name = strdup (name);
+    }
+  json_reader_end_member (reader);
+  if (!name)
+    {
+      error_print ("Cannot read member '%s'", DEV_TAG_NAME);
+      return -ENODEV;
+    }
 
-      debug_print (1, "Falling back to %s...", devices_filename);
+  if (ow_read_track_names (reader, DEV_TAG_INPUT_TRACK_NAMES,
+			   &desc->input_track_names, &desc->inputs))
+    {
+      return -ENODEV;
+    }
 
-      if (!json_parser_load_from_file (parser, devices_filename, &error))
-	{
-	  error_print ("%s", error->message);
-	  g_clear_error (&error);
-	  err = -ENODEV;
-	  goto cleanup_parser;
-	}
+  if (ow_read_track_names (reader, DEV_TAG_OUTPUT_TRACK_NAMES,
+			   &desc->output_track_names, &desc->outputs))
+    {
+      return -ENODEV;
+    }
+
+  return 0;
+}
+
+static struct ow_device_desc_table *
+ow_device_desc_table_load (const char *filename)
+{
+  gint devices;
+  JsonParser *parser;
+  JsonReader *reader;
+  GError *error = NULL;
+  struct ow_device_desc *descs, *desc;
+  struct ow_device_desc_table *table = NULL;
+
+  parser = json_parser_new ();
+
+  if (!json_parser_load_from_file (parser, filename, &error))
+    {
+      error_print ("%s", error->message);
+      g_clear_error (&error);
+      goto cleanup_parser;
     }
 
   reader = json_reader_new (json_parser_get_root (parser));
   if (!reader)
     {
       error_print ("Unable to read from parser");
-      err = -ENODEV;
       goto cleanup_parser;
     }
 
   if (!json_reader_is_array (reader))
     {
       error_print ("Not an array");
-      err = -ENODEV;
       goto cleanup_reader;
     }
 
   devices = json_reader_count_elements (reader);
-  if (!devices)
-    {
-      debug_print (1, "No devices found");
-      err = -ENODEV;
-      goto cleanup_reader;
-    }
-
-  err = -ENODEV;
+  table = malloc (sizeof (struct ow_device_desc_table));
+  table->len = 0;
+  table->prev = NULL;
+  descs = calloc (devices ? devices : 1, sizeof (struct ow_device_desc));
+  desc = descs;
   for (int i = 0; i < devices; i++)
     {
-      if (!json_reader_read_element (reader, i))
+      json_reader_read_element (reader, i);
+      if (ow_read_device_desc (reader, desc))
 	{
 	  error_print ("Cannot read element %d. Continuing...", i);
-	  continue;
+	  ow_free_device_desc (desc);
+	  memset (desc, 0, sizeof (struct ow_device_desc));
 	}
-
-      if (!json_reader_read_member (reader, DEV_TAG_PID))
-	{
-	  error_print ("Cannot read member '%s'. Continuing...", DEV_TAG_PID);
-	  continue;
-	}
-      dpid = json_reader_get_int_value (reader);
-      json_reader_end_member (reader);
-      if (dpid != pid)
-	{
-	  json_reader_end_element (reader);
-	  continue;
-	}
-      device_desc->pid = dpid;
-
-      err = 0;
-      debug_print (1, "Device with PID %d found", dpid);
-
-      if (!json_reader_read_member (reader, DEV_TAG_NAME))
-	{
-	  error_print ("Cannot read member '%s'. Stopping...", DEV_TAG_NAME);
-	  json_reader_end_element (reader);
-	  err = -ENODEV;
-	  break;
-	}
-      device_desc->name = strdup (json_reader_get_string_value (reader));
-      json_reader_end_member (reader);
-
-      if (!json_reader_read_member (reader, DEV_TAG_INPUT_TRACK_NAMES))
-	{
-	  error_print ("Cannot read member '%s'. Stopping...",
-		       DEV_TAG_INPUT_TRACK_NAMES);
-	  json_reader_end_element (reader);
-	  err = -ENODEV;
-	  break;
-	}
-      if (!json_reader_is_array (reader))
-	{
-	  error_print ("Not an array");
-	  err = -ENODEV;
-	  goto cleanup_reader;
-	}
-      device_desc->inputs = json_reader_count_elements (reader);
-      if (!device_desc->inputs)
-	{
-	  debug_print (1, "No tracks found");
-	  err = -ENODEV;
-	  goto cleanup_reader;
-	}
-      device_desc->input_track_names =
-	malloc (sizeof (char *) * device_desc->inputs);
-      for (int j = 0; j < device_desc->inputs; j++)
+      else
 	{
-	  device_desc->input_track_names[j] = NULL;
+	  desc++;
+	  table->len++;
 	}
-      for (int j = 0; j < device_desc->inputs; j++)
-	{
-	  if (json_reader_read_element (reader, j))
-	    {
-	      device_desc->input_track_names[j] =
-		strdup (json_reader_get_string_value (reader));
-	      json_reader_end_element (reader);
-	    }
-	  else
-	    {
-	      error_print ("Cannot read input track name %d", j);
-	      ow_free_device_desc (device_desc);
-	      err = -ENODEV;
-	      goto cleanup_reader;
-	    }
-	}
-      json_reader_end_member (reader);
+      json_reader_end_element (reader);
+    }
 
-      if (!json_reader_read_member (reader, DEV_TAG_OUTPUT_TRACK_NAMES))
-	{
-	  error_print ("Cannot read member '%s'. Stopping...",
-		       DEV_TAG_OUTPUT_TRACK_NAMES);
-	  json_reader_end_element (reader);
-	  err = -ENODEV;
-	  break;
-	}
-      if (!json_reader_is_array (reader))
-	{
-	  error_print ("Not an array");
-	  err = -ENODEV;
-	  goto cleanup_reader;
-	}
-      device_desc->outputs = json_reader_count_elements (reader);
-      if (!device_desc->outputs)
-	{
-	  debug_print (1, "No tracks found");
-	  err = -ENODEV;
-	  goto cleanup_reader;
-	}
-      device_desc->output_track_names =
-	malloc (sizeof (char *) * device_desc->outputs);
-      for (int j = 0; j < device_desc->outputs; j++)
+  qsort (descs, table->len, sizeof (struct ow_device_desc),
+	 ow_device_desc_cmp);
+  for (size_t i = 1; i < table->len; i++)
+    {
+      if (descs[i].pid == descs[i - 1].pid)
 	{
-	  device_desc->output_track_names[j] = NULL;
+	  error_print ("Duplicated device with PID %04x", descs[i].pid);
 	}
-      for (int j = 0; j < device_desc->outputs; j++)
-	{
-	  if (json_reader_read_element (reader, j))
-	    {
-	      device_desc->output_track_names[j] =
-		strdup (json_reader_get_string_value (reader));
-	      json_reader_end_element (reader);
-	    }
-	  else
-	    {
-	      error_print ("Cannot read output track name %d", j);
-	      ow_free_device_desc (device_desc);
-	      err = -ENODEV;
-	      goto cleanup_reader;
-	    }
-	}
-      break;
     }
+  table->descs = descs;
+
+  debug_print (1, "%zu devices loaded from %s", table->len, filename);
 
 cleanup_reader:
   g_object_unref (reader);
 cleanup_parser:
   g_object_unref (parser);
-  g_free (devices_filename);
-  return err;
-#else
-  for (const struct ow_device_desc_static ** d = OB_DEVICE_DESCS; *d != NULL;
-       d++)
+  return table;
+}
+
+//The user file is only parsed again if its modification time changes. A file
+//that can not be parsed is not retried until it changes again. Without a user
+//file, the built-in table, generated from the installed file, is used.
+static void
+ow_device_desc_table_update ()
+{
+  struct stat st;
+  struct ow_device_desc_table *table;
+  char *filename = get_expanded_dir (CONF_DIR DEVICES_FILE);
+
+  if (stat (filename, &st))
     {
-      if ((*d)->pid == pid)
+      if (!desc_table || desc_file_found)
 	{
-	  ow_copy_device_desc_static (device_desc, *d);
-	  return 0;
+	  debug_print (1, "%s not found. Using built-in devices...",
+		       filename);
 	}
+      desc_file_found = 0;
+      desc_table = ow_device_desc_table_builtin ();
+      goto end;
+    }
+
+  if (desc_file_found && st.st_mtim.tv_sec == desc_file_mtime.tv_sec
+      && st.st_mtim.tv_nsec == desc_file_mtime.tv_nsec)
+    {
+      goto end;
     }
-  return 1;
+
+  table = ow_device_desc_table_load (filename);
+  if (table)
+    {
+      table->prev = loaded_desc_tables;
+      loaded_desc_tables = table;
+      desc_table = table;
+    }
+  else if (!desc_table)
+    {
+      desc_table = ow_device_desc_table_builtin ();
+    }
+
+  desc_file_found = 1;
+  desc_file_mtime = st.st_mtim;
+
+end:
+  free (filename);
+}
+#else
+static void
+ow_device_desc_table_update ()
+{
+  if (!desc_table)
+    {
+      desc_table = ow_device_desc_table_builtin ();
+    }
+}
 #endif
+
+int
+ow_get_device_desc_from_vid_pid (uint16_t vid, uint16_t pid,
+				 const struct ow_device_desc **device_desc)
+{
+  struct ow_device_desc key;
+  const struct ow_device_desc *desc = NULL;
+
+  if (vid != ELEKTRON_VID)
+    {
+      return 1;
+    }
+
+  key.pid = pid;
+
+  pthread_mutex_lock (&desc_table_lock);
+  ow_device_desc_table_update ();
+  desc = bsearch (&key, desc_table->descs, desc_table->len,
+		  sizeof (struct ow_device_desc), ow_device_desc_cmp);
+  pthread_mutex_unlock (&desc_table_lock);
+
+  if (!desc)
+    {
+      return 1;
+    }
+
+  debug_print (2, "Device with PID %d found", pid);
+  *device_desc = desc;
+
+  return 0;
+}
+
+const struct ow_device_sizes *
+ow_get_device_sizes (const struct ow_device_desc *desc,
+		     unsigned int blocks_per_transfer)
+{
+  const struct ow_device_desc *d;
+
+  if (blocks_per_transfer != OW_DEFAULT_BLOCKS)
+    {
+      return NULL;
+    }
+
+  d = bsearch (desc, OW_DEVICE_DESCS, OW_DEVICE_DESCS_LEN,
+	       sizeof (struct ow_device_desc), ow_device_desc_cmp);
+
+  //A user defined device might have a different number of tracks.
+  if (!d || d->inputs != desc->inputs || d->outputs != desc->outputs)
+    {
+      return NULL;
+    }
+
+  return &OW_DEVICE_SIZES[d - OW_DEVICE_DESCS];
 }
 
 int
@@ -525,7 +491,7 @@ ow_get_usb_device_from_device_attrs (int device_num, const char *device_name,
 	}
       else
 	{
-	  if (strcmp (usb_device->desc.name, device_name) == 0)
+	  if (strcmp (usb_device->desc->name, device_name) == 0)
 	    {
 	      break;
 	    }
@@ -555,3 +521,229 @@ ow_set_thread_rt_priority (pthread_t thread, int p)
   };
   pthread_setschedparam (thread, SCHED_FIFO, &default_rt_param);
 }
+
+//CPU lists are comma separated CPUs or ranges of CPUs, such as 0-3,6.
+int
+ow_parse_cpu_list (const char *list, uint64_t * cpus)
+{
+  char *endstr;
+  long first, last;
+  const char *p = list;
+
+  *cpus = 0;
+  while (*p)
+    {
+      errno = 0;
+      first = strtol (p, &endstr, 10);
+      if (errno || endstr == p || first < 0 || first >= OW_MAX_CPUS)
+	{
+	  return -EINVAL;
+	}
+      last = first;
+      p = endstr;
+      if (*p == '-')
+	{
+	  p++;
+	  last = strtol (p, &endstr, 10);
+	  if (errno || endstr == p || last < first || last >= OW_MAX_CPUS)
+	    {
+	      return -EINVAL;
+	    }
+	  p = endstr;
+	}
+
+      for (long i = first; i <= last; i++)
+	{
+	  *cpus |= ((uint64_t) 1) << i;
+	}
+
+      if (*p == ',')
+	{
+	  p++;
+	  if (!*p)
+	    {
+	      return -EINVAL;
+	    }
+	}
+      else if (*p)
+	{
+	  return -EINVAL;
+	}
+    }
+
+  return 0;
+}
+
+void
+ow_set_thread_affinity (pthread_t thread, uint64_t cpus)
+{
+  cpu_set_t set;
+
+  if (!cpus)
+    {
+      return;
+    }
+
+  CPU_ZERO (&set);
+  for (int i = 0; i < OW_MAX_CPUS; i++)
+    {
+      if (cpus & (((uint64_t) 1) << i))
+	{
+	  CPU_SET (i, &set);
+	}
+    }
+
+  if (pthread_setaffinity_np (thread, sizeof (cpu_set_t), &set))
+    {
+      error_print ("Could not set thread affinity to %016lx", cpus);
+    }
+}
+
+//There is no glibc wrapper for sched_setattr.
+struct ow_sched_attr
+{
+  uint32_t size;
+  uint32_t sched_policy;
+  uint64_t sched_flags;
+  int32_t sched_nice;
+  uint32_t sched_priority;
+  uint64_t sched_runtime;
+  uint64_t sched_deadline;
+  uint64_t sched_period;
+};
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
+//This applies to the calling thread as SCHED_DEADLINE needs a thread id.
+int
+ow_set_thread_deadline (uint64_t runtime, uint64_t period)
+{
+#ifdef SYS_sched_setattr
+  struct ow_sched_attr attr = {
+    .size = sizeof (struct ow_sched_attr),
+    .sched_policy = SCHED_DEADLINE,
+    .sched_runtime = runtime,
+    .sched_deadline = period,
+    .sched_period = period
+  };
+
+  if (syscall (SYS_sched_setattr, 0, &attr, 0))
+    {
+      int err = errno;
+      error_print ("Could not set deadline scheduling (%lu/%lu ns): %s",
+		   runtime, period, strerror (err));
+      return -err;
+    }
+
+  return 0;
+#else
+  return -ENOSYS;
+#endif
+}
+
+//Every track gets a cache line aligned buffer big enough for the longest transfer.
+int
+ow_planar_process_init (struct ow_planar_process *planar,
+			const struct ow_device_desc *desc,
+			ow_sample_layout_t layout,
+			ow_planar_process_t process, void *data)
+{
+  size_t track_size = OW_CACHE_LINE_ALIGN (OW_MAX_BLOCKS *
+					   OB_FRAMES_PER_BLOCK *
+					   sizeof (float));
+  size_t tracks = desc->outputs + desc->inputs;
+
+  planar->process = process;
+  planar->data = data;
+  planar->layout = layout;
+  planar->outputs = desc->outputs;
+  planar->inputs = desc->inputs;
+  planar->mem = NULL;
+
+  if (layout == OW_SAMPLE_LAYOUT_PLANAR)
+    {
+      return 0;
+    }
+
+  if (posix_memalign ((void **) &planar->mem, OW_CACHE_LINE_SIZE,
+		      track_size * tracks))
+    {
+      error_print ("Could not allocate planar buffers");
+      return -ENOMEM;
+    }
+  memset (planar->mem, 0, track_size * tracks);
+
+  for (int i = 0; i < planar->outputs; i++)
+    {
+      planar->o2h[i] = (float *) ((char *) planar->mem + track_size * i);
+    }
+
+  for (int i = 0; i < planar->inputs; i++)
+    {
+      planar->h2o[i] = (float *) ((char *) planar->mem +
+				  track_size * (planar->outputs + i));
+    }
+
+  return 0;
+}
+
+void
+ow_planar_process_destroy (struct ow_planar_process *planar)
+{
+  free (planar->mem);
+  planar->mem = NULL;
+}
+
+void
+ow_planar_process (void *data, const float *o2h, float *h2o,
+		   uint32_t frames)
+{
+  struct ow_planar_process *planar = data;
+
+  //The tracks are set every time as the frames might change.
+  if (planar->layout == OW_SAMPLE_LAYOUT_PLANAR)
+    {
+      for (int i = 0; o2h && i < planar->outputs; i++)
+	{
+	  planar->o2h[i] = (float *) o2h + i * frames;
+	}
+      for (int i = 0; h2o && i < planar->inputs; i++)
+	{
+	  planar->h2o[i] = h2o + i * frames;
+	}
+      planar->process (planar->data,
+		       o2h ? (const float *const *) planar->o2h : NULL,
+		       h2o ? planar->h2o : NULL, frames);
+      return;
+    }
+
+  if (o2h)
+    {
+      for (int i = 0; i < frames; i++)
+	{
+	  for (int j = 0; j < planar->outputs; j++)
+	    {
+	      planar->o2h[j][i] = *o2h;
+	      o2h++;
+	    }
+	}
+    }
+
+  planar->process (planar->data,
+		   o2h ? (const float *const *) planar->o2h : NULL,
+		   h2o ? planar->h2o : NULL, frames);
+
+  if (h2o)
+    {
+      for (int i = 0; i < frames; i++)
+	{
+	  for (int j = 0; j < planar->inputs; j++)
+	    {
+	      *h2o = planar->h2o[j][i];
+	      h2o++;
+	    }
+	}
+    }
+}
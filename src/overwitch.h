@@ -42,6 +42,11 @@
 #define OW_DEFAULT_XFR_TIMEOUT 10
 
 #define OW_DEFAULT_BLOCKS 24
+#define OW_MIN_BLOCKS 2
+#define OW_MAX_BLOCKS 32
+#define OW_AUTO_BLOCKS 0	//The engine tunes the blocks per transfer while running.
+
+#define OW_DEFAULT_H2O_MIDI_WINDOW 1000	//One USB frame in us
 
 typedef size_t (*ow_buffer_rw_space_t) (void *);
 typedef size_t (*ow_buffer_read_t) (void *, char *, size_t);
@@ -49,14 +54,48 @@ typedef size_t (*ow_buffer_write_t) (void *, const char *, size_t);
 
 typedef uint64_t (*ow_get_time_t) ();	//Time in us
 
+//Pull model. Called from the USB thread on every transfer with the o2h frames and the h2o frames to fill, which are sent with the next transfer. Buffers are interleaved and NULL for disabled directions.
+typedef void (*ow_process_t) (void *, const float *, float *, uint32_t);
+
+typedef enum
+{
+  OW_SAMPLE_LAYOUT_INTERLEAVED = 0,
+  OW_SAMPLE_LAYOUT_PLANAR	//Track after track. Only with a process callback.
+} ow_sample_layout_t;
+//The ring buffers and the resampler are always interleaved as libsamplerate processes interleaved frames.
+//Hence, clients using them, such as the JACK and PipeWire ones, still transpose when copying to their ports.
+
+//Same as above but with a buffer per track.
+typedef void (*ow_planar_process_t) (void *, const float *const *,
+				     float *const *, uint32_t);
+
 struct ow_context;
 
 typedef void (*ow_dll_overbridge_init_t) (void *, double, uint32_t);
 
 typedef void (*ow_dll_overbridge_update_t) (void *, uint32_t, uint64_t);
 
+typedef uint32_t (*ow_dll_overbridge_get_frame_t) (void *, uint64_t);
+
 typedef void (*ow_set_rt_priority_t) (pthread_t, int);
 
+#define OW_MAX_CPUS 64
+
+typedef enum
+{
+  OW_SCHED_POLICY_FIFO = 0,
+  OW_SCHED_POLICY_DEADLINE
+} ow_sched_policy_t;
+
+//CPU masks have a bit per CPU. An empty mask keeps the process affinity so that CPU isolation done with taskset or cgroups is respected.
+struct ow_sched
+{
+  ow_sched_policy_t policy;	//Only used by the audio thread. The runtime and period are derived from the frames per transfer.
+  uint64_t audio_cpus;		//Audio and o2h MIDI thread
+  uint64_t midi_cpus;		//h2o MIDI thread
+  uint64_t host_cpus;		//Client threads, such as the JACK process thread
+};
+
 struct ow_resampler_latency
 {
   double o2h;
@@ -91,7 +130,9 @@ typedef enum
   OW_INIT_ERROR_NO_O2P_MIDI_BUF,
   OW_INIT_ERROR_NO_P2O_MIDI_BUF,
   OW_INIT_ERROR_NO_GET_TIME,
-  OW_INIT_ERROR_NO_DLL
+  OW_INIT_ERROR_NO_DLL,
+  OW_INIT_ERROR_PROCESS_WITH_DLL,
+  OW_INIT_ERROR_PLANAR_WITHOUT_PROCESS
 } ow_err_t;
 
 typedef enum
@@ -131,8 +172,14 @@ struct ow_context
   ow_buffer_write_t write;
   ow_buffer_rw_space_t read_space;
   ow_buffer_read_t read;
+  //If set, audio goes through this instead of the buffers and no DLL is allowed.
+  ow_process_t process;
+  void *process_data;
+  ow_sample_layout_t layout;
   //Needed for MIDI and the DLL
   ow_get_time_t get_time;
+  //Events due within this many us are sent in the same MIDI transfer. 0 uses OW_DEFAULT_H2O_MIDI_WINDOW.
+  uint32_t h2o_midi_window;
   //Data
   void *h2o_audio;
   void *o2h_audio;
@@ -142,9 +189,11 @@ struct ow_context
   struct ow_dll *dll;
   ow_dll_overbridge_init_t dll_overbridge_init;
   ow_dll_overbridge_update_t dll_overbridge_update;
+  ow_dll_overbridge_get_frame_t dll_overbridge_get_frame;
   //RT priority is always activated. If this is NULL, Overwitch will set itself with its default RT priority and policy.
   ow_set_rt_priority_t set_rt_priority;
   int priority;
+  struct ow_sched sched;
   //Options
   int options;
 };
@@ -171,7 +220,7 @@ struct ow_device_desc_static
 
 struct ow_usb_device
 {
-  struct ow_device_desc desc;
+  const struct ow_device_desc *desc;	//Shared. Do not free.
   uint16_t vid;
   uint16_t pid;
   uint8_t bus;
@@ -195,6 +244,8 @@ struct ow_midi_event
     struct ow_midi_event_packet packet;
     uint8_t raw[OB_MIDI_EVENT_SIZE];
   };
+  //Added after the existing fields to keep the ABI.
+  uint32_t frame;		//Overbridge frame at time. Only set with a DLL.
 };
 
 struct ow_resampler_reporter
@@ -204,6 +255,20 @@ struct ow_resampler_reporter
   void *data;
 };
 
+//Adapter to use an ow_planar_process_t as the context process callback with ow_planar_process as the function and this as the data.
+//With the planar layout, the tracks point to the engine buffers and nothing is copied.
+struct ow_planar_process
+{
+  ow_planar_process_t process;
+  void *data;
+  ow_sample_layout_t layout;
+  int outputs;
+  int inputs;
+  float *o2h[OB_MAX_TRACKS];
+  float *h2o[OB_MAX_TRACKS];
+  float *mem;
+};
+
 struct ow_engine;
 struct ow_resampler;
 
@@ -217,16 +282,30 @@ void ow_free_usb_device_list (struct ow_usb_device *, size_t);
 void ow_free_device_desc (struct ow_device_desc *);
 
 int ow_get_device_desc_from_vid_pid (uint16_t, uint16_t,
-				     struct ow_device_desc *);
+				     const struct ow_device_desc **);
 
 int ow_get_usb_device_from_device_attrs (int, const char *,
 					 struct ow_usb_device **);
 
 void ow_set_thread_rt_priority (pthread_t, int);
 
+int ow_parse_cpu_list (const char *, uint64_t *);
+
+void ow_set_thread_affinity (pthread_t, uint64_t);
+
+int ow_set_thread_deadline (uint64_t, uint64_t);
+
 void ow_copy_device_desc_static (struct ow_device_desc *,
 				 const struct ow_device_desc_static *);
 
+int ow_planar_process_init (struct ow_planar_process *,
+			    const struct ow_device_desc *, ow_sample_layout_t,
+			    ow_planar_process_t, void *);
+
+void ow_planar_process_destroy (struct ow_planar_process *);
+
+void ow_planar_process (void *, const float *, float *, uint32_t);
+
 //Engine
 ow_err_t ow_engine_init_from_bus_address (struct ow_engine **, uint8_t,
 					  uint8_t, unsigned int,
@@ -253,10 +332,15 @@ int ow_engine_is_option (struct ow_engine *, ow_engine_option_t);
 
 void ow_engine_set_option (struct ow_engine *, ow_engine_option_t, int);
 
-struct ow_device_desc *ow_engine_get_device_desc (struct ow_engine *);
+const struct ow_device_desc *ow_engine_get_device_desc (struct ow_engine *);
 
 void ow_engine_stop (struct ow_engine *);
 
+//Times the engine has gone back to BOOT to restart the USB transfers, either to recover from errors or to change the blocks per transfer.
+unsigned int ow_engine_get_restarts (struct ow_engine *);
+
+unsigned int ow_engine_get_blocks_per_transfer (struct ow_engine *);
+
 void ow_engine_set_overbridge_name (struct ow_engine *, const char *);
 
 const char *ow_engine_get_overbridge_name (struct ow_engine *);
@@ -293,7 +377,7 @@ struct ow_engine *ow_resampler_get_engine (struct ow_resampler *);
 
 void ow_resampler_stop (struct ow_resampler *);
 
-void ow_resampler_set_buffer_size (struct ow_resampler *, uint32_t);
+ow_err_t ow_resampler_set_buffer_size (struct ow_resampler *, uint32_t);
 
 void ow_resampler_set_samplerate (struct ow_resampler *, uint32_t);
 
@@ -315,3 +399,5 @@ void ow_resampler_get_o2h_latency (struct ow_resampler *, size_t *, size_t *,
 				   size_t *);
 
 double ow_resampler_get_target_delay_ms (struct ow_resampler *);
+
+int64_t ow_resampler_get_o2h_host_frame (struct ow_resampler *, uint32_t);
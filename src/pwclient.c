@@ -0,0 +1,541 @@
+/*
+ *   pwclient.c
+ *   Copyright (C) 2021 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <pipewire/pipewire.h>
+#include <pipewire/filter.h>
+
+#include "utils.h"
+#include "common.h"
+#include "pwclient.h"
+
+#define MAX_LATENCY (8192 * 2)	//Same as in the JACK client.
+#define DSP_FORMAT "32 bit float mono audio"
+
+static uint32_t
+pwring_round_up (uint32_t size)
+{
+  uint32_t v = 1;
+  while (v < size)
+    {
+      v <<= 1;
+    }
+  return v;
+}
+
+static void
+pwring_init (struct pwring *ring, uint32_t size)
+{
+  ring->size = pwring_round_up (size);
+  ring->data = malloc (ring->size);
+  mlock (ring->data, ring->size);
+  spa_ringbuffer_init (&ring->ring);
+}
+
+static void
+pwring_destroy (struct pwring *ring)
+{
+  munlock (ring->data, ring->size);
+  free (ring->data);
+}
+
+static size_t
+pwring_read_space (void *data)
+{
+  uint32_t index;
+  struct pwring *ring = data;
+  return spa_ringbuffer_get_read_index (&ring->ring, &index);
+}
+
+static size_t
+pwring_write_space (void *data)
+{
+  uint32_t index;
+  struct pwring *ring = data;
+  return ring->size - spa_ringbuffer_get_write_index (&ring->ring, &index);
+}
+
+static size_t
+pwring_read (void *data, char *dst, size_t size)
+{
+  uint32_t index;
+  struct pwring *ring = data;
+  int32_t avail = spa_ringbuffer_get_read_index (&ring->ring, &index);
+
+  if (size > avail)
+    {
+      size = avail;
+    }
+
+  //A NULL destination just advances the read index.
+  if (dst)
+    {
+      spa_ringbuffer_read_data (&ring->ring, ring->data, ring->size,
+				index & (ring->size - 1), dst, size);
+    }
+  spa_ringbuffer_read_update (&ring->ring, index + size);
+
+  return dst ? size : 0;
+}
+
+static size_t
+pwring_write (void *data, const char *src, size_t size)
+{
+  uint32_t index;
+  struct pwring *ring = data;
+  int32_t filled = spa_ringbuffer_get_write_index (&ring->ring, &index);
+
+  if (size > ring->size - filled)
+    {
+      size = ring->size - filled;
+    }
+
+  spa_ringbuffer_write_data (&ring->ring, ring->data, ring->size,
+			     index & (ring->size - 1), src, size);
+  spa_ringbuffer_write_update (&ring->ring, index + size);
+
+  return size;
+}
+
+//Same clock as the nsec field of the PipeWire position clock.
+static uint64_t
+pwclient_get_time ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static void
+pwclient_audio_running (void *data)
+{
+  debug_print (1, "PipeWire audio running");
+}
+
+static void
+pwclient_silence (struct pwclient *pwclient, uint32_t nframes)
+{
+  float *buffer;
+  struct ow_engine *engine = ow_resampler_get_engine (pwclient->resampler);
+  const struct ow_device_desc *desc = ow_engine_get_device_desc (engine);
+
+  for (int i = 0; i < desc->outputs; i++)
+    {
+      buffer = pw_filter_get_dsp_buffer (pwclient->output_ports[i], nframes);
+      if (buffer)
+	{
+	  memset (buffer, 0, nframes * sizeof (float));
+	}
+    }
+}
+
+struct pwclient_settings
+{
+  uint32_t bufsize;
+  uint32_t samplerate;
+};
+
+//Ports without a buffer are replaced by scratch buffers so the copy helpers can handle all the tracks.
+//This allocates memory and resets the resampler so it runs in the main loop while the process callback outputs silence.
+static int
+pwclient_apply_settings (struct spa_loop *loop, bool async, uint32_t seq,
+			 const void *data, size_t size, void *user_data)
+{
+  struct pwclient *pwclient = user_data;
+  const struct pwclient_settings *settings = data;
+
+  if (settings->samplerate != pwclient->samplerate)
+    {
+      debug_print (1, "PipeWire sample rate: %d", settings->samplerate);
+      pwclient->samplerate = settings->samplerate;
+      ow_resampler_set_samplerate (pwclient->resampler,
+				   settings->samplerate);
+    }
+
+  if (settings->bufsize != pwclient->bufsize)
+    {
+      debug_print (1, "PipeWire quantum: %d", settings->bufsize);
+      pwclient->bufsize = settings->bufsize;
+      free (pwclient->discard);
+      free (pwclient->silence);
+      pwclient->discard = malloc (settings->bufsize * sizeof (float));
+      pwclient->silence = calloc (settings->bufsize, sizeof (float));
+      if (ow_resampler_set_buffer_size (pwclient->resampler,
+					settings->bufsize))
+	{
+	  //The process callback sees the stopped engine and quits the main loop.
+	  error_print ("Error while setting the buffer size. Stopping...");
+	  ow_resampler_stop (pwclient->resampler);
+	  return 0;
+	}
+    }
+
+  __atomic_store_n (&pwclient->reconfiguring, 0, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+static void
+pwclient_process_cb (void *data, struct spa_io_position *position)
+{
+  float *f;
+  float *buffer[OB_MAX_TRACKS];
+  struct pwclient_settings settings;
+  struct pwclient *pwclient = data;
+  uint32_t nframes = position->clock.duration;
+  uint32_t samplerate = position->clock.rate.denom;
+  uint64_t current_usecs = position->clock.nsec / 1000;
+  struct ow_engine *engine = ow_resampler_get_engine (pwclient->resampler);
+  const struct ow_device_desc *desc = ow_engine_get_device_desc (engine);
+  int h2o_audio = 0;
+
+  if (ow_engine_get_status (engine) <= OW_ENGINE_STATUS_STOP)
+    {
+      pwclient_silence (pwclient, nframes);
+      pw_main_loop_quit (pwclient->loop);
+      return;
+    }
+
+  if (__atomic_load_n (&pwclient->reconfiguring, __ATOMIC_ACQUIRE))
+    {
+      pwclient_silence (pwclient, nframes);
+      return;
+    }
+
+  //PipeWire does not notify quantum and rate changes so these are checked every cycle.
+  //Changes are rare and imply a resampler reset anyway.
+  if (samplerate != pwclient->samplerate || nframes != pwclient->bufsize)
+    {
+      settings.bufsize = nframes;
+      settings.samplerate = samplerate;
+      pwclient->reconfiguring = 1;
+      pw_loop_invoke (pw_main_loop_get_loop (pwclient->loop),
+		      pwclient_apply_settings, 0, &settings,
+		      sizeof (struct pwclient_settings), false, pwclient);
+      pwclient_silence (pwclient, nframes);
+      return;
+    }
+
+  if (ow_resampler_compute_ratios (pwclient->resampler, current_usecs,
+				   pwclient_audio_running, pwclient))
+    {
+      pwclient_silence (pwclient, nframes);
+      return;
+    }
+
+  //o2h
+
+  for (int i = 0; i < desc->outputs; i++)
+    {
+      buffer[i] = pw_filter_get_dsp_buffer (pwclient->output_ports[i],
+					    nframes);
+      if (!buffer[i])
+	{
+	  buffer[i] = pwclient->discard;
+	}
+    }
+
+  f = ow_resampler_get_o2h_audio_buffer (pwclient->resampler);
+  ow_resampler_read_audio (pwclient->resampler);
+  copy_o2h_audio (f, nframes, buffer, desc);
+
+  //h2o
+
+  for (int i = 0; i < desc->inputs; i++)
+    {
+      buffer[i] = pw_filter_get_dsp_buffer (pwclient->input_ports[i],
+					    nframes);
+      if (buffer[i])
+	{
+	  h2o_audio = 1;
+	}
+      else
+	{
+	  buffer[i] = pwclient->silence;
+	}
+    }
+
+  //Unconnected input ports have no buffer.
+  ow_engine_set_option (engine, OW_ENGINE_OPTION_P2O_AUDIO, h2o_audio);
+
+  if (h2o_audio)
+    {
+      f = ow_resampler_get_h2o_audio_buffer (pwclient->resampler);
+      copy_h2o_audio (f, nframes, buffer, desc);
+      ow_resampler_write_audio (pwclient->resampler);
+    }
+}
+
+static void
+pwclient_state_changed_cb (void *data, enum pw_filter_state old,
+			   enum pw_filter_state state, const char *error)
+{
+  struct pwclient *pwclient = data;
+
+  debug_print (1, "PipeWire filter state: %s",
+	       pw_filter_state_as_string (state));
+
+  if (state == PW_FILTER_STATE_ERROR)
+    {
+      error_print ("PipeWire filter error: %s", error);
+      pw_main_loop_quit (pwclient->loop);
+    }
+}
+
+static const struct pw_filter_events filter_events = {
+  .version = PW_VERSION_FILTER_EVENTS,
+  .state_changed = pwclient_state_changed_cb,
+  .process = pwclient_process_cb,
+};
+
+void
+pwclient_stop (struct pwclient *pwclient)
+{
+  debug_print (1, "Stopping client...");
+  if (pwclient->loop)
+    {
+      ow_resampler_report_status (pwclient->resampler);
+      pw_main_loop_quit (pwclient->loop);
+    }
+}
+
+int
+pwclient_init (struct pwclient *pwclient)
+{
+  struct ow_resampler *resampler;
+  struct ow_engine *engine;
+  ow_err_t err = ow_resampler_init_from_bus_address (&resampler,
+						     pwclient->bus,
+						     pwclient->address,
+						     pwclient->blocks_per_transfer,
+						     pwclient->xfr_timeout,
+						     pwclient->quality);
+  pwclient->running = 0;
+  pwclient->loop = NULL;
+
+  if (err)
+    {
+      error_print ("Overwitch error: %s", ow_get_err_str (err));
+      return -1;
+    }
+
+  pwclient->resampler = resampler;
+  engine = ow_resampler_get_engine (pwclient->resampler);
+  pwclient->name = ow_engine_get_overbridge_name (engine);
+
+  return 0;
+}
+
+void
+pwclient_destroy (struct pwclient *pwclient)
+{
+  ow_resampler_destroy (pwclient->resampler);
+}
+
+static int
+pwclient_add_ports (struct pwclient *pwclient)
+{
+  struct pw_properties *props;
+  struct ow_engine *engine = ow_resampler_get_engine (pwclient->resampler);
+  const struct ow_device_desc *desc = ow_engine_get_device_desc (engine);
+
+  debug_print (1, "Registering ports...");
+  pwclient->output_ports = malloc (sizeof (void *) * desc->outputs);
+  for (int i = 0; i < desc->outputs; i++)
+    {
+      const char *name = desc->output_track_names[i];
+      debug_print (2, "Registering output port %s...", name);
+      props = pw_properties_new (PW_KEY_FORMAT_DSP, DSP_FORMAT,
+				 PW_KEY_PORT_NAME, name, NULL);
+      pwclient->output_ports[i] = pw_filter_add_port (pwclient->filter,
+						      PW_DIRECTION_OUTPUT,
+						      PW_FILTER_PORT_FLAG_MAP_BUFFERS,
+						      0, props, NULL, 0);
+      if (pwclient->output_ports[i] == NULL)
+	{
+	  error_print ("Error while registering PipeWire port");
+	  return -1;
+	}
+    }
+
+  pwclient->input_ports = malloc (sizeof (void *) * desc->inputs);
+  for (int i = 0; i < desc->inputs; i++)
+    {
+      const char *name = desc->input_track_names[i];
+      debug_print (2, "Registering input port %s...", name);
+      props = pw_properties_new (PW_KEY_FORMAT_DSP, DSP_FORMAT,
+				 PW_KEY_PORT_NAME, name, NULL);
+      pwclient->input_ports[i] = pw_filter_add_port (pwclient->filter,
+						     PW_DIRECTION_INPUT,
+						     PW_FILTER_PORT_FLAG_MAP_BUFFERS,
+						     0, props, NULL, 0);
+      if (pwclient->input_ports[i] == NULL)
+	{
+	  error_print ("Error while registering PipeWire port");
+	  return -1;
+	}
+    }
+
+  return 0;
+}
+
+int
+pwclient_run (struct pwclient *pwclient)
+{
+  ow_err_t err = OW_OK;
+  struct pw_properties *props;
+
+  pwclient->output_ports = NULL;
+  pwclient->input_ports = NULL;
+  pwclient->discard = NULL;
+  pwclient->silence = NULL;
+  pwclient->bufsize = 0;
+  pwclient->samplerate = 0;
+  pwclient->reconfiguring = 0;
+
+  pwring_init (&pwclient->o2h_audio, MAX_LATENCY *
+	       ow_resampler_get_o2h_frame_size (pwclient->resampler));
+  pwring_init (&pwclient->h2o_audio, MAX_LATENCY *
+	       ow_resampler_get_h2o_frame_size (pwclient->resampler));
+
+  pwclient->context.o2h_audio = &pwclient->o2h_audio;
+  pwclient->context.h2o_audio = &pwclient->h2o_audio;
+  pwclient->context.o2h_midi = NULL;
+  pwclient->context.h2o_midi = NULL;
+
+  pwclient->context.read_space = pwring_read_space;
+  pwclient->context.write_space = pwring_write_space;
+  pwclient->context.read = pwring_read;
+  pwclient->context.write = pwring_write;
+  pwclient->context.process = NULL;
+  pwclient->context.layout = OW_SAMPLE_LAYOUT_INTERLEAVED;
+  pwclient->context.get_time = pwclient_get_time;
+  pwclient->context.h2o_midi_window = OW_DEFAULT_H2O_MIDI_WINDOW;
+
+  pwclient->context.set_rt_priority = NULL;
+  memset (&pwclient->context.sched, 0, sizeof (struct ow_sched));
+
+  //MIDI is not supported by this backend.
+  pwclient->context.options = OW_ENGINE_OPTION_O2P_AUDIO;
+
+  pwclient->loop = pw_main_loop_new (NULL);
+  if (!pwclient->loop)
+    {
+      error_print ("Unable to create PipeWire loop");
+      err = OW_GENERIC_ERROR;
+      goto cleanup_rings;
+    }
+
+  //The latency is a hint for the graph quantum. PIPEWIRE_LATENCY takes precedence.
+  props = pw_properties_new (PW_KEY_MEDIA_TYPE, "Audio",
+			     PW_KEY_MEDIA_CATEGORY, "Duplex",
+			     PW_KEY_MEDIA_ROLE, "DSP",
+			     PW_KEY_NODE_LATENCY, pwclient->latency, NULL);
+  //Running the graph at the device rate leaves only the clock drift to the resampler.
+  pw_properties_setf (props, PW_KEY_NODE_RATE, "1/%d", (int) OB_SAMPLE_RATE);
+
+  pwclient->filter = pw_filter_new_simple (pw_main_loop_get_loop
+					   (pwclient->loop), pwclient->name,
+					   props, &filter_events, pwclient);
+  if (!pwclient->filter)
+    {
+      error_print ("Unable to create PipeWire filter");
+      err = OW_GENERIC_ERROR;
+      goto cleanup_loop;
+    }
+
+  if (pwclient_add_ports (pwclient))
+    {
+      err = OW_GENERIC_ERROR;
+      goto cleanup_filter;
+    }
+
+  err = ow_resampler_start (pwclient->resampler, &pwclient->context);
+  if (err)
+    {
+      goto cleanup_filter;
+    }
+
+  if (pw_filter_connect (pwclient->filter, PW_FILTER_FLAG_RT_PROCESS, NULL,
+			 0) < 0)
+    {
+      error_print ("Cannot connect filter");
+      err = OW_GENERIC_ERROR;
+      ow_resampler_stop (pwclient->resampler);
+      ow_resampler_wait (pwclient->resampler);
+      goto cleanup_filter;
+    }
+
+  pw_main_loop_run (pwclient->loop);
+
+  debug_print (1, "Exiting...");
+  //Keep the error status if the engine already stopped by itself.
+  if (ow_engine_get_status (ow_resampler_get_engine (pwclient->resampler)) >
+      OW_ENGINE_STATUS_STOP)
+    {
+      ow_resampler_stop (pwclient->resampler);
+    }
+  ow_resampler_wait (pwclient->resampler);
+
+cleanup_filter:
+  pw_filter_destroy (pwclient->filter);
+cleanup_loop:
+  pw_main_loop_destroy (pwclient->loop);
+  pwclient->loop = NULL;
+cleanup_rings:
+  pwring_destroy (&pwclient->o2h_audio);
+  pwring_destroy (&pwclient->h2o_audio);
+  free (pwclient->output_ports);
+  free (pwclient->input_ports);
+  free (pwclient->discard);
+  free (pwclient->silence);
+  return err;
+}
+
+static void *
+pwclient_thread_runner (void *data)
+{
+  struct pwclient *pwclient = data;
+  pwclient_run (pwclient);
+  return NULL;
+}
+
+int
+pwclient_start (struct pwclient *pwclient)
+{
+  int err = pthread_create (&pwclient->thread, NULL, pwclient_thread_runner,
+			    pwclient);
+  pwclient->running = err ? 0 : 1;
+  return err;
+}
+
+void
+pwclient_wait (struct pwclient *pwclient)
+{
+  if (pwclient->running)
+    {
+      pthread_join (pwclient->thread, NULL);
+      pwclient->running = 0;
+    }
+}
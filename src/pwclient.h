@@ -0,0 +1,72 @@
+/*
+ *   pwclient.h
+ *   Copyright (C) 2021 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pipewire/pipewire.h>
+#include <spa/utils/ringbuffer.h>
+#include "overwitch.h"
+
+#define PWCLIENT_DEFAULT_LATENCY "128/48000"
+
+struct pwring
+{
+  struct spa_ringbuffer ring;
+  uint32_t size;		//Power of 2
+  uint8_t *data;
+};
+
+struct pwclient
+{
+  //PipeWire stuff
+  const char *name;
+  struct pw_main_loop *loop;
+  struct pw_filter *filter;
+  void **output_ports;
+  void **input_ports;
+  //Parameters
+  uint8_t bus;
+  uint8_t address;
+  unsigned int blocks_per_transfer;
+  unsigned int xfr_timeout;
+  int quality;
+  const char *latency;
+  uint32_t bufsize;
+  uint32_t samplerate;
+  int reconfiguring;
+  float *discard;
+  float *silence;
+  // Overwitch stuff
+  struct ow_resampler *resampler;
+  struct ow_context context;
+  struct pwring o2h_audio;
+  struct pwring h2o_audio;
+  // Thread stuff
+  int running;
+  pthread_t thread;
+};
+
+int pwclient_init (struct pwclient *);
+
+int pwclient_start (struct pwclient *);
+
+void pwclient_destroy (struct pwclient *);
+
+void pwclient_wait (struct pwclient *);
+
+void pwclient_stop (struct pwclient *);
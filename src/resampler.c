@@ -131,7 +131,7 @@ ow_resampler_clear_buffers (struct ow_resampler *resampler)
   ow_engine_clear_buffers (resampler->engine);
 }
 
-static void
+static int
 ow_resampler_reset_buffers (struct ow_resampler *resampler)
 {
   debug_print (2, "Resetting buffers...");
@@ -143,27 +143,54 @@ ow_resampler_reset_buffers (struct ow_resampler *resampler)
 
   if (resampler->h2o_aux)
     {
-      free (resampler->h2o_aux);
-      free (resampler->h2o_buf_out);
-      free (resampler->h2o_buf_in);
-      free (resampler->h2o_queue);
-      free (resampler->o2h_buf_in);
-      free (resampler->o2h_buf_out);
+      ow_arena_destroy (&resampler->arena);
     }
 
   //The 8 times scale allow up to more than 192 kHz sample rate in JACK.
-  resampler->h2o_buf_in = malloc (resampler->h2o_bufsize);
-  resampler->h2o_buf_out = malloc (resampler->h2o_bufsize * 8);
-  resampler->h2o_aux = malloc (resampler->h2o_bufsize * 8);
-  resampler->h2o_queue = malloc (resampler->h2o_bufsize * 8);
+  if (ow_arena_init (&resampler->arena,
+		     OW_CACHE_LINE_ALIGN (resampler->h2o_bufsize) +
+		     3 * OW_CACHE_LINE_ALIGN (resampler->h2o_bufsize * 8) +
+		     2 * OW_CACHE_LINE_ALIGN (resampler->o2h_bufsize)))
+    {
+      goto error;
+    }
+
+  resampler->h2o_buf_in = ow_arena_alloc (&resampler->arena,
+					  resampler->h2o_bufsize);
+  resampler->h2o_buf_out = ow_arena_alloc (&resampler->arena,
+					   resampler->h2o_bufsize * 8);
+  resampler->h2o_aux = ow_arena_alloc (&resampler->arena,
+				       resampler->h2o_bufsize * 8);
+  resampler->h2o_queue = ow_arena_alloc (&resampler->arena,
+					 resampler->h2o_bufsize * 8);
 
-  resampler->o2h_buf_in = malloc (resampler->o2h_bufsize);
-  resampler->o2h_buf_out = malloc (resampler->o2h_bufsize);
+  resampler->o2h_buf_in = ow_arena_alloc (&resampler->arena,
+					  resampler->o2h_bufsize);
+  resampler->o2h_buf_out = ow_arena_alloc (&resampler->arena,
+					   resampler->o2h_bufsize);
 
-  memset (resampler->h2o_aux, 0, resampler->h2o_bufsize);
-  memset (resampler->o2h_buf_in, 0, resampler->h2o_bufsize);
+  if (!resampler->h2o_buf_in || !resampler->h2o_buf_out ||
+      !resampler->h2o_aux || !resampler->h2o_queue ||
+      !resampler->o2h_buf_in || !resampler->o2h_buf_out)
+    {
+      goto error;
+    }
 
   ow_resampler_clear_buffers (resampler);
+
+  return 0;
+
+error:
+  error_print ("Error while allocating resampler buffers");
+  ow_arena_destroy (&resampler->arena);
+  //A NULL h2o_aux means that the buffers are not set.
+  resampler->h2o_buf_in = NULL;
+  resampler->h2o_buf_out = NULL;
+  resampler->h2o_aux = NULL;
+  resampler->h2o_queue = NULL;
+  resampler->o2h_buf_in = NULL;
+  resampler->o2h_buf_out = NULL;
+  return 1;
 }
 
 double
@@ -172,6 +199,16 @@ ow_resampler_get_target_delay_ms (struct ow_resampler *resampler)
   return resampler->dll.target_delay * 1000 / OB_SAMPLE_RATE;
 }
 
+//The DLL frames are the Overbridge frame played at the start of the host cycle as they are kept target_delay behind the device.
+//This must be called in the host process thread before reading the audio.
+int64_t
+ow_resampler_get_o2h_host_frame (struct ow_resampler *resampler,
+				 uint32_t frame)
+{
+  int32_t delta = frame - resampler->dll.frames;
+  return floor (delta * resampler->o2h_ratio);
+}
+
 static void
 ow_resampler_reset_dll (struct ow_resampler *resampler,
 			uint32_t new_samplerate)
@@ -268,10 +305,12 @@ resampler_o2h_reader (void *cb_data, float **data)
 	  resampler->engine->o2h_max_latency = 0;	// Any maximum values is invalid at this point
 	  pthread_spin_unlock (&resampler->engine->lock);
 
+	  ow_engine_report_xrun (resampler->engine);
+
 	  if (last_frames > 1)
 	    {
 	      uint64_t pos =
-		(last_frames - 1) * resampler->engine->device_desc.outputs;
+		(last_frames - 1) * resampler->engine->device_desc->outputs;
 	      memcpy (resampler->o2h_buf_in, &resampler->o2h_buf_in[pos],
 		      resampler->engine->o2h_frame_size);
 	    }
@@ -412,9 +451,22 @@ ow_resampler_compute_ratios (struct ow_resampler *resampler,
 			     void (*audio_running_cb) (void *), void *cb_data)
 {
   int xruns;
+  unsigned int restarts;
   ow_engine_status_t engine_status;
   struct ow_dll *dll = &resampler->dll;
-  static uint64_t tuning_start_usecs;
+
+  //The engine has restarted its transfers so the DLL must be booted again.
+  restarts = ow_engine_get_restarts (resampler->engine);
+  if (restarts != resampler->restarts)
+    {
+      debug_print (1, "%s: Engine restarted. Resetting resampler...",
+		   resampler->engine->name);
+      resampler->restarts = restarts;
+      ow_resampler_clear_buffers (resampler);
+      ow_resampler_reset_dll (resampler, resampler->samplerate);
+      ow_resampler_report_status (resampler);
+      return 1;
+    }
 
   pthread_spin_lock (&resampler->lock);
   xruns = resampler->xruns;
@@ -501,11 +553,11 @@ ow_resampler_compute_ratios (struct ow_resampler *resampler,
 	resampler->reporter.period * resampler->samplerate /
 	resampler->bufsize;
 
-      tuning_start_usecs = current_usecs;
+      resampler->tuning_start_usecs = current_usecs;
     }
 
   if (resampler->status == OW_RESAMPLER_STATUS_TUNE &&
-      current_usecs - tuning_start_usecs > TUNING_PERIOD_US)
+      current_usecs - resampler->tuning_start_usecs > TUNING_PERIOD_US)
     {
       debug_print (2, "Running resampler...");
 
@@ -516,6 +568,10 @@ ow_resampler_compute_ratios (struct ow_resampler *resampler,
 
       resampler->status = OW_RESAMPLER_STATUS_RUN;
 
+      debug_print (1, "%s: Time to run: %.1f ms",
+		   resampler->engine->name,
+		   (current_usecs - resampler->start_usecs) / 1000.0);
+
       audio_running_cb (cb_data);
     }
 
@@ -535,11 +591,17 @@ ow_resampler_init_from_bus_address (struct ow_resampler **resampler_,
 				    unsigned int blocks_per_transfer,
 				    unsigned int xfr_timeout, int quality)
 {
-  struct ow_resampler *resampler = malloc (sizeof (struct ow_resampler));
-  ow_err_t err = ow_engine_init_from_bus_address (&resampler->engine, bus,
-						  address,
-						  blocks_per_transfer,
-						  xfr_timeout);
+  struct ow_resampler *resampler;
+  ow_err_t err;
+
+  if (posix_memalign ((void **) &resampler, OW_CACHE_LINE_SIZE,
+		      sizeof (struct ow_resampler)))
+    {
+      return OW_GENERIC_ERROR;
+    }
+
+  err = ow_engine_init_from_bus_address (&resampler->engine, bus, address,
+					 blocks_per_transfer, xfr_timeout);
   if (err)
     {
       free (resampler);
@@ -558,10 +620,10 @@ ow_resampler_init_from_bus_address (struct ow_resampler **resampler_,
 
   resampler->h2o_state =
     src_callback_new (resampler_h2o_reader, quality,
-		      resampler->engine->device_desc.inputs, NULL, resampler);
+		      resampler->engine->device_desc->inputs, NULL, resampler);
   resampler->o2h_state =
     src_callback_new (resampler_o2h_reader, quality,
-		      resampler->engine->device_desc.outputs, NULL,
+		      resampler->engine->device_desc->outputs, NULL,
 		      resampler);
 
   pthread_spin_init (&resampler->lock, PTHREAD_PROCESS_SHARED);
@@ -582,12 +644,7 @@ ow_resampler_destroy (struct ow_resampler *resampler)
   src_delete (resampler->o2h_state);
   if (resampler->h2o_aux)
     {
-      free (resampler->h2o_aux);
-      free (resampler->h2o_buf_out);
-      free (resampler->h2o_buf_in);
-      free (resampler->h2o_queue);
-      free (resampler->o2h_buf_in);
-      free (resampler->o2h_buf_out);
+      ow_arena_destroy (&resampler->arena);
     }
   pthread_spin_destroy (&resampler->lock);
   ow_engine_destroy (resampler->engine);
@@ -601,8 +658,11 @@ ow_resampler_start (struct ow_resampler *resampler,
   context->dll = &resampler->dll;
   context->dll_overbridge_init = ow_dll_overbridge_init;
   context->dll_overbridge_update = ow_dll_overbridge_update;
+  context->dll_overbridge_get_frame = ow_dll_overbridge_get_frame;
 
   resampler->status = OW_RESAMPLER_STATUS_READY;
+  resampler->start_usecs = context->get_time ? context->get_time () : 0;
+  resampler->restarts = 0;
 
   return ow_engine_start (resampler->engine, context);
 }
@@ -630,6 +690,8 @@ ow_resampler_inc_xruns (struct ow_resampler *resampler)
   resampler->o2h_xruns++;
   resampler->h2o_xruns++;
   pthread_spin_unlock (&resampler->lock);
+
+  ow_engine_report_xrun (resampler->engine);
 }
 
 inline ow_resampler_status_t
@@ -650,7 +712,7 @@ ow_resampler_stop (struct ow_resampler *resampler)
   ow_engine_stop (resampler->engine);
 }
 
-inline void
+inline ow_err_t
 ow_resampler_set_buffer_size (struct ow_resampler *resampler,
 			      uint32_t bufsize)
 {
@@ -658,9 +720,15 @@ ow_resampler_set_buffer_size (struct ow_resampler *resampler,
     {
       debug_print (1, "Setting resampler buffer size to %d", bufsize);
       resampler->bufsize = bufsize;
-      ow_resampler_reset_buffers (resampler);
+      if (ow_resampler_reset_buffers (resampler))
+	{
+	  //Allow a later call with the same size to retry.
+	  resampler->bufsize = 0;
+	  return OW_GENERIC_ERROR;
+	}
       ow_resampler_reset_dll (resampler, resampler->samplerate);
     }
+  return OW_OK;
 }
 
 inline void
@@ -38,6 +38,8 @@ struct ow_resampler
   float *o2h_buf_in;
   float *o2h_buf_out;
   size_t h2o_queue_len;
+  uint64_t start_usecs;
+  uint64_t tuning_start_usecs;
   int log_control_cycles;
   int log_cycles;
   int xruns;
@@ -45,6 +47,7 @@ struct ow_resampler
   int o2h_xruns;
   pthread_spinlock_t lock;	//Used to synchronize access to xruns.
   int reading_at_o2h_end;
+  unsigned int restarts;	//Last engine restart seen.
   size_t o2h_bufsize;
   size_t h2o_bufsize;
   uint32_t bufsize;
@@ -52,4 +55,5 @@ struct ow_resampler
   double max_target_ratio;
   double min_target_ratio;
   struct ow_resampler_reporter reporter;
+  struct ow_arena arena;
 };
@@ -0,0 +1,454 @@
+/*
+ *   transpose.c
+ *   Copyright (C) 2021 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include "transpose.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TRANSPOSE_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define TRANSPOSE_NEON
+#endif
+
+typedef void (*transpose_t) (float *, uint32_t, float *[], int);
+
+static const char *ISA_NAMES[] = {
+  "scalar", "SSE", "AVX2", "NEON"
+};
+
+static transpose_isa_t isa = TRANSPOSE_ISA_MAX;
+
+//Interleaved and planar pointers go in the same order in every function so the same driver works in both directions.
+typedef void (*transpose_tile_t) (float *, size_t, float **, size_t);
+
+static inline void
+transpose_rect_to_planar (float *f, int channels, float *buffer[],
+			  uint32_t i0, uint32_t i1, int j0, int j1)
+{
+  for (uint32_t i = i0; i < i1; i++)
+    {
+      for (int j = j0; j < j1; j++)
+	{
+	  buffer[j][i] = f[i * channels + j];
+	}
+    }
+}
+
+static inline void
+transpose_rect_to_interleaved (float *f, int channels, float *buffer[],
+			       uint32_t i0, uint32_t i1, int j0, int j1)
+{
+  for (uint32_t i = i0; i < i1; i++)
+    {
+      for (int j = j0; j < j1; j++)
+	{
+	  f[i * channels + j] = buffer[j][i];
+	}
+    }
+}
+
+//Whole tiles go through the tile function and the edges are copied one sample at a time.
+//If there is a tile function for half the size, the channels left by the big tiles go through it.
+__attribute__((always_inline))
+static inline void
+transpose_tiled (float *f, uint32_t nframes, float *buffer[], int channels,
+		 int tile, transpose_tile_t transpose_tile,
+		 transpose_tile_t transpose_half_tile, int to_planar)
+{
+  int half = tile / 2;
+  uint32_t tframes = nframes - nframes % tile;
+  int bchannels = channels - channels % tile;
+  int tchannels = bchannels;
+
+  if (transpose_half_tile && channels - bchannels >= half)
+    {
+      tchannels += half;
+    }
+
+  //Going through the frames first keeps the buffers written sequentially.
+  for (int j = 0; j < bchannels; j += tile)
+    {
+      for (uint32_t i = 0; i < tframes; i += tile)
+	{
+	  transpose_tile (&f[i * channels + j], channels, &buffer[j], i);
+	}
+    }
+
+  if (tchannels > bchannels)
+    {
+      for (uint32_t i = 0; i < tframes; i += half)
+	{
+	  transpose_half_tile (&f[i * channels + bchannels], channels,
+			       &buffer[bchannels], i);
+	}
+    }
+
+  if (to_planar)
+    {
+      transpose_rect_to_planar (f, channels, buffer, 0, tframes, tchannels,
+				channels);
+      transpose_rect_to_planar (f, channels, buffer, tframes, nframes, 0,
+				channels);
+    }
+  else
+    {
+      transpose_rect_to_interleaved (f, channels, buffer, 0, tframes,
+				     tchannels, channels);
+      transpose_rect_to_interleaved (f, channels, buffer, tframes, nframes,
+				     0, channels);
+    }
+}
+
+static void
+transpose_to_planar_scalar (float *f, uint32_t nframes, float *buffer[],
+			    int channels)
+{
+  transpose_rect_to_planar (f, channels, buffer, 0, nframes, 0, channels);
+}
+
+static void
+transpose_to_interleaved_scalar (float *f, uint32_t nframes, float *buffer[],
+				 int channels)
+{
+  transpose_rect_to_interleaved (f, channels, buffer, 0, nframes, 0,
+				 channels);
+}
+
+#ifdef TRANSPOSE_X86
+
+__attribute__((target ("sse"), always_inline))
+static inline void
+transpose_tile_to_planar_sse (float *f, size_t stride, float **buffer,
+			      size_t offset)
+{
+  __m128 r0 = _mm_loadu_ps (f);
+  __m128 r1 = _mm_loadu_ps (f + stride);
+  __m128 r2 = _mm_loadu_ps (f + 2 * stride);
+  __m128 r3 = _mm_loadu_ps (f + 3 * stride);
+
+  _MM_TRANSPOSE4_PS (r0, r1, r2, r3);
+
+  _mm_storeu_ps (buffer[0] + offset, r0);
+  _mm_storeu_ps (buffer[1] + offset, r1);
+  _mm_storeu_ps (buffer[2] + offset, r2);
+  _mm_storeu_ps (buffer[3] + offset, r3);
+}
+
+__attribute__((target ("sse"), always_inline))
+static inline void
+transpose_tile_to_interleaved_sse (float *f, size_t stride, float **buffer,
+				   size_t offset)
+{
+  __m128 r0 = _mm_loadu_ps (buffer[0] + offset);
+  __m128 r1 = _mm_loadu_ps (buffer[1] + offset);
+  __m128 r2 = _mm_loadu_ps (buffer[2] + offset);
+  __m128 r3 = _mm_loadu_ps (buffer[3] + offset);
+
+  _MM_TRANSPOSE4_PS (r0, r1, r2, r3);
+
+  _mm_storeu_ps (f, r0);
+  _mm_storeu_ps (f + stride, r1);
+  _mm_storeu_ps (f + 2 * stride, r2);
+  _mm_storeu_ps (f + 3 * stride, r3);
+}
+
+__attribute__((target ("sse")))
+static void
+transpose_to_planar_sse (float *f, uint32_t nframes, float *buffer[],
+			 int channels)
+{
+  transpose_tiled (f, nframes, buffer, channels, 4,
+		   transpose_tile_to_planar_sse, NULL, 1);
+}
+
+__attribute__((target ("sse")))
+static void
+transpose_to_interleaved_sse (float *f, uint32_t nframes, float *buffer[],
+			      int channels)
+{
+  transpose_tiled (f, nframes, buffer, channels, 4,
+		   transpose_tile_to_interleaved_sse, NULL, 0);
+}
+
+//Rows 0 to 3 go in the low lanes and 4 to 7 in the high lanes so no lane crossing shuffles are needed.
+__attribute__((target ("avx2"), always_inline))
+static inline void
+transpose_8x8_avx2 (float *src[8], float *dst[8])
+{
+  __m256 r[8], t[8];
+
+  for (int i = 0; i < 4; i++)
+    {
+      r[i] = _mm256_insertf128_ps (_mm256_castps128_ps256
+				   (_mm_loadu_ps (src[i])),
+				   _mm_loadu_ps (src[i + 4]), 1);
+      r[i + 4] = _mm256_insertf128_ps (_mm256_castps128_ps256
+				       (_mm_loadu_ps (src[i] + 4)),
+				       _mm_loadu_ps (src[i + 4] + 4), 1);
+    }
+
+  for (int i = 0; i < 8; i += 2)
+    {
+      t[i] = _mm256_unpacklo_ps (r[i], r[i + 1]);
+      t[i + 1] = _mm256_unpackhi_ps (r[i], r[i + 1]);
+    }
+
+  for (int i = 0; i < 8; i += 4)
+    {
+      _mm256_storeu_ps (dst[i], _mm256_shuffle_ps (t[i], t[i + 2], 0x44));
+      _mm256_storeu_ps (dst[i + 1],
+			_mm256_shuffle_ps (t[i], t[i + 2], 0xee));
+      _mm256_storeu_ps (dst[i + 2],
+			_mm256_shuffle_ps (t[i + 1], t[i + 3], 0x44));
+      _mm256_storeu_ps (dst[i + 3],
+			_mm256_shuffle_ps (t[i + 1], t[i + 3], 0xee));
+    }
+}
+
+__attribute__((target ("avx2"), always_inline))
+static inline void
+transpose_tile_to_planar_avx2 (float *f, size_t stride, float **buffer,
+			       size_t offset)
+{
+  float *src[8], *dst[8];
+
+  for (int i = 0; i < 8; i++)
+    {
+      src[i] = f + i * stride;
+      dst[i] = buffer[i] + offset;
+    }
+
+  transpose_8x8_avx2 (src, dst);
+}
+
+__attribute__((target ("avx2"), always_inline))
+static inline void
+transpose_tile_to_interleaved_avx2 (float *f, size_t stride, float **buffer,
+				    size_t offset)
+{
+  float *src[8], *dst[8];
+
+  for (int i = 0; i < 8; i++)
+    {
+      src[i] = buffer[i] + offset;
+      dst[i] = f + i * stride;
+    }
+
+  transpose_8x8_avx2 (src, dst);
+}
+
+__attribute__((target ("avx2")))
+static void
+transpose_to_planar_avx2 (float *f, uint32_t nframes, float *buffer[],
+			  int channels)
+{
+  transpose_tiled (f, nframes, buffer, channels, 8,
+		   transpose_tile_to_planar_avx2,
+		   transpose_tile_to_planar_sse, 1);
+}
+
+__attribute__((target ("avx2")))
+static void
+transpose_to_interleaved_avx2 (float *f, uint32_t nframes, float *buffer[],
+			       int channels)
+{
+  transpose_tiled (f, nframes, buffer, channels, 8,
+		   transpose_tile_to_interleaved_avx2,
+		   transpose_tile_to_interleaved_sse, 0);
+}
+
+#endif
+
+#ifdef TRANSPOSE_NEON
+
+static inline void
+transpose_4x4_neon (float32x4_t r[4])
+{
+  float32x4x2_t a = vtrnq_f32 (r[0], r[1]);
+  float32x4x2_t b = vtrnq_f32 (r[2], r[3]);
+
+  r[0] = vcombine_f32 (vget_low_f32 (a.val[0]), vget_low_f32 (b.val[0]));
+  r[1] = vcombine_f32 (vget_low_f32 (a.val[1]), vget_low_f32 (b.val[1]));
+  r[2] = vcombine_f32 (vget_high_f32 (a.val[0]), vget_high_f32 (b.val[0]));
+  r[3] = vcombine_f32 (vget_high_f32 (a.val[1]), vget_high_f32 (b.val[1]));
+}
+
+static inline void
+transpose_tile_to_planar_neon (float *f, size_t stride, float **buffer,
+			       size_t offset)
+{
+  float32x4_t r[4];
+
+  for (int i = 0; i < 4; i++)
+    {
+      r[i] = vld1q_f32 (f + i * stride);
+    }
+
+  transpose_4x4_neon (r);
+
+  for (int i = 0; i < 4; i++)
+    {
+      vst1q_f32 (buffer[i] + offset, r[i]);
+    }
+}
+
+static inline void
+transpose_tile_to_interleaved_neon (float *f, size_t stride, float **buffer,
+				    size_t offset)
+{
+  float32x4_t r[4];
+
+  for (int i = 0; i < 4; i++)
+    {
+      r[i] = vld1q_f32 (buffer[i] + offset);
+    }
+
+  transpose_4x4_neon (r);
+
+  for (int i = 0; i < 4; i++)
+    {
+      vst1q_f32 (f + i * stride, r[i]);
+    }
+}
+
+static void
+transpose_to_planar_neon (float *f, uint32_t nframes, float *buffer[],
+			  int channels)
+{
+  transpose_tiled (f, nframes, buffer, channels, 4,
+		   transpose_tile_to_planar_neon, NULL, 1);
+}
+
+static void
+transpose_to_interleaved_neon (float *f, uint32_t nframes, float *buffer[],
+			       int channels)
+{
+  transpose_tiled (f, nframes, buffer, channels, 4,
+		   transpose_tile_to_interleaved_neon, NULL, 0);
+}
+
+#endif
+
+static const transpose_t TO_PLANAR[] = {
+  transpose_to_planar_scalar,
+#ifdef TRANSPOSE_X86
+  transpose_to_planar_sse,
+  transpose_to_planar_avx2,
+#else
+  NULL,
+  NULL,
+#endif
+#ifdef TRANSPOSE_NEON
+  transpose_to_planar_neon
+#else
+  NULL
+#endif
+};
+
+static const transpose_t TO_INTERLEAVED[] = {
+  transpose_to_interleaved_scalar,
+#ifdef TRANSPOSE_X86
+  transpose_to_interleaved_sse,
+  transpose_to_interleaved_avx2,
+#else
+  NULL,
+  NULL,
+#endif
+#ifdef TRANSPOSE_NEON
+  transpose_to_interleaved_neon
+#else
+  NULL
+#endif
+};
+
+int
+transpose_is_isa_supported (transpose_isa_t i)
+{
+  switch (i)
+    {
+    case TRANSPOSE_ISA_SCALAR:
+      return 1;
+#ifdef TRANSPOSE_X86
+    case TRANSPOSE_ISA_SSE:
+      return __builtin_cpu_supports ("sse");
+    case TRANSPOSE_ISA_AVX2:
+      return __builtin_cpu_supports ("avx2");
+#endif
+#ifdef TRANSPOSE_NEON
+    case TRANSPOSE_ISA_NEON:
+      return 1;
+#endif
+    default:
+      return 0;
+    }
+}
+
+transpose_isa_t
+transpose_get_isa ()
+{
+  //Racing threads would choose the same.
+  if (isa == TRANSPOSE_ISA_MAX)
+    {
+      isa = TRANSPOSE_ISA_SCALAR;
+      for (int i = TRANSPOSE_ISA_MAX - 1; i > TRANSPOSE_ISA_SCALAR; i--)
+	{
+	  if (transpose_is_isa_supported (i))
+	    {
+	      isa = i;
+	      break;
+	    }
+	}
+    }
+  return isa;
+}
+
+int
+transpose_set_isa (transpose_isa_t i)
+{
+  if (i >= TRANSPOSE_ISA_MAX || !transpose_is_isa_supported (i))
+    {
+      return 1;
+    }
+  isa = i;
+  return 0;
+}
+
+const char *
+transpose_get_isa_name (transpose_isa_t i)
+{
+  return i < TRANSPOSE_ISA_MAX ? ISA_NAMES[i] : "unknown";
+}
+
+void
+transpose_to_planar (const float *f, uint32_t nframes, float *buffer[],
+		     int channels)
+{
+  //The interleaved buffer is only read in this direction.
+  TO_PLANAR[transpose_get_isa ()] ((float *) f, nframes, buffer, channels);
+}
+
+void
+transpose_to_interleaved (float *f, uint32_t nframes, float *buffer[],
+			  int channels)
+{
+  TO_INTERLEAVED[transpose_get_isa ()] (f, nframes, buffer, channels);
+}
@@ -0,0 +1,48 @@
+/*
+ *   transpose.h
+ *   Copyright (C) 2021 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+//Copies between interleaved frames and a buffer per channel.
+//Both are done in square tiles transposed in SIMD registers when the CPU allows it, which is bit exact as samples are only moved.
+
+typedef enum
+{
+  TRANSPOSE_ISA_SCALAR,
+  TRANSPOSE_ISA_SSE,		//4x4 tiles
+  TRANSPOSE_ISA_AVX2,		//8x8 tiles
+  TRANSPOSE_ISA_NEON,		//4x4 tiles
+  TRANSPOSE_ISA_MAX
+} transpose_isa_t;
+
+void transpose_to_planar (const float *, uint32_t, float *[], int);
+
+void transpose_to_interleaved (float *, uint32_t, float *[], int);
+
+int transpose_is_isa_supported (transpose_isa_t);
+
+//The best supported ISA is used by default. Returns 1 if the ISA is not supported.
+int transpose_set_isa (transpose_isa_t);
+
+transpose_isa_t transpose_get_isa ();
+
+const char *transpose_get_isa_name (transpose_isa_t);
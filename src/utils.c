@@ -21,6 +21,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <wordexp.h>
+#include <libgen.h>
+#include <sys/mman.h>
 #define _GNU_SOURCE
 #include "utils.h"
 
@@ -41,3 +43,92 @@ get_expanded_dir (const char *exp)
 
   return exp_dir;
 }
+
+int
+ow_arena_init (struct ow_arena *arena, size_t size)
+{
+  long page_size = sysconf (_SC_PAGESIZE);
+
+  //Page aligned so that locking does not affect other allocations.
+  arena->size = (size + page_size - 1) & ~((size_t) page_size - 1);
+  arena->used = 0;
+  if (posix_memalign ((void **) &arena->data, page_size, arena->size))
+    {
+      error_print ("Error while allocating arena (%zu B)", arena->size);
+      arena->data = NULL;
+      return 1;
+    }
+
+  arena->locked = !mlock (arena->data, arena->size);
+  if (!arena->locked)
+    {
+      debug_print (1, "Arena (%zu B) could not be locked in memory",
+		   arena->size);
+    }
+
+  //Pre-fault every page even if the arena is not locked.
+  memset (arena->data, 0, arena->size);
+
+  debug_print (2, "Arena of %zu B allocated", arena->size);
+
+  return 0;
+}
+
+void *
+ow_arena_alloc (struct ow_arena *arena, size_t size)
+{
+  void *p;
+  size_t len = OW_CACHE_LINE_ALIGN (size);
+
+  if (arena->used + len > arena->size)
+    {
+      error_print ("Arena exhausted (%zu B requested, %zu B available)",
+		   len, arena->size - arena->used);
+      return NULL;
+    }
+
+  p = arena->data + arena->used;
+  arena->used += len;
+  return p;
+}
+
+void
+ow_arena_destroy (struct ow_arena *arena)
+{
+  if (!arena->data)
+    {
+      return;
+    }
+
+  if (arena->locked)
+    {
+      munlock (arena->data, arena->size);
+    }
+  free (arena->data);
+  arena->data = NULL;
+}
+
+void
+print_help (const char *executable_path, const char *package_string,
+	    struct option *option, const char *fixed_params)
+{
+  char *exec_name;
+  char *executable_path_copy = strdup (executable_path);
+
+  fprintf (stderr, "%s\n", package_string);
+  exec_name = basename (executable_path_copy);
+  fprintf (stderr, "Usage: %s [options]%s%s\n", exec_name,
+	   fixed_params ? " " : "", fixed_params ? fixed_params : "");
+  fprintf (stderr, "Options:\n");
+  while (option->name)
+    {
+      fprintf (stderr, "  --%s, -%c", option->name, option->val);
+      if (option->has_arg)
+	{
+	  fprintf (stderr, " value");
+	}
+      fprintf (stderr, "\n");
+      option++;
+    }
+  free (executable_path_copy);
+}
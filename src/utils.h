@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <getopt.h>
 #include "../config.h"
 #if defined(JSON_DEVS_FILE) && !defined(OW_TESTING)
 #include <json-glib/json-glib.h>
@@ -41,12 +42,36 @@
 }
 
 #define error_print(format, ...) { \
-  gboolean tty = isatty(fileno(stderr)); \
-  const gchar * color_start = tty ? "\x1b[31m" : ""; \
-  const gchar * color_end = tty ? "\x1b[m" : ""; \
+  int tty = isatty(fileno(stderr)); \
+  const char * color_start = tty ? "\x1b[31m" : ""; \
+  const char * color_end = tty ? "\x1b[m" : ""; \
   fprintf(stderr, "%sERROR:" __FILE__ ":%d:%s: " format "%s\n", color_start, __LINE__, __FUNCTION__, ## __VA_ARGS__, color_end); \
 }
 
+#define OW_CACHE_LINE_SIZE 64
+
+#define OW_CACHE_LINE_ALIGNED __attribute__ ((aligned (OW_CACHE_LINE_SIZE)))
+
+#define OW_CACHE_LINE_ALIGN(size) (((size) + OW_CACHE_LINE_SIZE - 1) & ~((size_t) OW_CACHE_LINE_SIZE - 1))
+
 extern int debug_level;
 
+//Single allocation for all the buffers used by the RT threads.
+//Every chunk is cache line aligned and the whole arena is pre-faulted and locked in memory if allowed.
+struct ow_arena
+{
+  uint8_t *data;
+  size_t size;
+  size_t used;
+  int locked;
+};
+
 char *get_expanded_dir (const char *);
+
+int ow_arena_init (struct ow_arena *, size_t);
+
+void *ow_arena_alloc (struct ow_arena *, size_t);
+
+void ow_arena_destroy (struct ow_arena *);
+
+void print_help (const char *, const char *, struct option *, const char *);
@@ -0,0 +1,88 @@
+//Measures the copies between the interleaved resampler buffers and the host ports with every supported ISA.
+//This is run as bench-transpose [channels] [frames] [iterations].
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../src/transpose.h"
+
+#define DEFAULT_CHANNELS 20
+#define DEFAULT_FRAMES 1024
+#define DEFAULT_ITERATIONS 100000
+
+static double
+bench_elapsed_ns (struct timespec *start, struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1e9 + end->tv_nsec -
+    start->tv_nsec;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct timespec start, end;
+  double to_planar_ns, to_interleaved_ns;
+  float *interleaved;
+  float **planar;
+  int channels = argc > 1 ? atoi (argv[1]) : DEFAULT_CHANNELS;
+  int frames = argc > 2 ? atoi (argv[2]) : DEFAULT_FRAMES;
+  long iterations = argc > 3 ? atol (argv[3]) : DEFAULT_ITERATIONS;
+
+  if (channels <= 0 || frames <= 0 || iterations <= 0)
+    {
+      fprintf (stderr, "Usage: %s [channels] [frames] [iterations]\n",
+	       argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  interleaved = malloc (sizeof (float) * channels * frames);
+  planar = malloc (sizeof (float *) * channels);
+  for (int i = 0; i < channels; i++)
+    {
+      planar[i] = malloc (sizeof (float) * frames);
+    }
+  for (int i = 0; i < channels * frames; i++)
+    {
+      interleaved[i] = i;
+    }
+
+  printf ("Channels: %d; frames: %d; iterations: %ld\n", channels, frames,
+	  iterations);
+
+  for (transpose_isa_t isa = TRANSPOSE_ISA_SCALAR; isa < TRANSPOSE_ISA_MAX;
+       isa++)
+    {
+      if (transpose_set_isa (isa))
+	{
+	  continue;
+	}
+
+      clock_gettime (CLOCK_MONOTONIC, &start);
+      for (long i = 0; i < iterations; i++)
+	{
+	  transpose_to_planar (interleaved, frames, planar, channels);
+	}
+      clock_gettime (CLOCK_MONOTONIC, &end);
+      to_planar_ns = bench_elapsed_ns (&start, &end) / iterations;
+
+      clock_gettime (CLOCK_MONOTONIC, &start);
+      for (long i = 0; i < iterations; i++)
+	{
+	  transpose_to_interleaved (interleaved, frames, planar, channels);
+	}
+      clock_gettime (CLOCK_MONOTONIC, &end);
+      to_interleaved_ns = bench_elapsed_ns (&start, &end) / iterations;
+
+      printf ("%s: to planar: %.1f ns; to interleaved: %.1f ns\n",
+	      transpose_get_isa_name (isa), to_planar_ns, to_interleaved_ns);
+    }
+
+  for (int i = 0; i < channels; i++)
+    {
+      free (planar[i]);
+    }
+  free (planar);
+  free (interleaved);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,295 @@
+/*
+ *   bench.c
+ *   Copyright (C) 2021 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Measures the cost of the engine fields written by different threads sharing cache lines.
+//Every device runs an audio thread and an h2o MIDI thread on different cores.
+//They write the same fields the engine threads write, first in the engine struct as it was before being split in regions and then in the current one.
+//This is run as bench [devices] [iterations].
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include "../src/engine.h"
+
+#define DEFAULT_DEVICES 1
+#define DEFAULT_ITERATIONS 10000000
+
+//The engine struct before it was split in regions.
+struct ow_engine_unsplit
+{
+  char name[OW_LABEL_MAX_LEN];
+  char overbridge_name[OB_NAME_MAX_LEN];
+  ow_engine_status_t status;
+  unsigned int blocks_per_transfer;
+  unsigned int frames_per_transfer;
+  pthread_spinlock_t lock;
+  size_t o2h_latency;
+  size_t o2h_min_latency;
+  size_t o2h_max_latency;
+  size_t h2o_latency;
+  size_t h2o_min_latency;
+  size_t h2o_max_latency;
+  pthread_t audio_o2h_midi_thread;
+  pthread_t h2o_midi_thread;
+  const struct ow_device_desc *device_desc;
+  size_t h2o_transfer_size;
+  size_t o2h_transfer_size;
+  float *h2o_transfer_buf;
+  float *o2h_transfer_buf;
+  size_t o2h_frame_size;
+  size_t h2o_frame_size;
+  struct
+  {
+    libusb_context *context;
+    libusb_device_handle *device_handle;
+    unsigned int xfr_timeout;
+    //Audio
+    uint16_t audio_frames_counter;
+    struct libusb_transfer *xfr_audio_in;
+    struct libusb_transfer *xfr_audio_out;
+    uint8_t *xfr_audio_in_data;
+    uint8_t *xfr_audio_out_data;
+    size_t audio_in_blk_len;
+    size_t audio_out_blk_len;
+    int xfr_audio_in_data_len;
+    int xfr_audio_out_data_len;
+    //MIDI
+    struct libusb_transfer *xfr_midi_out;
+    struct libusb_transfer *xfr_midi_in;
+    uint8_t *xfr_midi_out_data;
+    uint8_t *xfr_midi_in_data;
+    //Control
+    struct libusb_transfer *xfr_control_out;
+    struct libusb_transfer *xfr_control_in;
+    uint8_t *xfr_control_out_data;
+    uint8_t *xfr_control_in_data;
+  } usb;
+  //j2o resampler
+  float *h2o_resampler_buf;
+  SRC_DATA h2o_data;
+  //MIDI
+  int reading_at_h2o_end;
+  pthread_spinlock_t h2o_midi_lock;
+  int h2o_midi_ready;
+  int h2o_midi_status;
+  //Recovery
+  int recovering;
+  int xfrs_in_flight;
+  unsigned int restarts;
+  unsigned int recovery_attempts;
+  uint64_t recovery_window_start;
+  //Blocks per transfer controller
+  struct
+  {
+    int enabled;
+    unsigned int blocks;
+    unsigned int min_blocks;
+    unsigned int stable_windows;
+    unsigned int frames;
+    unsigned int underflows;
+    unsigned int xruns;
+    uint64_t last_xfr_time;
+    uint64_t max_jitter;
+  } auto_blocks;
+  struct ow_context *context;
+  struct ow_arena arena;
+};
+
+struct bench_fields
+{
+  size_t *o2h_latency;
+  size_t *h2o_latency;
+  uint16_t *audio_frames_counter;
+  int *reading_at_h2o_end;
+  int *xfrs_in_flight;
+  pthread_spinlock_t *h2o_midi_lock;
+  int *h2o_midi_ready;
+  int *h2o_midi_status;
+};
+
+struct bench_thread
+{
+  pthread_t thread;
+  int cpu;
+  long iterations;
+  struct bench_fields *fields;
+};
+
+static void
+bench_pin (int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO (&set);
+  CPU_SET (cpu, &set);
+  pthread_setaffinity_np (pthread_self (), sizeof (set), &set);
+}
+
+static void *
+bench_audio_thread (void *data)
+{
+  struct bench_thread *t = data;
+  struct bench_fields *f = t->fields;
+
+  bench_pin (t->cpu);
+  for (long i = 0; i < t->iterations; i++)
+    {
+      __atomic_store_n (f->o2h_latency, i, __ATOMIC_RELAXED);
+      __atomic_store_n (f->h2o_latency, i, __ATOMIC_RELAXED);
+      __atomic_store_n (f->audio_frames_counter, i * OB_FRAMES_PER_BLOCK,
+			__ATOMIC_RELAXED);
+      __atomic_store_n (f->reading_at_h2o_end, i & 1, __ATOMIC_RELAXED);
+      __atomic_store_n (f->xfrs_in_flight, i & 7, __ATOMIC_RELAXED);
+    }
+
+  return NULL;
+}
+
+//The MIDI thread updates its fields under the h2o MIDI lock.
+static void *
+bench_midi_thread (void *data)
+{
+  struct bench_thread *t = data;
+  struct bench_fields *f = t->fields;
+
+  bench_pin (t->cpu);
+  for (long i = 0; i < t->iterations; i++)
+    {
+      pthread_spin_lock (f->h2o_midi_lock);
+      *f->h2o_midi_ready = i & 1;
+      *f->h2o_midi_status = i & 3;
+      pthread_spin_unlock (f->h2o_midi_lock);
+    }
+
+  return NULL;
+}
+
+static double
+bench_run (struct bench_fields *fields, int devices, long iterations)
+{
+  struct timespec start, end;
+  long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  struct bench_thread *threads = malloc (sizeof (struct bench_thread) *
+					 devices * 2);
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+
+  for (int i = 0; i < devices; i++)
+    {
+      for (int j = 0; j < 2; j++)
+	{
+	  struct bench_thread *t = &threads[i * 2 + j];
+	  t->cpu = (i * 2 + j) % cpus;
+	  t->iterations = iterations;
+	  t->fields = &fields[i];
+	  pthread_create (&t->thread, NULL,
+			  j ? bench_midi_thread : bench_audio_thread, t);
+	}
+    }
+
+  for (int i = 0; i < devices * 2; i++)
+    {
+      pthread_join (threads[i].thread, NULL);
+    }
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+
+  free (threads);
+
+  return ((end.tv_sec - start.tv_sec) * 1e9 + end.tv_nsec -
+	  start.tv_nsec) / iterations;
+}
+
+int
+main (int argc, char *argv[])
+{
+  double unsplit_ns, split_ns;
+  struct ow_engine_unsplit *unsplit;
+  struct ow_engine *engines;
+  struct bench_fields *fields;
+  int devices = argc > 1 ? atoi (argv[1]) : DEFAULT_DEVICES;
+  long iterations = argc > 2 ? atol (argv[2]) : DEFAULT_ITERATIONS;
+
+  if (devices <= 0 || iterations <= 0)
+    {
+      fprintf (stderr, "Usage: %s [devices] [iterations]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  fields = malloc (sizeof (struct bench_fields) * devices);
+
+  //Both layouts are allocated the same way the engine is.
+  if (posix_memalign ((void **) &unsplit, OW_CACHE_LINE_SIZE,
+		      sizeof (struct ow_engine_unsplit) * devices))
+    {
+      return EXIT_FAILURE;
+    }
+  memset (unsplit, 0, sizeof (struct ow_engine_unsplit) * devices);
+  for (int i = 0; i < devices; i++)
+    {
+      pthread_spin_init (&unsplit[i].h2o_midi_lock, PTHREAD_PROCESS_SHARED);
+      fields[i].o2h_latency = &unsplit[i].o2h_latency;
+      fields[i].h2o_latency = &unsplit[i].h2o_latency;
+      fields[i].audio_frames_counter = &unsplit[i].usb.audio_frames_counter;
+      fields[i].reading_at_h2o_end = &unsplit[i].reading_at_h2o_end;
+      fields[i].xfrs_in_flight = &unsplit[i].xfrs_in_flight;
+      fields[i].h2o_midi_lock = &unsplit[i].h2o_midi_lock;
+      fields[i].h2o_midi_ready = &unsplit[i].h2o_midi_ready;
+      fields[i].h2o_midi_status = &unsplit[i].h2o_midi_status;
+    }
+  unsplit_ns = bench_run (fields, devices, iterations);
+
+  if (posix_memalign ((void **) &engines, OW_CACHE_LINE_SIZE,
+		      sizeof (struct ow_engine) * devices))
+    {
+      return EXIT_FAILURE;
+    }
+  memset (engines, 0, sizeof (struct ow_engine) * devices);
+  for (int i = 0; i < devices; i++)
+    {
+      pthread_spin_init (&engines[i].h2o_midi_lock, PTHREAD_PROCESS_SHARED);
+      fields[i].o2h_latency = &engines[i].o2h_latency;
+      fields[i].h2o_latency = &engines[i].h2o_latency;
+      fields[i].audio_frames_counter = &engines[i].audio_frames_counter;
+      fields[i].reading_at_h2o_end = &engines[i].reading_at_h2o_end;
+      fields[i].xfrs_in_flight = &engines[i].xfrs_in_flight;
+      fields[i].h2o_midi_lock = &engines[i].h2o_midi_lock;
+      fields[i].h2o_midi_ready = &engines[i].h2o_midi_ready[0];
+      fields[i].h2o_midi_status = &engines[i].h2o_midi_status;
+    }
+  split_ns = bench_run (fields, devices, iterations);
+
+  printf ("Devices: %d; threads: %d; iterations: %ld\n", devices,
+	  devices * 2, iterations);
+  printf ("Unsplit layout (%zu B): %.2f ns per iteration\n",
+	  sizeof (struct ow_engine_unsplit), unsplit_ns);
+  printf ("Split layout (%zu B): %.2f ns per iteration\n",
+	  sizeof (struct ow_engine), split_ns);
+
+  free (unsplit);
+  free (engines);
+  free (fields);
+
+  return EXIT_SUCCESS;
+}
@@ -1,9 +1,19 @@
 #include <string.h>
+#include <stddef.h>
 #include <math.h>
+#include <sched.h>
+#include <pthread.h>
 #include <CUnit/CUnit.h>
 #include <CUnit/Basic.h>
 #include "../src/jclient.h"
 #include "../src/engine.h"
+#include "../src/devices.h"
+#include "../src/hotplug.h"
+#include "../src/dll.h"
+#include "../src/midibench.h"
+#include "../src/transpose.h"
+#include "../src/common.h"
+#include "../src/capture.h"
 
 #define OW_CONV_SCALE_32 (1.0f / (float) INT_MAX)
 #define BLOCKS 4
@@ -23,11 +33,13 @@ void
 test_sizes ()
 {
   struct ow_engine engine;
+  struct ow_device_desc desc;
 
   printf ("\n");
 
-  ow_copy_device_desc_static (&engine.device_desc, &TESTDEV_DESC);
-  ow_engine_init_mem (&engine, BLOCKS);
+  ow_copy_device_desc_static (&desc, &TESTDEV_DESC);
+  engine.device_desc = &desc;
+  CU_ASSERT_EQUAL_FATAL (ow_engine_init_mem (&engine, BLOCKS), 0);
 
   printf ("\n");
 
@@ -36,7 +48,13 @@ test_sizes ()
   CU_ASSERT_EQUAL (engine.usb.audio_in_blk_len,
 		   TRACKS * OB_FRAMES_PER_BLOCK * OB_BYTES_PER_SAMPLE + 32);
 
+  //The MIDI event layout is part of the library ABI.
+  CU_ASSERT_EQUAL (offsetof (struct ow_midi_event, time), 0);
+  CU_ASSERT_EQUAL (offsetof (struct ow_midi_event, packet),
+		   sizeof (uint64_t));
+
   ow_engine_free_mem (&engine);
+  ow_free_device_desc (&desc);
 }
 
 void
@@ -45,10 +63,12 @@ test_usb_blocks ()
   float *a, *b;
   size_t blk_size;
   struct ow_engine engine;
+  struct ow_device_desc desc;
 
   printf ("\n");
 
-  ow_copy_device_desc_static (&engine.device_desc, &TESTDEV_DESC);
+  ow_copy_device_desc_static (&desc, &TESTDEV_DESC);
+  engine.device_desc = &desc;
   ow_engine_init_mem (&engine, BLOCKS);
 
   blk_size =
@@ -58,12 +78,12 @@ test_usb_blocks ()
   CU_ASSERT_EQUAL (engine.usb.audio_out_blk_len, blk_size);
   CU_ASSERT_EQUAL (engine.usb.audio_in_blk_len, blk_size);
 
-  a = engine.p2o_transfer_buf;
+  a = engine.h2o_transfer_buf;
   for (int i = 0; i < BLOCKS; i++)
     {
       for (int j = 0; j < OB_FRAMES_PER_BLOCK; j++)
 	{
-	  for (int k = 0; k < engine.device_desc.outputs; k++)
+	  for (int k = 0; k < engine.device_desc->outputs; k++)
 	    {
 	      *a = 1e-8 * (i + 1) * (k + 1);
 	      a++;
@@ -89,13 +109,13 @@ test_usb_blocks ()
 
   ow_engine_read_usb_input_blocks (&engine);
 
-  a = engine.p2o_transfer_buf;
-  b = engine.o2p_transfer_buf;
+  a = engine.h2o_transfer_buf;
+  b = engine.o2h_transfer_buf;
   for (int i = 0; i < BLOCKS; i++)
     {
       for (int j = 0; j < OB_FRAMES_PER_BLOCK; j++)
 	{
-	  for (int k = 0; k < engine.device_desc.outputs; k++)
+	  for (int k = 0; k < engine.device_desc->outputs; k++)
 	    {
 	      float error = fabsf (*a - *b);
 	      CU_ASSERT_TRUE (error < 1e-8);
@@ -107,6 +127,7 @@ test_usb_blocks ()
     }
 
   ow_engine_free_mem (&engine);
+  ow_free_device_desc (&desc);
 }
 
 void
@@ -117,10 +138,12 @@ test_jack_buffers ()
   float input[TRACKS * NFRAMES];
   float output[TRACKS * NFRAMES];
   struct ow_engine engine;
+  struct ow_device_desc desc;
 
   printf ("\n");
 
-  ow_copy_device_desc_static (&engine.device_desc, &TESTDEV_DESC);
+  ow_copy_device_desc_static (&desc, &TESTDEV_DESC);
+  engine.device_desc = &desc;
 
   for (int i = 0; i < TRACKS; i++)
     {
@@ -133,12 +156,12 @@ test_jack_buffers ()
 	}
     }
 
-  jclient_copy_j2o_audio (output, NFRAMES, jack_input, &engine.device_desc);
+  jclient_copy_j2o_audio (output, NFRAMES, jack_input, engine.device_desc);
 
   memcpy (input, output,
 	  TRACKS * NFRAMES * sizeof (jack_default_audio_sample_t));
 
-  jclient_copy_o2j_audio (input, NFRAMES, jack_output, &engine.device_desc);
+  jclient_copy_o2j_audio (input, NFRAMES, jack_output, engine.device_desc);
 
   for (int i = 0; i < TRACKS; i++)
     {
@@ -151,6 +174,953 @@ test_jack_buffers ()
       free (jack_input[i]);
       free (jack_output[i]);
     }
+
+  ow_free_device_desc (&desc);
+}
+
+//Unconnected ports are neither read nor written and unconnected inputs are silent.
+void
+test_masked_copy ()
+{
+  float *planar[TRACKS];
+  float interleaved[TRACKS * NFRAMES];
+  float output[TRACKS * NFRAMES];
+  uint64_t mask = 0x25;
+  struct ow_device_desc desc;
+
+  ow_copy_device_desc_static (&desc, &TESTDEV_DESC);
+
+  for (int i = 0; i < TRACKS * NFRAMES; i++)
+    {
+      interleaved[i] = i + 1;
+    }
+
+  for (int i = 0; i < TRACKS; i++)
+    {
+      planar[i] = mask & (1ULL << i) ? malloc (sizeof (float) * NFRAMES) :
+	NULL;
+    }
+
+  copy_o2h_audio_masked (interleaved, NFRAMES, planar, &desc, mask);
+  copy_h2o_audio_masked (output, NFRAMES, planar, &desc, mask);
+
+  for (int i = 0; i < TRACKS; i++)
+    {
+      for (int j = 0; j < NFRAMES; j++)
+	{
+	  float expected = mask & (1ULL << i) ? interleaved[j * TRACKS + i] :
+	    0;
+	  CU_ASSERT_EQUAL (output[j * TRACKS + i], expected);
+	}
+      free (planar[i]);
+    }
+
+  ow_free_device_desc (&desc);
+}
+
+#define CAPTURE_TEST_FRAMES 16
+
+//Only the masked channels are kept and a read skips what was overwritten.
+void
+test_capture ()
+{
+  struct capture capture;
+  float src[4 * CAPTURE_TEST_FRAMES * 2];
+  float dst[3 * CAPTURE_TEST_FRAMES];
+  uint64_t pos = 0;
+  uint64_t lost = 0;
+  uint32_t len;
+
+  for (int i = 0; i < 4 * CAPTURE_TEST_FRAMES * 2; i++)
+    {
+      src[i] = i;
+    }
+
+  CU_ASSERT_EQUAL (capture_init (&capture, 3, CAPTURE_TEST_FRAMES), 0);
+
+  capture_write (&capture, src, 4, 0xb, 10);
+  len = capture_read (&capture, &pos, dst, CAPTURE_TEST_FRAMES, &lost);
+  CU_ASSERT_EQUAL (len, 10);
+  CU_ASSERT_EQUAL (pos, 10);
+  CU_ASSERT_EQUAL (lost, 0);
+  for (int i = 0; i < 10; i++)
+    {
+      CU_ASSERT_EQUAL (dst[i * 3], src[i * 4]);
+      CU_ASSERT_EQUAL (dst[i * 3 + 1], src[i * 4 + 1]);
+      CU_ASSERT_EQUAL (dst[i * 3 + 2], src[i * 4 + 3]);
+    }
+
+  capture_write (&capture, &src[40], 4, 0xb, 20);
+  CU_ASSERT_EQUAL (capture_get_head (&capture), 30);
+  CU_ASSERT_EQUAL (capture_get_tail (&capture), 14);
+
+  pos = 0;
+  len = capture_read (&capture, &pos, dst, CAPTURE_TEST_FRAMES, &lost);
+  CU_ASSERT_EQUAL (len, CAPTURE_TEST_FRAMES);
+  CU_ASSERT_EQUAL (pos, 30);
+  CU_ASSERT_EQUAL (lost, 14);
+  for (int i = 0; i < CAPTURE_TEST_FRAMES; i++)
+    {
+      CU_ASSERT_EQUAL (dst[i * 3], src[(i + 14) * 4]);
+      CU_ASSERT_EQUAL (dst[i * 3 + 2], src[(i + 14) * 4 + 3]);
+    }
+
+  capture_destroy (&capture);
+}
+
+#define TRANSPOSE_TEST_CHANNELS 20
+#define TRANSPOSE_TEST_FRAMES 1027
+
+//Every supported ISA must give the same bytes as the scalar copy, edges included.
+void
+test_transpose ()
+{
+  float *planar[TRANSPOSE_TEST_CHANNELS];
+  float *expected[TRANSPOSE_TEST_CHANNELS];
+  size_t size = sizeof (float) * TRANSPOSE_TEST_CHANNELS *
+    TRANSPOSE_TEST_FRAMES;
+  float *interleaved = malloc (size);
+  float *output = malloc (size);
+  transpose_isa_t isa = transpose_get_isa ();
+
+  for (int i = 0; i < TRANSPOSE_TEST_CHANNELS; i++)
+    {
+      planar[i] = malloc (sizeof (float) * TRANSPOSE_TEST_FRAMES);
+      expected[i] = malloc (sizeof (float) * TRANSPOSE_TEST_FRAMES);
+    }
+  for (int i = 0; i < TRANSPOSE_TEST_CHANNELS * TRANSPOSE_TEST_FRAMES; i++)
+    {
+      interleaved[i] = 1e-8 * (i + 1);
+    }
+
+  CU_ASSERT_EQUAL (transpose_set_isa (TRANSPOSE_ISA_SCALAR), 0);
+  transpose_to_planar (interleaved, TRANSPOSE_TEST_FRAMES, expected,
+		       TRANSPOSE_TEST_CHANNELS);
+
+  for (transpose_isa_t i = TRANSPOSE_ISA_SCALAR; i < TRANSPOSE_ISA_MAX; i++)
+    {
+      if (transpose_set_isa (i))
+	{
+	  continue;
+	}
+
+      printf ("\nISA: %s", transpose_get_isa_name (i));
+
+      for (int j = 0; j < TRANSPOSE_TEST_CHANNELS; j++)
+	{
+	  memset (planar[j], 0, sizeof (float) * TRANSPOSE_TEST_FRAMES);
+	}
+      transpose_to_planar (interleaved, TRANSPOSE_TEST_FRAMES, planar,
+			   TRANSPOSE_TEST_CHANNELS);
+      for (int j = 0; j < TRANSPOSE_TEST_CHANNELS; j++)
+	{
+	  CU_ASSERT_EQUAL (memcmp (planar[j], expected[j],
+				   sizeof (float) * TRANSPOSE_TEST_FRAMES),
+			   0);
+	}
+
+      memset (output, 0, size);
+      transpose_to_interleaved (output, TRANSPOSE_TEST_FRAMES, planar,
+				TRANSPOSE_TEST_CHANNELS);
+      CU_ASSERT_EQUAL (memcmp (output, interleaved, size), 0);
+    }
+  printf ("\n");
+
+  transpose_set_isa (isa);
+
+  for (int i = 0; i < TRANSPOSE_TEST_CHANNELS; i++)
+    {
+      free (planar[i]);
+      free (expected[i]);
+    }
+  free (interleaved);
+  free (output);
+}
+
+void
+test_device_desc_registry ()
+{
+  const struct ow_device_desc *a, *b;
+
+  CU_ASSERT_EQUAL (ow_get_device_desc_from_vid_pid (0x1935, 0x000c, &a), 0);
+  CU_ASSERT_EQUAL (ow_get_device_desc_from_vid_pid (0x1935, 0x000c, &b), 0);
+  CU_ASSERT_PTR_EQUAL (a, b);
+  CU_ASSERT_EQUAL (a->pid, 0x000c);
+  CU_ASSERT_STRING_EQUAL (a->name, "Digitakt");
+
+  CU_ASSERT_EQUAL (ow_get_device_desc_from_vid_pid (0x1935, 0x0020, &b), 0);
+  CU_ASSERT_EQUAL (b->pid, 0x0020);
+
+  CU_ASSERT_NOT_EQUAL (ow_get_device_desc_from_vid_pid (0x1935, 0xffff, &b),
+		       0);
+  CU_ASSERT_NOT_EQUAL (ow_get_device_desc_from_vid_pid (0x0000, 0x000c, &b),
+		       0);
+}
+
+void
+test_device_sizes ()
+{
+  struct ow_engine engine;
+  struct ow_device_desc desc;
+  const struct ow_device_sizes *sizes;
+
+  for (size_t i = 0; i < OW_DEVICE_DESCS_LEN; i++)
+    {
+      sizes = ow_get_device_sizes (&OW_DEVICE_DESCS[i], OW_DEFAULT_BLOCKS);
+      CU_ASSERT_PTR_NOT_NULL_FATAL (sizes);
+
+      //An unknown PID forces the engine to compute the sizes.
+      desc = OW_DEVICE_DESCS[i];
+      desc.pid = 0;
+      CU_ASSERT_PTR_NULL (ow_get_device_sizes (&desc, OW_DEFAULT_BLOCKS));
+
+      engine.device_desc = &desc;
+      ow_engine_init_mem (&engine, OW_DEFAULT_BLOCKS);
+
+      CU_ASSERT_EQUAL (sizes->o2h_frame_size, engine.o2h_frame_size);
+      CU_ASSERT_EQUAL (sizes->h2o_frame_size, engine.h2o_frame_size);
+      CU_ASSERT_EQUAL (sizes->audio_in_blk_len, engine.usb.audio_in_blk_len);
+      CU_ASSERT_EQUAL (sizes->audio_out_blk_len,
+		       engine.usb.audio_out_blk_len);
+      CU_ASSERT_EQUAL (sizes->o2h_transfer_size, engine.o2h_transfer_size);
+      CU_ASSERT_EQUAL (sizes->h2o_transfer_size, engine.h2o_transfer_size);
+      CU_ASSERT_EQUAL (sizes->xfr_audio_in_data_len,
+		       engine.usb.xfr_audio_in_data_len);
+      CU_ASSERT_EQUAL (sizes->xfr_audio_out_data_len,
+		       engine.usb.xfr_audio_out_data_len);
+
+      ow_engine_free_mem (&engine);
+    }
+
+  CU_ASSERT_PTR_NULL (ow_get_device_sizes (&OW_DEVICE_DESCS[0],
+					   OW_DEFAULT_BLOCKS + 1));
+}
+
+void
+test_auto_blocks ()
+{
+  struct ow_engine engine;
+  struct ow_device_desc desc;
+
+  ow_copy_device_desc_static (&desc, &TESTDEV_DESC);
+  engine.device_desc = &desc;
+  ow_engine_init_mem (&engine, OW_AUTO_BLOCKS);
+
+  CU_ASSERT_TRUE (engine.auto_blocks.enabled);
+  CU_ASSERT_TRUE (engine.blocks_per_transfer >= OW_MIN_BLOCKS);
+  CU_ASSERT_TRUE (engine.blocks_per_transfer < OW_DEFAULT_BLOCKS);
+  CU_ASSERT_EQUAL (engine.auto_blocks.blocks, engine.blocks_per_transfer);
+  CU_ASSERT_EQUAL (engine.frames_per_transfer,
+		   engine.blocks_per_transfer * OB_FRAMES_PER_BLOCK);
+  CU_ASSERT_EQUAL (engine.usb.xfr_audio_in_data_len,
+		   engine.blocks_per_transfer * engine.usb.audio_in_blk_len);
+  CU_ASSERT_EQUAL (engine.h2o_transfer_size,
+		   engine.frames_per_transfer * engine.h2o_frame_size);
+
+  ow_engine_free_mem (&engine);
+
+  ow_engine_init_mem (&engine, OW_MAX_BLOCKS);
+  CU_ASSERT_FALSE (engine.auto_blocks.enabled);
+  CU_ASSERT_EQUAL (engine.blocks_per_transfer, OW_MAX_BLOCKS);
+  ow_engine_free_mem (&engine);
+
+  ow_free_device_desc (&desc);
+}
+
+void
+test_arena ()
+{
+  struct ow_arena arena;
+  uint8_t *a, *b;
+
+  CU_ASSERT_EQUAL_FATAL (ow_arena_init (&arena, 1000), 0);
+  CU_ASSERT_TRUE (arena.size >= 1000);
+
+  a = ow_arena_alloc (&arena, 1);
+  b = ow_arena_alloc (&arena, 100);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (a);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (b);
+  CU_ASSERT_EQUAL ((uintptr_t) a % OW_CACHE_LINE_SIZE, 0);
+  CU_ASSERT_EQUAL ((uintptr_t) b % OW_CACHE_LINE_SIZE, 0);
+  CU_ASSERT_EQUAL (b - a, OW_CACHE_LINE_SIZE);
+  CU_ASSERT_EQUAL (*b, 0);
+
+  CU_ASSERT_PTR_NULL (ow_arena_alloc (&arena, arena.size));
+
+  ow_arena_destroy (&arena);
+}
+
+void
+test_cpu_list ()
+{
+  uint64_t cpus;
+
+  CU_ASSERT_EQUAL (ow_parse_cpu_list ("0-3,6", &cpus), 0);
+  CU_ASSERT_EQUAL (cpus, 0x4f);
+
+  CU_ASSERT_EQUAL (ow_parse_cpu_list ("63", &cpus), 0);
+  CU_ASSERT_EQUAL (cpus, ((uint64_t) 1) << 63);
+
+  CU_ASSERT_EQUAL (ow_parse_cpu_list ("", &cpus), 0);
+  CU_ASSERT_EQUAL (cpus, 0);
+
+  CU_ASSERT_NOT_EQUAL (ow_parse_cpu_list ("3-1", &cpus), 0);
+  CU_ASSERT_NOT_EQUAL (ow_parse_cpu_list ("64", &cpus), 0);
+  CU_ASSERT_NOT_EQUAL (ow_parse_cpu_list ("1,", &cpus), 0);
+  CU_ASSERT_NOT_EQUAL (ow_parse_cpu_list ("a", &cpus), 0);
+}
+
+static void
+planar_loopback (void *data, const float *const *o2h, float *const *h2o,
+		 uint32_t frames)
+{
+  int *calls = data;
+
+  (*calls)++;
+  for (int i = 0; i < frames; i++)
+    {
+      h2o[0][i] = o2h[1][i];
+      h2o[1][i] = o2h[0][i];
+    }
+}
+
+void
+test_planar_process ()
+{
+  struct ow_planar_process planar;
+  struct ow_device_desc desc;
+  float o2h[OB_FRAMES_PER_BLOCK * 2];
+  float h2o[OB_FRAMES_PER_BLOCK * 2];
+  int calls = 0;
+
+  desc.outputs = 2;
+  desc.inputs = 2;
+
+  CU_ASSERT_EQUAL_FATAL (ow_planar_process_init (&planar, &desc,
+						 OW_SAMPLE_LAYOUT_INTERLEAVED,
+						 planar_loopback, &calls),
+			 0);
+
+  for (int i = 0; i < OB_FRAMES_PER_BLOCK * 2; i++)
+    {
+      o2h[i] = i;
+    }
+
+  ow_planar_process (&planar, o2h, h2o, OB_FRAMES_PER_BLOCK);
+
+  CU_ASSERT_EQUAL (calls, 1);
+  CU_ASSERT_EQUAL (planar.o2h[0][1], 2);
+  CU_ASSERT_EQUAL (planar.o2h[1][1], 3);
+  for (int i = 0; i < OB_FRAMES_PER_BLOCK; i++)
+    {
+      CU_ASSERT_EQUAL (h2o[i * 2], o2h[i * 2 + 1]);
+      CU_ASSERT_EQUAL (h2o[i * 2 + 1], o2h[i * 2]);
+    }
+
+  ow_planar_process_destroy (&planar);
+}
+
+void
+test_planar_blocks ()
+{
+  struct ow_engine engine;
+  struct ow_device_desc desc;
+  struct ow_planar_process planar;
+  float *f;
+  int calls = 0;
+
+  ow_copy_device_desc_static (&desc, &TESTDEV_DESC);
+  engine.device_desc = &desc;
+  ow_engine_init_mem (&engine, BLOCKS);
+
+  //Track k, frame i
+  f = engine.h2o_transfer_buf;
+  for (int k = 0; k < desc.inputs; k++)
+    {
+      for (int i = 0; i < engine.frames_per_transfer; i++)
+	{
+	  *f = 1e-4 * (k + 1) + 1e-7 * i;
+	  f++;
+	}
+    }
+
+  ow_engine_write_usb_output_blocks_planar (&engine);
+
+  //The first sample of the second block is the frame 7 of the first track.
+  CU_ASSERT_EQUAL (be32toh (GET_NTH_OUTPUT_USB_BLK (&engine, 1)->data[0]),
+		   (int32_t) (engine.h2o_transfer_buf[OB_FRAMES_PER_BLOCK] *
+			      INT_MAX));
+
+  memcpy (engine.usb.xfr_audio_in_data, engine.usb.xfr_audio_out_data,
+	  engine.usb.xfr_audio_in_data_len);
+
+  ow_engine_read_usb_input_blocks_planar (&engine);
+
+  for (int i = 0; i < engine.frames_per_transfer * desc.outputs; i++)
+    {
+      CU_ASSERT_TRUE (fabsf (engine.h2o_transfer_buf[i] -
+			     engine.o2h_transfer_buf[i]) < 1e-8);
+    }
+
+  //No copies with the planar layout.
+  CU_ASSERT_EQUAL_FATAL (ow_planar_process_init (&planar, &desc,
+						 OW_SAMPLE_LAYOUT_PLANAR,
+						 planar_loopback, &calls),
+			 0);
+  CU_ASSERT_PTR_NULL (planar.mem);
+  ow_planar_process (&planar, engine.o2h_transfer_buf,
+		     engine.h2o_transfer_buf, engine.frames_per_transfer);
+  CU_ASSERT_EQUAL (calls, 1);
+  CU_ASSERT_PTR_EQUAL (planar.o2h[1],
+		       engine.o2h_transfer_buf + engine.frames_per_transfer);
+  CU_ASSERT_PTR_EQUAL (planar.h2o[0], engine.h2o_transfer_buf);
+  CU_ASSERT_EQUAL (engine.h2o_transfer_buf[0],
+		   engine.o2h_transfer_buf[engine.frames_per_transfer]);
+  ow_planar_process_destroy (&planar);
+
+  ow_engine_free_mem (&engine);
+  ow_free_device_desc (&desc);
+}
+
+#define DLL_TEST_FRAMES 168
+#define DLL_TEST_PERIOD_US 3500
+
+//MIDI events are stamped with the Overbridge frame interpolated between transfers.
+//The DLL boots with i0 one transfer ahead of the update time, so the frames are a transfer behind i0.frames and wrap in the first transfer.
+//That offset only goes away as the loop converges, so the frames are compared as deltas from the frame at every update.
+void
+test_dll_frames ()
+{
+  struct ow_dll dll;
+  uint64_t t = 1000;
+  uint32_t frame, first, last;
+  int32_t expected;
+
+  ow_dll_host_init (&dll);
+  ow_dll_overbridge_init (&dll, OB_SAMPLE_RATE, DLL_TEST_FRAMES);
+
+  ow_dll_overbridge_update (&dll, DLL_TEST_FRAMES, t);
+  frame = ow_dll_overbridge_get_frame (&dll, t);
+  CU_ASSERT (abs ((int32_t) (frame - dll.dll_overbridge.i0.frames) +
+		  DLL_TEST_FRAMES) <= 1);
+
+  last = frame;
+  for (int i = 0; i < 100; i++)
+    {
+      if (i)
+	{
+	  ow_dll_overbridge_update (&dll, DLL_TEST_FRAMES, t);
+	}
+      first = ow_dll_overbridge_get_frame (&dll, t);
+      for (int j = 0; j < DLL_TEST_PERIOD_US; j += 500)
+	{
+	  frame = ow_dll_overbridge_get_frame (&dll, t + j);
+	  expected = DLL_TEST_FRAMES * j / DLL_TEST_PERIOD_US;
+	  CU_ASSERT (abs ((int32_t) (frame - first) - expected) <= 1);
+	  CU_ASSERT ((int32_t) (frame - last) >= 0);
+	  last = frame;
+	}
+      t += DLL_TEST_PERIOD_US;
+    }
+
+  //Half a transfer after the last update
+  t -= DLL_TEST_PERIOD_US;
+  frame = ow_dll_overbridge_get_frame (&dll, t + DLL_TEST_PERIOD_US / 2);
+  first = ow_dll_overbridge_get_frame (&dll, t);
+  CU_ASSERT (abs ((int32_t) (frame - first) - DLL_TEST_FRAMES / 2) <= 1);
+}
+
+#define ALIGN_TEST_DEVICES 2
+#define ALIGN_TEST_FRAMES (OB_FRAMES_PER_BLOCK * 24)
+#define ALIGN_TEST_START_US 10000000
+#define ALIGN_TEST_END_US 70000000
+
+//Devices started at different times and running at different rates must record the same host time span.
+//Every transfer is handled as the recorder does. The start and end frames are set at the first transfer that reaches them.
+void
+test_record_alignment ()
+{
+  struct ow_dll dll;
+  uint64_t received, start, end, t;
+  double expected;
+  double rates[ALIGN_TEST_DEVICES] = { OB_SAMPLE_RATE,
+    OB_SAMPLE_RATE * 1.0001
+  };
+  uint64_t offsets[ALIGN_TEST_DEVICES] = { 1000, 3456 };
+  uint64_t period;
+
+  for (int i = 0; i < ALIGN_TEST_DEVICES; i++)
+    {
+      ow_dll_host_init (&dll);
+      ow_dll_overbridge_init (&dll, OB_SAMPLE_RATE, ALIGN_TEST_FRAMES);
+      received = 0;
+      start = UINT64_MAX;
+      end = UINT64_MAX;
+      period = ALIGN_TEST_FRAMES * 1000000ULL / OB_SAMPLE_RATE;
+
+      for (int k = 1; end == UINT64_MAX; k++)
+	{
+	  t = offsets[i] + k * ALIGN_TEST_FRAMES * 1e6 / rates[i];
+	  ow_dll_overbridge_update (&dll, ALIGN_TEST_FRAMES, t);
+	  received += ALIGN_TEST_FRAMES;
+
+	  if (start == UINT64_MAX && t + period >= ALIGN_TEST_START_US)
+	    {
+	      start = ow_dll_overbridge_get_abs_frame (&dll, received,
+						       ALIGN_TEST_START_US);
+	    }
+
+	  if (t + period >= ALIGN_TEST_END_US)
+	    {
+	      end = ow_dll_overbridge_get_abs_frame (&dll, received,
+						     ALIGN_TEST_END_US);
+	    }
+	}
+
+      expected = (ALIGN_TEST_START_US - offsets[i]) * rates[i] / 1e6;
+      printf ("Device %d: start: %lu (%.1f); end: %lu; frames: %lu\n", i,
+	      start, expected, end, end - start);
+      CU_ASSERT (fabs (start - expected) <= 1);
+      expected = (ALIGN_TEST_END_US - offsets[i]) * rates[i] / 1e6;
+      CU_ASSERT (fabs (end - expected) <= 1);
+      expected = (ALIGN_TEST_END_US - ALIGN_TEST_START_US) * rates[i] / 1e6;
+      CU_ASSERT (fabs ((end - start) - expected) <= 1);
+    }
+}
+
+#define MIDI_BENCH_TEST_CLOCKS 500
+#define MIDI_BENCH_TEST_PROBES 50
+
+//Recorded clock and probe traffic is replayed through the measurements.
+void
+test_midi_bench_replay ()
+{
+  char *buf;
+  size_t size;
+  FILE *file;
+  struct midi_bench bench;
+  struct midi_bench_report report;
+  struct midi_bench_event event;
+
+  file = open_memstream (&buf, &size);
+
+  event.dir = MIDI_BENCH_IN;
+  event.len = 1;
+  event.data[0] = MIDI_BENCH_START;
+  event.time = 0;
+  midi_bench_write_event (file, &event);
+
+  event.data[0] = MIDI_BENCH_CLOCK;
+  for (int i = 0; i < MIDI_BENCH_TEST_CLOCKS; i++)
+    {
+      event.time = 1000 + i * 20833 + (i % 2 ? 100 : 0);
+      midi_bench_write_event (file, &event);
+    }
+
+  event.len = 3;
+  for (int i = 0; i < MIDI_BENCH_TEST_PROBES; i++)
+    {
+      event.data[0] = 0x9f;
+      event.data[1] = i;
+      event.data[2] = 0x7f;
+      event.dir = MIDI_BENCH_OUT;
+      event.time = 20000000 + i * 100000;
+      midi_bench_write_event (file, &event);
+      //Note offs are not probes.
+      event.data[0] = 0x8f;
+      event.data[2] = 0;
+      midi_bench_write_event (file, &event);
+      event.data[0] = 0x9f;
+      event.data[2] = 0x7f;
+      event.dir = MIDI_BENCH_IN;
+      event.time += 2000 + (i % 10) * 100;
+      midi_bench_write_event (file, &event);
+    }
+
+  //Not echoed and then sent again
+  event.dir = MIDI_BENCH_OUT;
+  event.data[1] = 127;
+  midi_bench_write_event (file, &event);
+  midi_bench_write_event (file, &event);
+
+  fclose (file);
+
+  CU_ASSERT_EQUAL (midi_bench_init (&bench, 15), 0);
+  file = fmemopen (buf, size, "r");
+  CU_ASSERT_EQUAL (midi_bench_replay (&bench, file),
+		   1 + MIDI_BENCH_TEST_CLOCKS + MIDI_BENCH_TEST_PROBES * 3 +
+		   2);
+  fclose (file);
+  free (buf);
+
+  midi_bench_stats_report (&bench.clock, &report);
+  CU_ASSERT_EQUAL (report.count, MIDI_BENCH_TEST_CLOCKS - 1);
+  CU_ASSERT_EQUAL (report.min, 20733);
+  CU_ASSERT_EQUAL (report.max, 20933);
+  CU_ASSERT (fabs (report.mean - 20833) < 1);
+
+  midi_bench_stats_report (&bench.latency, &report);
+  CU_ASSERT_EQUAL (report.count, MIDI_BENCH_TEST_PROBES);
+  CU_ASSERT_EQUAL (report.min, 2000);
+  CU_ASSERT_EQUAL (report.p50, 2400);
+  CU_ASSERT_EQUAL (report.p90, 2800);
+  CU_ASSERT_EQUAL (report.p99, 2900);
+  CU_ASSERT_EQUAL (report.max, 2900);
+
+  CU_ASSERT_EQUAL (bench.lost_probes, 1);
+
+  midi_bench_destroy (&bench);
+}
+
+static void
+h2o_midi_push (jack_ringbuffer_t * rb, uint64_t time, uint8_t note)
+{
+  struct ow_midi_event event;
+
+  memset (&event, 0, sizeof (event));
+  event.time = time;
+  event.packet.header = 0x09;
+  event.packet.data[0] = 0x90;
+  event.packet.data[1] = note;
+  event.packet.data[2] = 0x64;
+  jack_ringbuffer_write (rb, (void *) &event, sizeof (event));
+}
+
+//Events due within the window from now go in the same transfer and the offset survives the queue being empty.
+void
+test_h2o_midi_batches ()
+{
+  struct ow_engine engine;
+  struct ow_context context;
+  uint8_t buf[OB_MIDI_EVENT_SIZE * 4];
+  jack_ringbuffer_t *rb = jack_ringbuffer_create (64 *
+						  sizeof (struct
+							  ow_midi_event));
+
+  memset (&engine, 0, sizeof (engine));
+  memset (&context, 0, sizeof (context));
+  context.h2o_midi = rb;
+  context.read_space = (ow_buffer_rw_space_t) jack_ringbuffer_read_space;
+  context.read = (ow_buffer_read_t) jack_ringbuffer_read;
+  engine.context = &context;
+  engine.h2o_midi_window = 1000;
+
+  h2o_midi_push (rb, 0, 0);
+  h2o_midi_push (rb, 500, 1);
+  h2o_midi_push (rb, 1000, 2);
+  h2o_midi_push (rb, 1001, 3);
+
+  //The first event sets the offset.
+  ow_engine_sync_h2o_midi (&engine, 10000, 0);
+  CU_ASSERT_EQUAL (engine.h2o_midi_offset, 10000);
+
+  //The last event is due after the window so it is kept for the next transfer.
+  CU_ASSERT_EQUAL (ow_engine_pack_h2o_midi (&engine, buf, sizeof (buf),
+					    10000), OB_MIDI_EVENT_SIZE * 3);
+  CU_ASSERT_EQUAL (buf[OB_MIDI_EVENT_SIZE * 2 + 2], 2);
+  CU_ASSERT_TRUE (engine.h2o_midi_event_read);
+  CU_ASSERT_EQUAL (engine.h2o_midi_event.packet.data[1], 3);
+
+  CU_ASSERT_EQUAL (ow_engine_pack_h2o_midi (&engine, buf, sizeof (buf),
+					    10001), OB_MIDI_EVENT_SIZE);
+  CU_ASSERT_EQUAL (buf[2], 3);
+  CU_ASSERT_FALSE (engine.h2o_midi_event_read);
+  CU_ASSERT_EQUAL (ow_engine_pack_h2o_midi (&engine, buf, sizeof (buf),
+					    10001), 0);
+
+  //The queue has been empty but the next event is still in time.
+  ow_engine_sync_h2o_midi (&engine, 12500, 2000);
+  CU_ASSERT_EQUAL (engine.h2o_midi_offset, 10000);
+
+  //No more than a transfer is packed.
+  for (int i = 0; i < 5; i++)
+    {
+      h2o_midi_push (rb, 2000, 4 + i);
+    }
+  CU_ASSERT_EQUAL (ow_engine_pack_h2o_midi (&engine, buf, sizeof (buf),
+					    12500), sizeof (buf));
+  CU_ASSERT_EQUAL (engine.h2o_midi_late_packets, 0);
+
+  //Packets sent after their window are counted.
+  CU_ASSERT_EQUAL (ow_engine_pack_h2o_midi (&engine, buf, sizeof (buf),
+					    13500), OB_MIDI_EVENT_SIZE);
+  CU_ASSERT_EQUAL (buf[2], 8);
+  CU_ASSERT_EQUAL (engine.h2o_midi_late_packets, 1);
+  CU_ASSERT_EQUAL (engine.h2o_midi_max_lateness, 1500);
+
+  //An event that would be late sets the offset again.
+  ow_engine_sync_h2o_midi (&engine, 20000, 5000);
+  CU_ASSERT_EQUAL (engine.h2o_midi_offset, 15000);
+
+  jack_ringbuffer_free (rb);
+}
+
+//The o2j side needs the whole SysEx in its queue before sending it.
+#define SYSEX_TEST_LEN (OB_MIDI_BUF_LEN / 2)
+#define SYSEX_TEST_CHUNK 1000
+#define SYSEX_TEST_RING_EVENTS 64
+
+static const uint8_t SYSEX_TEST_NOTE_ON[] = { 0x90, 0x3c, 0x64 };
+static const uint8_t SYSEX_TEST_TAIL[] = { 0xc0, 0x05, 0xf8, 0x80, 0x3c, 0x00 };
+
+struct sysex_test
+{
+  struct jclient producer;
+  struct jclient consumer;
+  uint8_t *input;
+  uint8_t *output;
+  size_t len;
+  size_t read;
+  int overflow;
+  int queued_behind;
+  int done;
+};
+
+//The producer side runs the j2o path of a JACK client, which only moves what fits in the h2o ring each time.
+static void *
+test_sysex_producer (void *data)
+{
+  size_t len, written, sysex_end;
+  struct sysex_test *test = data;
+  struct jclient *jclient = &test->producer;
+  struct mring *queue = &jclient->j2o_midi_queue;
+
+  jclient_j2o_midi_event (jclient, test->input, sizeof (SYSEX_TEST_NOTE_ON),
+			  0);
+
+  written = sizeof (SYSEX_TEST_NOTE_ON);
+  sysex_end = written + SYSEX_TEST_LEN;
+  while (written < sysex_end)
+    {
+      len = sysex_end - written;
+      len = len > SYSEX_TEST_CHUNK ? SYSEX_TEST_CHUNK : len;
+      while (mring_space (queue) < len)
+	{
+	  jclient_j2o_midi_flush (jclient, 0);
+	  sched_yield ();
+	}
+      jclient_j2o_midi_event (jclient, test->input + written, len, 0);
+      written += len;
+    }
+
+  //These arrive while the SysEx is still being sent.
+  test->queued_behind = mring_len (queue) > 0;
+  jclient_j2o_midi_event (jclient, test->input + written, 2, 0);
+  jclient_j2o_midi_event (jclient, test->input + written + 2, 1, 0);
+  jclient_j2o_midi_event (jclient, test->input + written + 3, 3, 0);
+
+  while (mring_len (queue))
+    {
+      jclient_j2o_midi_flush (jclient, 0);
+      sched_yield ();
+    }
+
+  __atomic_store_n (&test->done, 1, __ATOMIC_RELEASE);
+
+  return NULL;
+}
+
+//The consumer side parses the packets as the o2j path of a JACK client does.
+static void *
+test_sysex_consumer (void *data)
+{
+  int done;
+  uint32_t len;
+  struct ow_midi_event event;
+  struct sysex_test *test = data;
+  struct jclient *jclient = &test->consumer;
+  jack_ringbuffer_t *rb = test->producer.context.h2o_midi;
+
+  while (1)
+    {
+      done = __atomic_load_n (&test->done, __ATOMIC_ACQUIRE);
+
+      if (jack_ringbuffer_read_space (rb) < sizeof (struct ow_midi_event))
+	{
+	  if (done)
+	    {
+	      break;
+	    }
+	  sched_yield ();
+	  continue;
+	}
+
+      jack_ringbuffer_read (rb, (void *) &event,
+			    sizeof (struct ow_midi_event));
+
+      len = jclient_o2j_midi_packet (jclient, &event.packet);
+      if (len > test->len - test->read)
+	{
+	  test->overflow = 1;
+	  break;
+	}
+      mring_read (&jclient->o2j_midi_queue, test->output + test->read, len);
+      test->read += len;
+    }
+
+  return NULL;
+}
+
+//A note, a long SysEx and some messages queued behind it go from one thread to another through packets.
+void
+test_sysex_throughput ()
+{
+  pthread_t producer, consumer;
+  struct sysex_test test;
+  uint8_t *sysex;
+
+  memset (&test, 0, sizeof (test));
+  test.len = sizeof (SYSEX_TEST_NOTE_ON) + SYSEX_TEST_LEN +
+    sizeof (SYSEX_TEST_TAIL);
+
+  CU_ASSERT_EQUAL_FATAL (mring_init (&test.producer.j2o_midi_queue,
+				     OB_MIDI_BUF_LEN), 0);
+  CU_ASSERT_EQUAL_FATAL (mring_init (&test.consumer.o2j_midi_queue,
+				     OB_MIDI_BUF_LEN), 0);
+  test.producer.context.h2o_midi =
+    jack_ringbuffer_create (SYSEX_TEST_RING_EVENTS *
+			    sizeof (struct ow_midi_event));
+
+  test.input = malloc (test.len);
+  test.output = malloc (test.len);
+
+  memcpy (test.input, SYSEX_TEST_NOTE_ON, sizeof (SYSEX_TEST_NOTE_ON));
+  sysex = test.input + sizeof (SYSEX_TEST_NOTE_ON);
+  sysex[0] = 0xf0;
+  for (int i = 1; i < SYSEX_TEST_LEN - 1; i++)
+    {
+      sysex[i] = i & 0x7f;
+    }
+  sysex[SYSEX_TEST_LEN - 1] = 0xf7;
+  memcpy (sysex + SYSEX_TEST_LEN, SYSEX_TEST_TAIL, sizeof (SYSEX_TEST_TAIL));
+
+  pthread_create (&consumer, NULL, test_sysex_consumer, &test);
+  pthread_create (&producer, NULL, test_sysex_producer, &test);
+  pthread_join (producer, NULL);
+  pthread_join (consumer, NULL);
+
+  CU_ASSERT_TRUE (test.queued_behind);
+  CU_ASSERT_FALSE (test.overflow);
+  CU_ASSERT_FALSE (test.producer.j2o_ongoing_sysex);
+  CU_ASSERT_EQUAL (mring_len (&test.consumer.o2j_midi_queue), 0);
+  CU_ASSERT_EQUAL (test.read, test.len);
+  CU_ASSERT_EQUAL (memcmp (test.input, test.output, test.len), 0);
+
+  free (test.input);
+  free (test.output);
+  jack_ringbuffer_free (test.producer.context.h2o_midi);
+  mring_destroy (&test.producer.j2o_midi_queue);
+  mring_destroy (&test.consumer.o2j_midi_queue);
+}
+
+static int mock_created;
+static int mock_destroyed;
+static int mock_failures;
+
+static int
+mock_source_start (struct hotplug_manager *manager)
+{
+  return 0;
+}
+
+static void
+mock_source_stop (struct hotplug_manager *manager)
+{
+}
+
+static const struct hotplug_source HOTPLUG_SOURCE_MOCK = {
+  .start = mock_source_start,
+  .stop = mock_source_stop
+};
+
+static void *
+mock_create (const struct ow_usb_device *device, void *data)
+{
+  if (mock_failures)
+    {
+      mock_failures--;
+      return NULL;
+    }
+  //Also called from the manager thread.
+  __atomic_add_fetch (&mock_created, 1, __ATOMIC_RELEASE);
+  return data;
+}
+
+static void
+mock_destroy (void *instance, uint8_t bus, uint8_t address, void *data)
+{
+  __atomic_add_fetch (&mock_destroyed, 1, __ATOMIC_RELEASE);
+}
+
+static void
+mock_push (struct hotplug_manager *manager, hotplug_event_type_t type,
+	   uint16_t vid, uint8_t address)
+{
+  struct hotplug_event event = {
+    .type = type,
+    .vid = vid,
+    .pid = 0x000c,
+    .bus = 1,
+    .address = address
+  };
+  hotplug_manager_push (manager, &event);
+}
+
+void
+test_hotplug ()
+{
+  struct hotplug_manager manager;
+
+  mock_created = 0;
+  mock_destroyed = 0;
+  mock_failures = 0;
+
+  hotplug_manager_init (&manager, &HOTPLUG_SOURCE_MOCK, mock_create,
+			mock_destroy, &manager);
+
+  //Only Overbridge devices are created.
+  mock_push (&manager, HOTPLUG_EVENT_ARRIVED, 0x1935, 5);
+  mock_push (&manager, HOTPLUG_EVENT_ARRIVED, 0x0000, 6);
+  CU_ASSERT_EQUAL (hotplug_manager_dispatch (&manager), 2);
+  CU_ASSERT_EQUAL (mock_created, 1);
+  CU_ASSERT_EQUAL (manager.entries_len, 1);
+
+  //Re-plugged devices get a new address.
+  mock_push (&manager, HOTPLUG_EVENT_LEFT, 0x1935, 5);
+  mock_push (&manager, HOTPLUG_EVENT_ARRIVED, 0x1935, 7);
+  CU_ASSERT_EQUAL (hotplug_manager_dispatch (&manager), 2);
+  CU_ASSERT_EQUAL (mock_destroyed, 1);
+  CU_ASSERT_EQUAL (mock_created, 2);
+  CU_ASSERT_EQUAL (manager.entries_len, 1);
+
+  //A missed departure replaces the instance.
+  mock_push (&manager, HOTPLUG_EVENT_ARRIVED, 0x1935, 7);
+  hotplug_manager_dispatch (&manager);
+  CU_ASSERT_EQUAL (mock_destroyed, 2);
+  CU_ASSERT_EQUAL (mock_created, 3);
+  CU_ASSERT_EQUAL (manager.entries_len, 1);
+
+  //Creation is retried.
+  mock_failures = 2;
+  mock_push (&manager, HOTPLUG_EVENT_ARRIVED, 0x1935, 8);
+  hotplug_manager_dispatch (&manager);
+  CU_ASSERT_EQUAL (mock_created, 4);
+  CU_ASSERT_EQUAL (manager.entries_len, 2);
+
+  //Threaded operation. Stopping destroys everything.
+  CU_ASSERT_EQUAL (hotplug_manager_start (&manager), 0);
+  mock_push (&manager, HOTPLUG_EVENT_ARRIVED, 0x1935, 9);
+  for (int i = 0;
+       i < 100 && __atomic_load_n (&mock_created, __ATOMIC_ACQUIRE) < 5; i++)
+    {
+      usleep (10000);
+    }
+  CU_ASSERT_EQUAL (__atomic_load_n (&mock_created, __ATOMIC_ACQUIRE), 5);
+  hotplug_manager_stop (&manager);
+  CU_ASSERT_EQUAL (mock_destroyed, 5);
+  CU_ASSERT_EQUAL (manager.entries_len, 0);
+
+  hotplug_manager_destroy (&manager);
 }
 
 int
@@ -183,6 +1153,87 @@ main (int argc, char *argv[])
       goto cleanup;
     }
 
+  if (!CU_add_test (suite, "test_masked_copy", test_masked_copy))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_capture", test_capture))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_transpose", test_transpose))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_device_desc_registry",
+		    test_device_desc_registry))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_device_sizes", test_device_sizes))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_auto_blocks", test_auto_blocks))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_arena", test_arena))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_cpu_list", test_cpu_list))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_planar_process", test_planar_process))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_planar_blocks", test_planar_blocks))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_dll_frames", test_dll_frames))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_record_alignment", test_record_alignment))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_h2o_midi_batches", test_h2o_midi_batches))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_sysex_throughput", test_sysex_throughput))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_midi_bench_replay", test_midi_bench_replay))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_hotplug", test_hotplug))
+    {
+      goto cleanup;
+    }
+
   CU_basic_set_mode (CU_BRM_VERBOSE);
 
   CU_basic_run_tests ();